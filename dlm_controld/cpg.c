@@ -141,6 +141,7 @@ struct change {
 	uint32_t seq; /* used as a reference for debugging, and for queries */
 	uint32_t combined_seq; /* for queries */
 	uint64_t create_time;
+	uint64_t phase_time; /* monotime_ms the current state began */
 };
 
 /* per lockspace change member: cg->members */
@@ -212,11 +213,28 @@ static struct member *find_memb(struct change *cg, int nodeid)
 	return NULL;
 }
 
+/* per-message lookups from the cpg callbacks and the main loop */
+
+static struct lockspace *ls_handle_hash[LS_HASH_SIZE];
+static struct lockspace *ls_ci_hash[LS_HASH_SIZE];
+
+static uint32_t ls_handle_bucket(cpg_handle_t h)
+{
+	uint64_t v = (uint64_t)h;
+
+	return (uint32_t)(v ^ (v >> 32) ^ (v >> 16)) & (LS_HASH_SIZE - 1);
+}
+
+static uint32_t ls_ci_bucket(int ci)
+{
+	return (uint32_t)ci & (LS_HASH_SIZE - 1);
+}
+
 static struct lockspace *find_ls_handle(cpg_handle_t h)
 {
 	struct lockspace *ls;
 
-	list_for_each_entry(ls, &lockspaces, list) {
+	for (ls = ls_handle_hash[ls_handle_bucket(h)]; ls; ls = ls->handle_next) {
 		if (ls->cpg_handle == h)
 			return ls;
 	}
@@ -227,13 +245,55 @@ static struct lockspace *find_ls_ci(int ci)
 {
 	struct lockspace *ls;
 
-	list_for_each_entry(ls, &lockspaces, list) {
+	for (ls = ls_ci_hash[ls_ci_bucket(ci)]; ls; ls = ls->ci_next) {
 		if (ls->cpg_client == ci)
 			return ls;
 	}
 	return NULL;
 }
 
+/* ls->name, global_id, cpg_handle and cpg_client must be set */
+
+static void add_ls(struct lockspace *ls)
+{
+	uint32_t b;
+
+	list_add(&ls->list, &lockspaces);
+	add_ls_hash(ls);
+
+	b = ls_handle_bucket(ls->cpg_handle);
+	ls->handle_next = ls_handle_hash[b];
+	ls_handle_hash[b] = ls;
+
+	b = ls_ci_bucket(ls->cpg_client);
+	ls->ci_next = ls_ci_hash[b];
+	ls_ci_hash[b] = ls;
+}
+
+static void del_ls(struct lockspace *ls)
+{
+	struct lockspace **p;
+
+	for (p = &ls_handle_hash[ls_handle_bucket(ls->cpg_handle)]; *p;
+	     p = &(*p)->handle_next) {
+		if (*p == ls) {
+			*p = ls->handle_next;
+			break;
+		}
+	}
+
+	for (p = &ls_ci_hash[ls_ci_bucket(ls->cpg_client)]; *p;
+	     p = &(*p)->ci_next) {
+		if (*p == ls) {
+			*p = ls->ci_next;
+			break;
+		}
+	}
+
+	del_ls_hash(ls);
+	list_del(&ls->list);
+}
+
 static void free_cg(struct change *cg)
 {
 	struct member *memb, *safe;
@@ -267,6 +327,9 @@ static void free_ls(struct lockspace *ls)
 		free(node);
 	}
 
+	del_timer(&ls->change_timer);
+	free_plock_pools(ls);
+	free(ls->plock_batch_buf);
 	free(ls);
 }
 
@@ -672,6 +735,15 @@ static void stop_kernel(struct lockspace *ls, uint32_t seq)
 /* we know that the cluster_quorate value here is consistent with the cpg events
    because the ringid's are in sync per the check_ringid_done */
 
+/* a change waiting on a condition is applied again when one of the events it
+   waits for arrives, or when its retry timer expires */
+
+static void retry_changes(struct lockspace *ls)
+{
+	if (!timer_pending(&ls->change_timer))
+		mod_timer(&ls->change_timer, RETRY_TIMER_MS);
+}
+
 static int wait_conditions_done(struct lockspace *ls)
 {
 	if (!check_ringid_done(ls)) {
@@ -682,7 +754,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		ls->wait_retry++;
 		/* the check function logs a message */
 
-		poll_lockspaces++;
+		retry_changes(ls);
 		return 0;
 	}
 
@@ -694,7 +766,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		ls->wait_retry++;
 		log_retry(ls, "wait for quorum");
 
-		poll_lockspaces++;
+		retry_changes(ls);
 		return 0;
 	}
 
@@ -706,7 +778,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		ls->wait_retry++;
 		log_retry(ls, "wait for fencing");
 
-		poll_lockspaces++;
+		retry_changes(ls);
 		return 0;
 	}
 
@@ -718,7 +790,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		ls->wait_retry++;
 		log_retry(ls, "wait for fsdone");
 
-		poll_fs++;
+		retry_changes(ls);
 		return 0;
 	}
 
@@ -1101,9 +1173,21 @@ static void receive_plocks_done(struct lockspace *ls, struct dlm_header *hd,
 			  hd->msgdata2, ls->recv_plocks_data_count);
 	}
 
+	if (ls->recv_plocks_data_time) {
+		uint64_t ms = monotime_ms() - ls->recv_plocks_data_time;
+
+		log_dlock(ls, "receive_plocks_done resources %u in %llu ms %llu/sec",
+			  ls->recv_plocks_resources, (unsigned long long)ms,
+			  (unsigned long long)ls->recv_plocks_resources * 1000 /
+			  (ms ? ms : 1));
+		ls->recv_plocks_data_time = 0;
+		ls->recv_plocks_resources = 0;
+	}
+
 	process_saved_plocks(ls);
 	ls->need_plocks = 0;
 	ls->save_plocks = 0;
+	state_changed();
 
 	log_dlock(ls, "receive_plocks_done %d:%u plocks_data_count %u",
 		  hd->nodeid, hd->msgdata, ls->recv_plocks_data_count);
@@ -1195,6 +1279,13 @@ static void send_plocks_done(struct lockspace *ls, struct change *cg, uint32_t p
 	send_info(ls, cg, DLM_MSG_PLOCKS_DONE, 0, plocks_data);
 }
 
+/* the frames of plock state for the started change have been sent */
+
+void plocks_data_done(struct lockspace *ls, uint32_t plocks_data)
+{
+	send_plocks_done(ls, ls->started_change, plocks_data);
+}
+
 static int same_members(struct change *cg1, struct change *cg2)
 {
 	struct member *memb;
@@ -1287,8 +1378,11 @@ static void prepare_plocks(struct lockspace *ls)
 	if (ls->plock_data_node != our_nodeid)
 		return;
 
-	if (nodes_added(ls))
-		send_all_plocks_data(ls, cg->seq, &plocks_data);
+	/* frames left to send are finished from the main loop, which then
+	   sends plocks_done */
+
+	if (nodes_added(ls) && send_all_plocks_data(ls, cg->seq, &plocks_data))
+		return;
 
 	send_plocks_done(ls, cg, plocks_data);
 }
@@ -1301,6 +1395,8 @@ static void apply_changes(struct lockspace *ls)
 		return;
 	cg = list_first_entry(&ls->changes, struct change, list);
 
+	state_changed();
+
 	switch (cg->state) {
 
 	case CGST_WAIT_CONDITIONS:
@@ -1308,11 +1404,15 @@ static void apply_changes(struct lockspace *ls)
 			send_nacks(ls, cg);
 			send_start(ls, cg);
 			cg->state = CGST_WAIT_MESSAGES;
+			ls->recovery_conditions_ms += monotime_ms() - cg->phase_time;
+			cg->phase_time = monotime_ms();
 		}
 		break;
 
 	case CGST_WAIT_MESSAGES:
 		if (wait_messages_done(ls)) {
+			ls->recovery_messages_ms += monotime_ms() - cg->phase_time;
+			ls->recovery_count++;
 			set_protocol_stateful();
 			start_kernel(ls);
 			prepare_plocks(ls);
@@ -1325,17 +1425,12 @@ static void apply_changes(struct lockspace *ls)
 	}
 }
 
-void process_lockspace_changes(void)
+static void change_timer_fn(struct dlm_timer *t)
 {
-	struct lockspace *ls, *safe;
-
-	poll_lockspaces = 0;
-	poll_fs = 0;
+	struct lockspace *ls = t->data;
 
-	list_for_each_entry_safe(ls, safe, &lockspaces, list) {
-		if (!list_empty(&ls->changes))
-			apply_changes(ls);
-	}
+	if (!list_empty(&ls->changes))
+		apply_changes(ls);
 }
 
 static int add_change(struct lockspace *ls,
@@ -1360,6 +1455,7 @@ static int add_change(struct lockspace *ls,
 	INIT_LIST_HEAD(&cg->removed);
 	cg->state = CGST_WAIT_CONDITIONS;
 	cg->create_time = now;
+	cg->phase_time = monotime_ms();
 	cg->seq = ++ls->change_seq;
 	if (!cg->seq)
 		cg->seq = ++ls->change_seq;
@@ -1479,6 +1575,8 @@ static void confchg_cb(cpg_handle_t handle,
 		   left_list, left_list_entries,
 		   joined_list, joined_list_entries);
 
+	state_changed();
+
 	ls = find_ls_handle(handle);
 	if (!ls) {
 		log_error("confchg_cb no lockspace for cpg %s",
@@ -1493,14 +1591,19 @@ static void confchg_cb(cpg_handle_t handle,
 		stop_kernel(ls, 0);
 		set_configfs_members(ls, ls->name, 0, NULL, 0, NULL);
 		set_sysfs_event_done(ls->name, 0);
-		cpg_finalize(ls->cpg_handle);
+		drop_send_queue(ls->cpg_handle);
+		/* out of epoll before cpg_finalize closes the fd */
 		client_dead(ls->cpg_client);
+		cpg_finalize(ls->cpg_handle);
 		purge_plocks(ls, our_nodeid, 1);
-		list_del(&ls->list);
+		del_ls(ls);
 		free_ls(ls);
 		return;
 	}
 
+	/* plock state from the last change goes out before this one */
+	finish_plocks_frames(ls);
+
 	rv = add_change(ls, member_list, member_list_entries,
 			left_list, left_list_entries,
 			joined_list, joined_list_entries, &cg);
@@ -1563,6 +1666,7 @@ static void deliver_cb(cpg_handle_t handle,
 	switch (hd->type) {
 	case DLM_MSG_START:
 		receive_start(ls, hd, len);
+		state_changed();
 		break;
 
 	case DLM_MSG_PLOCK:
@@ -1622,6 +1726,20 @@ static void deliver_cb(cpg_handle_t handle,
 				  hd->type, nodeid, enable_plock, plock_ownership);
 		break;
 
+	case DLM_MSG_PLOCK_BATCH:
+		if (ls->disable_plock)
+			break;
+		if (ls->need_plocks && !ls->save_plocks) {
+			ignore_plock = 1;
+			break;
+		}
+		if (enable_plock)
+			receive_plock_batch(ls, hd, len);
+		else
+			log_error("msg %d nodeid %d enable_plock %d",
+				  hd->type, nodeid, enable_plock);
+		break;
+
 	case DLM_MSG_PLOCKS_DATA:
 		if (ls->disable_plock)
 			break;
@@ -1632,6 +1750,16 @@ static void deliver_cb(cpg_handle_t handle,
 				  hd->type, nodeid, enable_plock);
 		break;
 
+	case DLM_MSG_PLOCKS_FRAME:
+		if (ls->disable_plock)
+			break;
+		if (enable_plock)
+			receive_plocks_frame(ls, hd, len);
+		else
+			log_error("msg %d nodeid %d enable_plock %d",
+				  hd->type, nodeid, enable_plock);
+		break;
+
 	case DLM_MSG_PLOCKS_DONE:
 		if (ls->disable_plock)
 			break;
@@ -1763,11 +1891,10 @@ int dlm_join_lockspace(struct lockspace *ls)
 
 	ci = client_add(fd, process_cpg_lockspace, NULL);
 
-	list_add(&ls->list, &lockspaces);
-
 	ls->cpg_handle = h;
 	ls->cpg_client = ci;
 	ls->cpg_fd = fd;
+	init_timer(&ls->change_timer, change_timer_fn, ls);
 	ls->kernel_stopped = 1;
 	ls->need_plocks = 1;
 	ls->joining = 1;
@@ -1779,6 +1906,8 @@ int dlm_join_lockspace(struct lockspace *ls)
 	/* TODO: allow global_id to be set in cluster.conf? */
 	ls->global_id = cpgname_to_crc(name.value, name.length);
 
+	add_ls(ls);
+
 	log_group(ls, "cpg_join %s ...", name.value);
  retry:
 	error = cpg_join(h, &name);
@@ -1798,7 +1927,7 @@ int dlm_join_lockspace(struct lockspace *ls)
 	return 0;
 
  fail:
-	list_del(&ls->list);
+	del_ls(ls);
 	client_dead(ci);
 	cpg_finalize(h);
  fail_free:
@@ -10,6 +10,8 @@
 
 /* protocol_version flags */
 #define PV_STATEFUL 0x0001
+#define PV_PLOCK_BATCH 0x0002	/* in dm_ver, can receive DLM_MSG_PLOCK_BATCH */
+#define PV_PLOCKS_FRAME 0x0004	/* in dm_ver, can receive DLM_MSG_PLOCKS_FRAME */
 
 /* retries are once a second */
 #define log_retry(cur_count, fmt, args...) ({ \
@@ -112,6 +114,7 @@ static uint32_t last_join_seq;
 static uint32_t send_fipu_seq;
 static int wait_clear_fipu;
 static int fence_in_progress_unknown = 1;
+static struct dlm_timer fence_timer;
 
 #define MAX_ZOMBIES 16
 static int zombie_pids[MAX_ZOMBIES];
@@ -119,6 +122,8 @@ static int zombie_count;
 
 static int fence_result_pid;
 static unsigned int fence_result_try;
+static uint32_t fence_request_count;	/* agents run */
+static uint32_t fence_fail_count;	/* agents failed */
 static int stateful_merge_wait; /* cluster is stuck in waiting for manual intervention */
 
 static void send_fence_result(int nodeid, int result, uint32_t flags, uint64_t walltime);
@@ -249,6 +254,10 @@ const char *msg_name(int type)
 		return "plocks_data";
 	case DLM_MSG_PLOCKS_DONE:
 		return "plocks_done";
+	case DLM_MSG_PLOCK_BATCH:
+		return "plock_batch";
+	case DLM_MSG_PLOCKS_FRAME:
+		return "plocks_frame";
 	case DLM_MSG_DEADLK_CYCLE_START:
 		return "deadlk_cycle_start";
 	case DLM_MSG_DEADLK_CYCLE_END:
@@ -262,35 +271,230 @@ const char *msg_name(int type)
 	}
 }
 
+/*
+ * When corosync can't take a message (CS_ERR_TRY_AGAIN), it's copied onto
+ * an outbound queue for the cpg handle and the sender carries on.  Anything
+ * sent on that handle while the queue is non-empty is queued behind it to
+ * keep the order.  update_flow_control_status() drains the queues from the
+ * main loop, which retries every SEND_QUEUE_RETRY_MS while poll_send_queue
+ * is set.
+ *
+ * While the queues hold more than SEND_QUEUE_HIGH bytes, send_queue_full is
+ * set, and plock ops aren't read from the kernel and plock state frames
+ * aren't generated, until they're back under SEND_QUEUE_LOW.
+ */
+
+struct send_msg {
+	struct list_head list;
+	int type;
+	int len;
+	char buf[0];
+};
+
+struct send_queue {
+	struct list_head list;
+	struct list_head msgs;
+	cpg_handle_t handle;
+	uint32_t count;
+	uint64_t bytes;
+	uint64_t stall_begin;
+};
+
+static LIST_HEAD(send_queues);
+static uint32_t send_queue_len;
+static uint32_t send_queue_max;
+static uint64_t send_queue_bytes;
+static uint32_t send_stall_count;
+static uint64_t send_stall_ms;
+static uint64_t send_stall_max;
+
+static uint64_t send_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void check_send_queue_full(void)
+{
+	if (!send_queue_full && send_queue_bytes > SEND_QUEUE_HIGH) {
+		log_debug("cpg send queue %llu bytes, pausing plocks",
+			  (unsigned long long)send_queue_bytes);
+		send_queue_full = 1;
+		update_plock_polling();
+	} else if (send_queue_full && send_queue_bytes < SEND_QUEUE_LOW) {
+		log_debug("cpg send queue %llu bytes, resuming plocks",
+			  (unsigned long long)send_queue_bytes);
+		send_queue_full = 0;
+		update_plock_polling();
+	}
+}
+
+static struct send_queue *find_send_queue(cpg_handle_t h)
+{
+	struct send_queue *sq;
+
+	list_for_each_entry(sq, &send_queues, list) {
+		if (sq->handle == h)
+			return sq;
+	}
+	return NULL;
+}
+
+static int queue_message(cpg_handle_t h, struct send_queue *sq,
+			 void *buf, int len, int type)
+{
+	struct send_msg *sm;
+
+	sm = malloc(sizeof(struct send_msg) + len);
+	if (!sm) {
+		log_error("cpg send queue no mem %s", msg_name(type));
+		return -ENOMEM;
+	}
+	sm->type = type;
+	sm->len = len;
+	memcpy(sm->buf, buf, len);
+
+	if (!sq) {
+		sq = malloc(sizeof(struct send_queue));
+		if (!sq) {
+			log_error("cpg send queue no mem %s", msg_name(type));
+			free(sm);
+			return -ENOMEM;
+		}
+		memset(sq, 0, sizeof(struct send_queue));
+		INIT_LIST_HEAD(&sq->msgs);
+		sq->handle = h;
+		sq->stall_begin = send_time_ms();
+		list_add_tail(&sq->list, &send_queues);
+		send_stall_count++;
+
+		log_debug("cpg_mcast_joined busy handle %llx %s, queueing",
+			  (unsigned long long)h, msg_name(type));
+	}
+
+	list_add_tail(&sm->list, &sq->msgs);
+	sq->count++;
+	sq->bytes += len;
+	send_queue_len++;
+	send_queue_bytes += len;
+	if (send_queue_len > send_queue_max)
+		send_queue_max = send_queue_len;
+
+	poll_send_queue = 1;
+	check_send_queue_full();
+	return 0;
+}
+
+static void free_send_queue(struct send_queue *sq)
+{
+	struct send_msg *sm, *safe;
+	uint64_t stall = send_time_ms() - sq->stall_begin;
+
+	list_for_each_entry_safe(sm, safe, &sq->msgs, list) {
+		list_del(&sm->list);
+		free(sm);
+	}
+	send_queue_len -= sq->count;
+	send_queue_bytes -= sq->bytes;
+
+	send_stall_ms += stall;
+	if (stall > send_stall_max)
+		send_stall_max = stall;
+
+	list_del(&sq->list);
+	free(sq);
+
+	if (list_empty(&send_queues))
+		poll_send_queue = 0;
+
+	check_send_queue_full();
+}
+
+/* called before cpg_finalize, the handle can't be used after that */
+
+void drop_send_queue(cpg_handle_t h)
+{
+	struct send_queue *sq = find_send_queue(h);
+
+	if (!sq)
+		return;
+
+	if (sq->count)
+		log_error("cpg send queue handle %llx dropping %u messages",
+			  (unsigned long long)h, sq->count);
+	free_send_queue(sq);
+}
+
+void update_flow_control_status(void)
+{
+	struct send_queue *sq, *safe;
+	struct send_msg *sm, *safe2;
+	cpg_flow_control_state_t state;
+	struct iovec iov;
+	cs_error_t error;
+
+	list_for_each_entry_safe(sq, safe, &send_queues, list) {
+		/* corosync is asking senders to back off, try again later */
+		error = cpg_flow_control_state_get(sq->handle, &state);
+		if (error == CS_OK && state == CPG_FLOW_CONTROL_ENABLED)
+			continue;
+
+		list_for_each_entry_safe(sm, safe2, &sq->msgs, list) {
+			iov.iov_base = sm->buf;
+			iov.iov_len = sm->len;
+
+			error = cpg_mcast_joined(sq->handle, CPG_TYPE_AGREED,
+						 &iov, 1);
+			if (error == CS_ERR_TRY_AGAIN)
+				break;
+			if (error != CS_OK)
+				log_error("cpg_mcast_joined error %d handle %llx %s",
+					  error, (unsigned long long)sq->handle,
+					  msg_name(sm->type));
+
+			list_del(&sm->list);
+			sq->count--;
+			sq->bytes -= sm->len;
+			send_queue_len--;
+			send_queue_bytes -= sm->len;
+			free(sm);
+		}
+
+		if (!sq->count) {
+			log_debug("cpg send queue handle %llx drained after %llu ms",
+				  (unsigned long long)sq->handle,
+				  (unsigned long long)(send_time_ms() - sq->stall_begin));
+			free_send_queue(sq);
+		}
+	}
+
+	check_send_queue_full();
+}
+
 static int _send_message(cpg_handle_t h, void *buf, int len, int type)
 {
+	struct send_queue *sq;
 	struct iovec iov;
 	cs_error_t error;
-	int retries = 0;
+
+	sq = find_send_queue(h);
+	if (sq)
+		return queue_message(h, sq, buf, len, type);
 
 	iov.iov_base = buf;
 	iov.iov_len = len;
 
- retry:
 	error = cpg_mcast_joined(h, CPG_TYPE_AGREED, &iov, 1);
-	if (error == CS_ERR_TRY_AGAIN) {
-		retries++;
-		usleep(1000);
-		if (!(retries % 100))
-			log_error("cpg_mcast_joined retry %d %s",
-				   retries, msg_name(type));
-		goto retry;
-	}
+	if (error == CS_ERR_TRY_AGAIN)
+		return queue_message(h, NULL, buf, len, type);
 	if (error != CS_OK) {
 		log_error("cpg_mcast_joined error %d handle %llx %s",
 			  error, (unsigned long long)h, msg_name(type));
 		return -1;
 	}
 
-	if (retries)
-		log_debug("cpg_mcast_joined retried %d %s",
-			  retries, msg_name(type));
-
 	return 0;
 }
 
@@ -301,6 +505,10 @@ void dlm_send_message(struct lockspace *ls, char *buf, int len)
 	struct dlm_header *hd = (struct dlm_header *) buf;
 	int type = hd->type;
 
+	/* queued plock ops go out ahead of anything sent after them */
+	if (type != DLM_MSG_PLOCK_BATCH)
+		flush_plock_batch(ls);
+
 	hd->version[0]  = cpu_to_le16(our_protocol.daemon_run[0]);
 	hd->version[1]  = cpu_to_le16(our_protocol.daemon_run[1]);
 	hd->version[2]  = cpu_to_le16(our_protocol.daemon_run[2]);
@@ -839,6 +1047,9 @@ static void daemon_fence_work(void)
 	int retry = 0;
 	uint32_t flags;
 
+	/* called after each daemon cpg event and fencing step */
+	state_changed();
+
 	if (!daemon_fence_allow)
 		return;
 
@@ -1067,6 +1278,8 @@ static void daemon_fence_work(void)
 		log_debug("fence request %d pos %d",
 			  node->nodeid, node->fence_config.pos);
 
+		fence_request_count++;
+
 		rv = fence_request(node->nodeid,
 				   node->fail_walltime,
 				   node->fail_monotime,
@@ -1074,6 +1287,7 @@ static void daemon_fence_work(void)
 				   node->left_reason,
 				   &pid);
 		if (rv < 0) {
+			fence_fail_count++;
 			send_fence_result(node->nodeid, rv, 0, time(NULL));
 			node->fence_result_wait = 1;
 			continue;
@@ -1180,6 +1394,8 @@ static void daemon_fence_work(void)
 			/* agent exit 1, if there's another agent to run at
 			   next priority, set it to run next, otherwise fail */
 
+			fence_fail_count++;
+
 			rv = fence_config_next_priority(&node->fence_config);
 			if (rv < 0) {
 				send_fence_result(nodeid, result, 0, time(NULL));
@@ -1284,17 +1500,21 @@ static void daemon_fence_work(void)
 		clear_zombies();
 
 	/*
-	 * setting retry_fencing will cause the main daemon poll loop
-	 * to timeout in 1 second and call this function again.
+	 * setting retry_fencing arms the fence timer which calls this
+	 * function again in RETRY_TIMER_MS.
 	 */
  out:
-	if (retry)
+	if (retry) {
 		retry_fencing++;
-	else
+		if (!timer_pending(&fence_timer))
+			mod_timer(&fence_timer, RETRY_TIMER_MS);
+	} else {
 		retry_fencing = 0;
+		del_timer(&fence_timer);
+	}
 }
 
-void process_fencing_changes(void)
+static void fence_timer_fn(struct dlm_timer *t)
 {
 	daemon_fence_work();
 }
@@ -1542,6 +1762,35 @@ void set_protocol_stateful(void)
 	our_protocol.dr_ver.flags |= PV_STATEFUL;
 }
 
+/* every daemon cpg member has told us it can receive a message type;
+   a node's daemon proto message arrives before it can join a lockspace */
+
+static int all_daemons_flag(uint16_t flag)
+{
+	struct node_daemon *node;
+	int i;
+
+	if (!daemon_member_count)
+		return 0;
+
+	for (i = 0; i < daemon_member_count; i++) {
+		node = get_node_daemon(daemon_member[i].nodeid);
+		if (!node || !(node->proto.dm_ver.flags & flag))
+			return 0;
+	}
+	return 1;
+}
+
+int all_daemons_plock_batch(void)
+{
+	return all_daemons_flag(PV_PLOCK_BATCH);
+}
+
+int all_daemons_plocks_frame(void)
+{
+	return all_daemons_flag(PV_PLOCKS_FRAME);
+}
+
 static void pv_in(struct protocol_version *pv)
 {
 	pv->major = le16_to_cpu(pv->major);
@@ -1930,7 +2179,10 @@ int set_protocol(void)
 		/* only process messages/events from daemon cpg until protocol
 		   is established */
 
-		rv = poll(&pollfd, 1, -1);
+		if (poll_send_queue)
+			update_flow_control_status();
+
+		rv = poll(&pollfd, 1, poll_send_queue ? SEND_QUEUE_RETRY_MS : -1);
 		if (rv == -1 && errno == EINTR) {
 			if (daemon_quit)
 				return -1;
@@ -2485,6 +2737,7 @@ int setup_cpg_daemon(void)
 
 	our_protocol.daemon_max[1] = 1;
 	our_protocol.daemon_max[2] = 1;
+	our_protocol.dm_ver.flags = PV_PLOCK_BATCH | PV_PLOCKS_FRAME;
 	our_protocol.kernel_max[0] = 1;
 	our_protocol.kernel_max[1] = 1;
 	our_protocol.kernel_max[2] = 1;
@@ -2554,9 +2807,12 @@ void close_cpg_daemon(void)
 		log_error("daemon cpg_leave error %d", error);
  fin:
 	list_for_each_entry(ls, &lockspaces, list) {
-		if (ls->cpg_handle)
+		if (ls->cpg_handle) {
+			drop_send_queue(ls->cpg_handle);
 			cpg_finalize(ls->cpg_handle);
+		}
 	}
+	drop_send_queue(cpg_handle_daemon);
 	cpg_finalize(cpg_handle_daemon);
 }
 
@@ -2564,6 +2820,7 @@ void init_daemon(void)
 {
 	INIT_LIST_HEAD(&daemon_nodes);
 	INIT_LIST_HEAD(&startup_nodes);
+	init_timer(&fence_timer, fence_timer_fn, NULL);
 
 }
 
@@ -2606,49 +2863,24 @@ static int print_state_daemon_node(struct node_daemon *node, char *str)
 	return strlen(str) + 1;
 }
 
-void send_state_daemon_nodes(int fd)
-{
-	struct node_daemon *node;
-	struct dlmc_state st;
-	char str[DLMC_STATE_MAXSTR];
-	int str_len;
-
-	list_for_each_entry(node, &daemon_nodes, list) {
-		memset(&st, 0, sizeof(st));
-		st.type = DLMC_STATE_DAEMON_NODE;
-		st.nodeid = node->nodeid;
+/* appends a dlmc_state record followed by its string to buf */
 
-		memset(str, 0, sizeof(str));
-		str_len = print_state_daemon_node(node, str);
-
-		st.str_len = str_len;
-
-		send(fd, &st, sizeof(st), MSG_NOSIGNAL);
-		if (str_len)
-			send(fd, str, str_len, MSG_NOSIGNAL);
-	}
-}
-
-void send_state_startup_nodes(int fd)
+static void copy_state(char *buf, int *pos, int type, int nodeid,
+		       char *str, int str_len)
 {
-	struct node_daemon *node;
 	struct dlmc_state st;
-	char str[DLMC_STATE_MAXSTR];
-	int str_len;
 
-	list_for_each_entry(node, &startup_nodes, list) {
-		memset(&st, 0, sizeof(st));
-		st.type = DLMC_STATE_STARTUP_NODE;
-		st.nodeid = node->nodeid;
-
-		memset(str, 0, sizeof(str));
-		str_len = print_state_daemon_node(node, str);
+	memset(&st, 0, sizeof(st));
+	st.type = type;
+	st.nodeid = nodeid;
+	st.str_len = str_len;
 
-		st.str_len = str_len;
+	memcpy(buf + *pos, &st, sizeof(st));
+	*pos += sizeof(st);
 
-		send(fd, &st, sizeof(st), MSG_NOSIGNAL);
-		if (str_len)
-			send(fd, str, str_len, MSG_NOSIGNAL);
+	if (str_len) {
+		memcpy(buf + *pos, str, str_len);
+		*pos += str_len;
 	}
 }
 
@@ -2665,7 +2897,12 @@ static int print_state_daemon(char *str)
 		 "fence_in_progress_unknown=%d "
 		 "zombie_count=%d "
 		 "monotime=%llu "
-		 "stateful_merge_wait=%d ",
+		 "stateful_merge_wait=%d "
+		 "send_queue_len=%u "
+		 "send_queue_max=%u "
+		 "send_stall_count=%u "
+		 "send_stall_ms=%llu "
+		 "send_stall_max=%llu ",
 		 daemon_member_count,
 		 daemon_joined_count,
 		 daemon_remove_count,
@@ -2676,28 +2913,66 @@ static int print_state_daemon(char *str)
 		 fence_in_progress_unknown,
 		 zombie_count,
 		 (unsigned long long)monotime(),
-		 stateful_merge_wait);
+		 stateful_merge_wait,
+		 send_queue_len,
+		 send_queue_max,
+		 send_stall_count,
+		 (unsigned long long)send_stall_ms,
+		 (unsigned long long)send_stall_max);
 
 	return strlen(str) + 1;
 }
 
-void send_state_daemon(int fd)
+void set_daemon_metrics(struct daemon_metrics *dm)
 {
-	struct dlmc_state st;
+	dm->member_count = daemon_member_count;
+	dm->send_queue_len = send_queue_len;
+	dm->send_stall_count = send_stall_count;
+	dm->send_stall_ms = send_stall_ms;
+	dm->fence_request_count = fence_request_count;
+	dm->fence_fail_count = fence_fail_count;
+}
+
+/* the daemon state followed by the daemon and startup nodes, in the
+   stream of dlmc_state records that dlmc_dump_status() reads */
+
+int copy_state_daemon(char **buf_out, int *len_out)
+{
+	struct node_daemon *node;
 	char str[DLMC_STATE_MAXSTR];
+	char *buf;
+	int count = 1, pos = 0;
 	int str_len;
 
-	memset(&st, 0, sizeof(st));
-	st.type = DLMC_STATE_DAEMON;
-	st.nodeid = our_nodeid;
+	list_for_each_entry(node, &daemon_nodes, list)
+		count++;
+	list_for_each_entry(node, &startup_nodes, list)
+		count++;
+
+	buf = malloc(count * (sizeof(struct dlmc_state) + DLMC_STATE_MAXSTR));
+	if (!buf)
+		return -ENOMEM;
 
 	memset(str, 0, sizeof(str));
 	str_len = print_state_daemon(str);
+	copy_state(buf, &pos, DLMC_STATE_DAEMON, our_nodeid, str, str_len);
 
-	st.str_len = str_len;
+	list_for_each_entry(node, &daemon_nodes, list) {
+		memset(str, 0, sizeof(str));
+		str_len = print_state_daemon_node(node, str);
+		copy_state(buf, &pos, DLMC_STATE_DAEMON_NODE, node->nodeid,
+			   str, str_len);
+	}
+
+	list_for_each_entry(node, &startup_nodes, list) {
+		memset(str, 0, sizeof(str));
+		str_len = print_state_daemon_node(node, str);
+		copy_state(buf, &pos, DLMC_STATE_STARTUP_NODE, node->nodeid,
+			   str, str_len);
+	}
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
-	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+	*buf_out = buf;
+	*len_out = pos;
+	return 0;
 }
 
@@ -35,6 +35,20 @@
 #define DLMC_CMD_RUN_START		15
 #define DLMC_CMD_RUN_CHECK		16
 #define DLMC_CMD_DUMP_RUN		17
+#define DLMC_CMD_PLOCK_STATS		18
+#define DLMC_CMD_DUMP_PLOCKS_STREAM	19
+#define DLMC_CMD_OPEN			20
+
+/* DLMC_CMD_DUMP_PLOCKS_STREAM sends a dlmc_plock_filter after the header,
+   and is answered with headers each followed by a chunk of plocks, then
+   a header with option DLMC_STREAM_END, data set to the result, followed
+   by the filter with its cursor updated */
+
+#define DLMC_STREAM_END			1
+
+/* DLMC_CMD_OPEN on the query socket keeps the connection open after each
+   reply, so further requests can be sent on it, several at a time.  The
+   replies come back in order, with seq copied from each request. */
 
 struct dlmc_header {
 	unsigned int magic;
@@ -44,7 +58,7 @@ struct dlmc_header {
 	unsigned int len;
 	int data;	/* embedded command-specific data, for convenience */
 	int flags;
-	int unsued2;
+	int seq;	/* request id, copied into the reply */
 	char name[DLM_LOCKSPACE_LEN]; /* no terminating null space */
 };
 
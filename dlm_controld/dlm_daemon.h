@@ -85,6 +85,22 @@
 
 #define DEFAULT_NETLINK_RCVBUF	(2 * 1024 * 1024)
 
+/* number of buckets in each lockspace hash table, a power of two */
+#define LS_HASH_SIZE		256
+
+/* how often queued cpg messages are retried while corosync is busy */
+#define SEND_QUEUE_RETRY_MS	10
+
+/* queued cpg message bytes at which plock work is paused and resumed */
+#define SEND_QUEUE_HIGH		(16 * 1024 * 1024)
+#define SEND_QUEUE_LOW		(4 * 1024 * 1024)
+
+/* resolution of the timer wheel, see timer.c */
+#define TIMER_TICK_MS		10
+
+/* how often work waiting on something outside the daemon is retried */
+#define RETRY_TIMER_MS		1000
+
 enum {
         no_arg = 0,
         req_arg_bool = 1,
@@ -106,7 +122,12 @@ enum {
         enable_fscontrol_ind,
         enable_plock_ind,
         plock_debug_ind,
+        plock_trace_ind,
         plock_rate_limit_ind,
+        plock_batch_ind,
+        plock_msg_batch_size_ind,
+        plock_msg_batch_delay_ind,
+        plock_data_frame_size_ind,
         plock_ownership_ind,
         drop_resources_time_ind,
         drop_resources_count_ind,
@@ -119,6 +140,7 @@ enum {
         enable_quorum_fencing_ind,
         enable_quorum_lockspace_ind,
         enable_helper_ind,
+        metrics_port_ind,
         help_ind,
         version_ind,
         dlm_options_max,
@@ -170,18 +192,24 @@ EXTERN struct dlm_option dlm_options[dlm_options_max];
 
 #define MAX_NODE_ADDRESSES 4
 
+/* Largest message sent with cpg_mcast_joined.  libcpg passes a message to
+   corosync in a single 1MB IPC request, which also holds corosync's own
+   request header. */
+
+#define DLM_CPG_MSG_MAX (1024 * 1024 - 1024)
+
 #define PROTO_TCP  0
 #define PROTO_SCTP 1
 #define PROTO_DETECT 2
 
 EXTERN int daemon_quit;
 EXTERN int cluster_down;
-EXTERN int poll_lockspaces;
 EXTERN unsigned int retry_fencing;
 EXTERN int daemon_fence_allow;
-EXTERN int poll_fs;
-EXTERN int poll_ignore_plock;
-EXTERN int poll_drop_plock;
+EXTERN int poll_plock_batch;
+EXTERN int poll_send_queue;
+EXTERN int send_queue_full;
+EXTERN int poll_plocks_frames;
 EXTERN int plock_fd;
 EXTERN int plock_ci;
 EXTERN struct list_head lockspaces;
@@ -212,10 +240,62 @@ void log_level(char *name_in, uint32_t level_in, const char *fmt, ...);
 #define log_erros(ls, fmt, args...) log_level((ls)->name, LOG_ERR, fmt, ##args)
 #define log_group(ls, fmt, args...) log_level((ls)->name, LOG_DEBUG, fmt, ##args)
 
-#define log_plock(ls, fmt, args...) log_level((ls)->name, LOG_PLOCK|LOG_NONE, fmt, ##args)
+/* log_plock is the most frequent, and is only formatted when the plock
+   log is kept (or printed for plock_debug) */
+
+EXTERN int log_plock_on;
+
+#define log_plock(ls, fmt, args...) \
+do { \
+	if (log_plock_on) \
+		log_level((ls)->name, LOG_PLOCK|LOG_NONE, fmt, ##args); \
+} while (0)
+
 #define log_dlock(ls, fmt, args...) log_level((ls)->name, LOG_PLOCK|LOG_DEBUG, fmt, ##args)
 #define log_elock(ls, fmt, args...) log_level((ls)->name, LOG_PLOCK|LOG_ERR, fmt, ##args)
 
+/*
+ * A record in the plock log.  Plock operations are saved as plock_trace
+ * records of their fields and only formatted when the log is read, other
+ * plock log messages are saved as text, continued in further records if
+ * longer than PLOCK_TRACE_TEXT.
+ */
+
+enum {
+	PT_TEXT = 1,
+	PT_TEXT_CONT,
+	PT_READ,
+	PT_RECV,
+	PT_SYNC,
+	PT_OWN,
+	PT_DROP,
+};
+
+#define PLOCK_TRACE_TEXT 112
+
+struct plock_trace {
+	uint64_t time;		/* monotime() */
+	uint16_t type;		/* PT_ */
+	uint16_t len;		/* of text */
+	int32_t from;		/* nodeid the op was received from */
+	union {
+		char text[PLOCK_TRACE_TEXT];
+		struct {
+			uint64_t number;
+			uint64_t start;
+			uint64_t end;
+			uint64_t owner;
+			uint32_t pid;
+			int32_t nodeid;
+			uint8_t optype;
+			uint8_t ex;
+			uint8_t wait;
+			uint8_t pad;
+			char name[DLM_LOCKSPACE_LEN]; /* not terminated */
+		} op;
+	};
+};
+
 /* dlm_header types */
 enum {
 	DLM_MSG_PROTOCOL = 1,
@@ -236,6 +316,8 @@ enum {
 	DLM_MSG_RUN_REQUEST,
 	DLM_MSG_RUN_REPLY,
 	DLM_MSG_RUN_CANCEL,
+	DLM_MSG_PLOCK_BATCH,
+	DLM_MSG_PLOCKS_FRAME,
 };
 
 /* dlm_header flags */
@@ -257,11 +339,61 @@ struct dlm_header {
 	uint64_t pad;
 };
 
+struct dlm_timer {
+	struct list_head	list;
+	uint64_t		expires;   /* in ticks */
+	void			(*fn)(struct dlm_timer *t);
+	void			*data;
+	int			pending;
+};
+
+/* per-lockspace free lists of plock objects, see plock.c */
+
+enum {
+	PLOCK_POOL_RESOURCE = 0,
+	PLOCK_POOL_LOCK,
+	PLOCK_POOL_WAITER,
+	PLOCK_POOL_MSG,
+	PLOCK_POOL_OWNER,
+	PLOCK_POOL_NODE,
+	PLOCK_POOL_OP,
+	PLOCK_POOL_COUNT,
+};
+
+#define PLOCK_OPS_HASH		64
+
+struct plock_pool {
+	void			*slabs;	   /* chain of allocated slabs */
+	void			*free;	   /* chain of free objects */
+	uint32_t		in_use;
+	uint32_t		free_count;
+	uint32_t		slab_count;
+	uint64_t		alloc_count;
+};
+
+/* daemon counters for the metrics, see set_daemon_metrics */
+
+struct daemon_metrics {
+	int			member_count;
+	uint32_t		send_queue_len;
+	uint32_t		send_stall_count;
+	uint64_t		send_stall_ms;
+	uint32_t		fence_request_count;
+	uint32_t		fence_fail_count;
+};
+
 struct lockspace {
 	struct list_head	list;
 	char			name[DLM_LOCKSPACE_LEN+1];
 	uint32_t		global_id;
 
+	/* hash chains for find_ls, find_ls_id, find_ls_handle, find_ls_ci */
+
+	struct lockspace	*name_next;
+	struct lockspace	*id_next;
+	struct lockspace	*handle_next;
+	struct lockspace	*ci_next;
+
 	/* dlm.conf config */
 
 	int			nodir;
@@ -287,6 +419,10 @@ struct lockspace {
 	struct change		*started_change;
 	struct list_head	changes;
 	struct list_head	node_history;
+	struct dlm_timer	change_timer; /* retry waiting changes */
+	uint32_t		recovery_count; /* kernel starts */
+	uint64_t		recovery_conditions_ms; /* waiting conditions */
+	uint64_t		recovery_messages_ms; /* waiting start messages */
 
 	/* plock stuff */
 
@@ -294,12 +430,45 @@ struct lockspace {
 	int			need_plocks;
 	int			save_plocks;
 	int			disable_plock;
+	struct frame_state	*plocks_frames; /* being sent, see plock.c */
 	uint32_t		recv_plocks_data_count;
+	uint32_t		recv_plocks_resources;
+	uint64_t		recv_plocks_data_time; /* ms of first plocks_data */
 	struct list_head	saved_messages;
 	struct list_head	plock_resources;
 	struct rb_root		plock_resources_root;
+	struct rb_root		plock_owners_root; /* by nodeid and owner */
+	struct list_head	plock_nodes;	/* plock state per nodeid */
+	int			plock_nodes_incomplete;
+	struct plock_pool	plock_pools[PLOCK_POOL_COUNT];
+	char			*plock_batch_buf;
+	int			plock_batch_len;
+	uint32_t		plock_batch_count;
+	struct timeval		plock_batch_time; /* first queued op */
 	time_t			last_plock_time;
-	struct timeval		drop_resources_last;
+	struct list_head	plock_lru; /* drop candidates, oldest first */
+	struct dlm_timer	drop_timer;
+	uint64_t		drop_resources_last; /* monotime_ms */
+	uint32_t		drop_resources_sent;
+	uint32_t		drop_resources_batch;
+
+	/* resource cache stats, see log_plock_pools */
+
+	uint64_t		plock_lookup_count;
+	uint64_t		plock_lookup_hit;
+	uint64_t		plock_unown_sent;
+	uint64_t		plock_drop_sent;
+	uint64_t		plock_dropped;
+	uint64_t		plock_stats_time;
+	uint64_t		plock_stats_dropped;
+
+	/* plock latencies, see dlmc_plock_stats */
+
+	struct list_head	plock_ops_hash[PLOCK_OPS_HASH]; /* in progress */
+	struct list_head	plock_ops;	/* in progress, oldest first */
+	uint32_t		plock_ops_count;
+	uint64_t		plock_op_stats_time; /* monotime of first op */
+	struct dlmc_plock_stats	plock_op_stats;
 
 #if 0
 	/* deadlock stuff */
@@ -386,17 +555,15 @@ int get_weight(struct lockspace *ls, int nodeid);
 void setup_lockspace_config(struct lockspace *ls);
 
 /* cpg.c */
-void process_lockspace_changes(void);
-void process_fencing_changes(void);
 int dlm_join_lockspace(struct lockspace *ls);
 int dlm_leave_lockspace(struct lockspace *ls);
-void update_flow_control_status(void);
 int set_node_info(struct lockspace *ls, int nodeid, struct dlmc_node *node);
 int set_lockspace_info(struct lockspace *ls, struct dlmc_lockspace *lockspace);
 int set_lockspaces(int *count, struct dlmc_lockspace **lss_out);
 int set_lockspace_nodes(struct lockspace *ls, int option, int *node_count,
 			struct dlmc_node **nodes_out);
 int set_fs_notified(struct lockspace *ls, int nodeid);
+void plocks_data_done(struct lockspace *ls, uint32_t plocks_data);
 
 /* daemon_cpg.c */
 void init_daemon(void);
@@ -406,6 +573,8 @@ const char *reason_str(int reason);
 const char *msg_name(int type);
 void dlm_send_message(struct lockspace *ls, char *buf, int len);
 int dlm_send_message_daemon(char *buf, int len);
+void update_flow_control_status(void);
+void drop_send_queue(cpg_handle_t h);
 void dlm_header_in(struct dlm_header *hd);
 int dlm_header_validate(struct dlm_header *hd, int nodeid);
 int fence_node_time(int nodeid, uint64_t *last_fenced);
@@ -414,10 +583,11 @@ int setup_cpg_daemon(void);
 void close_cpg_daemon(void);
 void process_cpg_daemon(int ci);
 void set_protocol_stateful(void);
+int all_daemons_plock_batch(void);
+int all_daemons_plocks_frame(void);
 int set_protocol(void);
-void send_state_daemon_nodes(int fd);
-void send_state_daemon(int fd);
-void send_state_startup_nodes(int fd);
+int copy_state_daemon(char **buf_out, int *len_out);
+void set_daemon_metrics(struct daemon_metrics *dm);
 
 int receive_run_reply(struct dlm_header *hd, int len);
 int receive_run_request(struct dlm_header *hd, int len);
@@ -457,6 +627,8 @@ void deadlk_confchg(struct lockspace *ls,
 int do_read(int fd, void *buf, size_t count);
 int do_write(int fd, void *buf, size_t count);
 uint64_t monotime(void);
+uint64_t monotime_ms(void);
+uint64_t monotime_us(void);
 void client_dead(int ci);
 int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci));
 int client_fd(int ci);
@@ -464,6 +636,9 @@ void client_ignore(int ci, int fd);
 void client_back(int ci, int fd);
 struct lockspace *find_ls(char *name);
 struct lockspace *find_ls_id(uint32_t id);
+void state_changed(void);
+void add_ls_hash(struct lockspace *ls);
+void del_ls_hash(struct lockspace *ls);
 const char *dlm_mode_str(int mode);
 void cluster_dead(int ci);
 struct dlm_option *get_dlm_option(char *name);
@@ -498,8 +673,10 @@ void process_netlink(int ci);
 int setup_plocks(void);
 void close_plocks(void);
 void process_plocks(int ci);
-void drop_resources_all(void);
-int limit_plocks(void);
+void flush_plock_results(void);
+void flush_plock_batch(struct lockspace *ls);
+void flush_plock_batches(void);
+void receive_plock_batch(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_plock(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_own(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_sync(struct lockspace *ls, struct dlm_header *hd, int len);
@@ -507,10 +684,31 @@ void receive_drop(struct lockspace *ls, struct dlm_header *hd, int len);
 void process_saved_plocks(struct lockspace *ls);
 void purge_plocks(struct lockspace *ls, int nodeid, int unmount);
 int copy_plock_state(struct lockspace *ls, char *buf, int *len_out);
-
-void send_all_plocks_data(struct lockspace *ls, uint32_t seq, uint32_t *plocks_data);
+int copy_plock_state_page(struct lockspace *ls, struct dlmc_plock_filter *f,
+			  char *buf, int size, int *len_out);
+int copy_plock_stats(struct lockspace *ls, char *buf, int *len_out);
+
+int send_all_plocks_data(struct lockspace *ls, uint32_t seq, uint32_t *plocks_data);
+void send_plocks_frames(void);
+void finish_plocks_frames(struct lockspace *ls);
+void update_plock_polling(void);
 void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len);
+void receive_plocks_frame(struct lockspace *ls, struct dlm_header *hd, int len);
 void clear_plocks_data(struct lockspace *ls);
+void free_plock_pools(struct lockspace *ls);
+void drop_resources(struct dlm_timer *t);
+void log_plock_pools(void);
+int format_plock_trace(struct plock_trace *pt, char *buf, int len);
+
+/* timer.c */
+void init_timer(struct dlm_timer *t, void (*fn)(struct dlm_timer *t),
+		void *data);
+int timer_pending(struct dlm_timer *t);
+void mod_timer(struct dlm_timer *t, unsigned int ms);
+void del_timer(struct dlm_timer *t);
+void update_timers(void);
+void process_timers(int ci);
+int setup_timers(void);
 
 /* logging.c */
 
@@ -518,6 +716,14 @@ void init_logging(void);
 void close_logging(void);
 void copy_log_dump(char *buf, int *len);
 void copy_log_dump_plock(char *buf, int *len);
+void log_plock_trace(struct plock_trace *pt);
+uint32_t log_dropped_count(void);
+
+/* metrics.c */
+int setup_metrics(void);
+int copy_metrics(char *buf, int size);
+int metrics_request(char *req, int len);
+int metrics_header(int status, int len, char *hdr, int size);
 
 /* crc.c */
 uint32_t cpgname_to_crc(const char *data, int len);
@@ -169,6 +169,75 @@ int dlmc_dump_plocks(char *name, char *buf)
 	return do_dump(DLMC_CMD_DUMP_PLOCKS, name, buf);
 }
 
+int dlmc_dump_plocks_stream(char *name, struct dlmc_plock_filter *filter,
+			    int (*cb)(char *buf, int len, void *data),
+			    void *data)
+{
+	struct dlmc_header h;
+	char *buf;
+	int fd, rv, len;
+
+	buf = malloc(DLMC_PLOCK_CHUNK_SIZE + 1);
+	if (!buf)
+		return -ENOMEM;
+
+	init_header(&h, DLMC_CMD_DUMP_PLOCKS_STREAM, name,
+		    sizeof(struct dlmc_plock_filter));
+
+	fd = do_connect(DLMC_QUERY_SOCK_PATH);
+	if (fd < 0) {
+		rv = fd;
+		goto out;
+	}
+
+	rv = do_write(fd, &h, sizeof(h));
+	if (rv < 0)
+		goto out_close;
+
+	rv = do_write(fd, filter, sizeof(struct dlmc_plock_filter));
+	if (rv < 0)
+		goto out_close;
+
+	while (1) {
+		rv = do_read(fd, &h, sizeof(h));
+		if (rv < 0)
+			goto out_close;
+
+		len = h.len - sizeof(h);
+
+		if (h.option == DLMC_STREAM_END) {
+			if (len != sizeof(struct dlmc_plock_filter)) {
+				rv = -EPROTO;
+				goto out_close;
+			}
+			rv = do_read(fd, filter, len);
+			if (rv < 0)
+				goto out_close;
+			rv = h.data;
+			break;
+		}
+
+		if (len <= 0 || len > DLMC_PLOCK_CHUNK_SIZE) {
+			rv = -EPROTO;
+			goto out_close;
+		}
+
+		rv = do_read(fd, buf, len);
+		if (rv < 0)
+			goto out_close;
+		buf[len] = '\0';
+
+		rv = cb(buf, len, data);
+		if (rv)
+			break;
+	}
+ out_close:
+	close(fd);
+ out:
+	free(buf);
+	return rv;
+}
+
 int dlmc_dump_run(char *buf)
 {
 	return do_dump(DLMC_CMD_DUMP_RUN, NULL, buf);
@@ -537,192 +606,331 @@ int dlmc_print_status(uint32_t flags)
 	return rv;
 }
 
-int dlmc_node_info(char *name, int nodeid, struct dlmc_node *node)
+/*
+ * Queries are sent on a connection of their own by default, which is
+ * closed after the reply.  dlmc_open() returns a connection that stays
+ * open, to be passed to the _fd variants, so a caller making many queries
+ * doesn't connect for each one.  The replies on it come back in order,
+ * and the seq in each is checked against the request it answers.
+ */
+
+#define DLMC_PIPELINE_MAX	64
+
+static int query_seq;
+
+static int send_query(int fd, int cmd, char *name, int option, int data)
 {
-	struct dlmc_header h, *rh;
-	char reply[sizeof(struct dlmc_header) + sizeof(struct dlmc_node)];
-	int fd, rv;
+	struct dlmc_header h;
+	int rv;
 
-	init_header(&h, DLMC_CMD_NODE_INFO, name, 0);
-	h.data = nodeid;
+	init_header(&h, cmd, name, 0);
+	h.option = option;
+	h.data = data;
+	h.seq = __atomic_add_fetch(&query_seq, 1, __ATOMIC_RELAXED) & 0x7FFFFFFF;
+	if (!h.seq)
+		h.seq = 1;
+
+	rv = do_write(fd, &h, sizeof(h));
+	if (rv < 0)
+		return rv;
+	return h.seq;
+}
+
+/* reads a whole reply, so the next one on the connection starts at the
+   next header.  Returns the number of bytes copied into buf, up to len,
+   anything past that is discarded. */
 
-	memset(reply, 0, sizeof(reply));
+static int read_reply(int fd, int seq, struct dlmc_header *rh,
+		      void *buf, int len)
+{
+	char discard[256];
+	int extra, n, rv;
+
+	rv = do_read(fd, rh, sizeof(struct dlmc_header));
+	if (rv < 0)
+		return rv;
+
+	/* daemons without DLMC_CMD_OPEN reply with seq 0 */
+	if (rh->seq && rh->seq != seq)
+		return -EPROTO;
+
+	if (rh->len < sizeof(struct dlmc_header))
+		return -EPROTO;
+
+	extra = rh->len - sizeof(struct dlmc_header);
+	if (len > extra)
+		len = extra;
+
+	if (len) {
+		rv = do_read(fd, buf, len);
+		if (rv < 0)
+			return rv;
+		extra -= len;
+	}
+
+	while (extra) {
+		n = extra > sizeof(discard) ? sizeof(discard) : extra;
+		rv = do_read(fd, discard, n);
+		if (rv < 0)
+			return rv;
+		extra -= n;
+	}
+	return len;
+}
+
+int dlmc_open(void)
+{
+	struct dlmc_header rh;
+	int fd, seq, rv;
 
 	fd = do_connect(DLMC_QUERY_SOCK_PATH);
-	if (fd < 0) {
-		rv = fd;
-		goto out;
+	if (fd < 0)
+		return fd;
+
+	seq = send_query(fd, DLMC_CMD_OPEN, NULL, 0, 0);
+	if (seq < 0) {
+		rv = seq;
+		goto fail;
 	}
 
-	rv = do_write(fd, &h, sizeof(h));
-	if (rv < 0)
-		goto out_close;
+	/* an older daemon closes the connection without a reply */
+	rv = read_reply(fd, seq, &rh, NULL, 0);
+	if (rv < 0 || rh.command != DLMC_CMD_OPEN || rh.data < 0) {
+		rv = -EOPNOTSUPP;
+		goto fail;
+	}
+	return fd;
+ fail:
+	close(fd);
+	return rv;
+}
+
+void dlmc_close(int fd)
+{
+	close(fd);
+}
+
+static int recv_node_info(int fd, int seq, struct dlmc_node *node)
+{
+	struct dlmc_header rh;
+	struct dlmc_node tmp;
+	int rv;
 
-	rv = do_read(fd, reply, sizeof(reply));
+	rv = read_reply(fd, seq, &rh, &tmp, sizeof(tmp));
 	if (rv < 0)
-		goto out_close;
+		return rv;
 
-	rh = (struct dlmc_header *)reply;
-	rv = rh->data;
+	rv = rh.data;
 	if (rv < 0)
-		goto out_close;
+		return rv;
 
-	memcpy(node, (char *)reply + sizeof(struct dlmc_header),
-	       sizeof(struct dlmc_node));
- out_close:
-	close(fd);
- out:
+	memcpy(node, &tmp, sizeof(struct dlmc_node));
 	return rv;
 }
 
-int dlmc_lockspace_info(char *name, struct dlmc_lockspace *lockspace)
+int dlmc_node_info_fd(int fd, char *name, int nodeid, struct dlmc_node *node)
 {
-	struct dlmc_header h, *rh;
-	char reply[sizeof(struct dlmc_header) + sizeof(struct dlmc_lockspace)];
-	int fd, rv;
+	int seq;
+
+	seq = send_query(fd, DLMC_CMD_NODE_INFO, name, 0, nodeid);
+	if (seq < 0)
+		return seq;
 
-	init_header(&h, DLMC_CMD_LOCKSPACE_INFO, name, 0);
+	return recv_node_info(fd, seq, node);
+}
 
-	memset(reply, 0, sizeof(reply));
+int dlmc_node_info(char *name, int nodeid, struct dlmc_node *node)
+{
+	int fd, rv;
 
 	fd = do_connect(DLMC_QUERY_SOCK_PATH);
-	if (fd < 0) {
-		rv = fd;
-		goto out;
-	}
+	if (fd < 0)
+		return fd;
 
-	rv = do_write(fd, &h, sizeof(h));
-	if (rv < 0)
-		goto out_close;
+	rv = dlmc_node_info_fd(fd, name, nodeid, node);
+	close(fd);
+	return rv;
+}
+
+/* returns a connection error, the query result is set in result */
 
-	rv = do_read(fd, reply, sizeof(reply));
+static int recv_lockspace_info(int fd, int seq, struct dlmc_lockspace *ls,
+			       int *result)
+{
+	struct dlmc_header rh;
+	struct dlmc_lockspace tmp;
+	int rv;
+
+	rv = read_reply(fd, seq, &rh, &tmp, sizeof(tmp));
 	if (rv < 0)
-		goto out_close;
+		return rv;
+
+	*result = rh.data;
+	if (rh.data >= 0)
+		memcpy(ls, &tmp, sizeof(struct dlmc_lockspace));
+	return 0;
+}
+
+int dlmc_lockspace_info_fd(int fd, char *name, struct dlmc_lockspace *lockspace)
+{
+	int seq, rv, result;
+
+	seq = send_query(fd, DLMC_CMD_LOCKSPACE_INFO, name, 0, 0);
+	if (seq < 0)
+		return seq;
 
-	rh = (struct dlmc_header *)reply;
-	rv = rh->data;
+	rv = recv_lockspace_info(fd, seq, lockspace, &result);
 	if (rv < 0)
-		goto out_close;
+		return rv;
+	return result;
+}
 
-	memcpy(lockspace, (char *)reply + sizeof(struct dlmc_header),
-	       sizeof(struct dlmc_lockspace));
- out_close:
+int dlmc_lockspace_info(char *name, struct dlmc_lockspace *lockspace)
+{
+	int fd, rv;
+
+	fd = do_connect(DLMC_QUERY_SOCK_PATH);
+	if (fd < 0)
+		return fd;
+
+	rv = dlmc_lockspace_info_fd(fd, name, lockspace);
 	close(fd);
- out:
 	return rv;
 }
 
-int dlmc_lockspaces(int max, int *count, struct dlmc_lockspace *lss)
+/* Requests are written ahead of the replies being read, but no more than
+   DLMC_PIPELINE_MAX at once, so neither side fills its socket buffer while
+   the other is waiting to write. */
+
+int dlmc_lockspace_info_many(int fd, int count, char **names,
+			     struct dlmc_lockspace *lss, int *results)
 {
-	struct dlmc_header h, *rh;
-	char *reply;
-	int reply_len;
-	int fd, rv, result, ls_count;
+	int seqs[DLMC_PIPELINE_MAX];
+	int sent = 0, done = 0;
+	int rv;
 
-	init_header(&h, DLMC_CMD_LOCKSPACES, NULL, 0);
-	h.data = max;
+	while (done < count) {
+		while (sent < count && sent - done < DLMC_PIPELINE_MAX) {
+			rv = send_query(fd, DLMC_CMD_LOCKSPACE_INFO,
+					names[sent], 0, 0);
+			if (rv < 0)
+				return rv;
+			seqs[sent % DLMC_PIPELINE_MAX] = rv;
+			sent++;
+		}
 
-	reply_len = sizeof(struct dlmc_header) +
-		    (max * sizeof(struct dlmc_lockspace));
-	reply = malloc(reply_len);
-	if (!reply) {
-		rv = -1;
-		goto out;
+		rv = recv_lockspace_info(fd, seqs[done % DLMC_PIPELINE_MAX],
+					 &lss[done], &results[done]);
+		if (rv < 0)
+			return rv;
+		done++;
 	}
-	memset(reply, 0, reply_len);
+	return 0;
+}
 
-	fd = do_connect(DLMC_QUERY_SOCK_PATH);
-	if (fd < 0) {
-		rv = fd;
-		goto out;
-	}
+int dlmc_plock_stats_fd(int fd, char *name, struct dlmc_plock_stats *stats)
+{
+	struct dlmc_header rh;
+	int seq, rv;
 
-	rv = do_write(fd, &h, sizeof(h));
+	seq = send_query(fd, DLMC_CMD_PLOCK_STATS, name, 0, 0);
+	if (seq < 0)
+		return seq;
+
+	rv = read_reply(fd, seq, &rh, stats, sizeof(struct dlmc_plock_stats));
 	if (rv < 0)
-		goto out_close;
+		return rv;
 
-	/* won't usually get back the full reply_len */
-	do_read(fd, reply, reply_len);
+	if (rh.data < 0)
+		return rh.data;
 
-	rh = (struct dlmc_header *)reply;
-	result = rh->data;
-	if (result < 0 && result != -E2BIG) {
-		rv = result;
-		goto out_close;
-	}
+	if (rh.len - sizeof(rh) != sizeof(struct dlmc_plock_stats))
+		return -EPROTO;
+	return 0;
+}
 
-	if (result == -E2BIG) {
-		*count = -E2BIG;
-		ls_count = max;
-	} else {
-		*count = result;
-		ls_count = result;
-	}
-	rv = 0;
+int dlmc_plock_stats(char *name, struct dlmc_plock_stats *stats)
+{
+	int fd, rv;
 
-	memcpy(lss, (char *)reply + sizeof(struct dlmc_header),
-	       ls_count * sizeof(struct dlmc_lockspace));
- out_close:
+	fd = do_connect(DLMC_QUERY_SOCK_PATH);
+	if (fd < 0)
+		return fd;
+
+	rv = dlmc_plock_stats_fd(fd, name, stats);
 	close(fd);
- out:
 	return rv;
 }
 
-int dlmc_lockspace_nodes(char *name, int type, int max, int *count,
-			 struct dlmc_node *nodes)
+int dlmc_lockspaces_fd(int fd, int max, int *count, struct dlmc_lockspace *lss)
 {
-	struct dlmc_header h, *rh;
-	char *reply;
-	int reply_len;
-	int fd, rv, result, node_count;
+	struct dlmc_header rh;
+	int seq, rv, result;
 
-	init_header(&h, DLMC_CMD_LOCKSPACE_NODES, name, 0);
-	h.option = type;
-	h.data = max;
+	seq = send_query(fd, DLMC_CMD_LOCKSPACES, NULL, 0, max);
+	if (seq < 0)
+		return seq;
 
-	reply_len = sizeof(struct dlmc_header) +
-		    (max * sizeof(struct dlmc_node));
-	reply = malloc(reply_len);
-	if (!reply) {
-		rv = -1;
-		goto out;
-	}
-	memset(reply, 0, reply_len);
+	/* won't usually get back max */
+	rv = read_reply(fd, seq, &rh, lss, max * sizeof(struct dlmc_lockspace));
+	if (rv < 0)
+		return rv;
+
+	result = rh.data;
+	if (result < 0 && result != -E2BIG)
+		return result;
+
+	*count = result;
+	return 0;
+}
+
+int dlmc_lockspaces(int max, int *count, struct dlmc_lockspace *lss)
+{
+	int fd, rv;
 
 	fd = do_connect(DLMC_QUERY_SOCK_PATH);
-	if (fd < 0) {
-		rv = fd;
-		goto out;
-	}
+	if (fd < 0)
+		return fd;
 
-	rv = do_write(fd, &h, sizeof(h));
+	rv = dlmc_lockspaces_fd(fd, max, count, lss);
+	close(fd);
+	return rv;
+}
+
+int dlmc_lockspace_nodes_fd(int fd, char *name, int type, int max, int *count,
+			    struct dlmc_node *nodes)
+{
+	struct dlmc_header rh;
+	int seq, rv, result;
+
+	seq = send_query(fd, DLMC_CMD_LOCKSPACE_NODES, name, type, max);
+	if (seq < 0)
+		return seq;
+
+	/* won't usually get back max */
+	rv = read_reply(fd, seq, &rh, nodes, max * sizeof(struct dlmc_node));
 	if (rv < 0)
-		goto out_close;
+		return rv;
 
-	/* won't usually get back the full reply_len */
-	do_read(fd, reply, reply_len);
+	result = rh.data;
+	if (result < 0 && result != -E2BIG)
+		return result;
 
-	rh = (struct dlmc_header *)reply;
-	result = rh->data;
-	if (result < 0 && result != -E2BIG) {
-		rv = result;
-		goto out_close;
-	}
+	*count = result;
+	return 0;
+}
 
-	if (result == -E2BIG) {
-		*count = -E2BIG;
-		node_count = max;
-	} else {
-		*count = result;
-		node_count = result;
-	}
-	rv = 0;
+int dlmc_lockspace_nodes(char *name, int type, int max, int *count,
+			 struct dlmc_node *nodes)
+{
+	int fd, rv;
 
-	memcpy(nodes, (char *)reply + sizeof(struct dlmc_header),
-	       node_count * sizeof(struct dlmc_node));
- out_close:
+	fd = do_connect(DLMC_QUERY_SOCK_PATH);
+	if (fd < 0)
+		return fd;
+
+	rv = dlmc_lockspace_nodes_fd(fd, name, type, max, count, nodes);
 	close(fd);
- out:
 	return rv;
 }
 
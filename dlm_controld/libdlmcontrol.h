@@ -80,17 +80,105 @@ struct dlmc_lockspace {
 
 #define DLMC_STATUS_VERBOSE	0x00000001
 
+/* dlmc_plock_stats() */
+
+#define DLMC_PLOCK_OP_LOCK	0	/* lock that doesn't wait */
+#define DLMC_PLOCK_OP_UNLOCK	1
+#define DLMC_PLOCK_OP_GET	2
+#define DLMC_PLOCK_OP_WAIT	3	/* lock that waits for conflicts */
+#define DLMC_PLOCK_OPS		4
+
+#define DLMC_PLOCK_PATH_LOCAL	0	/* resource owned by this node */
+#define DLMC_PLOCK_PATH_OWNER	1	/* waited for ownership of resource */
+#define DLMC_PLOCK_PATH_CLUSTER	2	/* replicated to all nodes */
+#define DLMC_PLOCK_PATHS	3
+
+/* Values are microseconds.  Bucket b counts values v where b = v for
+   v < 4, and otherwise with e the highest bit set in v, b is
+   4 * (e - 1) plus the two bits of v below e.  That is, four buckets
+   for each power of two, each a quarter of it wide. */
+
+#define DLMC_PLOCK_HIST_BUCKETS	128
+
+struct dlmc_plock_hist {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint32_t buckets[DLMC_PLOCK_HIST_BUCKETS];
+};
+
+struct dlmc_plock_stats {
+	uint64_t seconds;	/* since stats were started for the ls */
+	uint64_t unmatched;	/* ops with results not timed */
+	/* from reading the op from the kernel to writing its result */
+	struct dlmc_plock_hist ops[DLMC_PLOCK_OPS][DLMC_PLOCK_PATHS];
+	/* time this node's locks spent on the waiters list */
+	struct dlmc_plock_hist waiters;
+	/* reading from the kernel stopped by plock_rate_limit,
+	   for all lockspaces */
+	struct dlmc_plock_hist rate_delays;
+};
+
+/* dlmc_dump_plocks_stream()
+
+   The plocks are returned in chunks of whole lines, in the order of
+   resource (inode) number, without a limit on the total size.  The
+   filter selects the lines, and with max_len set, a call returns about
+   that many bytes and sets the cursor to where the next call continues.
+   Each chunk reflects the state when it was copied, so lines may be
+   missed or repeated if locks change during a dump. */
+
+#define DLMC_PLOCK_CHUNK_SIZE	(64 * 1024)
+
+#define DLMC_PLOCK_WAITERS	0x00000001 /* only waiting and pending locks */
+
+struct dlmc_plock_filter {
+	uint64_t number;	/* only this resource, 0 for all */
+	uint64_t cursor;	/* resource number to continue with */
+	uint32_t cursor_line;	/* and line within the resource */
+	uint32_t flags;		/* DLMC_PLOCK_ */
+	uint32_t max_len;	/* return about this many bytes, 0 for all */
+	uint32_t pid;		/* only locks of this pid, 0 for all */
+	int nodeid;		/* only locks of this node, 0 for all */
+	int pad;
+};
+
 int dlmc_dump_debug(char *buf);
 int dlmc_dump_config(char *buf);
 int dlmc_dump_run(char *buf);
 int dlmc_dump_log_plock(char *buf);
 int dlmc_dump_plocks(char *name, char *buf);
+
+/* cb is called with each chunk, and returning non-zero ends the dump
+   with that value.  Returns 0 when all plocks were returned, 1 when
+   max_len ended it (filter cursor is set to continue), or -errno. */
+
+int dlmc_dump_plocks_stream(char *name, struct dlmc_plock_filter *filter,
+			    int (*cb)(char *buf, int len, void *data),
+			    void *data);
 int dlmc_lockspace_info(char *lsname, struct dlmc_lockspace *ls);
 int dlmc_node_info(char *lsname, int nodeid, struct dlmc_node *node);
 int dlmc_lockspaces(int max, int *count, struct dlmc_lockspace *lss);
 int dlmc_lockspace_nodes(char *lsname, int type, int max, int *count,
 			 struct dlmc_node *nodes);
 int dlmc_print_status(uint32_t flags);
+int dlmc_plock_stats(char *lsname, struct dlmc_plock_stats *stats);
+
+/* dlmc_open() returns a query connection that stays open for the _fd
+   variants below, or -errno (-EOPNOTSUPP from an older dlm_controld).
+   dlmc_lockspace_info_many() sends the requests without waiting for each
+   reply, and sets each result in results. */
+
+int dlmc_open(void);
+void dlmc_close(int fd);
+int dlmc_lockspace_info_fd(int fd, char *lsname, struct dlmc_lockspace *ls);
+int dlmc_lockspace_info_many(int fd, int count, char **lsnames,
+			     struct dlmc_lockspace *lss, int *results);
+int dlmc_node_info_fd(int fd, char *lsname, int nodeid, struct dlmc_node *node);
+int dlmc_lockspaces_fd(int fd, int max, int *count, struct dlmc_lockspace *lss);
+int dlmc_lockspace_nodes_fd(int fd, char *lsname, int type, int max, int *count,
+			    struct dlmc_node *nodes);
+int dlmc_plock_stats_fd(int fd, char *lsname, struct dlmc_plock_stats *stats);
 
 #define DLMC_RESULT_REGISTER	1
 #define DLMC_RESULT_NOTIFIED	2
@@ -7,6 +7,8 @@
  */
 
 #include "dlm_daemon.h"
+#include <pthread.h>
+#include <semaphore.h>
 
 static int syslog_facility;
 static int syslog_priority;
@@ -14,6 +16,183 @@ static int logfile_priority;
 static char logfile[PATH_MAX];
 static FILE *logfile_fp;
 
+#define NAME_ID_SIZE 32
+#define LOG_STR_LEN 512
+
+/*
+ * Messages for syslog and the logfile are written by a separate thread so
+ * that the main loop doesn't wait for disk or syslog.  log_level() (from
+ * the main thread or the query thread) formats the message, saves it in
+ * the log_dump ring, and queues it in log_ring, a bounded multi-producer
+ * single-consumer queue: a producer claims a slot by advancing log_head,
+ * and publishes the message by setting the slot's seq.  If the ring is
+ * full the message is counted in log_dropped rather than waiting, and the
+ * writer reports the number dropped.  The writer flushes the logfile when
+ * the ring is empty, so a burst of messages is written together.
+ */
+
+#define LOG_RING_SIZE 512	/* power of 2 */
+
+struct log_msg {
+	uint64_t seq;
+	int level;
+	int len;
+	time_t walltime;
+	char str[LOG_STR_LEN];
+};
+
+static struct log_msg log_ring[LOG_RING_SIZE];
+static uint64_t log_head;	/* next slot claimed by a producer */
+static uint64_t log_tail;	/* next slot read by the writer */
+static uint32_t log_dropped;
+static uint32_t log_dropped_reported;
+static sem_t log_sem;		/* counts queued messages */
+static pthread_t log_thread;
+static int log_thread_running;
+static int log_thread_stop;
+static pid_t log_thread_pid;	/* forked children don't have the thread */
+
+static void log_write(int level, time_t walltime, char *str, int len)
+{
+	char tbuf[64];
+
+	if (level <= syslog_priority)
+		syslog(level, "%s", str);
+
+	if (level <= logfile_priority && logfile_fp) {
+		strftime(tbuf, sizeof(tbuf), "%b %d %T", localtime(&walltime));
+		fprintf(logfile_fp, "%s %s", tbuf, str);
+	}
+}
+
+static int log_enqueue(int level, char *str, int len)
+{
+	struct log_msg *msg;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	while (1) {
+		msg = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	msg->level = level;
+	msg->len = len;
+	msg->walltime = time(NULL);
+	memcpy(msg->str, str, len + 1);
+
+	__atomic_store_n(&msg->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+	return 0;
+}
+
+static void log_dequeue(void)
+{
+	struct log_msg *msg = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+
+	/* a producer that claimed this slot before the one that posted
+	   log_sem may still be copying its message */
+
+	while (__atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+		sched_yield();
+
+	log_write(msg->level, msg->walltime, msg->str, msg->len);
+
+	__atomic_store_n(&msg->seq, log_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	log_tail++;
+}
+
+static void log_report_dropped(void)
+{
+	uint32_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	char str[128];
+	int len;
+
+	if (dropped == log_dropped_reported)
+		return;
+
+	len = snprintf(str, sizeof(str), "%llu logging dropped %u messages\n",
+		       (unsigned long long)monotime(),
+		       dropped - log_dropped_reported);
+	log_write(LOG_ERR, time(NULL), str, len);
+	log_dropped_reported = dropped;
+}
+
+uint32_t log_dropped_count(void)
+{
+	return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+static void *log_thread_fn(void *arg)
+{
+	while (1) {
+		if (sem_trywait(&log_sem) < 0) {
+			/* the ring is empty, write out what we have */
+			log_report_dropped();
+			if (logfile_fp)
+				fflush(logfile_fp);
+
+			if (__atomic_load_n(&log_thread_stop, __ATOMIC_ACQUIRE))
+				break;
+
+			while (sem_wait(&log_sem) < 0 && errno == EINTR)
+				;
+		}
+
+		/* the stop post doesn't come with a message */
+		if (__atomic_load_n(&log_tail, __ATOMIC_RELAXED) ==
+		    __atomic_load_n(&log_head, __ATOMIC_ACQUIRE))
+			continue;
+
+		log_dequeue();
+	}
+	return NULL;
+}
+
+static void start_log_thread(void)
+{
+	int i, rv;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+
+	sem_init(&log_sem, 0, 0);
+
+	rv = pthread_create(&log_thread, NULL, log_thread_fn, NULL);
+	if (rv) {
+		/* messages are written by log_level() */
+		syslog(LOG_ERR, "logging thread create error %d", rv);
+		return;
+	}
+	log_thread_running = 1;
+	log_thread_pid = getpid();
+}
+
+/* wait for the writer to finish the queued messages */
+
+static void stop_log_thread(void)
+{
+	if (!log_thread_running || getpid() != log_thread_pid)
+		return;
+
+	__atomic_store_n(&log_thread_stop, 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+	pthread_join(log_thread, NULL);
+	log_thread_running = 0;
+}
+
 void init_logging(void)
 {
 	syslog_facility = DEFAULT_SYSLOG_FACILITY;
@@ -27,6 +206,9 @@ void init_logging(void)
 	if (opt(debug_logfile_ind))
 		logfile_priority = LOG_DEBUG;
 
+	log_plock_on = opt(plock_trace_ind) ||
+		       (opt(daemon_debug_ind) && opt(plock_debug_ind));
+
 	if (logfile[0]) {
 		logfile_fp = fopen(logfile, "a+");
 		if (logfile_fp != NULL) {
@@ -36,26 +218,37 @@ void init_logging(void)
 	}
 
 	openlog(DAEMON_NAME, LOG_CONS | LOG_PID, syslog_facility);
+
+	start_log_thread();
+
+	/* don't lose queued messages if the daemon exits */
+	atexit(stop_log_thread);
 }
 
 void close_logging(void)
 {
+	stop_log_thread();
 	closelog();
 	if (logfile_fp)
 		fclose(logfile_fp);
+	logfile_fp = NULL;
 }
 
-#define NAME_ID_SIZE 32
-#define LOG_STR_LEN 512
-static char log_str[LOG_STR_LEN];
-
 static char log_dump[LOG_DUMP_SIZE];
 static unsigned int log_point;
 static unsigned int log_wrap;
 
-static char log_dump_plock[LOG_DUMP_SIZE];
-static unsigned int log_point_plock;
-static unsigned int log_wrap_plock;
+#define PLOCK_TRACE_RECS (LOG_DUMP_SIZE / sizeof(struct plock_trace))
+
+static struct plock_trace plock_trace[PLOCK_TRACE_RECS];
+static uint64_t plock_trace_count;
+
+/* the query thread's copy of plock_trace to format */
+static struct plock_trace plock_trace_copy[PLOCK_TRACE_RECS];
+
+/* the query thread copies the dump buffers while the main thread
+   is logging to them */
+static pthread_mutex_t log_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void log_copy(char *buf, int *len, char *log_buf,
 		     unsigned int *point, unsigned int *wrap)
@@ -80,16 +273,105 @@ static void log_copy(char *buf, int *len, char *log_buf,
 
 void copy_log_dump(char *buf, int *len)
 {
+	pthread_mutex_lock(&log_dump_mutex);
 	log_copy(buf, len, log_dump, &log_point, &log_wrap);
+	pthread_mutex_unlock(&log_dump_mutex);
+}
+
+static int plock_trace_len(struct plock_trace *pt, char *line, int size)
+{
+	if (pt->type == PT_TEXT || pt->type == PT_TEXT_CONT)
+		return pt->len;
+	return format_plock_trace(pt, line, size);
 }
 
+/* format as many of the most recent plock log records as fit in buf */
+
 void copy_log_dump_plock(char *buf, int *len)
 {
-	log_copy(buf, len, log_dump_plock, &log_point_plock, &log_wrap_plock);
+	struct plock_trace *pt;
+	char line[256];
+	uint64_t count, first, i;
+	int n, pos = 0, total = 0;
+
+	pthread_mutex_lock(&log_dump_mutex);
+	count = plock_trace_count;
+	memcpy(plock_trace_copy, plock_trace, sizeof(plock_trace));
+	pthread_mutex_unlock(&log_dump_mutex);
+
+	first = count > PLOCK_TRACE_RECS ? count - PLOCK_TRACE_RECS : 0;
+
+	for (i = count; i > first; i--) {
+		pt = &plock_trace_copy[(i - 1) % PLOCK_TRACE_RECS];
+		n = plock_trace_len(pt, line, sizeof(line));
+		if (total + n >= LOG_DUMP_SIZE)
+			break;
+		total += n;
+	}
+	first = i;
+
+	/* don't start in the middle of a message */
+	while (first < count &&
+	       plock_trace_copy[first % PLOCK_TRACE_RECS].type == PT_TEXT_CONT)
+		first++;
+
+	for (i = first; i < count; i++) {
+		pt = &plock_trace_copy[i % PLOCK_TRACE_RECS];
+		if (pt->type == PT_TEXT || pt->type == PT_TEXT_CONT) {
+			memcpy(buf + pos, pt->text, pt->len);
+			pos += pt->len;
+		} else {
+			pos += format_plock_trace(pt, buf + pos, LOG_DUMP_SIZE - pos);
+		}
+	}
+	*len = pos;
+}
+
+static struct plock_trace *next_plock_trace(void)
+{
+	return &plock_trace[plock_trace_count++ % PLOCK_TRACE_RECS];
 }
 
-static void log_save_str(int len, char *log_buf, unsigned int *point,
-			 unsigned int *wrap)
+/* save a plock op in the plock log, the caller fills in all but the time */
+
+void log_plock_trace(struct plock_trace *pt)
+{
+	char line[256];
+
+	pt->time = monotime();
+
+	pthread_mutex_lock(&log_dump_mutex);
+	memcpy(next_plock_trace(), pt, sizeof(struct plock_trace));
+	pthread_mutex_unlock(&log_dump_mutex);
+
+	if (opt(daemon_debug_ind) && opt(plock_debug_ind)) {
+		format_plock_trace(pt, line, sizeof(line));
+		fprintf(stderr, "%s", line);
+	}
+}
+
+/* called with log_dump_mutex held */
+
+static void log_save_plock_text(char *str, int len)
+{
+	struct plock_trace *pt;
+	int type = PT_TEXT;
+	int n;
+
+	while (len) {
+		n = len > PLOCK_TRACE_TEXT ? PLOCK_TRACE_TEXT : len;
+		pt = next_plock_trace();
+		pt->type = type;
+		pt->len = n;
+		memcpy(pt->text, str, n);
+		str += n;
+		len -= n;
+		type = PT_TEXT_CONT;
+	}
+}
+
+static void log_save_str(char *log_str, int len, char *log_buf,
+			 unsigned int *point, unsigned int *wrap)
 {
 	unsigned int p = *point;
 	unsigned int w = *wrap;
@@ -122,6 +404,7 @@ static void log_save_str(int len, char *log_buf, unsigned int *point,
 void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 {
 	va_list ap;
+	char log_str[LOG_STR_LEN];
 	char name[NAME_ID_SIZE + 2];
 	uint32_t level = level_in & 0x0000FFFF;
 	uint32_t extra = level_in & 0xFFFF0000;
@@ -157,20 +440,22 @@ void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 	log_str[pos++] = '\n';
 	log_str[pos++] = '\0';
 
+	pthread_mutex_lock(&log_dump_mutex);
 	if (level < LOG_NONE)
-		log_save_str(pos - 1, log_dump, &log_point, &log_wrap);
-	if (plock)
-		log_save_str(pos - 1, log_dump_plock, &log_point_plock, &log_wrap_plock);
-
-	if (level <= syslog_priority)
-		syslog(level, "%s", log_str);
-
-	if (level <= logfile_priority && logfile_fp) {
-		time_t logtime = time(NULL);
-		char tbuf[64];
-		strftime(tbuf, sizeof(tbuf), "%b %d %T", localtime(&logtime));
-		fprintf(logfile_fp, "%s %s", tbuf, log_str);
-		fflush(logfile_fp);
+		log_save_str(log_str, pos - 1, log_dump, &log_point, &log_wrap);
+	if (plock && log_plock_on)
+		log_save_plock_text(log_str, pos - 1);
+	pthread_mutex_unlock(&log_dump_mutex);
+
+	if (level <= syslog_priority ||
+	    (level <= logfile_priority && logfile_fp)) {
+		if (log_thread_running && getpid() == log_thread_pid) {
+			log_enqueue(level, log_str, pos - 1);
+		} else {
+			log_write(level, time(NULL), log_str, pos - 1);
+			if (logfile_fp)
+				fflush(logfile_fp);
+		}
 	}
 
 	if (!dlm_options[daemon_debug_ind].use_int)
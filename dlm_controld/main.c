@@ -14,6 +14,8 @@
 #include <linux/genetlink.h>
 #include <linux/dlm_netlink.h>
 #include <uuid/uuid.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #ifdef USE_SD_NOTIFY
 #include <systemd/sd-daemon.h>
@@ -23,12 +25,10 @@
 #include "version.cf"
 
 #define CLIENT_NALLOC	32
-static int client_maxi;
 static int client_size = 0;
 static struct client *client = NULL;
-static struct pollfd *pollfd = NULL;
+static int epoll_fd = -1;
 static pthread_t query_thread;
-static pthread_mutex_t query_mutex;
 static struct list_head fs_register_list;
 static int kernel_monitor_fd;
 
@@ -41,6 +41,7 @@ uint32_t helper_full_count;
 
 struct client {
 	int fd;
+	int polled;
 	void *workfn;
 	void *deadfn;
 	struct lockspace *ls;
@@ -91,40 +92,89 @@ uint64_t monotime(void)
 	return ts.tv_sec;
 }
 
+uint64_t monotime_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monotime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Client fds are registered with epoll so a wakeup only visits the fds
+ * that are ready, rather than scanning every client.  Registration is
+ * level-triggered: several handlers (process_plocks with its batch budget,
+ * process_listener, process_connection) deliberately leave input behind
+ * for the next pass.  The epoll data carries both the fd and the client
+ * index, so an event for a slot that was closed and reused earlier in the
+ * same pass is ignored.
+ */
+
 static void client_alloc(void)
 {
 	int i;
 
 	if (!client) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			log_error("can't create epoll fd %d", errno);
 		client = malloc(CLIENT_NALLOC * sizeof(struct client));
-		pollfd = malloc(CLIENT_NALLOC * sizeof(struct pollfd));
 	} else {
 		client = realloc(client, (client_size + CLIENT_NALLOC) *
 					 sizeof(struct client));
-		pollfd = realloc(pollfd, (client_size + CLIENT_NALLOC) *
-					 sizeof(struct pollfd));
-		if (!pollfd)
-			log_error("can't alloc for pollfd");
 	}
-	if (!client || !pollfd)
+	if (!client)
 		log_error("can't alloc for client array");
 
 	for (i = client_size; i < client_size + CLIENT_NALLOC; i++) {
 		client[i].workfn = NULL;
 		client[i].deadfn = NULL;
 		client[i].fd = -1;
-		pollfd[i].fd = -1;
-		pollfd[i].revents = 0;
+		client[i].polled = 0;
 	}
 	client_size += CLIENT_NALLOC;
 }
 
+static void client_poll_add(int ci, int fd)
+{
+	struct epoll_event ev;
+
+	if (client[ci].polled)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)ci;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		log_error("epoll_ctl add ci %d fd %d errno %d", ci, fd, errno);
+		return;
+	}
+	client[ci].polled = 1;
+}
+
+static void client_poll_del(int ci, int fd)
+{
+	if (!client[ci].polled)
+		return;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		log_error("epoll_ctl del ci %d fd %d errno %d", ci, fd, errno);
+	client[ci].polled = 0;
+}
+
 void client_dead(int ci)
 {
+	client_poll_del(ci, client[ci].fd);
 	close(client[ci].fd);
 	client[ci].workfn = NULL;
 	client[ci].fd = -1;
-	pollfd[ci].fd = -1;
 }
 
 int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
@@ -142,10 +192,7 @@ int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			else
 				client[i].deadfn = client_dead;
 			client[i].fd = fd;
-			pollfd[i].fd = fd;
-			pollfd[i].events = POLLIN;
-			if (i > client_maxi)
-				client_maxi = i;
+			client_poll_add(i, fd);
 			return i;
 		}
 	}
@@ -161,14 +208,12 @@ int client_fd(int ci)
 
 void client_ignore(int ci, int fd)
 {
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
+	client_poll_del(ci, fd);
 }
 
 void client_back(int ci, int fd)
 {
-	pollfd[ci].fd = fd;
-	pollfd[ci].events = POLLIN;
+	client_poll_add(ci, fd);
 }
 
 static void sigterm_handler(int sig)
@@ -193,12 +238,12 @@ struct run *find_run(char *uuid_str)
 
 static void close_helper(void)
 {
+	if (helper_ci >= 0)
+		client_ignore(helper_ci, helper_status_fd);
 	close(helper_req_fd);
 	close(helper_status_fd);
 	helper_req_fd = -1;
 	helper_status_fd = -1;
-	pollfd[helper_ci].fd = -1;
-	pollfd[helper_ci].events = 0;
 	helper_ci = -1;
 
 	/* don't set helper_pid = -1 until we've tried waitpid */
@@ -375,6 +420,7 @@ static void process_helper(int ci)
 			  send_reply.uuid, send_reply.info.local_pid, send_reply.info.local_result);
 
 		send_run_reply(run, &send_reply);
+		state_changed();
 		return;
 	}
 
@@ -540,6 +586,7 @@ static int check_run_operation(char *uuid_str, uint32_t flags, struct dlmc_run_c
 static struct lockspace *create_ls(char *name)
 {
 	struct lockspace *ls;
+	int i;
 
 	ls = malloc(sizeof(*ls));
 	if (!ls)
@@ -552,6 +599,13 @@ static struct lockspace *create_ls(char *name)
 	INIT_LIST_HEAD(&ls->saved_messages);
 	INIT_LIST_HEAD(&ls->plock_resources);
 	ls->plock_resources_root = RB_ROOT;
+	ls->plock_owners_root = RB_ROOT;
+	INIT_LIST_HEAD(&ls->plock_nodes);
+	INIT_LIST_HEAD(&ls->plock_lru);
+	INIT_LIST_HEAD(&ls->plock_ops);
+	for (i = 0; i < PLOCK_OPS_HASH; i++)
+		INIT_LIST_HEAD(&ls->plock_ops_hash[i]);
+	init_timer(&ls->drop_timer, drop_resources, ls);
 #if 0
 	INIT_LIST_HEAD(&ls->deadlk_nodes);
 	INIT_LIST_HEAD(&ls->transactions);
@@ -562,11 +616,68 @@ static struct lockspace *create_ls(char *name)
 	return ls;
 }
 
+/*
+ * Lockspaces are hashed by name and by global_id so that uevents, client
+ * commands and every plock op from the kernel don't walk the lockspaces
+ * list.  The lockspace is added to the hash tables by dlm_join_lockspace()
+ * once its global_id is known, and removed before it's freed.
+ */
+
+static struct lockspace *ls_name_hash[LS_HASH_SIZE];
+static struct lockspace *ls_id_hash[LS_HASH_SIZE];
+
+static uint32_t ls_name_bucket(const char *name)
+{
+	return cpgname_to_crc(name, strlen(name)) & (LS_HASH_SIZE - 1);
+}
+
+static uint32_t ls_id_bucket(uint32_t id)
+{
+	return (id ^ (id >> 16)) & (LS_HASH_SIZE - 1);
+}
+
+void add_ls_hash(struct lockspace *ls)
+{
+	uint32_t b;
+
+	b = ls_name_bucket(ls->name);
+	ls->name_next = ls_name_hash[b];
+	ls_name_hash[b] = ls;
+
+	b = ls_id_bucket(ls->global_id);
+	ls->id_next = ls_id_hash[b];
+	ls_id_hash[b] = ls;
+}
+
+void del_ls_hash(struct lockspace *ls)
+{
+	struct lockspace **p;
+
+	for (p = &ls_name_hash[ls_name_bucket(ls->name)]; *p;
+	     p = &(*p)->name_next) {
+		if (*p == ls) {
+			*p = ls->name_next;
+			break;
+		}
+	}
+
+	for (p = &ls_id_hash[ls_id_bucket(ls->global_id)]; *p;
+	     p = &(*p)->id_next) {
+		if (*p == ls) {
+			*p = ls->id_next;
+			break;
+		}
+	}
+
+	ls->name_next = NULL;
+	ls->id_next = NULL;
+}
+
 struct lockspace *find_ls(char *name)
 {
 	struct lockspace *ls;
 
-	list_for_each_entry(ls, &lockspaces, list) {
+	for (ls = ls_name_hash[ls_name_bucket(name)]; ls; ls = ls->name_next) {
 		if ((strlen(ls->name) == strlen(name)) &&
 		    !strncmp(ls->name, name, strlen(name)))
 			return ls;
@@ -578,7 +689,7 @@ struct lockspace *find_ls_id(uint32_t id)
 {
 	struct lockspace *ls;
 
-	list_for_each_entry(ls, &lockspaces, list) {
+	for (ls = ls_id_hash[ls_id_bucket(id)]; ls; ls = ls->id_next) {
 		if (ls->global_id == id)
 			return ls;
 	}
@@ -718,6 +829,8 @@ static void process_uevent(int ci)
 	if (!act || !sys || !argv[3])
 		return;
 
+	state_changed();
+
 	if (strncmp(sys, "dlm", 3))
 		return;
 
@@ -887,34 +1000,6 @@ static void copy_run_list(char *buf, int *len)
 	*len = pos;
 }
 
-static void query_dump_run(int fd)
-{
-	struct dlmc_header h;
-	int len = 0;
-
-	copy_run_list(copy_buf, &len);
-
-	init_header(&h, DLMC_CMD_DUMP_RUN, NULL, 0, len);
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
-
-	if (len)
-		send(fd, copy_buf, len, MSG_NOSIGNAL);
-}
-
-static void query_dump_debug(int fd)
-{
-	struct dlmc_header h;
-	int len = 0;
-
-	copy_log_dump(copy_buf, &len);
-
-	init_header(&h, DLMC_CMD_DUMP_DEBUG, NULL, 0, len);
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
-
-	if (len)
-		send(fd, copy_buf, len, MSG_NOSIGNAL);
-}
-
 static void copy_options(char *buf, int *len)
 {
 	struct dlm_option *o;
@@ -941,237 +1026,918 @@ static void copy_options(char *buf, int *len)
 	*len = pos;
 }
 
-static void query_dump_config(int fd)
-{
-	struct dlmc_header h;
-	int len = 0;
+/*
+ * The query thread doesn't look at daemon state.  The main thread publishes
+ * an immutable, versioned snapshot of everything the queries report (the
+ * lockspaces and their nodes, daemon status, config and run operations),
+ * and the query thread replies from a snapshot it holds a reference to.
+ *
+ * state_version is advanced by the main thread, through state_changed(),
+ * when the state the snapshots report changes: lockspace changes and their
+ * messages, daemon cpg and fencing events, quorum changes, uevents, and
+ * commands from dlm_tool or gfs_controld.  Plock ops don't advance it.
+ * When a query finds the current snapshot older than state_version, or
+ * more than QUERY_SNAP_MAX_MS old (the counters and monotime in the daemon
+ * status change on their own), it asks the main thread for a new one
+ * (through query_efd), and the client waits up to QUERY_WAIT_MS for it.  If
+ * the main thread is busy, e.g. blocked writing to sysfs, the query is
+ * answered from the older snapshot.  Publishing only swaps the snapshot
+ * pointer under snap_mutex, and a snapshot is freed when its last
+ * reference is dropped.
+ * Repeated queries of a daemon that isn't changing involve the main thread
+ * at most once every QUERY_SNAP_MAX_MS.
+ *
+ * Everything a client waits for from the main thread is a query_work
+ * queued on query_work_todo: a new snapshot, the plock pool stats in the
+ * log, plock state (too large to copy into each snapshot), and the metrics
+ * text for a scrape on metrics_port (see metrics.c).  The main thread does
+ * it between passes, moves it to query_work_done and wakes the query thread
+ * with query_reply_efd.  The query thread never blocks on the main thread;
+ * the client waits, while the others are served.  Plock state has to be
+ * current, so a plock client waits as long as it takes.
+ */
 
-	copy_options(copy_buf, &len);
+#define QUERY_WAIT_MS		500
+#define QUERY_SNAP_MAX_MS	1000
 
-	init_header(&h, DLMC_CMD_DUMP_CONFIG, NULL, 0, len);
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+#define QUERY_REQ_SNAP		0x00000001
+#define QUERY_REQ_POOLS		0x00000002
+#define QUERY_REQ_WORK		0x00000004
 
-	if (len)
-		send(fd, copy_buf, len, MSG_NOSIGNAL);
-}
+#define QUERY_WORK_SNAP		1
+#define QUERY_WORK_POOLS	2
+#define QUERY_WORK_PLOCKS	3
+#define QUERY_WORK_METRICS	4
 
-static void query_dump_log_plock(int fd)
-{
-	struct dlmc_header h;
-	int len = 0;
+#define SNAP_NODE_OPTIONS	3	/* DLMC_NODES_ALL, MEMBERS, NEXT */
 
-	copy_log_dump_plock(copy_buf, &len);
+struct snap_nodes {
+	int count;
+	struct dlmc_node *nodes;
+};
 
-	init_header(&h, DLMC_CMD_DUMP_DEBUG, NULL, 0, len);
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+struct query_snap {
+	uint64_t version;
+	uint64_t time;		/* monotime_ms */
+	int refs;
+	int ls_count;
+	struct dlmc_lockspace *lss;
+	struct snap_nodes (*ls_nodes)[SNAP_NODE_OPTIONS];
+	char *status;
+	int status_len;
+	char *config;
+	int config_len;
+	char *run;
+	int run_len;
+};
 
-	if (len)
-		send(fd, copy_buf, len, MSG_NOSIGNAL);
-}
+static pthread_mutex_t snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct query_snap *snap_current;
+static uint64_t state_version;
+static uint32_t query_request;
+static int query_efd = -1;
+static int query_reply_efd = -1;
+static int metrics_fd = -1;
 
-static void query_dump_plocks(int fd, char *name)
-{
-	struct lockspace *ls;
-	struct dlmc_header h;
-	int len = 0;
+struct query_client;
+
+struct query_work {
+	struct list_head list;
+	struct query_client *qc; /* NULL if the client has gone, query thread */
+	int cmd;		 /* QUERY_WORK_ */
+
+	/* QUERY_WORK_PLOCKS */
+	int plock_cmd;
+	char name[DLM_LOCKSPACE_LEN+1];
+	struct dlmc_plock_filter filter; /* for DLMC_CMD_DUMP_PLOCKS_STREAM */
+	int size;			 /* of the stream chunk */
+
+	char *buf;
+	int len;
 	int rv;
+};
 
-	ls = find_ls(name);
-	if (!ls) {
-		rv = -ENOENT;
-		goto out;
-	}
+static LIST_HEAD(query_work_todo);
+static LIST_HEAD(query_work_done);
 
-	rv = copy_plock_state(ls, copy_buf, &len);
- out:
-	init_header(&h, DLMC_CMD_DUMP_PLOCKS, name, rv, len);
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+/* query thread buffer for the log dumps */
+static char query_buf[LOG_DUMP_SIZE];
 
-	if (len)
-		send(fd, copy_buf, len, MSG_NOSIGNAL);
-}
+static void free_query_snap(struct query_snap *snap)
+{
+	int i, j;
 
-/* combines a header and the data and sends it back to the client in
-   a single do_write() call */
+	if (snap->ls_nodes) {
+		for (i = 0; i < snap->ls_count; i++) {
+			for (j = 0; j < SNAP_NODE_OPTIONS; j++)
+				free(snap->ls_nodes[i][j].nodes);
+		}
+		free(snap->ls_nodes);
+	}
+	free(snap->lss);
+	free(snap->status);
+	free(snap->config);
+	free(snap->run);
+	free(snap);
+}
 
-static void do_reply(int fd, int cmd, char *name, int result, int option,
-		     char *buf, int buflen)
+static void put_query_snap(struct query_snap *snap)
 {
-	struct dlmc_header *h;
-	char *reply;
-	int reply_len;
+	int refs;
 
-	reply_len = sizeof(struct dlmc_header) + buflen;
-	reply = malloc(reply_len);
-	if (!reply)
+	if (!snap)
 		return;
-	memset(reply, 0, reply_len);
-	h = (struct dlmc_header *)reply;
 
-	init_header(h, cmd, name, result, buflen);
-	h->option = option;
+	pthread_mutex_lock(&snap_mutex);
+	refs = --snap->refs;
+	pthread_mutex_unlock(&snap_mutex);
 
-	if (buf && buflen)
-		memcpy(reply + sizeof(struct dlmc_header), buf, buflen);
+	if (!refs)
+		free_query_snap(snap);
+}
 
-	do_write(fd, reply, reply_len);
+static char *copy_out(char *buf, int len)
+{
+	char *out;
 
-	free(reply);
+	out = malloc(len ? len : 1);
+	if (out && len)
+		memcpy(out, buf, len);
+	return out;
 }
 
-static void query_lockspace_info(int fd, char *name)
+/* main thread */
+
+static struct query_snap *create_query_snap(void)
 {
+	struct query_snap *snap;
 	struct lockspace *ls;
-	struct dlmc_lockspace lockspace;
-	int rv;
+	struct snap_nodes *sn;
+	int i = 0, j, rv;
 
-	ls = find_ls(name);
-	if (!ls) {
-		rv = -ENOENT;
-		goto out;
+	snap = malloc(sizeof(struct query_snap));
+	if (!snap)
+		return NULL;
+	memset(snap, 0, sizeof(struct query_snap));
+
+	snap->version = state_version;
+	snap->time = monotime_ms();
+	snap->refs = 1;
+
+	rv = set_lockspaces(&snap->ls_count, &snap->lss);
+	if (rv < 0)
+		goto fail;
+
+	snap->ls_nodes = malloc(snap->ls_count * sizeof(*snap->ls_nodes) + 1);
+	if (!snap->ls_nodes)
+		goto fail;
+	memset(snap->ls_nodes, 0, snap->ls_count * sizeof(*snap->ls_nodes));
+
+	/* set_lockspaces() copied the lockspaces in list order */
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		for (j = 0; j < SNAP_NODE_OPTIONS; j++) {
+			sn = &snap->ls_nodes[i][j];
+			rv = set_lockspace_nodes(ls, DLMC_NODES_ALL + j,
+						 &sn->count, &sn->nodes);
+			if (rv < 0)
+				goto fail;
+		}
+		i++;
 	}
 
-	memset(&lockspace, 0, sizeof(lockspace));
+	rv = copy_state_daemon(&snap->status, &snap->status_len);
+	if (rv < 0)
+		goto fail;
 
-	rv = set_lockspace_info(ls, &lockspace);
- out:
-	do_reply(fd, DLMC_CMD_LOCKSPACE_INFO, name, rv, 0,
-		 (char *)&lockspace, sizeof(lockspace));
+	copy_options(copy_buf, &snap->config_len);
+	snap->config = copy_out(copy_buf, snap->config_len);
+	if (!snap->config)
+		goto fail;
+
+	copy_run_list(copy_buf, &snap->run_len);
+	snap->run = copy_out(copy_buf, snap->run_len);
+	if (!snap->run)
+		goto fail;
+
+	return snap;
+ fail:
+	log_error("create_query_snap no mem");
+	free_query_snap(snap);
+	return NULL;
 }
 
-static void query_node_info(int fd, char *name, int nodeid)
+static void copy_plock_query(struct query_work *w)
 {
 	struct lockspace *ls;
-	struct dlmc_node node;
-	int rv;
+	int len = 0;
 
-	ls = find_ls(name);
+	ls = find_ls(w->name);
 	if (!ls) {
-		rv = -ENOENT;
-		goto out;
+		w->rv = -ENOENT;
+		return;
 	}
 
-	memset(&node, 0, sizeof(node));
-
-	rv = set_node_info(ls, nodeid, &node);
- out:
-	do_reply(fd, DLMC_CMD_NODE_INFO, name, rv, 0,
-		 (char *)&node, sizeof(node));
+	if (w->plock_cmd == DLMC_CMD_PLOCK_STATS)
+		w->rv = copy_plock_stats(ls, copy_buf, &len);
+	else if (w->plock_cmd == DLMC_CMD_DUMP_PLOCKS_STREAM)
+		w->rv = copy_plock_state_page(ls, &w->filter, copy_buf,
+					      w->size, &len);
+	else
+		w->rv = copy_plock_state(ls, copy_buf, &len);
+	if (w->rv >= 0)
+		w->len = len;
 }
 
-static void query_lockspaces(int fd, int max)
+static void do_query_work(struct query_work *w)
 {
-	int ls_count = 0;
-	struct dlmc_lockspace *lss = NULL;
-	int rv, result;
-
-	rv = set_lockspaces(&ls_count, &lss);
-	if (rv < 0) {
-		result = rv;
-		ls_count = 0;
-		goto out;
+	switch (w->cmd) {
+	case QUERY_WORK_PLOCKS:
+		copy_plock_query(w);
+		break;
+	case QUERY_WORK_METRICS:
+		w->len = copy_metrics(copy_buf, LOG_DUMP_SIZE);
+		break;
+	default:
+		/* snapshots and pool stats are done once for all the work */
+		return;
 	}
 
-	if (ls_count > max) {
-		result = -E2BIG;
-		ls_count = max;
-	} else {
-		result = ls_count;
+	w->buf = copy_out(copy_buf, w->len);
+	if (!w->buf) {
+		w->rv = -ENOMEM;
+		w->len = 0;
 	}
- out:
-	do_reply(fd, DLMC_CMD_LOCKSPACES, NULL, result, 0,
-		 (char *)lss, ls_count * sizeof(struct dlmc_lockspace));
+}
+
+/* called when something the snapshots report has changed */
 
-	if (lss)
-		free(lss);
+void state_changed(void)
+{
+	__atomic_store_n(&state_version, state_version + 1, __ATOMIC_RELAXED);
 }
 
-static void query_lockspace_nodes(int fd, char *name, int option, int max)
+/* called by the main loop after each pass, when nothing is in progress */
+
+static void process_query_requests(void)
 {
-	struct lockspace *ls;
-	int node_count = 0;
-	struct dlmc_node *nodes = NULL;
-	int rv, result;
+	struct query_snap *snap = NULL, *old = NULL;
+	struct query_work *w;
+	LIST_HEAD(work);
+	uint32_t req;
 
-	ls = find_ls(name);
-	if (!ls) {
-		result = -ENOENT;
-		node_count = 0;
-		goto out;
-	}
+	if (!__atomic_load_n(&query_request, __ATOMIC_ACQUIRE))
+		return;
 
-	rv = set_lockspace_nodes(ls, option, &node_count, &nodes);
-	if (rv < 0) {
-		result = rv;
-		node_count = 0;
-		goto out;
-	}
+	pthread_mutex_lock(&snap_mutex);
+	req = query_request;
+	query_request = 0;
+	list_splice_init(&query_work_todo, &work);
+	pthread_mutex_unlock(&snap_mutex);
 
-	/* node_count is the number of structs copied/returned; the caller's
-	   max may be less than that, in which case we copy as many as they
-	   asked for and return -E2BIG */
+	list_for_each_entry(w, &work, list)
+		do_query_work(w);
 
-	if (node_count > max) {
-		result = -E2BIG;
-		node_count = max;
-	} else {
-		result = node_count;
+	if (req & QUERY_REQ_POOLS)
+		log_plock_pools();
+
+	if (req & QUERY_REQ_SNAP)
+		snap = create_query_snap();
+
+	pthread_mutex_lock(&snap_mutex);
+	if (snap) {
+		old = snap_current;
+		snap_current = snap;
 	}
- out:
-	do_reply(fd, DLMC_CMD_LOCKSPACE_NODES, name, result, 0,
-		 (char *)nodes, node_count * sizeof(struct dlmc_node));
+	list_splice_init(&work, &query_work_done);
+	pthread_mutex_unlock(&snap_mutex);
 
-	if (nodes)
-		free(nodes);
+	if (req & QUERY_REQ_WORK)
+		eventfd_write(query_reply_efd, 1);
+
+	put_query_snap(old);
 }
 
-static void process_connection(int ci)
+static void process_query_efd(int ci)
 {
-	struct dlmc_header h;
-	char uuid_str[RUN_UUID_LEN];
-	char *extra = NULL;
-	int rv, extra_len = 0;
-	struct lockspace *ls;
-	struct dlmc_run_check_state state;
+	uint64_t val;
 
-	memset(uuid_str, 0, sizeof(uuid_str));
+	if (read(client[ci].fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		log_error("query eventfd read errno %d", errno);
+}
 
-	rv = do_read(client[ci].fd, &h, sizeof(h));
-	if (rv < 0) {
-		log_debug("connection %d read error %d", ci, rv);
-		goto out;
-	}
+/* query thread */
 
-	if (h.magic != DLMC_MAGIC) {
-		log_debug("connection %d magic error %x", ci, h.magic);
-		goto out;
-	}
+/* call with snap_mutex held */
 
-	if ((h.version & 0xFFFF0000) != (DLMC_VERSION & 0xFFFF0000)) {
-		log_debug("connection %d version error %x", ci, h.version);
-		goto out;
-	}
+static void send_query_request(uint32_t req)
+{
+	uint64_t val = 1;
 
-	if (h.len > sizeof(h)) {
-		extra_len = h.len - sizeof(h);
-		extra = malloc(extra_len);
-		if (!extra) {
-			log_error("process_connection no mem %d", extra_len);
-			goto out;
-		}
-		memset(extra, 0, extra_len);
+	__atomic_store_n(&query_request, query_request | req, __ATOMIC_RELEASE);
 
-		rv = do_read(client[ci].fd, extra, extra_len);
-		if (rv < 0) {
-			log_debug("connection %d extra read error %d", ci, rv);
-			goto out;
-		}
-	}
+	if (write(query_efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return;
+}
 
-	switch (h.command) {
-	case DLMC_CMD_FENCE_ACK:
-		fence_ack_node(atoi(h.name));
-		break;
+static int query_snap_stale(void)
+{
+	int stale;
+
+	pthread_mutex_lock(&snap_mutex);
+	stale = !snap_current || snap_current->version !=
+		__atomic_load_n(&state_version, __ATOMIC_RELAXED) ||
+		monotime_ms() - snap_current->time > QUERY_SNAP_MAX_MS;
+	pthread_mutex_unlock(&snap_mutex);
+
+	return stale;
+}
+
+/* the client has already waited for a new snapshot if it was stale */
+
+static struct query_snap *get_query_snap(void)
+{
+	struct query_snap *snap;
+
+	pthread_mutex_lock(&snap_mutex);
+	snap = snap_current;
+	if (snap)
+		snap->refs++;
+	pthread_mutex_unlock(&snap_mutex);
+
+	return snap;
+}
+
+static int find_snap_ls(struct query_snap *snap, char *name)
+{
+	int i;
+
+	for (i = 0; i < snap->ls_count; i++) {
+		if (!strncmp(snap->lss[i].name, name, DLM_LOCKSPACE_LEN))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Query clients
+ *
+ * The query thread serves all its clients from one epoll loop.  A client
+ * that connects and sends a request is answered and closed, as before.  A
+ * client that starts with DLMC_CMD_OPEN keeps the connection, and can send
+ * any number of requests without waiting for the replies.  Requests are
+ * answered in order, and each reply header echoes the seq of its request.
+ *
+ * Replies are queued in the client's out buffer and sent as the socket
+ * takes them.  The next request isn't read until the last reply has been
+ * sent, so a client that doesn't read its replies only holds up itself.
+ * A plock stream copies its next chunk only once the previous one is sent.
+ * In the same way, a client waiting for query_work from the main thread
+ * has no more requests processed until the work is done or its deadline
+ * (wait_until) passes, while the loop goes on serving the others.
+ *
+ * A metrics client (http) is served the same way: its request header is
+ * read as it arrives, it waits for the metrics as query_work, and it's
+ * closed once the reply has been sent.
+ */
+
+#define QUERY_CLIENTS_MAX	128
+#define QUERY_IN_MAX		(sizeof(struct dlmc_header) + 1024)
+#define QUERY_OUT_KEEP		(64 * 1024)
+
+#define QUERY_EV_LISTEN		0
+#define QUERY_EV_METRICS	1
+#define QUERY_EV_REPLY		2
+#define QUERY_EV_CLIENT		3
+
+struct query_client {
+	int fd;
+	int slot;
+	int persistent;	/* sent DLMC_CMD_OPEN */
+	int http;	/* metrics scrape */
+	int done;	/* one shot client has had its request */
+	int seq;	/* of the request being answered */
+	uint32_t events;
+
+	struct query_work *work;	/* waiting for the main thread */
+	uint64_t wait_until;		/* for work the reply can do without */
+	int waited;			/* for the request in the in buffer */
+
+	char in[QUERY_IN_MAX];
+	int in_len;
+
+	char *out;
+	int out_len;
+	int out_pos;
+	int out_size;
+
+	/* DLMC_CMD_DUMP_PLOCKS_STREAM in progress */
+	int streaming;
+	uint32_t stream_sent;
+	char stream_name[DLM_LOCKSPACE_LEN+1];
+	struct dlmc_plock_filter stream_filter;
+};
+
+static struct query_client *query_clients[QUERY_CLIENTS_MAX];
+static int query_epoll_fd = -1;
+
+static int query_out(struct query_client *qc, void *buf, int len)
+{
+	char *out;
+	int size;
+
+	if (qc->out_pos && qc->out_pos == qc->out_len)
+		qc->out_pos = qc->out_len = 0;
+
+	if (qc->out_len + len > qc->out_size) {
+		size = qc->out_size ? qc->out_size * 2 : 4096;
+		while (size < qc->out_len + len)
+			size *= 2;
+		out = realloc(qc->out, size);
+		if (!out)
+			return -ENOMEM;
+		qc->out = out;
+		qc->out_size = size;
+	}
+
+	memcpy(qc->out + qc->out_len, buf, len);
+	qc->out_len += len;
+	return 0;
+}
+
+static int query_send(struct query_client *qc, int cmd, char *name, int result,
+		      char *buf, int len)
+{
+	struct dlmc_header h;
+	int rv;
+
+	init_header(&h, cmd, name, result, len);
+	h.seq = qc->seq;
+
+	rv = query_out(qc, &h, sizeof(h));
+	if (rv < 0)
+		return rv;
+
+	if (len)
+		rv = query_out(qc, buf, len);
+	return rv;
+}
+
+/* send what the socket will take without blocking, the rest is sent when
+   epoll reports the socket writable */
+
+static int query_flush(struct query_client *qc)
+{
+	int rv;
+
+	while (qc->out_pos < qc->out_len) {
+		rv = send(qc->fd, qc->out + qc->out_pos, qc->out_len - qc->out_pos,
+			  MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (rv < 0)
+			return -errno;
+		qc->out_pos += rv;
+	}
+
+	qc->out_pos = qc->out_len = 0;
+
+	/* don't keep a large dump buffer around for an idle client */
+	if (qc->out_size > QUERY_OUT_KEEP) {
+		free(qc->out);
+		qc->out = NULL;
+		qc->out_size = 0;
+	}
+	return 0;
+}
+
+static struct query_work *query_work_new(int cmd)
+{
+	struct query_work *w;
+
+	w = malloc(sizeof(struct query_work));
+	if (!w)
+		return NULL;
+	memset(w, 0, sizeof(struct query_work));
+	w->cmd = cmd;
+	return w;
+}
+
+/* hand work to the main thread, the client waits for it in query_reply */
+
+static void query_work_post(struct query_client *qc, struct query_work *w,
+			    uint32_t req)
+{
+	w->qc = qc;
+	qc->work = w;
+
+	pthread_mutex_lock(&snap_mutex);
+	list_add_tail(&w->list, &query_work_todo);
+	send_query_request(req | QUERY_REQ_WORK);
+	pthread_mutex_unlock(&snap_mutex);
+}
+
+/* wait up to QUERY_WAIT_MS for work the reply can be made without,
+   returns 1 if the client is waiting */
+
+static int query_wait(struct query_client *qc, int cmd, uint32_t req)
+{
+	struct query_work *w;
+
+	w = query_work_new(cmd);
+	if (!w)
+		return 0;
+
+	query_work_post(qc, w, req);
+	qc->wait_until = monotime_ms() + QUERY_WAIT_MS;
+	return 1;
+}
+
+static void query_dump_run(struct query_client *qc)
+{
+	struct query_snap *snap;
+
+	snap = get_query_snap();
+	if (!snap) {
+		query_send(qc, DLMC_CMD_DUMP_RUN, NULL, -EAGAIN, NULL, 0);
+		return;
+	}
+
+	query_send(qc, DLMC_CMD_DUMP_RUN, NULL, 0, snap->run, snap->run_len);
+	put_query_snap(snap);
+}
+
+static void query_dump_debug(struct query_client *qc)
+{
+	int len = 0;
+
+	copy_log_dump(query_buf, &len);
+
+	query_send(qc, DLMC_CMD_DUMP_DEBUG, NULL, 0, query_buf, len);
+}
+
+static void query_dump_config(struct query_client *qc)
+{
+	struct query_snap *snap;
+
+	snap = get_query_snap();
+	if (!snap) {
+		query_send(qc, DLMC_CMD_DUMP_CONFIG, NULL, -EAGAIN, NULL, 0);
+		return;
+	}
+
+	query_send(qc, DLMC_CMD_DUMP_CONFIG, NULL, 0,
+		   snap->config, snap->config_len);
+	put_query_snap(snap);
+}
+
+static void query_dump_log_plock(struct query_client *qc)
+{
+	int len = 0;
+
+	copy_log_dump_plock(query_buf, &len);
+
+	query_send(qc, DLMC_CMD_DUMP_DEBUG, NULL, 0, query_buf, len);
+}
+
+/* plock state and stats have to be current, so the client waits for the
+   main thread as long as it takes */
+
+static void query_dump_plocks(struct query_client *qc, int cmd, char *name)
+{
+	struct query_work *w;
+
+	w = query_work_new(QUERY_WORK_PLOCKS);
+	if (!w) {
+		query_send(qc, cmd, name, -ENOMEM, NULL, 0);
+		return;
+	}
+
+	w->plock_cmd = cmd;
+	memcpy(w->name, name, DLM_LOCKSPACE_LEN);
+	query_work_post(qc, w, 0);
+}
+
+/* The plocks are copied a chunk at a time by the main thread, each chunk
+   sent before the next is copied, so neither side holds more than one
+   chunk however many plocks there are. */
+
+static void query_stream_end(struct query_client *qc, int rv)
+{
+	struct dlmc_header eh;
+
+	init_header(&eh, DLMC_CMD_DUMP_PLOCKS_STREAM, qc->stream_name, rv,
+		    sizeof(qc->stream_filter));
+	eh.option = DLMC_STREAM_END;
+	eh.seq = qc->seq;
+
+	if (!query_out(qc, &eh, sizeof(eh)))
+		query_out(qc, &qc->stream_filter, sizeof(qc->stream_filter));
+	qc->streaming = 0;
+}
+
+/* called when the previous chunk has been sent */
+
+static void query_stream_next(struct query_client *qc)
+{
+	uint32_t max_len = qc->stream_filter.max_len;
+	struct query_work *w;
+
+	w = query_work_new(QUERY_WORK_PLOCKS);
+	if (!w) {
+		query_stream_end(qc, -ENOMEM);
+		return;
+	}
+
+	w->plock_cmd = DLMC_CMD_DUMP_PLOCKS_STREAM;
+	memcpy(w->name, qc->stream_name, DLM_LOCKSPACE_LEN);
+	w->filter = qc->stream_filter;
+
+	/* a chunk is no larger than what's left of max_len */
+
+	w->size = DLMC_PLOCK_CHUNK_SIZE;
+	if (max_len && max_len - qc->stream_sent < w->size)
+		w->size = max_len - qc->stream_sent;
+
+	query_work_post(qc, w, 0);
+}
+
+/* called when the main thread has copied the chunk */
+
+static void query_stream_chunk(struct query_client *qc, struct query_work *w)
+{
+	int rv = w->rv;
+
+	qc->stream_filter = w->filter;
+
+	if (rv >= 0 && w->len &&
+	    query_send(qc, DLMC_CMD_DUMP_PLOCKS_STREAM, qc->stream_name, 0,
+		       w->buf, w->len) < 0)
+		rv = -ENOMEM;
+
+	if (rv > 0) {
+		qc->stream_sent += w->len;
+		if (!qc->stream_filter.max_len ||
+		    qc->stream_sent < qc->stream_filter.max_len)
+			return;
+	}
+
+	query_stream_end(qc, rv);
+}
+
+static void query_dump_plocks_stream(struct query_client *qc,
+				     struct dlmc_header *h, char *extra)
+{
+	memset(&qc->stream_filter, 0, sizeof(qc->stream_filter));
+	memset(qc->stream_name, 0, sizeof(qc->stream_name));
+	memcpy(qc->stream_name, h->name, DLM_LOCKSPACE_LEN);
+	qc->stream_sent = 0;
+
+	if (h->len - sizeof(struct dlmc_header) != sizeof(qc->stream_filter)) {
+		query_stream_end(qc, -EINVAL);
+		return;
+	}
+
+	memcpy(&qc->stream_filter, extra, sizeof(qc->stream_filter));
+	qc->streaming = 1;
+}
+
+static void query_dump_status(struct query_client *qc)
+{
+	struct query_snap *snap;
+
+	/* there's no header, dlmc_dump_status reads dlmc_state records
+	   until the connection is closed, so it can't share a connection */
+
+	if (qc->persistent) {
+		query_send(qc, DLMC_CMD_DUMP_STATUS, NULL, -EINVAL, NULL, 0);
+		return;
+	}
+
+	snap = get_query_snap();
+	if (!snap)
+		return;
+
+	if (snap->status_len)
+		query_out(qc, snap->status, snap->status_len);
+	put_query_snap(snap);
+}
+
+static void query_lockspace_info(struct query_client *qc, char *name)
+{
+	struct query_snap *snap;
+	struct dlmc_lockspace lockspace;
+	int i, rv;
+
+	memset(&lockspace, 0, sizeof(lockspace));
+
+	snap = get_query_snap();
+	if (!snap) {
+		rv = -EAGAIN;
+		goto out;
+	}
+
+	i = find_snap_ls(snap, name);
+	if (i < 0) {
+		rv = -ENOENT;
+		goto out;
+	}
+
+	lockspace = snap->lss[i];
+	rv = 0;
+ out:
+	query_send(qc, DLMC_CMD_LOCKSPACE_INFO, name, rv,
+		   (char *)&lockspace, sizeof(lockspace));
+	put_query_snap(snap);
+}
+
+static void query_node_info(struct query_client *qc, char *name, int nodeid)
+{
+	struct query_snap *snap;
+	struct snap_nodes *sn;
+	struct dlmc_node node;
+	int i, rv;
+
+	memset(&node, 0, sizeof(node));
+
+	snap = get_query_snap();
+	if (!snap) {
+		rv = -EAGAIN;
+		goto out;
+	}
+
+	i = find_snap_ls(snap, name);
+	if (i < 0) {
+		rv = -ENOENT;
+		goto out;
+	}
+
+	/* as set_node_info(), a node without history only has its nodeid */
+
+	node.nodeid = nodeid;
+	rv = 0;
+
+	sn = &snap->ls_nodes[i][DLMC_NODES_ALL - 1];
+	for (i = 0; i < sn->count; i++) {
+		if (sn->nodes[i].nodeid == nodeid) {
+			node = sn->nodes[i];
+			break;
+		}
+	}
+ out:
+	query_send(qc, DLMC_CMD_NODE_INFO, name, rv,
+		   (char *)&node, sizeof(node));
+	put_query_snap(snap);
+}
+
+static void query_lockspaces(struct query_client *qc, int max)
+{
+	struct query_snap *snap;
+	struct dlmc_lockspace *lss = NULL;
+	int ls_count = 0;
+	int result;
+
+	snap = get_query_snap();
+	if (!snap) {
+		result = -EAGAIN;
+		goto out;
+	}
+
+	lss = snap->lss;
+	ls_count = snap->ls_count;
+
+	if (ls_count > max) {
+		result = -E2BIG;
+		ls_count = max;
+	} else {
+		result = ls_count;
+	}
+ out:
+	query_send(qc, DLMC_CMD_LOCKSPACES, NULL, result,
+		   (char *)lss, ls_count * sizeof(struct dlmc_lockspace));
+	put_query_snap(snap);
+}
+
+static void query_lockspace_nodes(struct query_client *qc, char *name, int option, int max)
+{
+	struct query_snap *snap;
+	struct dlmc_node *nodes = NULL;
+	int node_count = 0;
+	int i, result;
+
+	snap = get_query_snap();
+	if (!snap) {
+		result = -EAGAIN;
+		goto out;
+	}
+
+	i = find_snap_ls(snap, name);
+	if (i < 0) {
+		result = -ENOENT;
+		goto out;
+	}
+
+	if (option >= DLMC_NODES_ALL &&
+	    option < DLMC_NODES_ALL + SNAP_NODE_OPTIONS) {
+		node_count = snap->ls_nodes[i][option - DLMC_NODES_ALL].count;
+		nodes = snap->ls_nodes[i][option - DLMC_NODES_ALL].nodes;
+	}
+
+	/* node_count is the number of structs copied/returned; the caller's
+	   max may be less than that, in which case we copy as many as they
+	   asked for and return -E2BIG */
+
+	if (node_count > max) {
+		result = -E2BIG;
+		node_count = max;
+	} else {
+		result = node_count;
+	}
+ out:
+	query_send(qc, DLMC_CMD_LOCKSPACE_NODES, name, result,
+		   (char *)nodes, node_count * sizeof(struct dlmc_node));
+	put_query_snap(snap);
+}
+
+/* combines a header and the data and sends it back to the client in
+   a single do_write() call */
+
+static void do_reply(int fd, int cmd, char *name, int result, int option,
+		     char *buf, int buflen)
+{
+	struct dlmc_header *h;
+	char *reply;
+	int reply_len;
+
+	reply_len = sizeof(struct dlmc_header) + buflen;
+	reply = malloc(reply_len);
+	if (!reply)
+		return;
+	memset(reply, 0, reply_len);
+	h = (struct dlmc_header *)reply;
+
+	init_header(h, cmd, name, result, buflen);
+	h->option = option;
+
+	if (buf && buflen)
+		memcpy(reply + sizeof(struct dlmc_header), buf, buflen);
+
+	do_write(fd, reply, reply_len);
+
+	free(reply);
+}
+
+static void process_connection(int ci)
+{
+	struct dlmc_header h;
+	char uuid_str[RUN_UUID_LEN];
+	char *extra = NULL;
+	int rv, extra_len = 0;
+	struct lockspace *ls;
+	struct dlmc_run_check_state state;
+
+	memset(uuid_str, 0, sizeof(uuid_str));
+
+	rv = do_read(client[ci].fd, &h, sizeof(h));
+	if (rv < 0) {
+		log_debug("connection %d read error %d", ci, rv);
+		goto out;
+	}
+
+	if (h.magic != DLMC_MAGIC) {
+		log_debug("connection %d magic error %x", ci, h.magic);
+		goto out;
+	}
+
+	if ((h.version & 0xFFFF0000) != (DLMC_VERSION & 0xFFFF0000)) {
+		log_debug("connection %d version error %x", ci, h.version);
+		goto out;
+	}
+
+	if (h.len > sizeof(h)) {
+		extra_len = h.len - sizeof(h);
+		extra = malloc(extra_len);
+		if (!extra) {
+			log_error("process_connection no mem %d", extra_len);
+			goto out;
+		}
+		memset(extra, 0, extra_len);
+
+		rv = do_read(client[ci].fd, extra, extra_len);
+		if (rv < 0) {
+			log_debug("connection %d extra read error %d", ci, rv);
+			goto out;
+		}
+	}
+
+	state_changed();
+
+	switch (h.command) {
+	case DLMC_CMD_FENCE_ACK:
+		fence_ack_node(atoi(h.name));
+		break;
 
 	case DLMC_CMD_FS_REGISTER:
 		if (opt(enable_fscontrol_ind)) {
@@ -1289,25 +2055,396 @@ static int setup_listener(const char *sock_path)
 	return s;
 }
 
-static void query_lock(void)
+/* This is a thread, so we have to be careful, don't call log_ functions.
+   We need a thread to process queries because the main thread may block
+   for long periods when writing to sysfs to stop dlm-kernel (any maybe
+   other places).  It only reads the snapshots the main thread publishes. */
+
+static void process_query(struct query_client *qc, struct dlmc_header *h,
+			  char *extra)
 {
-	pthread_mutex_lock(&query_mutex);
+	switch (h->command) {
+	case DLMC_CMD_OPEN:
+		qc->persistent = 1;
+		query_send(qc, DLMC_CMD_OPEN, NULL, 0, NULL, 0);
+		break;
+	case DLMC_CMD_DUMP_DEBUG:
+		query_dump_debug(qc);
+		break;
+	case DLMC_CMD_DUMP_CONFIG:
+		query_dump_config(qc);
+		break;
+	case DLMC_CMD_DUMP_LOG_PLOCK:
+		query_dump_log_plock(qc);
+		break;
+	case DLMC_CMD_DUMP_PLOCKS:
+	case DLMC_CMD_PLOCK_STATS:
+		query_dump_plocks(qc, h->command, h->name);
+		break;
+	case DLMC_CMD_DUMP_PLOCKS_STREAM:
+		query_dump_plocks_stream(qc, h, extra);
+		break;
+	case DLMC_CMD_LOCKSPACE_INFO:
+		query_lockspace_info(qc, h->name);
+		break;
+	case DLMC_CMD_NODE_INFO:
+		query_node_info(qc, h->name, h->data);
+		break;
+	case DLMC_CMD_LOCKSPACES:
+		query_lockspaces(qc, h->data);
+		break;
+	case DLMC_CMD_LOCKSPACE_NODES:
+		query_lockspace_nodes(qc, h->name, h->option, h->data);
+		break;
+	case DLMC_CMD_DUMP_STATUS:
+		query_dump_status(qc);
+		break;
+	case DLMC_CMD_DUMP_RUN:
+		query_dump_run(qc);
+		break;
+	default:
+		/* a pipelining client is waiting for a reply to each request */
+		if (qc->persistent)
+			query_send(qc, h->command, NULL, -EINVAL, NULL, 0);
+		break;
+	}
 }
 
-static void query_unlock(void)
+static void query_http_reply(struct query_client *qc, int status,
+			     char *buf, int len)
 {
-	pthread_mutex_unlock(&query_mutex);
+	char hdr[256];
+	int hdr_len;
+
+	hdr_len = metrics_header(status, len, hdr, sizeof(hdr));
+
+	if (!query_out(qc, hdr, hdr_len) && len)
+		query_out(qc, buf, len);
+	qc->done = 1;
 }
 
-/* This is a thread, so we have to be careful, don't call log_ functions.
-   We need a thread to process queries because the main thread may block
-   for long periods when writing to sysfs to stop dlm-kernel (any maybe
-   other places). */
+/* returns 1 when the request header has been handled, 0 if it's not all
+   in the in buffer yet */
 
-static void *process_queries(void *arg)
+static int query_http_parse(struct query_client *qc)
+{
+	struct query_work *w;
+	int status;
+
+	if (qc->in_len < QUERY_IN_MAX &&
+	    !memmem(qc->in, qc->in_len, "\r\n\r\n", 4) &&
+	    !memmem(qc->in, qc->in_len, "\n\n", 2))
+		return 0;
+
+	status = metrics_request(qc->in, qc->in_len);
+
+	if (status == 200) {
+		w = query_work_new(QUERY_WORK_METRICS);
+		if (w) {
+			query_work_post(qc, w, 0);
+			return 1;
+		}
+		status = 503;
+	}
+
+	query_http_reply(qc, status, NULL, 0);
+	return 1;
+}
+
+static void query_work_complete(struct query_client *qc, struct query_work *w)
+{
+	switch (w->cmd) {
+	case QUERY_WORK_SNAP:
+	case QUERY_WORK_POOLS:
+		qc->waited = 1;
+		break;
+	case QUERY_WORK_PLOCKS:
+		if (w->plock_cmd == DLMC_CMD_DUMP_PLOCKS_STREAM)
+			query_stream_chunk(qc, w);
+		else
+			query_send(qc, w->plock_cmd, w->name, w->rv,
+				   w->buf, w->len);
+		break;
+	case QUERY_WORK_METRICS:
+		query_http_reply(qc, w->rv < 0 ? 503 : 200, w->buf, w->len);
+		break;
+	}
+}
+
+/* before a request is answered, have the main thread bring what it reports
+   up to date, returns 1 if the client waits for that */
+
+static int query_prepare(struct query_client *qc, struct dlmc_header *h)
+{
+	if (qc->waited) {
+		qc->waited = 0;
+		return 0;
+	}
+
+	switch (h->command) {
+	case DLMC_CMD_DUMP_DEBUG:
+		/* the plock pool stats are added to the log */
+		return query_wait(qc, QUERY_WORK_POOLS, QUERY_REQ_POOLS);
+	case DLMC_CMD_DUMP_CONFIG:
+	case DLMC_CMD_DUMP_STATUS:
+	case DLMC_CMD_DUMP_RUN:
+	case DLMC_CMD_LOCKSPACE_INFO:
+	case DLMC_CMD_NODE_INFO:
+	case DLMC_CMD_LOCKSPACES:
+	case DLMC_CMD_LOCKSPACE_NODES:
+		if (query_snap_stale())
+			return query_wait(qc, QUERY_WORK_SNAP, QUERY_REQ_SNAP);
+		break;
+	}
+	return 0;
+}
+
+/* returns 1 if a request was processed, 0 if there's no complete request
+   in the in buffer yet or the client is waiting to answer it, or -1 if
+   the client sent something invalid */
+
+static int query_parse(struct query_client *qc)
 {
 	struct dlmc_header h;
-	int s, f, rv;
+	int len;
+
+	if (qc->in_len < sizeof(h))
+		return 0;
+
+	memcpy(&h, qc->in, sizeof(h));
+
+	if (h.magic != DLMC_MAGIC)
+		return -1;
+
+	if ((h.version & 0xFFFF0000) != (DLMC_VERSION & 0xFFFF0000))
+		return -1;
+
+	if (h.len < sizeof(h) || h.len > QUERY_IN_MAX)
+		return -1;
+
+	len = h.len;
+	if (qc->in_len < len)
+		return 0;
+
+	/* the request stays in the in buffer while the client waits */
+	if (query_prepare(qc, &h))
+		return 0;
+
+	qc->seq = h.seq;
+	process_query(qc, &h, qc->in + sizeof(h));
+
+	qc->in_len -= len;
+	if (qc->in_len)
+		memmove(qc->in, qc->in + len, qc->in_len);
+
+	if (!qc->persistent)
+		qc->done = 1;
+	return 1;
+}
+
+static void query_client_close(struct query_client *qc)
+{
+	/* the work is freed when the main thread is done with it */
+	if (qc->work)
+		qc->work->qc = NULL;
+
+	query_clients[qc->slot] = NULL;
+	close(qc->fd);
+	free(qc->out);
+	free(qc);
+}
+
+/* send queued replies and process requests until the socket is full or
+   there's nothing left to do, returns -1 when the client is finished */
+
+static int query_client_work(struct query_client *qc)
+{
+	struct epoll_event ev;
+	uint32_t events;
+	int rv;
+
+	while (1) {
+		if (query_flush(qc) < 0)
+			return -1;
+
+		if (qc->out_len)
+			break;
+
+		if (qc->work)
+			break;
+
+		if (qc->streaming) {
+			query_stream_next(qc);
+			continue;
+		}
+
+		if (qc->done)
+			return -1;
+
+		rv = qc->http ? query_http_parse(qc) : query_parse(qc);
+		if (rv < 0)
+			return -1;
+		if (!rv)
+			break;
+	}
+
+	events = 0;
+	if (qc->in_len < QUERY_IN_MAX)
+		events |= EPOLLIN;
+	if (qc->out_len)
+		events |= EPOLLOUT;
+
+	if (events != qc->events) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.u32 = QUERY_EV_CLIENT + qc->slot;
+		if (epoll_ctl(query_epoll_fd, EPOLL_CTL_MOD, qc->fd, &ev) < 0)
+			return -1;
+		qc->events = events;
+	}
+	return 0;
+}
+
+static int query_client_read(struct query_client *qc)
+{
+	int rv;
+
+	if (qc->in_len == QUERY_IN_MAX)
+		return 0;
+
+	rv = recv(qc->fd, qc->in + qc->in_len, QUERY_IN_MAX - qc->in_len,
+		  MSG_DONTWAIT);
+	if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (rv <= 0)
+		return -1;
+
+	qc->in_len += rv;
+	return 0;
+}
+
+static void query_client_add(int s, int http)
+{
+	struct query_client *qc;
+	struct epoll_event ev;
+	int f, i;
+
+	f = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (f < 0)
+		return;
+
+	for (i = 0; i < QUERY_CLIENTS_MAX; i++) {
+		if (!query_clients[i])
+			break;
+	}
+	if (i == QUERY_CLIENTS_MAX)
+		goto fail;
+
+	qc = malloc(sizeof(struct query_client));
+	if (!qc)
+		goto fail;
+	memset(qc, 0, sizeof(struct query_client));
+	qc->fd = f;
+	qc->slot = i;
+	qc->http = http;
+	qc->events = EPOLLIN;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = QUERY_EV_CLIENT + i;
+	if (epoll_ctl(query_epoll_fd, EPOLL_CTL_ADD, f, &ev) < 0) {
+		free(qc);
+		goto fail;
+	}
+
+	query_clients[i] = qc;
+	return;
+ fail:
+	close(f);
+}
+
+/* the main thread has finished some query_work */
+
+static void query_reply(void)
+{
+	struct query_work *w, *safe;
+	struct query_client *qc;
+	LIST_HEAD(done);
+	uint64_t val;
+
+	if (read(query_reply_efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return;
+
+	pthread_mutex_lock(&snap_mutex);
+	list_splice_init(&query_work_done, &done);
+	pthread_mutex_unlock(&snap_mutex);
+
+	list_for_each_entry_safe(w, safe, &done, list) {
+		list_del(&w->list);
+		qc = w->qc;
+		if (qc) {
+			qc->work = NULL;
+			qc->wait_until = 0;
+			query_work_complete(qc, w);
+			if (query_client_work(qc) < 0)
+				query_client_close(qc);
+		}
+		free(w->buf);
+		free(w);
+	}
+}
+
+/* stop waiting for work that's past its deadline, and answer from what
+   there is; returns the epoll timeout for the next deadline */
+
+static int query_wait_timeouts(void)
+{
+	struct query_client *qc;
+	uint64_t now = monotime_ms();
+	int i, ms, timeout = -1;
+
+	for (i = 0; i < QUERY_CLIENTS_MAX; i++) {
+		qc = query_clients[i];
+		if (!qc || !qc->wait_until)
+			continue;
+
+		if (qc->wait_until <= now) {
+			/* the work is freed when the main thread is done */
+			qc->work->qc = NULL;
+			qc->work = NULL;
+			qc->wait_until = 0;
+			qc->waited = 1;
+			if (query_client_work(qc) < 0) {
+				query_client_close(qc);
+				continue;
+			}
+			/* the next request may wait as well */
+			if (!qc->wait_until)
+				continue;
+		}
+
+		ms = qc->wait_until - now;
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+	return timeout;
+}
+
+static int query_epoll_add(int fd, uint32_t id)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+	return epoll_ctl(query_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void *process_queries(void *arg)
+{
+	struct epoll_event events[16];
+	struct query_client *qc;
+	int s, i, n, rv;
 
 	rv = setup_listener(DLMC_QUERY_SOCK_PATH);
 	if (rv < 0)
@@ -1315,66 +2452,57 @@ static void *process_queries(void *arg)
 
 	s = rv;
 
+	query_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (query_epoll_fd < 0)
+		return NULL;
+
+	if (query_epoll_add(s, QUERY_EV_LISTEN) < 0)
+		return NULL;
+
+	if (query_epoll_add(query_reply_efd, QUERY_EV_REPLY) < 0)
+		return NULL;
+
+	if (metrics_fd >= 0 && query_epoll_add(metrics_fd, QUERY_EV_METRICS) < 0)
+		metrics_fd = -1;
+
 	for (;;) {
-		f = accept(s, NULL, NULL);
-		if (f < 0)
+		n = epoll_wait(query_epoll_fd, events, 16,
+			       query_wait_timeouts());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
 			return NULL;
 
-		rv = do_read(f, &h, sizeof(h));
-		if (rv < 0) {
-			goto out;
-		}
+		for (i = 0; i < n; i++) {
+			switch (events[i].data.u32) {
+			case QUERY_EV_LISTEN:
+				query_client_add(s, 0);
+				break;
 
-		if (h.magic != DLMC_MAGIC) {
-			goto out;
-		}
+			case QUERY_EV_METRICS:
+				query_client_add(metrics_fd, 1);
+				break;
 
-		if ((h.version & 0xFFFF0000) != (DLMC_VERSION & 0xFFFF0000)) {
-			goto out;
-		}
+			case QUERY_EV_REPLY:
+				query_reply();
+				break;
 
-		query_lock();
+			default:
+				qc = query_clients[events[i].data.u32 - QUERY_EV_CLIENT];
+				if (!qc)
+					break;
 
-		switch (h.command) {
-		case DLMC_CMD_DUMP_DEBUG:
-			query_dump_debug(f);
-			break;
-		case DLMC_CMD_DUMP_CONFIG:
-			query_dump_config(f);
-			break;
-		case DLMC_CMD_DUMP_LOG_PLOCK:
-			query_dump_log_plock(f);
-			break;
-		case DLMC_CMD_DUMP_PLOCKS:
-			query_dump_plocks(f, h.name);
-			break;
-		case DLMC_CMD_LOCKSPACE_INFO:
-			query_lockspace_info(f, h.name);
-			break;
-		case DLMC_CMD_NODE_INFO:
-			query_node_info(f, h.name, h.data);
-			break;
-		case DLMC_CMD_LOCKSPACES:
-			query_lockspaces(f, h.data);
-			break;
-		case DLMC_CMD_LOCKSPACE_NODES:
-			query_lockspace_nodes(f, h.name, h.option, h.data);
-			break;
-		case DLMC_CMD_DUMP_STATUS:
-			send_state_daemon(f);
-			send_state_daemon_nodes(f);
-			send_state_startup_nodes(f);
-			break;
-		case DLMC_CMD_DUMP_RUN:
-			query_dump_run(f);
-			break;
-		default:
-			break;
-		}
-		query_unlock();
+				if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+				    query_client_read(qc) < 0) {
+					query_client_close(qc);
+					break;
+				}
 
- out:
-		close(f);
+				if (query_client_work(qc) < 0)
+					query_client_close(qc);
+				break;
+			}
+		}
 	}
 }
 
@@ -1382,7 +2510,22 @@ static int setup_queries(void)
 {
 	int rv;
 
-	pthread_mutex_init(&query_mutex, NULL);
+	query_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (query_efd < 0) {
+		log_error("can't create query eventfd %d", errno);
+		return -1;
+	}
+	client_add(query_efd, process_query_efd, NULL);
+
+	query_reply_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (query_reply_efd < 0) {
+		log_error("can't create query reply eventfd %d", errno);
+		return -1;
+	}
+
+	/* metrics are optional, the daemon runs without them if the port
+	   can't be used */
+	metrics_fd = setup_metrics();
 
 	rv = pthread_create(&query_thread, NULL, process_queries, NULL);
 	if (rv < 0) {
@@ -1416,12 +2559,18 @@ void cluster_dead(int ci)
 
 static int loop(void)
 {
+	struct epoll_event events[CLIENT_NALLOC];
 	struct lockspace *ls;
 	int poll_timeout = -1;
-	int rv, i;
+	int rv, i, ci, fd;
 	void (*workfn) (int ci);
 	void (*deadfn) (int ci);
 
+	rv = setup_timers();
+	if (rv < 0)
+		goto out;
+	client_add(rv, process_timers, NULL);
+
 	rv = setup_queries();
 	if (rv < 0)
 		goto out;
@@ -1509,6 +2658,7 @@ static int loop(void)
 	if (opt(enable_helper_ind))
 		helper_ci = client_add(helper_status_fd, process_helper, helper_dead);
 
+
 #ifdef USE_SD_NOTIFY
 	sd_notify(0, "READY=1");
 #endif
@@ -1518,7 +2668,10 @@ static int loop(void)
 	daemon_fence_allow = 1;
 
 	for (;;) {
-		rv = poll(pollfd, client_maxi + 1, poll_timeout);
+		update_timers();
+
+
+		rv = epoll_wait(epoll_fd, events, CLIENT_NALLOC, poll_timeout);
 		if (rv == -1 && errno == EINTR) {
 			if (daemon_quit && list_empty(&lockspaces)) {
 				rv = 0;
@@ -1531,58 +2684,55 @@ static int loop(void)
 			continue;
 		}
 		if (rv < 0) {
-			log_error("poll errno %d", errno);
+			log_error("epoll_wait errno %d", errno);
 			goto out;
 		}
 
-		query_lock();
+		for (i = 0; i < rv; i++) {
+			ci = (int)(uint32_t)events[i].data.u64;
+			fd = (int)(uint32_t)(events[i].data.u64 >> 32);
 
-		for (i = 0; i <= client_maxi; i++) {
-			if (client[i].fd < 0)
+			if (client[ci].fd < 0 || client[ci].fd != fd ||
+			    !client[ci].polled)
 				continue;
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
-				workfn(i);
+			if (events[i].events & EPOLLIN) {
+				workfn = client[ci].workfn;
+				workfn(ci);
 			}
-			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				deadfn = client[i].deadfn;
-				deadfn(i);
+			if (client[ci].fd != fd)
+				continue;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				deadfn = client[ci].deadfn;
+				deadfn(ci);
 			}
 		}
-		query_unlock();
+		flush_plock_results();
 
 		if (daemon_quit)
 			break;
 
-		query_lock();
-
 		poll_timeout = -1;
 
-		if (retry_fencing) {
-			process_fencing_changes();
-			poll_timeout = 1000;
+		if (poll_plock_batch) {
+			flush_plock_batches();
+			if (poll_plock_batch &&
+			    (poll_timeout < 0 ||
+			     poll_timeout > opt(plock_msg_batch_delay_ind)))
+				poll_timeout = opt(plock_msg_batch_delay_ind);
 		}
 
-		if (poll_lockspaces || poll_fs) {
-			process_lockspace_changes();
-			poll_timeout = 1000;
-		}
+		if (poll_send_queue)
+			update_flow_control_status();
 
-		if (poll_ignore_plock) {
-			if (!limit_plocks()) {
-				poll_ignore_plock = 0;
-				client_back(plock_ci, plock_fd);
-			}
-			poll_timeout = 1000;
-		}
+		/* frames paused by a full send queue can go on once it drains */
+		if (poll_plocks_frames && !send_queue_full)
+			send_plocks_frames();
 
-		if (poll_drop_plock) {
-			drop_resources_all();
-			if (poll_drop_plock)
-				poll_timeout = 1000;
-		}
+		if (poll_send_queue &&
+		    (poll_timeout < 0 || poll_timeout > SEND_QUEUE_RETRY_MS))
+			poll_timeout = SEND_QUEUE_RETRY_MS;
 
-		query_unlock();
+		process_query_requests();
 	}
  out:
 	log_debug("shutdown");
@@ -1813,11 +2963,36 @@ static void set_opt_defaults(void)
 			0, NULL, 0,
 			"enable plock debugging");
 
+	set_opt_default(plock_trace_ind,
+			"plock_trace", '\0', req_arg_bool,
+			1, NULL, 0,
+			"enable/disable saving plock operations for dlm_tool log_plock");
+
 	set_opt_default(plock_rate_limit_ind,
 			"plock_rate_limit", 'l', req_arg_int,
 			0, NULL, 0,
 			"limit rate of plock operations (0 for none)");
 
+	set_opt_default(plock_batch_ind,
+			"plock_batch", '\0', req_arg_int,
+			64, NULL, 0,
+			"max plock operations read from the kernel at once");
+
+	set_opt_default(plock_msg_batch_size_ind,
+			"plock_msg_batch_size", '\0', req_arg_int,
+			4096, NULL, 0,
+			"max bytes of plock operations sent in one message (0 for no batching)");
+
+	set_opt_default(plock_msg_batch_delay_ind,
+			"plock_msg_batch_delay", '\0', req_arg_int,
+			0, NULL, 0,
+			"max milliseconds to hold plock operations for a batch message");
+
+	set_opt_default(plock_data_frame_size_ind,
+			"plock_data_frame_size", '\0', req_arg_int,
+			65536, NULL, 0,
+			"max bytes of plock state sent in one message to a joining node (0 for one message per resource)");
+
 	set_opt_default(plock_ownership_ind,
 			"plock_ownership", 'o', req_arg_bool,
 			0, NULL, 0,
@@ -1878,6 +3053,11 @@ static void set_opt_defaults(void)
 			1, NULL, 0,
 			"enable/disable helper process for running commands");
 
+	set_opt_default(metrics_port_ind,
+			"metrics_port", '\0', req_arg_int,
+			0, NULL, 0,
+			"localhost port to serve metrics over http (0 for none)");
+
 	set_opt_default(help_ind,
 			"help", 'h', no_arg,
 			-1, NULL, 0,
@@ -162,6 +162,7 @@ static void quorum_callback(quorum_handle_t cbhandle, uint32_t quorate,
 
 	cluster_quorate = quorate;
 	cluster_ringid_seq = ring_seq;
+	state_changed();
 
 	log_debug("cluster quorum %u seq %llu nodes %u",
 		  cluster_quorate, (unsigned long long)cluster_ringid_seq, node_list_entries);
@@ -0,0 +1,315 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include "dlm_daemon.h"
+
+/*
+ * Metrics in the Prometheus text format, served over http on a localhost
+ * port (metrics_port) for scrapers.
+ *
+ * The main thread formats the metrics with copy_metrics() only when a
+ * scrape asks for them, and the query thread sends them.  A scrape waits
+ * for the main thread without holding up other query clients, and never
+ * holds anything the main thread needs.
+ */
+
+struct metrics_buf {
+	char *buf;
+	int size;
+	int len;
+	int full;
+};
+
+static void out(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (mb->full)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(mb->buf + mb->len, mb->size - mb->len, fmt, ap);
+	va_end(ap);
+
+	/* leave out the line that didn't fit, and everything after it */
+	if (n < 0 || n >= mb->size - mb->len) {
+		mb->buf[mb->len] = '\0';
+		mb->full = 1;
+		return;
+	}
+	mb->len += n;
+}
+
+static void family(struct metrics_buf *mb, const char *name,
+		   const char *type, const char *help)
+{
+	out(mb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* lockspace names go in label values, which have \ and " escaped */
+
+static void ls_label(struct lockspace *ls, char *label)
+{
+	char *p = label;
+	int i;
+
+	for (i = 0; ls->name[i]; i++) {
+		if (ls->name[i] == '\\' || ls->name[i] == '"')
+			*p++ = '\\';
+		*p++ = ls->name[i];
+	}
+	*p = '\0';
+}
+
+#define LS_LABEL_LEN (2 * DLM_LOCKSPACE_LEN + 1)
+
+/* one sample of a per lockspace metric for each lockspace */
+
+#define out_ls(mb, name, fmt, val) do { \
+	struct lockspace *_ls; \
+	char _label[LS_LABEL_LEN]; \
+	list_for_each_entry(_ls, &lockspaces, list) { \
+		ls_label(_ls, _label); \
+		out(mb, "%s{lockspace=\"%s\"} " fmt "\n", name, _label, val); \
+	} \
+} while (0)
+
+static const char *op_name[DLMC_PLOCK_OPS] = {
+	[DLMC_PLOCK_OP_LOCK]	= "lock",
+	[DLMC_PLOCK_OP_UNLOCK]	= "unlock",
+	[DLMC_PLOCK_OP_GET]	= "get",
+	[DLMC_PLOCK_OP_WAIT]	= "wait",
+};
+
+static const char *path_name[DLMC_PLOCK_PATHS] = {
+	[DLMC_PLOCK_PATH_LOCAL]		= "local",
+	[DLMC_PLOCK_PATH_OWNER]		= "owner",
+	[DLMC_PLOCK_PATH_CLUSTER]	= "cluster",
+};
+
+static void out_plock_ops(struct metrics_buf *mb, int seconds)
+{
+	struct dlmc_plock_hist *h;
+	struct lockspace *ls;
+	char label[LS_LABEL_LEN];
+	int op, path;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		ls_label(ls, label);
+
+		for (op = 0; op < DLMC_PLOCK_OPS; op++) {
+			for (path = 0; path < DLMC_PLOCK_PATHS; path++) {
+				h = &ls->plock_op_stats.ops[op][path];
+				if (!h->count)
+					continue;
+
+				if (seconds)
+					out(mb, "dlm_plock_op_seconds_total"
+					    "{lockspace=\"%s\",op=\"%s\",path=\"%s\"} %.6f\n",
+					    label, op_name[op], path_name[path],
+					    h->total * 1.e-6);
+				else
+					out(mb, "dlm_plock_ops_total"
+					    "{lockspace=\"%s\",op=\"%s\",path=\"%s\"} %llu\n",
+					    label, op_name[op], path_name[path],
+					    (unsigned long long)h->count);
+			}
+		}
+	}
+}
+
+/* main thread */
+
+int copy_metrics(char *buf, int size)
+{
+	struct metrics_buf mb = { .buf = buf, .size = size };
+	struct daemon_metrics dm;
+	struct dlmc_lockspace lockspace;
+	struct lockspace *ls;
+	int count = 0;
+
+	memset(&dm, 0, sizeof(dm));
+	set_daemon_metrics(&dm);
+
+	list_for_each_entry(ls, &lockspaces, list)
+		count++;
+
+	buf[0] = '\0';
+
+	family(&mb, "dlm_lockspaces", "gauge", "Lockspaces joined.");
+	out(&mb, "dlm_lockspaces %d\n", count);
+
+	family(&mb, "dlm_daemon_members", "gauge",
+	       "Nodes in the dlm_controld cpg.");
+	out(&mb, "dlm_daemon_members %d\n", dm.member_count);
+
+	family(&mb, "dlm_quorate", "gauge", "Cluster is quorate.");
+	out(&mb, "dlm_quorate %d\n", cluster_quorate);
+
+	family(&mb, "dlm_cpg_send_queue_length", "gauge",
+	       "Messages queued while cpg is busy.");
+	out(&mb, "dlm_cpg_send_queue_length %u\n", dm.send_queue_len);
+
+	family(&mb, "dlm_cpg_send_stalls_total", "counter",
+	       "Times sending was held back by cpg flow control.");
+	out(&mb, "dlm_cpg_send_stalls_total %u\n", dm.send_stall_count);
+
+	family(&mb, "dlm_cpg_send_stall_seconds_total", "counter",
+	       "Time sending was held back by cpg flow control.");
+	out(&mb, "dlm_cpg_send_stall_seconds_total %.3f\n",
+	    dm.send_stall_ms * 1.e-3);
+
+	family(&mb, "dlm_fence_requests_total", "counter",
+	       "Fence agents run by this node.");
+	out(&mb, "dlm_fence_requests_total %u\n", dm.fence_request_count);
+
+	family(&mb, "dlm_fence_failures_total", "counter",
+	       "Fence agents run by this node that failed.");
+	out(&mb, "dlm_fence_failures_total %u\n", dm.fence_fail_count);
+
+	family(&mb, "dlm_log_dropped_total", "counter",
+	       "Log messages dropped because the log writer was behind.");
+	out(&mb, "dlm_log_dropped_total %u\n", log_dropped_count());
+
+	family(&mb, "dlm_lockspace_members", "gauge",
+	       "Members of the lockspace in the last completed change.");
+	list_for_each_entry(ls, &lockspaces, list) {
+		char label[LS_LABEL_LEN];
+
+		memset(&lockspace, 0, sizeof(lockspace));
+		set_lockspace_info(ls, &lockspace);
+		ls_label(ls, label);
+		out(&mb, "dlm_lockspace_members{lockspace=\"%s\"} %d\n",
+		    label, lockspace.cg_prev.member_count);
+	}
+
+	family(&mb, "dlm_lockspace_change_seq", "gauge",
+	       "Sequence number of the last membership change.");
+	out_ls(&mb, "dlm_lockspace_change_seq", "%u", _ls->change_seq);
+
+	family(&mb, "dlm_lockspace_recovering", "gauge",
+	       "Lockspace is stopped for a membership change.");
+	out_ls(&mb, "dlm_lockspace_recovering", "%d",
+	       !list_empty(&_ls->changes));
+
+	family(&mb, "dlm_lockspace_recoveries_total", "counter",
+	       "Membership changes completed by starting the lockspace.");
+	out_ls(&mb, "dlm_lockspace_recoveries_total", "%u",
+	       _ls->recovery_count);
+
+	family(&mb, "dlm_lockspace_recovery_conditions_seconds_total", "counter",
+	       "Time changes waited for quorum, fencing and fs recovery.");
+	out_ls(&mb, "dlm_lockspace_recovery_conditions_seconds_total", "%.3f",
+	       _ls->recovery_conditions_ms * 1.e-3);
+
+	family(&mb, "dlm_lockspace_recovery_messages_seconds_total", "counter",
+	       "Time changes waited for start messages from members.");
+	out_ls(&mb, "dlm_lockspace_recovery_messages_seconds_total", "%.3f",
+	       _ls->recovery_messages_ms * 1.e-3);
+
+	family(&mb, "dlm_plock_resources", "gauge",
+	       "Plock resources (files) cached.");
+	out_ls(&mb, "dlm_plock_resources", "%u",
+	       _ls->plock_pools[PLOCK_POOL_RESOURCE].in_use);
+
+	family(&mb, "dlm_plock_locks", "gauge", "Plocks held.");
+	out_ls(&mb, "dlm_plock_locks", "%u",
+	       _ls->plock_pools[PLOCK_POOL_LOCK].in_use);
+
+	family(&mb, "dlm_plock_waiters", "gauge",
+	       "Plocks waiting for conflicts or resource ownership.");
+	out_ls(&mb, "dlm_plock_waiters", "%u",
+	       _ls->plock_pools[PLOCK_POOL_WAITER].in_use);
+
+	family(&mb, "dlm_plock_ops_total", "counter",
+	       "Plock ops from this node completed, by op and path.");
+	out_plock_ops(&mb, 0);
+
+	family(&mb, "dlm_plock_op_seconds_total", "counter",
+	       "Time from reading plock ops to writing their results.");
+	out_plock_ops(&mb, 1);
+
+	return mb.len;
+}
+
+int setup_metrics(void)
+{
+	struct sockaddr_in addr;
+	int s, rv, one = 1;
+
+	if (!opt(metrics_port_ind))
+		return -1;
+
+	s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s < 0) {
+		log_error("metrics socket error %d", errno);
+		return -1;
+	}
+
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(opt(metrics_port_ind));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	rv = bind(s, (struct sockaddr *)&addr, sizeof(addr));
+	if (rv < 0) {
+		log_error("metrics bind port %d error %d",
+			  opt(metrics_port_ind), errno);
+		close(s);
+		return -1;
+	}
+
+	rv = listen(s, 5);
+	if (rv < 0) {
+		log_error("metrics listen error %d", errno);
+		close(s);
+		return -1;
+	}
+
+	log_debug("metrics port %d", opt(metrics_port_ind));
+	return s;
+}
+
+/* query thread, no log_ functions */
+
+/* A minimal http/1.0 server: the query thread reads a request header from
+   a non-blocking metrics client, asks the main thread for the metrics with
+   a GET, and closes the connection after the reply. */
+
+int metrics_request(char *req, int len)
+{
+	if (len < 4 || strncmp(req, "GET ", 4))
+		return 405;
+	return 200;
+}
+
+int metrics_header(int status, int len, char *hdr, int size)
+{
+	switch (status) {
+	case 200:
+		return snprintf(hdr, size,
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: close\r\n\r\n", len);
+	case 405:
+		return snprintf(hdr, size,
+			"HTTP/1.0 405 Method Not Allowed\r\n"
+			"Allow: GET\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n");
+	default:
+		return snprintf(hdr, size,
+			"HTTP/1.0 503 Service Unavailable\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n");
+	}
+}
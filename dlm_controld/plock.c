@@ -8,6 +8,7 @@
 
 #include "dlm_daemon.h"
 #include <linux/dlm_plock.h>
+#include <sys/sysinfo.h>
 
 /* FIXME: remove this once everyone is using the version of
  * dlm_plock.h which defines it */
@@ -24,6 +25,14 @@ static uint32_t plock_rate_delays;
 static struct timeval plock_read_time;
 static struct timeval plock_recv_time;
 static struct timeval plock_rate_last;
+static struct dlm_timer plock_limit_timer;
+
+/* plock ops read from the kernel per process_plocks() call, and results
+   written back to the kernel per writev(), since the last report */
+static uint32_t plock_batch_count;
+static uint32_t plock_batch_max;
+static uint32_t plock_writev_count;
+static uint32_t plock_writev_results;
 
 static int plock_device_fd = -1;
 
@@ -55,38 +64,98 @@ struct plock_data {
 #define R_PURGE_UNOWN 0x00000008 /* set owner=0 in purge */
 #define R_SEND_DROP   0x00000010
 
+/*
+ * The locks and waiters of each (nodeid, owner) pair are also kept on the
+ * lists of a plock_owner, found in ls->plock_owners_root, and the owners
+ * of each nodeid are on the list of a plock_node, along with the resources
+ * that node owns.  Purging a failed node, or the close of a file, then
+ * only visits the locks of that node or owner.
+ */
+
+struct plock_node {
+	struct list_head	list;	   /* ls->plock_nodes */
+	int			nodeid;
+	struct list_head	owners;	   /* plock_owner node_list */
+	struct list_head	resources; /* resources owned by nodeid */
+};
+
+struct plock_owner {
+	struct rb_node		rb_node;   /* ls->plock_owners_root */
+	struct list_head	node_list; /* plock_node owners */
+	struct plock_node	*node;
+	uint64_t		owner;
+	int			count;	   /* locks, waiters and users */
+	struct list_head	locks;
+	struct list_head	waiters;
+};
+
 struct resource {
 	struct list_head	list;	   /* list of resources */
 	uint64_t		number;
 	int                     owner;     /* nodeid or 0 for unowned */
 	uint32_t		flags;
-	struct timeval          last_access;
+	uint64_t		last_access; /* monotime_ms */
 	struct list_head	locks;	   /* one lock for each range */
-	struct list_head	waiters;
+	struct rb_root		locks_root; /* locks indexed by range */
+	struct list_head	waiters;   /* in the order they were queued */
+	struct rb_root		waiters_root; /* waiters indexed by range */
 	struct list_head        pending;   /* discovering r owner */
 	struct rb_node		rb_node;
+	struct list_head	lru;	   /* ls->plock_lru */
+	struct list_head	owned;	   /* plock_node resources */
+	struct list_head	purge;	   /* resources changed by purge */
 };
 
 #define P_SYNCING 0x00000001 /* plock has been sent as part of sync but not
 				yet received */
+#define P_WAKE    0x00000002 /* waiter is on the do_waiters() wake list */
 
 struct posix_lock {
 	struct list_head	list;	   /* resource locks or waiters list */
+	struct rb_node		rb_node;   /* resource locks_root */
+	struct list_head	owner_list; /* plock_owner locks */
+	struct plock_owner	*pown;
+	struct resource		*r;
 	uint32_t		pid;
 	uint64_t		owner;
 	uint64_t		start;
 	uint64_t		end;
+	uint64_t		subtree_last; /* max end in rb subtree */
 	int			ex;
 	int			nodeid;
 	uint32_t		flags;
 };
 
 struct lock_waiter {
-	struct list_head	list;
+	struct list_head	list;	   /* resource waiters or pending list */
+	struct rb_node		rb_node;   /* resource waiters_root */
+	uint64_t		subtree_last; /* max end in rb subtree */
+	uint64_t		seq;	   /* order queued */
+	struct list_head	owner_list; /* plock_owner waiters */
+	struct plock_owner	*pown;
+	struct resource		*r;
 	uint32_t		flags;
+	uint64_t		queued;	   /* monotime_us, our waiters */
 	struct dlm_plock_info	info;
 };
 
+/* a plock op from the kernel that's waiting for its result, for the
+   latency stats */
+
+struct plock_op {
+	struct list_head	hash_list; /* ls plock_ops_hash */
+	struct list_head	list;	   /* ls plock_ops */
+	uint64_t		number;
+	uint64_t		owner;
+	uint64_t		start;
+	uint64_t		end;
+	uint64_t		begin;	   /* monotime_us */
+	uint32_t		pid;
+	uint8_t			optype;
+	uint8_t			wait;
+	uint8_t			path;
+};
+
 struct save_msg {
 	struct list_head list;
 	int nodeid;
@@ -95,10 +164,235 @@ struct save_msg {
 	char buf[0];
 };
 
+/*
+ * The plock objects of a lockspace are allocated from per-type pools so
+ * that plock ops don't go to the heap once the pools have grown to the
+ * working set.  A pool grows a slab of PLOCK_SLAB_OBJS objects at a time,
+ * freed objects go back on the pool's free list, and slabs are only
+ * returned to the heap when the pool is idle after a purge, or when the
+ * lockspace is freed.  Saved messages larger than PLOCK_MSG_LEN (there
+ * should be none) are allocated from the heap.
+ */
+
+#define PLOCK_SLAB_OBJS 64
+#define PLOCK_MSG_LEN (sizeof(struct dlm_header) + sizeof(struct dlm_plock_info))
+
+struct plock_slab {
+	struct plock_slab *next;
+	uint64_t objs[0];
+};
+
+static const size_t pool_obj_size[PLOCK_POOL_COUNT] = {
+	[PLOCK_POOL_RESOURCE]	= sizeof(struct resource),
+	[PLOCK_POOL_LOCK]	= sizeof(struct posix_lock),
+	[PLOCK_POOL_WAITER]	= sizeof(struct lock_waiter),
+	[PLOCK_POOL_MSG]	= sizeof(struct save_msg) + PLOCK_MSG_LEN,
+	[PLOCK_POOL_OWNER]	= sizeof(struct plock_owner),
+	[PLOCK_POOL_NODE]	= sizeof(struct plock_node),
+	[PLOCK_POOL_OP]		= sizeof(struct plock_op),
+};
+
+static const char *pool_name[PLOCK_POOL_COUNT] = {
+	[PLOCK_POOL_RESOURCE]	= "resource",
+	[PLOCK_POOL_LOCK]	= "lock",
+	[PLOCK_POOL_WAITER]	= "waiter",
+	[PLOCK_POOL_MSG]	= "msg",
+	[PLOCK_POOL_OWNER]	= "owner",
+	[PLOCK_POOL_NODE]	= "node",
+	[PLOCK_POOL_OP]		= "op",
+};
+
+static size_t pool_size(int type)
+{
+	return (pool_obj_size[type] + 7) & ~(size_t)7;
+}
+
+static int pool_grow(struct plock_pool *pool, size_t size, int nobjs)
+{
+	struct plock_slab *slab;
+	char *obj;
+	int i;
+
+	slab = malloc(sizeof(struct plock_slab) + size * nobjs);
+	if (!slab)
+		return -ENOMEM;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count++;
+
+	/* pushed in reverse so that objects are handed out in address order */
+
+	for (i = nobjs - 1; i >= 0; i--) {
+		obj = (char *)slab->objs + i * size;
+		*(void **)obj = pool->free;
+		pool->free = obj;
+	}
+	pool->free_count += nobjs;
+	return 0;
+}
+
+/*
+ * Make sure the pool has at least count free objects, growing it by a
+ * single slab big enough for all of them.  Used when the number of objects
+ * about to be allocated is known up front, e.g. the thousands of locks in
+ * a plocks frame, so they're carved out of one contiguous block.
+ */
+
+static int pool_reserve(struct lockspace *ls, int type, uint32_t count)
+{
+	struct plock_pool *pool = &ls->plock_pools[type];
+
+	if (pool->free_count >= count)
+		return 0;
+
+	count -= pool->free_count;
+	if (count < PLOCK_SLAB_OBJS)
+		count = PLOCK_SLAB_OBJS;
+
+	return pool_grow(pool, pool_size(type), count);
+}
+
+/* returns a zeroed object */
+
+static void *pool_alloc(struct lockspace *ls, int type)
+{
+	struct plock_pool *pool = &ls->plock_pools[type];
+	size_t size = pool_size(type);
+	void *obj;
+
+	if (!pool->free && pool_grow(pool, size, PLOCK_SLAB_OBJS) < 0)
+		return NULL;
+
+	obj = pool->free;
+	pool->free = *(void **)obj;
+	pool->free_count--;
+	pool->in_use++;
+	pool->alloc_count++;
+
+	memset(obj, 0, size);
+	return obj;
+}
+
+static void pool_free(struct lockspace *ls, int type, void *obj)
+{
+	struct plock_pool *pool = &ls->plock_pools[type];
+
+	*(void **)obj = pool->free;
+	pool->free = obj;
+	pool->free_count++;
+	pool->in_use--;
+}
+
+/* return all the slabs of a pool to the heap, freeing every object in it */
+
+static void pool_release(struct plock_pool *pool)
+{
+	struct plock_slab *slab, *next;
+
+	for (slab = pool->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	pool->slabs = NULL;
+	pool->free = NULL;
+	pool->in_use = 0;
+	pool->free_count = 0;
+	pool->slab_count = 0;
+}
+
+static void release_idle_pools(struct lockspace *ls)
+{
+	int i;
+
+	for (i = 0; i < PLOCK_POOL_COUNT; i++) {
+		if (!ls->plock_pools[i].in_use)
+			pool_release(&ls->plock_pools[i]);
+	}
+}
+
+/* the lockspace is being freed, so nothing refers to its plock objects */
+
+void free_plock_pools(struct lockspace *ls)
+{
+	int i;
+
+	del_timer(&ls->drop_timer);
+
+	for (i = 0; i < PLOCK_POOL_COUNT; i++)
+		pool_release(&ls->plock_pools[i]);
+
+	/* the frame buffer is part of the same allocation */
+	free(ls->plocks_frames);
+	ls->plocks_frames = NULL;
+
+	ls->plock_owners_root = RB_ROOT;
+	INIT_LIST_HEAD(&ls->plock_nodes);
+
+	INIT_LIST_HEAD(&ls->plock_ops);
+	for (i = 0; i < PLOCK_OPS_HASH; i++)
+		INIT_LIST_HEAD(&ls->plock_ops_hash[i]);
+	ls->plock_ops_count = 0;
+}
+
+/* the drop rate is per minute since the previous dump */
+
+static void log_plock_resource_stats(struct lockspace *ls)
+{
+	uint64_t now = monotime_ms();
+	uint64_t dropped = ls->plock_dropped - ls->plock_stats_dropped;
+	uint64_t elapsed = now - ls->plock_stats_time;
+	uint64_t hit_pct = 0, drop_rate = 0;
+
+	if (ls->plock_lookup_count)
+		hit_pct = ls->plock_lookup_hit * 100 / ls->plock_lookup_count;
+	if (ls->plock_stats_time && elapsed)
+		drop_rate = dropped * 60000 / elapsed;
+
+	log_dlock(ls, "plock resources %u lookup %llu hit %llu (%llu%%) "
+		  "unown_sent %llu drop_sent %llu dropped %llu "
+		  "drop_rate %llu/min drop_batch %u",
+		  ls->plock_pools[PLOCK_POOL_RESOURCE].in_use,
+		  (unsigned long long)ls->plock_lookup_count,
+		  (unsigned long long)ls->plock_lookup_hit,
+		  (unsigned long long)hit_pct,
+		  (unsigned long long)ls->plock_unown_sent,
+		  (unsigned long long)ls->plock_drop_sent,
+		  (unsigned long long)ls->plock_dropped,
+		  (unsigned long long)drop_rate,
+		  ls->drop_resources_batch);
+
+	ls->plock_stats_time = now;
+	ls->plock_stats_dropped = ls->plock_dropped;
+}
+
+void log_plock_pools(void)
+{
+	struct lockspace *ls;
+	struct plock_pool *pool;
+	int i;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		for (i = 0; i < PLOCK_POOL_COUNT; i++) {
+			pool = &ls->plock_pools[i];
+			log_dlock(ls, "plock pool %s size %zu in_use %u free %u slabs %u allocs %llu",
+				  pool_name[i], pool_size(i), pool->in_use,
+				  pool->free_count, pool->slab_count,
+				  (unsigned long long)pool->alloc_count);
+		}
+		log_plock_resource_stats(ls);
+	}
+}
+
 
 static void send_own(struct lockspace *ls, struct resource *r, int owner);
 static void save_pending_plock(struct lockspace *ls, struct resource *r,
 			       struct dlm_plock_info *in);
+static void plock_limit_timer_fn(struct dlm_timer *t);
+static void check_plock_msg_batch_size(void);
+static void end_plock_op(struct lockspace *ls, struct dlm_plock_info *in,
+			 int record);
 
 
 static int got_unown(struct resource *r)
@@ -160,6 +454,91 @@ static const char *ex_str(int optype, int ex)
 		return "RD";
 }
 
+/*
+ * Plock ops are saved in the plock log as binary records, and formatted
+ * by format_plock_trace() only if the log is read.
+ */
+
+static void trace_plock(struct lockspace *ls, int type,
+			struct dlm_plock_info *info, int from)
+{
+	struct plock_trace pt;
+
+	pt.type		= type;
+	pt.len		= 0;
+	pt.from		= from;
+	pt.op.number	= info->number;
+	pt.op.start	= info->start;
+	pt.op.end	= info->end;
+	pt.op.owner	= info->owner;
+	pt.op.pid	= info->pid;
+	pt.op.nodeid	= info->nodeid;
+	pt.op.optype	= info->optype;
+	pt.op.ex	= info->ex;
+	pt.op.wait	= info->wait;
+	memcpy(pt.op.name, ls->name, DLM_LOCKSPACE_LEN);
+
+	log_plock_trace(&pt);
+}
+
+#define log_plock_op(ls, type, info, from) \
+do { \
+	if (log_plock_on) \
+		trace_plock(ls, type, info, from); \
+} while (0)
+
+/* format a plock_trace record the same as the log_plock() it replaces;
+   called by the query thread */
+
+int format_plock_trace(struct plock_trace *pt, char *buf, int len)
+{
+	unsigned long long number = pt->op.number;
+	unsigned long long start = pt->op.start;
+	unsigned long long end = pt->op.end;
+	unsigned long long owner = pt->op.owner;
+	int namelen = strnlen(pt->op.name, DLM_LOCKSPACE_LEN);
+	int n, pos;
+
+	pos = snprintf(buf, len, "%llu %.*s ", (unsigned long long)pt->time,
+		       namelen, pt->op.name);
+	if (pos >= len)
+		return len - 1;
+
+	switch (pt->type) {
+	case PT_READ:
+	case PT_RECV:
+		n = snprintf(buf + pos, len - pos,
+			     "%s plock %llx %s %s %llx-%llx %d/%u/%llx w %d\n",
+			     pt->type == PT_READ ? "read" : "receive",
+			     number, op_str(pt->op.optype),
+			     ex_str(pt->op.optype, pt->op.ex), start, end,
+			     pt->op.nodeid, pt->op.pid, owner, pt->op.wait);
+		break;
+	case PT_SYNC:
+		n = snprintf(buf + pos, len - pos,
+			     "receive sync %llx from %u %s %llx-%llx %d/%u/%llx\n",
+			     number, pt->from, pt->op.ex ? "WR" : "RD",
+			     start, end, pt->op.nodeid, pt->op.pid, owner);
+		break;
+	case PT_OWN:
+		n = snprintf(buf + pos, len - pos,
+			     "receive_own %llx from %u owner %u\n",
+			     number, pt->from, pt->op.nodeid);
+		break;
+	case PT_DROP:
+		n = snprintf(buf + pos, len - pos,
+			     "receive_drop %llx from %u\n", number, pt->from);
+		break;
+	default:
+		n = snprintf(buf + pos, len - pos, "bad plock trace type %u\n",
+			     pt->type);
+	}
+
+	if (n >= len - pos)
+		return len - 1;
+	return pos + n;
+}
+
 int setup_plocks(void)
 {
 	plock_read_count = 0;
@@ -168,9 +547,12 @@ int setup_plocks(void)
 	gettimeofday(&plock_read_time, NULL);
 	gettimeofday(&plock_recv_time, NULL);
 	gettimeofday(&plock_rate_last, NULL);
+	init_timer(&plock_limit_timer, plock_limit_timer_fn, NULL);
+	check_plock_msg_batch_size();
 
 	if (plock_minor) {
-		plock_device_fd = open("/dev/misc/dlm_plock", O_RDWR);
+		plock_device_fd = open("/dev/misc/dlm_plock",
+				       O_RDWR | O_NONBLOCK);
 	}
 
 	if (plock_device_fd < 0) {
@@ -208,6 +590,33 @@ static uint64_t dt_usec(struct timeval *start, struct timeval *stop)
 	return dt;
 }
 
+/* the first resource numbered number or higher */
+
+static struct resource *rb_first_plock_resource(struct lockspace *ls,
+						uint64_t number)
+{
+	struct rb_node *n = ls->plock_resources_root.rb_node;
+	struct resource *r, *first = NULL;
+
+	while (n) {
+		r = rb_entry(n, struct resource, rb_node);
+		if (number <= r->number) {
+			first = r;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return first;
+}
+
+static struct resource *next_plock_resource(struct resource *r)
+{
+	struct rb_node *n = rb_next(&r->rb_node);
+
+	return n ? rb_entry(n, struct resource, rb_node) : NULL;
+}
+
 static struct resource * rb_search_plock_resource(struct lockspace *ls, uint64_t number)
 {
 	struct rb_node *n = ls->plock_resources_root.rb_node;
@@ -254,15 +663,27 @@ static void rb_del_plock_resource(struct lockspace *ls, struct resource *r)
 	}
 }
 
-static struct resource *search_resource(struct lockspace *ls, uint64_t number)
+/*
+ * With plock_ownership, resources that may be dropped are kept on the
+ * lockspace's plock_lru list in the order they were last accessed, and the
+ * lockspace drop_timer is armed for when the oldest reaches
+ * drop_resources_age.  drop_resources() then only visits the resources that
+ * have expired.  A resource that can't be dropped when it's visited, because
+ * it's in use or owned by another node, is taken off the list; the access
+ * that changes that puts it back.
+ */
+
+static void touch_resource(struct lockspace *ls, struct resource *r)
 {
-	struct resource *r;
+	r->last_access = monotime_ms();
 
-	list_for_each_entry(r, &ls->plock_resources, list) {
-		if (r->number == number)
-			return r;
-	}
-	return NULL;
+	if (!opt(plock_ownership_ind))
+		return;
+
+	list_move_tail(&r->lru, &ls->plock_lru);
+
+	if (!timer_pending(&ls->drop_timer))
+		mod_timer(&ls->drop_timer, opt(drop_resources_age_ind));
 }
 
 static int find_resource(struct lockspace *ls, uint64_t number, int create,
@@ -271,27 +692,35 @@ static int find_resource(struct lockspace *ls, uint64_t number, int create,
 	struct resource *r = NULL;
 	int rv = 0;
 
+	ls->plock_lookup_count++;
+
 	r = rb_search_plock_resource(ls, number);
-	if (r)
+	if (r) {
+		ls->plock_lookup_hit++;
 		goto out;
+	}
 
 	if (create == 0) {
 		rv = -ENOENT;
 		goto out;
 	}
 
-	r = malloc(sizeof(struct resource));
+	r = pool_alloc(ls, PLOCK_POOL_RESOURCE);
 	if (!r) {
 		log_elock(ls, "find_resource no memory %d", errno);
 		rv = -ENOMEM;
 		goto out;
 	}
 
-	memset(r, 0, sizeof(struct resource));
 	r->number = number;
 	INIT_LIST_HEAD(&r->locks);
+	r->locks_root = RB_ROOT;
 	INIT_LIST_HEAD(&r->waiters);
+	r->waiters_root = RB_ROOT;
 	INIT_LIST_HEAD(&r->pending);
+	INIT_LIST_HEAD(&r->lru);
+	INIT_LIST_HEAD(&r->owned);
+	INIT_LIST_HEAD(&r->purge);
 
 	if (opt(plock_ownership_ind))
 		r->owner = -1;
@@ -302,30 +731,28 @@ static int find_resource(struct lockspace *ls, uint64_t number, int create,
 	rb_insert_plock_resource(ls, r);
  out:
 	if (r)
-		gettimeofday(&r->last_access, NULL);
+		touch_resource(ls, r);
 	*r_out = r;
 	return rv;
 }
 
+static void free_resource(struct lockspace *ls, struct resource *r)
+{
+	list_del(&r->owned);
+	list_del(&r->lru);
+	rb_del_plock_resource(ls, r);
+	list_del(&r->list);
+	pool_free(ls, PLOCK_POOL_RESOURCE, r);
+}
+
 static void put_resource(struct lockspace *ls, struct resource *r)
 {
 	/* with ownership, resources are only freed via drop messages */
 	if (opt(plock_ownership_ind))
 		return;
 
-	if (list_empty(&r->locks) && list_empty(&r->waiters)) {
-		rb_del_plock_resource(ls, r);
-		list_del(&r->list);
-		free(r);
-	}
-}
-
-static inline int ranges_overlap(uint64_t start1, uint64_t end1,
-				 uint64_t start2, uint64_t end2)
-{
-	if (end1 < start2 || start1 > end2)
-		return 0;
-	return 1;
+	if (list_empty(&r->locks) && list_empty(&r->waiters))
+		free_resource(ls, r);
 }
 
 /**
@@ -419,315 +846,1151 @@ static int shrink_range2(uint64_t *start2, uint64_t *end2,
 	return error;
 }
 
-static int shrink_range(struct posix_lock *po, uint64_t start, uint64_t end)
-{
-	return shrink_range2(&po->start, &po->end, start, end);
-}
-
-static int is_conflict(struct resource *r, struct dlm_plock_info *in, int get)
+static struct plock_node *find_plock_node(struct lockspace *ls, int nodeid)
 {
-	struct posix_lock *po;
-
-	list_for_each_entry(po, &r->locks, list) {
-		if (po->nodeid == in->nodeid && po->owner == in->owner)
-			continue;
-		if (!ranges_overlap(po->start, po->end, in->start, in->end))
-			continue;
+	struct plock_node *pn;
 
-		if (in->ex || po->ex) {
-			if (get) {
-				in->ex = po->ex;
-				in->pid = po->pid;
-				in->start = po->start;
-				in->end = po->end;
-			}
-			return 1;
-		}
+	list_for_each_entry(pn, &ls->plock_nodes, list) {
+		if (pn->nodeid == nodeid)
+			return pn;
 	}
-	return 0;
+	return NULL;
 }
 
-static int add_lock(struct resource *r, uint32_t nodeid, uint64_t owner,
-		    uint32_t pid, int ex, uint64_t start, uint64_t end)
+static struct plock_node *get_plock_node(struct lockspace *ls, int nodeid)
 {
-	struct posix_lock *po;
+	struct plock_node *pn;
 
-	po = malloc(sizeof(struct posix_lock));
-	if (!po)
-		return -ENOMEM;
-	memset(po, 0, sizeof(struct posix_lock));
+	pn = find_plock_node(ls, nodeid);
+	if (pn)
+		return pn;
 
-	po->start = start;
-	po->end = end;
-	po->nodeid = nodeid;
-	po->owner = owner;
-	po->pid = pid;
-	po->ex = ex;
-	list_add_tail(&po->list, &r->locks);
+	pn = pool_alloc(ls, PLOCK_POOL_NODE);
+	if (!pn)
+		return NULL;
 
-	return 0;
+	pn->nodeid = nodeid;
+	INIT_LIST_HEAD(&pn->owners);
+	INIT_LIST_HEAD(&pn->resources);
+	list_add_tail(&pn->list, &ls->plock_nodes);
+	return pn;
 }
 
-/* RN within RE (and starts or ends on RE boundary)
-   1. add new lock for non-overlap area of RE, orig mode
-   2. convert RE to RN range and mode */
+/* a plock_node is kept until its node is purged, there are few of them */
 
-static int lock_case1(struct posix_lock *po, struct resource *r,
-		      struct dlm_plock_info *in)
+static void put_plock_node(struct lockspace *ls, struct plock_node *pn)
 {
-	uint64_t start2, end2;
-	int rv;
+	if (!list_empty(&pn->owners) || !list_empty(&pn->resources))
+		return;
 
-	/* non-overlapping area start2:end2 */
-	start2 = po->start;
-	end2 = po->end;
-	rv = shrink_range2(&start2, &end2, in->start, in->end);
-	if (rv)
-		goto out;
+	list_del(&pn->list);
+	pool_free(ls, PLOCK_POOL_NODE, pn);
+}
 
-	po->start = in->start;
-	po->end = in->end;
-	po->ex = in->ex;
+static int cmp_plock_owner(int nodeid, uint64_t owner, struct plock_owner *pown)
+{
+	if (nodeid != pown->node->nodeid)
+		return nodeid < pown->node->nodeid ? -1 : 1;
+	if (owner != pown->owner)
+		return owner < pown->owner ? -1 : 1;
+	return 0;
+}
 
-	rv = add_lock(r, in->nodeid, in->owner, in->pid, !in->ex, start2, end2);
- out:
-	return rv;
+static struct plock_owner *find_plock_owner(struct lockspace *ls, int nodeid,
+					    uint64_t owner)
+{
+	struct rb_node *n = ls->plock_owners_root.rb_node;
+	struct plock_owner *pown;
+	int cmp;
+
+	while (n) {
+		pown = rb_entry(n, struct plock_owner, rb_node);
+		cmp = cmp_plock_owner(nodeid, owner, pown);
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return pown;
+	}
+	return NULL;
 }
 
-/* RN within RE (RE overlaps RN on both sides)
-   1. add new lock for front fragment, orig mode
-   2. add new lock for back fragment, orig mode
-   3. convert RE to RN range and mode */
-			 
-static int lock_case2(struct posix_lock *po, struct resource *r,
-		      struct dlm_plock_info *in)
+/* returns the owner with a reference held, creating it if needed */
 
+static struct plock_owner *get_plock_owner(struct lockspace *ls, int nodeid,
+					   uint64_t owner)
 {
-	int rv;
+	struct rb_node **p = &ls->plock_owners_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct plock_owner *pown;
+	struct plock_node *pn;
+	int cmp;
 
-	rv = add_lock(r, in->nodeid, in->owner, in->pid,
-		      !in->ex, po->start, in->start - 1);
-	if (rv)
-		goto out;
+	while (*p) {
+		parent = *p;
+		pown = rb_entry(parent, struct plock_owner, rb_node);
+		cmp = cmp_plock_owner(nodeid, owner, pown);
+		if (cmp < 0) {
+			p = &parent->rb_left;
+		} else if (cmp > 0) {
+			p = &parent->rb_right;
+		} else {
+			pown->count++;
+			return pown;
+		}
+	}
 
-	rv = add_lock(r, in->nodeid, in->owner, in->pid,
-		      !in->ex, in->end + 1, po->end);
-	if (rv)
-		goto out;
+	pn = get_plock_node(ls, nodeid);
+	if (!pn)
+		return NULL;
 
-	po->start = in->start;
-	po->end = in->end;
-	po->ex = in->ex;
- out:
-	return rv;
+	pown = pool_alloc(ls, PLOCK_POOL_OWNER);
+	if (!pown)
+		return NULL;
+
+	pown->node = pn;
+	pown->owner = owner;
+	pown->count = 1;
+	INIT_LIST_HEAD(&pown->locks);
+	INIT_LIST_HEAD(&pown->waiters);
+	list_add_tail(&pown->node_list, &pn->owners);
+
+	rb_link_node(&pown->rb_node, parent, p);
+	rb_insert_color(&pown->rb_node, &ls->plock_owners_root);
+	return pown;
 }
 
-static int lock_internal(struct lockspace *ls, struct resource *r,
-			 struct dlm_plock_info *in)
+static void put_plock_owner(struct lockspace *ls, struct plock_owner *pown)
 {
-	struct posix_lock *po, *safe;
-	int rv = 0;
+	if (--pown->count)
+		return;
 
-	list_for_each_entry_safe(po, safe, &r->locks, list) {
-		if (po->nodeid != in->nodeid || po->owner != in->owner)
-			continue;
-		if (!ranges_overlap(po->start, po->end, in->start, in->end))
-			continue;
+	rb_erase(&pown->rb_node, &ls->plock_owners_root);
+	list_del(&pown->node_list);
+	pool_free(ls, PLOCK_POOL_OWNER, pown);
+}
+
+static int link_lock(struct lockspace *ls, struct resource *r,
+		     struct posix_lock *po)
+{
+	po->pown = get_plock_owner(ls, po->nodeid, po->owner);
+	if (!po->pown)
+		return -ENOMEM;
+	po->r = r;
+	list_add_tail(&po->owner_list, &po->pown->locks);
+	return 0;
+}
+
+static void unlink_lock(struct lockspace *ls, struct posix_lock *po)
+{
+	list_del(&po->owner_list);
+	put_plock_owner(ls, po->pown);
+}
+
+static int link_waiter(struct lockspace *ls, struct resource *r,
+		       struct lock_waiter *w)
+{
+	w->pown = get_plock_owner(ls, w->info.nodeid, w->info.owner);
+	if (!w->pown)
+		return -ENOMEM;
+	w->r = r;
+	list_add_tail(&w->owner_list, &w->pown->waiters);
+	return 0;
+}
+
+static void unlink_waiter(struct lockspace *ls, struct lock_waiter *w)
+{
+	list_del(&w->owner_list);
+	put_plock_owner(ls, w->pown);
+}
+
+/* resources owned by a node (plock_ownership) are on its plock_node, if
+   that can't be allocated purge has to fall back to looking at them all */
+
+static void set_owner(struct lockspace *ls, struct resource *r, int owner)
+{
+	struct plock_node *pn;
+
+	list_del_init(&r->owned);
+	r->owner = owner;
+
+	if (owner <= 0)
+		return;
+
+	pn = get_plock_node(ls, owner);
+	if (!pn) {
+		log_elock(ls, "set_owner %llx no mem for node %d",
+			  (unsigned long long)r->number, owner);
+		ls->plock_nodes_incomplete = 1;
+		return;
+	}
+	list_add_tail(&r->owned, &pn->resources);
+}
+
+/* put the owned resources that set_owner couldn't on their plock_node, so
+   purges can go back to using purge_node */
+
+static void reindex_plock_nodes(struct lockspace *ls)
+{
+	struct plock_node *pn;
+	struct resource *r;
+
+	list_for_each_entry(r, &ls->plock_resources, list) {
+		if (r->owner <= 0 || !list_empty(&r->owned))
+			continue;
+
+		pn = get_plock_node(ls, r->owner);
+		if (!pn)
+			return;
+		list_add_tail(&r->owned, &pn->resources);
+	}
+
+	log_dlock(ls, "plock nodes reindexed");
+	ls->plock_nodes_incomplete = 0;
+}
+
+/*
+ * The granted locks on a resource are kept on r->locks, and are also
+ * indexed by r->locks_root, an interval tree sorted by start and augmented
+ * with the largest end in each subtree.  Finding the locks that overlap a
+ * range then only visits the overlapping locks instead of every lock held
+ * on the resource.  The range of a lock in the tree must only be changed
+ * with set_lock_range().
+ */
+
+static uint64_t lock_subtree_last(struct rb_node *n)
+{
+	return rb_entry(n, struct posix_lock, rb_node)->subtree_last;
+}
+
+static void lock_augment_cb(struct rb_node *n, void *data)
+{
+	struct posix_lock *po = rb_entry(n, struct posix_lock, rb_node);
+	uint64_t last = po->end;
+
+	if (n->rb_left && lock_subtree_last(n->rb_left) > last)
+		last = lock_subtree_last(n->rb_left);
+	if (n->rb_right && lock_subtree_last(n->rb_right) > last)
+		last = lock_subtree_last(n->rb_right);
+
+	po->subtree_last = last;
+}
+
+static void rb_insert_lock(struct resource *r, struct posix_lock *po)
+{
+	struct posix_lock *entry;
+	struct rb_node **p;
+	struct rb_node *parent = NULL;
+
+	p = &r->locks_root.rb_node;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct posix_lock, rb_node);
+		if (po->start < entry->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	po->subtree_last = po->end;
+	rb_link_node(&po->rb_node, parent, p);
+	rb_insert_color(&po->rb_node, &r->locks_root);
+	rb_augment_insert(&po->rb_node, lock_augment_cb, NULL);
+}
+
+static void rb_del_lock(struct resource *r, struct posix_lock *po)
+{
+	struct rb_node *deepest;
+
+	deepest = rb_augment_erase_begin(&po->rb_node);
+	rb_erase(&po->rb_node, &r->locks_root);
+	rb_augment_erase_end(deepest, lock_augment_cb, NULL);
+}
+
+/* leftmost lock in the subtree at n that overlaps start:end */
+
+static struct posix_lock *lock_subtree_search(struct rb_node *n,
+					      uint64_t start, uint64_t end)
+{
+	struct posix_lock *po;
+
+	while (1) {
+		if (n->rb_left && lock_subtree_last(n->rb_left) >= start) {
+			n = n->rb_left;
+			continue;
+		}
+
+		po = rb_entry(n, struct posix_lock, rb_node);
+		if (po->start > end)
+			return NULL;
+		if (po->end >= start)
+			return po;
+
+		n = n->rb_right;
+		if (!n || lock_subtree_last(n) < start)
+			return NULL;
+	}
+}
+
+static struct posix_lock *first_overlap(struct resource *r,
+					uint64_t start, uint64_t end)
+{
+	struct rb_node *n = r->locks_root.rb_node;
+
+	if (!n || lock_subtree_last(n) < start)
+		return NULL;
+	return lock_subtree_search(n, start, end);
+}
+
+/* the next lock after po (in start order) that overlaps start:end;
+   this can be called before po is removed or has its range changed */
+
+static struct posix_lock *next_overlap(struct posix_lock *po,
+				       uint64_t start, uint64_t end)
+{
+	struct rb_node *n = &po->rb_node;
+	struct rb_node *right = n->rb_right;
+	struct rb_node *parent, *prev;
+
+	while (1) {
+		if (right && lock_subtree_last(right) >= start)
+			return lock_subtree_search(right, start, end);
+
+		/* go up until we arrive from a left child */
+		do {
+			parent = rb_parent(n);
+			if (!parent)
+				return NULL;
+			prev = n;
+			n = parent;
+			right = n->rb_right;
+		} while (prev == right);
+
+		po = rb_entry(n, struct posix_lock, rb_node);
+		if (po->start > end)
+			return NULL;
+		if (po->end >= start)
+			return po;
+	}
+}
+
+static void set_lock_range(struct resource *r, struct posix_lock *po,
+			   uint64_t start, uint64_t end)
+{
+	rb_del_lock(r, po);
+	po->start = start;
+	po->end = end;
+	rb_insert_lock(r, po);
+}
+
+static void del_lock(struct lockspace *ls, struct resource *r,
+		     struct posix_lock *po)
+{
+	rb_del_lock(r, po);
+	list_del(&po->list);
+	unlink_lock(ls, po);
+	pool_free(ls, PLOCK_POOL_LOCK, po);
+}
+
+static int shrink_range(struct resource *r, struct posix_lock *po,
+			uint64_t start, uint64_t end)
+{
+	uint64_t start2 = po->start;
+	uint64_t end2 = po->end;
+	int rv;
+
+	rv = shrink_range2(&start2, &end2, start, end);
+	if (!rv)
+		set_lock_range(r, po, start2, end2);
+	return rv;
+}
+
+static int is_conflict(struct resource *r, struct dlm_plock_info *in, int get)
+{
+	struct posix_lock *po;
+
+	for (po = first_overlap(r, in->start, in->end); po;
+	     po = next_overlap(po, in->start, in->end)) {
+		if (po->nodeid == in->nodeid && po->owner == in->owner)
+			continue;
+
+		if (in->ex || po->ex) {
+			if (get) {
+				in->ex = po->ex;
+				in->pid = po->pid;
+				in->start = po->start;
+				in->end = po->end;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int add_lock(struct lockspace *ls, struct resource *r,
+		    uint32_t nodeid, uint64_t owner, uint32_t pid, int ex,
+		    uint64_t start, uint64_t end)
+{
+	struct posix_lock *po;
+
+	po = pool_alloc(ls, PLOCK_POOL_LOCK);
+	if (!po)
+		return -ENOMEM;
+
+	po->start = start;
+	po->end = end;
+	po->nodeid = nodeid;
+	po->owner = owner;
+	po->pid = pid;
+	po->ex = ex;
+
+	if (link_lock(ls, r, po) < 0) {
+		pool_free(ls, PLOCK_POOL_LOCK, po);
+		return -ENOMEM;
+	}
+	list_add_tail(&po->list, &r->locks);
+	rb_insert_lock(r, po);
+
+	return 0;
+}
+
+/* RN within RE (and starts or ends on RE boundary)
+   1. add new lock for non-overlap area of RE, orig mode
+   2. convert RE to RN range and mode */
+
+static int lock_case1(struct lockspace *ls, struct posix_lock *po,
+		      struct resource *r, struct dlm_plock_info *in)
+{
+	uint64_t start2, end2;
+	int rv;
+
+	/* non-overlapping area start2:end2 */
+	start2 = po->start;
+	end2 = po->end;
+	rv = shrink_range2(&start2, &end2, in->start, in->end);
+	if (rv)
+		goto out;
+
+	set_lock_range(r, po, in->start, in->end);
+	po->ex = in->ex;
+
+	rv = add_lock(ls, r, in->nodeid, in->owner, in->pid, !in->ex, start2, end2);
+ out:
+	return rv;
+}
+
+/* RN within RE (RE overlaps RN on both sides)
+   1. add new lock for front fragment, orig mode
+   2. add new lock for back fragment, orig mode
+   3. convert RE to RN range and mode */
+			 
+static int lock_case2(struct lockspace *ls, struct posix_lock *po,
+		      struct resource *r, struct dlm_plock_info *in)
+
+{
+	int rv;
+
+	rv = add_lock(ls, r, in->nodeid, in->owner, in->pid,
+		      !in->ex, po->start, in->start - 1);
+	if (rv)
+		goto out;
+
+	rv = add_lock(ls, r, in->nodeid, in->owner, in->pid,
+		      !in->ex, in->end + 1, po->end);
+	if (rv)
+		goto out;
+
+	set_lock_range(r, po, in->start, in->end);
+	po->ex = in->ex;
+ out:
+	return rv;
+}
+
+static int lock_internal(struct lockspace *ls, struct resource *r,
+			 struct dlm_plock_info *in)
+{
+	struct posix_lock *po, *safe;
+	int rv = 0;
+
+	for (po = first_overlap(r, in->start, in->end); po; po = safe) {
+		safe = next_overlap(po, in->start, in->end);
+
+		if (po->nodeid != in->nodeid || po->owner != in->owner)
+			continue;
 
 		/* existing range (RE) overlaps new range (RN) */
 
-		switch(overlap_type(in->start, in->end, po->start, po->end)) {
+		switch(overlap_type(in->start, in->end, po->start, po->end)) {
+
+		case 0:
+			if (po->ex == in->ex)
+				goto out;
+
+			/* ranges the same - just update the existing lock */
+			po->ex = in->ex;
+			goto out;
+
+		case 1:
+			if (po->ex == in->ex)
+				goto out;
+
+			rv = lock_case1(ls, po, r, in);
+			goto out;
+
+		case 2:
+			if (po->ex == in->ex)
+				goto out;
+
+			rv = lock_case2(ls, po, r, in);
+			goto out;
+
+		case 3:
+			del_lock(ls, r, po);
+			break;
+
+		case 4:
+			if (po->start < in->start)
+				set_lock_range(r, po, po->start, in->start - 1);
+			else
+				set_lock_range(r, po, in->end + 1, po->end);
+			break;
+
+		default:
+			rv = -1;
+			goto out;
+		}
+	}
+
+	rv = add_lock(ls, r, in->nodeid, in->owner, in->pid,
+		      in->ex, in->start, in->end);
+ out:
+	return rv;
+
+}
+
+/* remove the range of an unlock from one of the owner's locks; done is set
+   when no other lock of the owner can overlap the range */
+
+static int unlock_range(struct lockspace *ls, struct resource *r,
+			struct posix_lock *po, struct dlm_plock_info *in,
+			int *done)
+{
+	int rv = 0;
+
+	*done = 0;
+
+	/* existing range (RE) overlaps new range (RN) */
+
+	switch (overlap_type(in->start, in->end, po->start, po->end)) {
+
+	case 0:
+		/* ranges the same - just remove the existing lock */
+
+		del_lock(ls, r, po);
+		*done = 1;
+		break;
+
+	case 1:
+		/* RN within RE and starts or ends on RE boundary -
+		 * shrink and update RE */
+
+		rv = shrink_range(r, po, in->start, in->end);
+		*done = 1;
+		break;
+
+	case 2:
+		/* RN within RE - shrink and update RE to be front
+		 * fragment, and add a new lock for back fragment */
+
+		rv = add_lock(ls, r, in->nodeid, in->owner, in->pid,
+			      po->ex, in->end + 1, po->end);
+		set_lock_range(r, po, po->start, in->start - 1);
+		*done = 1;
+		break;
+
+	case 3:
+		/* RE within RN - remove RE, then continue checking
+		 * because RN could cover other locks */
+
+		del_lock(ls, r, po);
+		break;
+
+	case 4:
+		/* front of RE in RN, or end of RE in RN - shrink and
+		 * update RE, then continue because RN could cover
+		 * other locks */
+
+		rv = shrink_range(r, po, in->start, in->end);
+		break;
+
+	default:
+		rv = -1;
+		*done = 1;
+	}
+
+	return rv;
+}
+
+static int unlock_internal(struct lockspace *ls, struct resource *r,
+			   struct dlm_plock_info *in)
+{
+	struct posix_lock *po, *safe;
+	int rv = 0, done;
+
+	for (po = first_overlap(r, in->start, in->end); po; po = safe) {
+		safe = next_overlap(po, in->start, in->end);
+
+		if (po->nodeid != in->nodeid || po->owner != in->owner)
+			continue;
+
+		rv = unlock_range(ls, r, po, in, &done);
+		if (done)
+			break;
+	}
+	return rv;
+}
+
+/* the unlock for a close, found through the owner's locks rather than
+   the locks of every owner on the resource */
+
+static void unlock_close(struct lockspace *ls, struct resource *r,
+			 struct dlm_plock_info *in)
+{
+	struct plock_owner *pown;
+	struct posix_lock *po, *safe;
+	int done;
+
+	pown = find_plock_owner(ls, in->nodeid, in->owner);
+	if (!pown)
+		return;
+	pown->count++;
+
+	list_for_each_entry_safe(po, safe, &pown->locks, owner_list) {
+		if (po->r != r || po->end < in->start || po->start > in->end)
+			continue;
+
+		unlock_range(ls, r, po, in, &done);
+		if (done)
+			break;
+	}
+
+	put_plock_owner(ls, pown);
+}
+
+/*
+ * Waiters are also indexed by range, in r->waiters_root, so that when part
+ * of a range is unlocked or downgraded only the waiters overlapping it are
+ * checked again, rather than every waiter against every lock.  r->waiters
+ * keeps the waiters in the order they were queued, and the seq number
+ * lets the waiters found in the tree be granted in that same order.
+ */
+
+static uint64_t waiter_seq;
+
+static uint64_t waiter_subtree_last(struct rb_node *n)
+{
+	return rb_entry(n, struct lock_waiter, rb_node)->subtree_last;
+}
+
+static void waiter_augment_cb(struct rb_node *n, void *data)
+{
+	struct lock_waiter *w = rb_entry(n, struct lock_waiter, rb_node);
+	uint64_t last = w->info.end;
+
+	if (n->rb_left && waiter_subtree_last(n->rb_left) > last)
+		last = waiter_subtree_last(n->rb_left);
+	if (n->rb_right && waiter_subtree_last(n->rb_right) > last)
+		last = waiter_subtree_last(n->rb_right);
+
+	w->subtree_last = last;
+}
+
+static int queue_waiter(struct lockspace *ls, struct resource *r,
+			struct lock_waiter *w)
+{
+	struct lock_waiter *entry;
+	struct rb_node **p;
+	struct rb_node *parent = NULL;
+
+	if (link_waiter(ls, r, w) < 0)
+		return -ENOMEM;
+
+	w->seq = ++waiter_seq;
+	list_add_tail(&w->list, &r->waiters);
+
+	p = &r->waiters_root.rb_node;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct lock_waiter, rb_node);
+		if (w->info.start < entry->info.start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	w->subtree_last = w->info.end;
+	rb_link_node(&w->rb_node, parent, p);
+	rb_insert_color(&w->rb_node, &r->waiters_root);
+	rb_augment_insert(&w->rb_node, waiter_augment_cb, NULL);
+	return 0;
+}
+
+static void dequeue_waiter(struct lockspace *ls, struct resource *r,
+			   struct lock_waiter *w)
+{
+	struct rb_node *deepest;
+
+	deepest = rb_augment_erase_begin(&w->rb_node);
+	rb_erase(&w->rb_node, &r->waiters_root);
+	rb_augment_erase_end(deepest, waiter_augment_cb, NULL);
+	list_del(&w->list);
+	unlink_waiter(ls, w);
+}
+
+static void clear_waiters(struct lockspace *ls, struct resource *r,
+			  struct dlm_plock_info *in)
+{
+	struct plock_owner *pown;
+	struct lock_waiter *w, *safe;
+
+	pown = find_plock_owner(ls, in->nodeid, in->owner);
+	if (!pown)
+		return;
+	pown->count++;
+
+	list_for_each_entry_safe(w, safe, &pown->waiters, owner_list) {
+		if (w->r != r)
+			continue;
+
+		dequeue_waiter(ls, r, w);
+
+		/* the kernel doesn't get a result for it */
+		if (w->info.nodeid == our_nodeid)
+			end_plock_op(ls, &w->info, 0);
+
+		log_elock(ls, "clear waiter %llx %llx-%llx %d/%u/%llx",
+			  (unsigned long long)in->number,
+			  (unsigned long long)in->start,
+			  (unsigned long long)in->end,
+			  in->nodeid, in->pid,
+			  (unsigned long long)in->owner);
+		pool_free(ls, PLOCK_POOL_WAITER, w);
+	}
+
+	put_plock_owner(ls, pown);
+}
+
+static int add_waiter(struct lockspace *ls, struct resource *r,
+		      struct dlm_plock_info *in)
+
+{
+	struct lock_waiter *w;
+
+	w = pool_alloc(ls, PLOCK_POOL_WAITER);
+	if (!w)
+		return -ENOMEM;
+	memcpy(&w->info, in, sizeof(struct dlm_plock_info));
+	w->queued = (in->nodeid == our_nodeid) ? monotime_us() : 0;
+
+	if (queue_waiter(ls, r, w) < 0) {
+		pool_free(ls, PLOCK_POOL_WAITER, w);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Plock latency stats, returned by dlmc_plock_stats().
+ *
+ * When an op is read from the kernel, a plock_op records when, and which
+ * path it's taking: local when we own the resource, owner when it waits
+ * for us to become the owner, cluster when it's replicated to all nodes.
+ * When the result is written, the matching plock_op (the oldest for the
+ * same lock) is taken off and the time between is added to the histogram
+ * for the op type and path.  Ops without results (unlock-close, waiters
+ * removed by close) are taken off without being counted, and if results
+ * are lost some other way, the oldest ops are dropped after PLOCK_OPS_MAX.
+ */
+
+#define PLOCK_OPS_MAX 4096
+
+static struct dlmc_plock_hist plock_rate_delay_hist;
+static uint64_t plock_rate_delay_begin;
+
+static void hist_add(struct dlmc_plock_hist *h, uint64_t v)
+{
+	int b, e;
+
+	if (v < 4) {
+		b = v;
+	} else {
+		e = 63 - __builtin_clzll(v);
+		b = 4 * (e - 1) + ((v >> (e - 2)) & 3);
+		if (b >= DLMC_PLOCK_HIST_BUCKETS)
+			b = DLMC_PLOCK_HIST_BUCKETS - 1;
+	}
+
+	h->count++;
+	h->total += v;
+	if (v > h->max)
+		h->max = v;
+	h->buckets[b]++;
+}
+
+static int plock_op_type(struct dlm_plock_info *in)
+{
+	switch (in->optype) {
+	case DLM_PLOCK_OP_UNLOCK:
+		return DLMC_PLOCK_OP_UNLOCK;
+	case DLM_PLOCK_OP_GET:
+		return DLMC_PLOCK_OP_GET;
+	default:
+		return in->wait ? DLMC_PLOCK_OP_WAIT : DLMC_PLOCK_OP_LOCK;
+	}
+}
+
+static struct list_head *plock_op_hash(struct lockspace *ls, uint64_t number,
+				       uint64_t owner)
+{
+	uint64_t h = (number ^ owner) * 0x9e3779b97f4a7c15ULL;
+
+	return &ls->plock_ops_hash[(h >> 32) % PLOCK_OPS_HASH];
+}
+
+static void del_plock_op(struct lockspace *ls, struct plock_op *op)
+{
+	list_del(&op->hash_list);
+	list_del(&op->list);
+	ls->plock_ops_count--;
+	pool_free(ls, PLOCK_POOL_OP, op);
+}
+
+static void start_plock_op(struct lockspace *ls, struct dlm_plock_info *in,
+			   int path)
+{
+	struct plock_op *op;
 
-		case 0:
-			if (po->ex == in->ex)
-				goto out;
+#ifdef DLM_PLOCK_BUILD_WORKAROUND
+	if (in->pad & DLM_PLOCK_FL_CLOSE)
+#else
+	if (in->flags & DLM_PLOCK_FL_CLOSE)
+#endif
+		return;
 
-			/* ranges the same - just update the existing lock */
-			po->ex = in->ex;
-			goto out;
+	if (ls->plock_ops_count >= PLOCK_OPS_MAX) {
+		op = list_first_entry(&ls->plock_ops, struct plock_op, list);
+		del_plock_op(ls, op);
+		ls->plock_op_stats.unmatched++;
+	}
 
-		case 1:
-			if (po->ex == in->ex)
-				goto out;
+	op = pool_alloc(ls, PLOCK_POOL_OP);
+	if (!op)
+		return;
 
-			rv = lock_case1(po, r, in);
-			goto out;
+	op->number = in->number;
+	op->owner = in->owner;
+	op->start = in->start;
+	op->end = in->end;
+	op->pid = in->pid;
+	op->optype = in->optype;
+	op->wait = in->wait;
+	op->path = path;
+	op->begin = monotime_us();
+
+	if (!ls->plock_op_stats_time)
+		ls->plock_op_stats_time = monotime();
+
+	list_add_tail(&op->hash_list, plock_op_hash(ls, in->number, in->owner));
+	list_add_tail(&op->list, &ls->plock_ops);
+	ls->plock_ops_count++;
+}
 
-		case 2:
-			if (po->ex == in->ex)
-				goto out;
+/* getlk results replace the range and pid with the conflicting lock's */
 
-			rv = lock_case2(po, r, in);
-			goto out;
+static void end_plock_op(struct lockspace *ls, struct dlm_plock_info *in,
+			 int record)
+{
+	struct list_head *head;
+	struct plock_op *op;
 
-		case 3:
-			list_del(&po->list);
-			free(po);
-			break;
+	if (!ls->plock_ops_count)
+		return;
 
-		case 4:
-			if (po->start < in->start)
-				po->end = in->start - 1;
-			else
-				po->start = in->end + 1;
-			break;
+	head = plock_op_hash(ls, in->number, in->owner);
 
-		default:
-			rv = -1;
-			goto out;
-		}
+	list_for_each_entry(op, head, hash_list) {
+		if (op->number != in->number || op->owner != in->owner ||
+		    op->optype != in->optype)
+			continue;
+		if (in->optype != DLM_PLOCK_OP_GET &&
+		    (op->start != in->start || op->end != in->end ||
+		     op->pid != in->pid))
+			continue;
+
+		if (record)
+			hist_add(&ls->plock_op_stats.ops[plock_op_type(in)][op->path],
+				 monotime_us() - op->begin);
+		del_plock_op(ls, op);
+		return;
 	}
+}
 
-	rv = add_lock(r, in->nodeid, in->owner, in->pid,
-		      in->ex, in->start, in->end);
- out:
-	return rv;
+int copy_plock_stats(struct lockspace *ls, char *buf, int *len_out)
+{
+	struct dlmc_plock_stats *st = &ls->plock_op_stats;
 
+	if (ls->plock_op_stats_time)
+		st->seconds = monotime() - ls->plock_op_stats_time;
+	st->rate_delays = plock_rate_delay_hist;
+
+	memcpy(buf, st, sizeof(struct dlmc_plock_stats));
+	*len_out = sizeof(struct dlmc_plock_stats);
+	return 0;
 }
 
-static int unlock_internal(struct lockspace *ls, struct resource *r,
-			   struct dlm_plock_info *in)
+/* Results are queued and written to the kernel together by
+   flush_plock_results(), which is called at the end of process_plocks()
+   and after each pass through the main loop.  The kernel handles each
+   iovec of a writev() as a separate result write. */
+
+#define PLOCK_RESULTS_MAX 64
+
+static struct dlm_plock_info plock_results[PLOCK_RESULTS_MAX];
+static struct iovec plock_results_iov[PLOCK_RESULTS_MAX];
+static int plock_results_count;
+
+void flush_plock_results(void)
 {
-	struct posix_lock *po, *safe;
-	int rv = 0;
+	int done = 0, rv;
 
-	list_for_each_entry_safe(po, safe, &r->locks, list) {
-		if (po->nodeid != in->nodeid || po->owner != in->owner)
+	while (done < plock_results_count) {
+		rv = writev(plock_device_fd, plock_results_iov + done,
+			    plock_results_count - done);
+		if (rv < 0 && errno == EINTR)
 			continue;
-		if (!ranges_overlap(po->start, po->end, in->start, in->end))
+		if (rv <= 0) {
+			/* skip the result the kernel didn't take */
+			log_debug("write_result: write error %d fd %d\n",
+				  errno, plock_device_fd);
+			done++;
 			continue;
+		}
+		plock_writev_count++;
+		plock_writev_results += rv / sizeof(struct dlm_plock_info);
+		done += rv / sizeof(struct dlm_plock_info);
+	}
+	plock_results_count = 0;
+}
 
-		/* existing range (RE) overlaps new range (RN) */
+static void queue_result(struct dlm_plock_info *in)
+{
+	struct iovec *iov;
 
-		switch (overlap_type(in->start, in->end, po->start, po->end)) {
+	if (plock_results_count == PLOCK_RESULTS_MAX)
+		flush_plock_results();
 
-		case 0:
-			/* ranges the same - just remove the existing lock */
+	memcpy(&plock_results[plock_results_count], in,
+	       sizeof(struct dlm_plock_info));
+	iov = &plock_results_iov[plock_results_count];
+	iov->iov_base = &plock_results[plock_results_count];
+	iov->iov_len = sizeof(struct dlm_plock_info);
+	plock_results_count++;
+}
 
-			list_del(&po->list);
-			free(po);
-			goto out;
+static void write_result(struct lockspace *ls, struct dlm_plock_info *in,
+			 int rv)
+{
+	in->rv = rv;
+	end_plock_op(ls, in, 1);
+	queue_result(in);
+}
 
-		case 1:
-			/* RN within RE and starts or ends on RE boundary -
-			 * shrink and update RE */
+/* whether granting the lock would release part of a write lock held by
+   the same owner, i.e. it's a read lock replacing the owner's write lock;
+   otherwise a lock_internal() never unblocks anything */
 
-			rv = shrink_range(po, in->start, in->end);
-			goto out;
+static int lock_releases(struct resource *r, struct dlm_plock_info *in)
+{
+	struct posix_lock *po;
 
-		case 2:
-			/* RN within RE - shrink and update RE to be front
-			 * fragment, and add a new lock for back fragment */
+	if (in->ex)
+		return 0;
 
-			rv = add_lock(r, in->nodeid, in->owner, in->pid,
-				      po->ex, in->end + 1, po->end);
-			po->end = in->start - 1;
-			goto out;
+	for (po = first_overlap(r, in->start, in->end); po;
+	     po = next_overlap(po, in->start, in->end)) {
+		if (po->nodeid == in->nodeid && po->owner == in->owner &&
+		    po->ex)
+			return 1;
+	}
+	return 0;
+}
 
-		case 3:
-			/* RE within RN - remove RE, then continue checking
-			 * because RN could cover other locks */
+static void grant_waiter(struct lockspace *ls, struct resource *r,
+			 struct lock_waiter *w)
+{
+	struct dlm_plock_info *in = &w->info;
+	int rv;
 
-			list_del(&po->list);
-			free(po);
-			continue;
+	dequeue_waiter(ls, r, w);
 
-		case 4:
-			/* front of RE in RN, or end of RE in RN - shrink and
-			 * update RE, then continue because RN could cover
-			 * other locks */
+	/*
+	log_group(ls, "take waiter %llx %llx-%llx %d/%u/%llx",
+		  in->number, in->start, in->end,
+		  in->nodeid, in->pid, in->owner);
+	*/
 
-			rv = shrink_range(po, in->start, in->end);
-			continue;
+	rv = lock_internal(ls, r, in);
 
-		default:
-			rv = -1;
-			goto out;
-		}
+	if (in->nodeid == our_nodeid) {
+		hist_add(&ls->plock_op_stats.waiters, monotime_us() - w->queued);
+		write_result(ls, in, rv);
 	}
- out:
-	return rv;
 }
 
-static void clear_waiters(struct lockspace *ls, struct resource *r,
-			  struct dlm_plock_info *in)
+/* check every waiter in the order queued, after locks have been removed
+   from any part of the resource */
+
+static void do_all_waiters(struct lockspace *ls, struct resource *r)
 {
 	struct lock_waiter *w, *safe;
+	int releases;
 
+ restart:
 	list_for_each_entry_safe(w, safe, &r->waiters, list) {
-		if (w->info.nodeid != in->nodeid || w->info.owner != in->owner)
+		if (is_conflict(r, &w->info, 0))
 			continue;
 
-		list_del(&w->list);
+		releases = lock_releases(r, &w->info);
+		grant_waiter(ls, r, w);
+		pool_free(ls, PLOCK_POOL_WAITER, w);
 
-		log_elock(ls, "clear waiter %llx %llx-%llx %d/%u/%llx",
-			  (unsigned long long)in->number,
-			  (unsigned long long)in->start,
-			  (unsigned long long)in->end,
-			  in->nodeid, in->pid,
-			  (unsigned long long)in->owner);
-		free(w);
+		/* waiters passed over already may be granted now */
+		if (releases)
+			goto restart;
 	}
 }
 
-static int add_waiter(struct lockspace *ls, struct resource *r,
-		      struct dlm_plock_info *in)
+static struct lock_waiter **wake_list;
+static int wake_size;
+static int wake_count;
 
+/* add the waiters in the subtree at n that overlap start:end to wake_list */
+
+static int collect_waiters(struct rb_node *n, uint64_t start, uint64_t end)
 {
-	struct lock_waiter *w;
+	struct lock_waiter *w, **list;
+	int rv;
 
-	w = malloc(sizeof(struct lock_waiter));
-	if (!w)
-		return -ENOMEM;
-	memcpy(&w->info, in, sizeof(struct dlm_plock_info));
-	list_add_tail(&w->list, &r->waiters);
-	return 0;
+	if (!n || waiter_subtree_last(n) < start)
+		return 0;
+
+	rv = collect_waiters(n->rb_left, start, end);
+	if (rv < 0)
+		return rv;
+
+	w = rb_entry(n, struct lock_waiter, rb_node);
+	if (w->info.start > end)
+		return 0;
+
+	if (w->info.end >= start && !(w->flags & P_WAKE)) {
+		if (wake_count == wake_size) {
+			list = realloc(wake_list, (wake_size ? wake_size * 2 : 64) *
+				       sizeof(struct lock_waiter *));
+			if (!list)
+				return -ENOMEM;
+			wake_list = list;
+			wake_size = wake_size ? wake_size * 2 : 64;
+		}
+		w->flags |= P_WAKE;
+		wake_list[wake_count++] = w;
+	}
+
+	return collect_waiters(n->rb_right, start, end);
 }
 
-static void write_result(struct lockspace *ls, struct dlm_plock_info *in,
-			 int rv)
+static int cmp_waiter_seq(const void *a, const void *b)
 {
-	int write_rv;
+	const struct lock_waiter *wa = *(struct lock_waiter * const *)a;
+	const struct lock_waiter *wb = *(struct lock_waiter * const *)b;
 
-	in->rv = rv;
-	write_rv = write(plock_device_fd, in, sizeof(struct dlm_plock_info));
-	if (write_rv < 0)
-		log_debug("write_result: write error %d fd %d\n",
-			  errno, plock_device_fd);
+	if (wa->seq < wb->seq)
+		return -1;
+	return wa->seq > wb->seq;
 }
 
-static void do_waiters(struct lockspace *ls, struct resource *r)
+static void clear_wake_list(int from)
 {
-	struct lock_waiter *w, *safe;
-	struct dlm_plock_info *in;
-	int rv;
+	int i;
 
-	list_for_each_entry_safe(w, safe, &r->waiters, list) {
-		in = &w->info;
+	for (i = from; i < wake_count; i++)
+		wake_list[i]->flags &= ~P_WAKE;
+	wake_count = 0;
+}
+
+/* check the waiters overlapping start:end, which has had locks removed
+   or downgraded, granting them in the order they were queued */
+
+static void do_waiters(struct lockspace *ls, struct resource *r,
+		       uint64_t start, uint64_t end)
+{
+	struct lock_waiter *w;
+	int i, count;
+
+	if (list_empty(&r->waiters))
+		return;
+
+	wake_count = 0;
+
+	if (collect_waiters(r->waiters_root.rb_node, start, end) < 0) {
+		clear_wake_list(0);
+		goto all;
+	}
 
-		if (is_conflict(r, in, 0))
+	qsort(wake_list, wake_count, sizeof(struct lock_waiter *),
+	      cmp_waiter_seq);
+
+	for (i = 0; i < wake_count; i++) {
+		w = wake_list[i];
+		w->flags &= ~P_WAKE;
+
+		if (is_conflict(r, &w->info, 0))
 			continue;
 
-		list_del(&w->list);
+		/* granting a read lock over the owner's write lock can
+		   unblock waiters outside start:end, including ones that
+		   were passed over already; they're checked next, still
+		   in the order queued */
 
-		/*
-		log_group(ls, "take waiter %llx %llx-%llx %d/%u/%llx",
-			  in->number, in->start, in->end,
-			  in->nodeid, in->pid, in->owner);
-		*/
+		if (!lock_releases(r, &w->info)) {
+			grant_waiter(ls, r, w);
+			pool_free(ls, PLOCK_POOL_WAITER, w);
+			continue;
+		}
 
-		rv = lock_internal(ls, r, in);
+		grant_waiter(ls, r, w);
+		count = wake_count;
 
-		if (in->nodeid == our_nodeid)
-			write_result(ls, in, rv);
+		if (collect_waiters(r->waiters_root.rb_node, w->info.start,
+				    w->info.end) < 0) {
+			pool_free(ls, PLOCK_POOL_WAITER, w);
+			clear_wake_list(i + 1);
+			goto all;
+		}
+		pool_free(ls, PLOCK_POOL_WAITER, w);
 
-		free(w);
+		if (wake_count > count)
+			qsort(wake_list + i + 1, wake_count - i - 1,
+			      sizeof(struct lock_waiter *), cmp_waiter_seq);
 	}
+	wake_count = 0;
+	return;
+ all:
+	do_all_waiters(ls, r);
 }
 
 static void do_lock(struct lockspace *ls, struct dlm_plock_info *in,
 		    struct resource *r)
 {
+	int releases = 0;
 	int rv;
 
 	if (is_conflict(r, in, 0)) {
@@ -739,14 +2002,17 @@ static void do_lock(struct lockspace *ls, struct dlm_plock_info *in,
 				goto out;
 			rv = -EINPROGRESS;
 		}
-	} else
+	} else {
+		releases = lock_releases(r, in);
 		rv = lock_internal(ls, r, in);
+	}
 
  out:
 	if (in->nodeid == our_nodeid && rv != -EINPROGRESS)
 		write_result(ls, in, rv);
 
-	do_waiters(ls, r);
+	if (releases)
+		do_waiters(ls, r, in->start, in->end);
 	put_resource(ls, r);
 }
 
@@ -755,23 +2021,24 @@ static void do_unlock(struct lockspace *ls, struct dlm_plock_info *in,
 {
 	int rv;
 
-	rv = unlock_internal(ls, r, in);
-
 #ifdef DLM_PLOCK_BUILD_WORKAROUND
 	if (in->pad & DLM_PLOCK_FL_CLOSE) {
 #else
 	if (in->flags & DLM_PLOCK_FL_CLOSE) {
 #endif
+		unlock_close(ls, r, in);
 		clear_waiters(ls, r, in);
 		/* no replies for unlock-close ops */
 		goto skip_result;
 	}
 
+	rv = unlock_internal(ls, r, in);
+
 	if (in->nodeid == our_nodeid)
 		write_result(ls, in, rv);
 
  skip_result:
-	do_waiters(ls, r);
+	do_waiters(ls, r, in->start, in->end);
 	put_resource(ls, r);
 }
 
@@ -796,10 +2063,16 @@ static void save_message(struct lockspace *ls, struct dlm_header *hd, int len,
 {
 	struct save_msg *sm;
 
-	sm = malloc(sizeof(struct save_msg) + len);
-	if (!sm)
-		return;
-	memset(sm, 0, sizeof(struct save_msg) + len);
+	if (len <= PLOCK_MSG_LEN) {
+		sm = pool_alloc(ls, PLOCK_POOL_MSG);
+		if (!sm)
+			return;
+	} else {
+		sm = malloc(sizeof(struct save_msg) + len);
+		if (!sm)
+			return;
+		memset(sm, 0, sizeof(struct save_msg) + len);
+	}
 
 	memcpy(&sm->buf, hd, len);
 	sm->type = type;
@@ -856,13 +2129,7 @@ static void _receive_plock(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive plock %llx %s %s %llx-%llx %d/%u/%llx w %d",
-		  (unsigned long long)info.number,
-		  op_str(info.optype),
-		  ex_str(info.optype, info.ex),
-		  (unsigned long long)info.start, (unsigned long long)info.end,
-		  info.nodeid, info.pid, (unsigned long long)info.owner,
-		  info.wait);
+	log_plock_op(ls, PT_RECV, &info, from);
 
 	plock_recv_count++;
 	if (!(plock_recv_count % 1000)) {
@@ -972,6 +2239,208 @@ void receive_plock(struct lockspace *ls, struct dlm_header *hd, int len)
 	_receive_plock(ls, hd, len);
 }
 
+/*
+ * When every daemon can receive them, plock ops are queued per lockspace
+ * and sent together in a DLM_MSG_PLOCK_BATCH message of plock_batch_rec
+ * records.  A batch is sent when it reaches plock_msg_batch_size bytes,
+ * when any other message is sent to the lockspace (preserving order), and
+ * by the main loop once the first queued op is plock_msg_batch_delay ms
+ * old (0 sends batches at the end of each pass through the main loop).
+ */
+
+struct plock_batch_rec {
+	uint16_t type;
+	uint16_t pad1;
+	uint32_t pad;
+	struct dlm_plock_info info;
+};
+
+/* a batch is one cpg message, so it can't be larger than one */
+
+static void check_plock_msg_batch_size(void)
+{
+	int max = sizeof(struct dlm_header) +
+		  ((DLM_CPG_MSG_MAX - sizeof(struct dlm_header)) /
+		   sizeof(struct plock_batch_rec)) *
+		  sizeof(struct plock_batch_rec);
+
+	if (opt(plock_msg_batch_size_ind) > max) {
+		log_error("plock_msg_batch_size %d reduced to %d",
+			  opt(plock_msg_batch_size_ind), max);
+		dlm_options[plock_msg_batch_size_ind].use_int = max;
+	}
+}
+
+static int plock_batch_ok(void)
+{
+	return opt(plock_msg_batch_size_ind) >= (int)(sizeof(struct dlm_header) +
+			  2 * sizeof(struct plock_batch_rec)) &&
+	       all_daemons_plock_batch();
+}
+
+/* send the records of a batch as separate messages of their types */
+
+static void send_plock_batch_recs(struct lockspace *ls, uint32_t count)
+{
+	char buf[PLOCK_MSG_LEN];
+	struct dlm_header *hd = (struct dlm_header *)buf;
+	struct plock_batch_rec *rec;
+	uint32_t i;
+
+	rec = (struct plock_batch_rec *)(ls->plock_batch_buf +
+					 sizeof(struct dlm_header));
+
+	for (i = 0; i < count; i++, rec++) {
+		memset(hd, 0, sizeof(struct dlm_header));
+		hd->type = le16_to_cpu(rec->type);
+		memcpy(buf + sizeof(struct dlm_header), &rec->info,
+		       sizeof(struct dlm_plock_info));
+		dlm_send_message(ls, buf, PLOCK_MSG_LEN);
+	}
+}
+
+void flush_plock_batch(struct lockspace *ls)
+{
+	struct dlm_header *hd;
+	uint32_t count;
+	int len;
+
+	if (!ls->plock_batch_count)
+		return;
+
+	/* reset first, dlm_send_message flushes non-batch messages */
+	count = ls->plock_batch_count;
+	len = ls->plock_batch_len;
+	ls->plock_batch_count = 0;
+	ls->plock_batch_len = 0;
+
+	/* a daemon that can't receive batches can join the daemon cpg
+	   while the batch is held for plock_msg_batch_delay */
+
+	if (!all_daemons_plock_batch()) {
+		log_plock(ls, "send plock batch %u unbatched", count);
+		send_plock_batch_recs(ls, count);
+		return;
+	}
+
+	hd = (struct dlm_header *)ls->plock_batch_buf;
+	memset(hd, 0, sizeof(struct dlm_header));
+	hd->type = DLM_MSG_PLOCK_BATCH;
+	hd->msgdata = count;
+
+	log_plock(ls, "send plock batch %u len %d", count, len);
+
+	dlm_send_message(ls, ls->plock_batch_buf, len);
+}
+
+void flush_plock_batches(void)
+{
+	struct lockspace *ls;
+	struct timeval now;
+	int pending = 0;
+
+	gettimeofday(&now, NULL);
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (!ls->plock_batch_count)
+			continue;
+		if (time_diff_ms(&ls->plock_batch_time, &now) >=
+		    opt(plock_msg_batch_delay_ind))
+			flush_plock_batch(ls);
+		else
+			pending = 1;
+	}
+	poll_plock_batch = pending;
+}
+
+static int queue_struct_info(struct lockspace *ls, struct dlm_plock_info *in,
+			     int msg_type)
+{
+	struct plock_batch_rec *rec;
+	int size = opt(plock_msg_batch_size_ind);
+
+	if (ls->plock_batch_count &&
+	    ls->plock_batch_len + sizeof(struct plock_batch_rec) > size)
+		flush_plock_batch(ls);
+
+	if (!ls->plock_batch_buf) {
+		ls->plock_batch_buf = malloc(size);
+		if (!ls->plock_batch_buf)
+			return -ENOMEM;
+	}
+
+	if (!ls->plock_batch_count) {
+		ls->plock_batch_len = sizeof(struct dlm_header);
+		gettimeofday(&ls->plock_batch_time, NULL);
+	}
+
+	rec = (struct plock_batch_rec *)(ls->plock_batch_buf +
+					 ls->plock_batch_len);
+	memset(rec, 0, sizeof(struct plock_batch_rec));
+	rec->type = cpu_to_le16(msg_type);
+	memcpy(&rec->info, in, sizeof(struct dlm_plock_info));
+	info_bswap_out(&rec->info);
+
+	ls->plock_batch_len += sizeof(struct plock_batch_rec);
+	ls->plock_batch_count++;
+	poll_plock_batch = 1;
+	return 0;
+}
+
+void receive_plock_batch(struct lockspace *ls, struct dlm_header *hd, int len)
+{
+	char buf[PLOCK_MSG_LEN];
+	struct dlm_header *h = (struct dlm_header *)buf;
+	struct plock_batch_rec *rec;
+	uint32_t count = hd->msgdata;
+	uint32_t i;
+
+	if (len < sizeof(struct dlm_header) ||
+	    count > (len - sizeof(struct dlm_header)) /
+		    sizeof(struct plock_batch_rec)) {
+		log_elock(ls, "receive_plock_batch from %d count %u bad len %d",
+			  hd->nodeid, count, len);
+		return;
+	}
+
+	rec = (struct plock_batch_rec *)((char *)hd + sizeof(struct dlm_header));
+
+	/* each record is handled as a separate message of its type */
+
+	for (i = 0; i < count; i++, rec++) {
+		memcpy(h, hd, sizeof(struct dlm_header));
+		h->type = le16_to_cpu(rec->type);
+		memcpy(buf + sizeof(struct dlm_header), &rec->info,
+		       sizeof(struct dlm_plock_info));
+
+		if (h->type != DLM_MSG_PLOCK && !opt(plock_ownership_ind)) {
+			log_elock(ls, "receive_plock_batch from %d %s ownership %d",
+				  hd->nodeid, msg_name(h->type),
+				  opt(plock_ownership_ind));
+			continue;
+		}
+
+		switch (h->type) {
+		case DLM_MSG_PLOCK:
+			receive_plock(ls, h, PLOCK_MSG_LEN);
+			break;
+		case DLM_MSG_PLOCK_OWN:
+			receive_own(ls, h, PLOCK_MSG_LEN);
+			break;
+		case DLM_MSG_PLOCK_DROP:
+			receive_drop(ls, h, PLOCK_MSG_LEN);
+			break;
+		case DLM_MSG_PLOCK_SYNC_LOCK:
+		case DLM_MSG_PLOCK_SYNC_WAITER:
+			receive_sync(ls, h, PLOCK_MSG_LEN);
+			break;
+		default:
+			log_elock(ls, "receive_plock_batch from %d bad type %d",
+				  hd->nodeid, h->type);
+		}
+	}
+}
+
 static int send_struct_info(struct lockspace *ls, struct dlm_plock_info *in,
 			    int msg_type)
 {
@@ -979,6 +2448,12 @@ static int send_struct_info(struct lockspace *ls, struct dlm_plock_info *in,
 	int rv = 0, len;
 	char *buf;
 
+	if (plock_batch_ok()) {
+		rv = queue_struct_info(ls, in, msg_type);
+		if (!rv)
+			return 0;
+	}
+
 	len = sizeof(struct dlm_header) + sizeof(struct dlm_plock_info);
 	buf = malloc(len);
 	if (!buf) {
@@ -1090,7 +2565,7 @@ static void save_pending_plock(struct lockspace *ls, struct resource *r,
 {
 	struct lock_waiter *w;
 
-	w = malloc(sizeof(struct lock_waiter));
+	w = pool_alloc(ls, PLOCK_POOL_WAITER);
 	if (!w) {
 		log_elock(ls, "save_pending_plock no mem");
 		return;
@@ -1109,7 +2584,7 @@ static void add_pending_plocks(struct lockspace *ls, struct resource *r)
 	list_for_each_entry_safe(w, safe, &r->pending, list) {
 		__receive_plock(ls, &w->info, our_nodeid, r);
 		list_del(&w->list);
-		free(w);
+		pool_free(ls, PLOCK_POOL_WAITER, w);
 	}
 }
 
@@ -1123,7 +2598,7 @@ static void send_pending_plocks(struct lockspace *ls, struct resource *r)
 	list_for_each_entry_safe(w, safe, &r->pending, list) {
 		send_plock(ls, r, &w->info);
 		list_del(&w->list);
-		free(w);
+		pool_free(ls, PLOCK_POOL_WAITER, w);
 	}
 }
 
@@ -1140,8 +2615,7 @@ static void _receive_own(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive_own %llx from %u owner %u",
-		  (unsigned long long)info.number, hd->nodeid, info.nodeid);
+	log_plock_op(ls, PT_OWN, &info, hd->nodeid);
 
 	rv = find_resource(ls, info.number, 1, &r);
 	if (rv)
@@ -1171,7 +2645,7 @@ static void _receive_own(struct lockspace *ls, struct dlm_header *hd, int len)
 
 			if (r->owner == -1) {
 				/* we have gained ownership */
-				r->owner = our_nodeid;
+				set_owner(ls, r, our_nodeid);
 				add_pending_plocks(ls, r);
 			} else if (r->owner == our_nodeid) {
 				should_not_happen = 1;
@@ -1204,7 +2678,7 @@ static void _receive_own(struct lockspace *ls, struct dlm_header *hd, int len)
 			} else if (r->owner == 0) {
 				should_not_happen = 1;
 			} else {
-				r->owner = 0;
+				set_owner(ls, r, 0);
 				r->flags |= R_GOT_UNOWN;
 				send_pending_plocks(ls, r);
 			}
@@ -1214,7 +2688,7 @@ static void _receive_own(struct lockspace *ls, struct dlm_header *hd, int len)
 
 			if (r->owner == -1) {
 				/* normal path for a node becoming owner */
-				r->owner = from;
+				set_owner(ls, r, from);
 			} else if (r->owner == our_nodeid) {
 				/* we relinquish our ownership: sync our local
 				   plocks to everyone, then set owner to 0 */
@@ -1224,7 +2698,7 @@ static void _receive_own(struct lockspace *ls, struct dlm_header *hd, int len)
 				   local ops may arrive before we receive
 				   our send_own message and can't be added
 				   locally */
-				r->owner = 0;
+				set_owner(ls, r, 0);
 			} else if (r->owner == 0) {
 				/* can happen because we set owner to 0 before
 				   we receive our send_own sent just above */
@@ -1313,10 +2787,7 @@ static void _receive_sync(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive sync %llx from %u %s %llx-%llx %d/%u/%llx",
-		  (unsigned long long)info.number, from, info.ex ? "WR" : "RD",
-		  (unsigned long long)info.start, (unsigned long long)info.end,
-		  info.nodeid, info.pid, (unsigned long long)info.owner);
+	log_plock_op(ls, PT_SYNC, &info, from);
 
 	rv = find_resource(ls, info.number, 0, &r);
 	if (rv) {
@@ -1332,7 +2803,7 @@ static void _receive_sync(struct lockspace *ls, struct dlm_header *hd, int len)
 	}
 
 	if (hd->type == DLM_MSG_PLOCK_SYNC_LOCK)
-		add_lock(r, info.nodeid, info.owner, info.pid, info.ex, 
+		add_lock(ls, r, info.nodeid, info.owner, info.pid, info.ex, 
 			 info.start, info.end);
 	else if (hd->type == DLM_MSG_PLOCK_SYNC_WAITER)
 		add_waiter(ls, r, &info);
@@ -1360,8 +2831,7 @@ static void _receive_drop(struct lockspace *ls, struct dlm_header *hd, int len)
 	memcpy(&info, (char *)hd + sizeof(struct dlm_header), sizeof(info));
 	info_bswap_in(&info);
 
-	log_plock(ls, "receive_drop %llx from %u",
-		  (unsigned long long)info.number, from);
+	log_plock_op(ls, PT_DROP, &info, from);
 
 	rv = find_resource(ls, info.number, 0, &r);
 	if (rv) {
@@ -1393,9 +2863,8 @@ static void _receive_drop(struct lockspace *ls, struct dlm_header *hd, int len)
 	   guaranteed to be the same on all nodes */
 
 	if (list_empty(&r->locks) && list_empty(&r->waiters)) {
-		rb_del_plock_resource(ls, r);
-		list_del(&r->list);
-		free(r);
+		free_resource(ls, r);
+		ls->plock_dropped++;
 	} else {
 		/* A sent drop, B sent a plock, receive plock, receive drop */
 		log_plock(ls, "receive_drop from %d r %llx in use", from,
@@ -1416,70 +2885,106 @@ void receive_drop(struct lockspace *ls, struct dlm_header *hd, int len)
 /* We only drop resources from the unowned state to simplify things.
    If we want to drop a resource we own, we unown/relinquish it first. */
 
-/* FIXME: in the transition from owner = us, to owner = 0, to drop;
-   we want the second period to be shorter than the first */
+/* FIXME: in the transition from owner = us, to owner = 0, to drop;
+   we want the second period to be shorter than the first */
+
+/*
+ * Give up ownership of, or drop, the resources that have been idle for
+ * drop_resources_age, sending a batch of messages per drop_resources_time
+ * in a lockspace.  The batch starts at drop_resources_count.  It doubles,
+ * up to DROP_BATCH_MAX_SHIFT times, while expired resources are left over
+ * at the end of a batch, and shrinks back as the backlog clears.  When the
+ * system is short of memory the largest batch is used.
+ */
+
+#define DROP_BATCH_MAX_SHIFT 4
+
+static int low_memory(void)
+{
+	struct sysinfo si;
+
+	if (sysinfo(&si) < 0)
+		return 0;
+
+	/* less than 1/16 of memory free */
+	return (uint64_t)(si.freeram + si.bufferram) * si.mem_unit <
+	       (uint64_t)si.totalram * si.mem_unit / 16;
+}
 
-static int drop_resources(struct lockspace *ls)
+void drop_resources(struct dlm_timer *t)
 {
-	struct resource *r;
-	struct timeval now;
-	int count = 0;
+	struct lockspace *ls = t->data;
+	struct resource *r, *safe;
+	uint64_t now, idle, elapsed;
+	uint32_t min_batch, max_batch, batch;
+	int backlog = 0;
 
 	if (!opt(plock_ownership_ind))
-		return 0;
+		return;
 
-	if (list_empty(&ls->plock_resources))
-		return 0;
+	min_batch = opt(drop_resources_count_ind);
+	if (!min_batch)
+		return;
+	max_batch = min_batch << DROP_BATCH_MAX_SHIFT;
 
-	gettimeofday(&now, NULL);
+	if (ls->drop_resources_batch < min_batch)
+		ls->drop_resources_batch = min_batch;
+	if (ls->drop_resources_batch > max_batch)
+		ls->drop_resources_batch = max_batch;
 
-	if (time_diff_ms(&ls->drop_resources_last, &now) <
-			 opt(drop_resources_time_ind))
-		return 1;
+	batch = low_memory() ? max_batch : ls->drop_resources_batch;
+
+	now = monotime_ms();
 
-	ls->drop_resources_last = now;
+	elapsed = now - ls->drop_resources_last;
+	if (elapsed >= opt(drop_resources_time_ind)) {
+		ls->drop_resources_last = now;
+		ls->drop_resources_sent = 0;
+		elapsed = 0;
+	}
 
-	/* try to drop the oldest, unused resources */
+	list_for_each_entry_safe(r, safe, &ls->plock_lru, lru) {
+		idle = now - r->last_access;
+		if (idle < opt(drop_resources_age_ind)) {
+			/* the rest were used more recently */
+			mod_timer(t, opt(drop_resources_age_ind) - idle);
+			break;
+		}
 
-	list_for_each_entry_reverse(r, &ls->plock_resources, list) {
-		if (count >= opt(drop_resources_count_ind))
+		if (ls->drop_resources_sent >= batch) {
+			backlog = 1;
+			mod_timer(t, opt(drop_resources_time_ind) - elapsed);
 			break;
+		}
+
+		list_del_init(&r->lru);
+
 		if (r->owner && r->owner != our_nodeid)
 			continue;
-		if (time_diff_ms(&r->last_access, &now) <
-		    opt(drop_resources_age_ind))
+		if (!list_empty(&r->locks) || !list_empty(&r->waiters))
 			continue;
 
-		if (list_empty(&r->locks) && list_empty(&r->waiters)) {
-			if (r->owner == our_nodeid) {
-				send_own(ls, r, 0);
-				r->owner = 0;
-			} else if (r->owner == 0 && got_unown(r)) {
-				send_drop(ls, r);
-			}
-
-			count++;
+		if (r->owner == our_nodeid) {
+			send_own(ls, r, 0);
+			set_owner(ls, r, 0);
+			ls->plock_unown_sent++;
+			ls->drop_resources_sent++;
+		} else if (got_unown(r)) {
+			send_drop(ls, r);
+			ls->plock_drop_sent++;
+			ls->drop_resources_sent++;
 		}
 	}
 
-	return 1;
-}
-
-void drop_resources_all(void)
-{
-	struct lockspace *ls;
-	int rv = 0;
-
-	poll_drop_plock = 0;
-
-	list_for_each_entry(ls, &lockspaces, list) {
-		rv = drop_resources(ls);
-		if (rv)
-			poll_drop_plock = 1;
+	if (backlog) {
+		if (ls->drop_resources_batch < max_batch)
+			ls->drop_resources_batch <<= 1;
+	} else if (ls->drop_resources_batch > min_batch) {
+		ls->drop_resources_batch >>= 1;
 	}
 }
 
-int limit_plocks(void)
+static int limit_plocks(void)
 {
 	struct timeval now;
 
@@ -1505,43 +3010,57 @@ int limit_plocks(void)
 	return 0;
 }
 
-void process_plocks(int ci)
+/* the plock device is read unless the rate limit or a full cpg send queue
+   has stopped it */
+
+void update_plock_polling(void)
 {
-	struct lockspace *ls;
-	struct resource *r;
-	struct dlm_plock_info info;
-	struct timeval now;
-	uint64_t usec;
-	int create, rv;
+	if (plock_device_fd < 0)
+		return;
 
-	if (limit_plocks()) {
-		poll_ignore_plock = 1;
+	if (send_queue_full || timer_pending(&plock_limit_timer))
 		client_ignore(plock_ci, plock_fd);
-		return;
-	}
+	else
+		client_back(plock_ci, plock_fd);
+}
 
-	gettimeofday(&now, NULL);
+/* reading from the plock device was stopped by the rate limit, resume it
+   once the current one second interval is up */
 
-	memset(&info, 0, sizeof(info));
+static void plock_limit_timer_fn(struct dlm_timer *t)
+{
+	struct timeval now;
+	unsigned long diff;
 
-	rv = do_read(plock_device_fd, &info, sizeof(info));
-	if (rv < 0) {
-		log_debug("process_plocks: read error %d fd %d\n",
-			  errno, plock_device_fd);
+	if (limit_plocks()) {
+		gettimeofday(&now, NULL);
+		diff = time_diff_ms(&plock_rate_last, &now);
+		mod_timer(t, diff < 1000 ? 1000 - diff : 1);
 		return;
 	}
 
+	hist_add(&plock_rate_delay_hist, monotime_us() - plock_rate_delay_begin);
+	update_plock_polling();
+}
+
+static void process_plock(struct dlm_plock_info *info, struct timeval *now)
+{
+	struct lockspace *ls;
+	struct resource *r;
+	uint64_t usec;
+	int create, rv;
+
 	/* kernel doesn't set the nodeid field */
-	info.nodeid = our_nodeid;
+	info->nodeid = our_nodeid;
 
 	if (!opt(enable_plock_ind)) {
 		rv = -ENOSYS;
 		goto fail;
 	}
 
-	ls = find_ls_id(info.fsid);
+	ls = find_ls_id(info->fsid);
 	if (!ls) {
-		log_plock(ls, "process_plocks: no ls id %x", info.fsid);
+		log_plock(ls, "process_plocks: no ls id %x", info->fsid);
 		rv = -EEXIST;
 		goto fail;
 	}
@@ -1551,61 +3070,117 @@ void process_plocks(int ci)
 		goto fail;
 	}
 
-	log_plock(ls, "read plock %llx %s %s %llx-%llx %d/%u/%llx w %d",
-		  (unsigned long long)info.number,
-		  op_str(info.optype),
-		  ex_str(info.optype, info.ex),
-		  (unsigned long long)info.start, (unsigned long long)info.end,
-		  info.nodeid, info.pid, (unsigned long long)info.owner,
-		  info.wait);
+	log_plock_op(ls, PT_READ, info, our_nodeid);
 
 	/* report plock rate and any delays since the last report */
 	plock_read_count++;
 	if (!(plock_read_count % 1000)) {
-		usec = dt_usec(&plock_read_time, &now) ;
-		log_plock(ls, "plock_read_count %u time %.3f s delays %u",
-			  plock_read_count, usec * 1.e-6, plock_rate_delays);
-		plock_read_time = now;
+		usec = dt_usec(&plock_read_time, now) ;
+		log_plock(ls, "plock_read_count %u time %.3f s delays %u "
+			  "batches %u max %u writev %u results %u",
+			  plock_read_count, usec * 1.e-6, plock_rate_delays,
+			  plock_batch_count, plock_batch_max,
+			  plock_writev_count, plock_writev_results);
+		plock_read_time = *now;
 		plock_rate_delays = 0;
+		plock_batch_count = 0;
+		plock_batch_max = 0;
+		plock_writev_count = 0;
+		plock_writev_results = 0;
 	}
 
-	create = (info.optype == DLM_PLOCK_OP_UNLOCK) ? 0 : 1;
+	create = (info->optype == DLM_PLOCK_OP_UNLOCK) ? 0 : 1;
 
-	rv = find_resource(ls, info.number, create, &r);
+	rv = find_resource(ls, info->number, create, &r);
 	if (rv)
 		goto fail;
 
 	if (r->owner == 0) {
 		/* plock state replicated on all nodes */
-		send_plock(ls, r, &info);
+		start_plock_op(ls, info, DLMC_PLOCK_PATH_CLUSTER);
+		send_plock(ls, r, info);
 
 	} else if (r->owner == our_nodeid) {
 		/* we are the owner of r, so our plocks are local */
-		__receive_plock(ls, &info, our_nodeid, r);
+		start_plock_op(ls, info, DLMC_PLOCK_PATH_LOCAL);
+		__receive_plock(ls, info, our_nodeid, r);
 
 	} else {
 		/* r owner is -1: r is new, try to become the owner;
 		   r owner > 0: tell other owner to give up ownership;
 		   both done with a message trying to set owner to ourself */
+		start_plock_op(ls, info, DLMC_PLOCK_PATH_OWNER);
 		send_own(ls, r, our_nodeid);
-		save_pending_plock(ls, r, &info);
+		save_pending_plock(ls, r, info);
 	}
 
-	if (opt(plock_ownership_ind) && !list_empty(&ls->plock_resources))
-		poll_drop_plock = 1;
 	return;
 
  fail:
 #ifdef DLM_PLOCK_BUILD_WORKAROUND
-	if (!(info.pad & DLM_PLOCK_FL_CLOSE)) {
+	if (!(info->pad & DLM_PLOCK_FL_CLOSE)) {
 #else
-	if (!(info.flags & DLM_PLOCK_FL_CLOSE)) {
+	if (!(info->flags & DLM_PLOCK_FL_CLOSE)) {
 #endif
-		info.rv = rv;
-		rv = write(plock_device_fd, &info, sizeof(info));
+		info->rv = rv;
+		queue_result(info);
 	}
 }
 
+/* Read up to plock_batch ops from the kernel per call, stopping early
+   when the kernel has no more ops queued (EAGAIN), the rate limit is
+   reached, or the cpg send queue fills. */
+
+void process_plocks(int ci)
+{
+	struct dlm_plock_info info;
+	struct timeval now;
+	int budget = opt(plock_batch_ind);
+	int count = 0;
+	int rv;
+
+	if (budget < 1)
+		budget = 1;
+
+	gettimeofday(&now, NULL);
+
+	while (count < budget) {
+		if (send_queue_full)
+			break;
+
+		if (limit_plocks()) {
+			plock_rate_delay_begin = monotime_us();
+			client_ignore(plock_ci, plock_fd);
+			mod_timer(&plock_limit_timer, 1);
+			break;
+		}
+
+		memset(&info, 0, sizeof(info));
+
+		rv = read(plock_device_fd, &info, sizeof(info));
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0 && errno == EAGAIN)
+			break;
+		if (rv != sizeof(info)) {
+			log_debug("process_plocks: read error %d %d fd %d\n",
+				  rv, errno, plock_device_fd);
+			break;
+		}
+
+		process_plock(&info, &now);
+		count++;
+	}
+
+	if (count) {
+		plock_batch_count++;
+		if (count > plock_batch_max)
+			plock_batch_max = count;
+	}
+
+	flush_plock_results();
+}
+
 void process_saved_plocks(struct lockspace *ls)
 {
 	struct save_msg *sm, *sm2;
@@ -1639,7 +3214,10 @@ void process_saved_plocks(struct lockspace *ls)
 		}
 
 		list_del(&sm->list);
-		free(sm);
+		if (sm->len <= PLOCK_MSG_LEN)
+			pool_free(ls, PLOCK_POOL_MSG, sm);
+		else
+			free(sm);
 		count++;
 	}
  out:
@@ -1767,46 +3345,432 @@ static int send_plocks_data(struct lockspace *ls, uint32_t seq, char *buf, int l
 	return 0;
 }
 
-void send_all_plocks_data(struct lockspace *ls, uint32_t seq, uint32_t *plocks_data)
+/*
+ * When every daemon can receive them, plock state is sent to a joining
+ * node in DLM_MSG_PLOCKS_FRAME messages of up to plock_data_frame_size
+ * bytes, each holding the state of many resources.  After the dlm_header
+ * and plocks_frame header, a frame is a sequence of entries, one per
+ * resource (or part of a resource continued from the previous frame):
+ *
+ *   varint  resource number, as a delta from the previous entry's
+ *   varint  flags (RD_CONTINUE)
+ *   varint  owner, zigzag encoded
+ *   records, each starting with a non-zero PF_ flags byte
+ *   0       end of the entry
+ *
+ * A record is the start of the range as a zigzag delta from the previous
+ * record's start, the length of the range, and the owner, pid and nodeid
+ * unless they're the same as the previous record's, all as varints.
+ * Resources are sent in order of number so the number deltas are small.
+ * A frame with entry flags or record flags that aren't known here is
+ * rejected.
+ */
+
+#define PLOCKS_FRAME_VERSION	1
+#define PLOCKS_FRAME_MAX	DLM_CPG_MSG_MAX /* including the dlm_header */
+
+#define PF_REC			0x01
+#define PF_WAITER		0x02
+#define PF_EX			0x04
+#define PF_SAME_OWNER		0x08
+#define PF_SAME_PID		0x10
+#define PF_SAME_NODEID		0x20
+#define PF_REC_FLAGS		(PF_REC | PF_WAITER | PF_EX | PF_SAME_OWNER | \
+				 PF_SAME_PID | PF_SAME_NODEID)
+
+#define VARINT_MAX		10
+#define PF_ENTRY_MAX		(3 * VARINT_MAX)
+#define PF_REC_MAX		(1 + 5 * VARINT_MAX)
+
+struct plocks_frame {
+	uint32_t version;
+	uint32_t entries;
+	uint32_t locks;
+	uint32_t waiters;
+};
+
+struct frame_state {
+	struct lockspace *ls;
+	char *buf;
+	int size;
+	unsigned char *p;
+	uint32_t seq;
+	uint32_t entries;
+	uint32_t locks;
+	uint32_t waiters;
+	uint32_t send_count;
+	uint64_t number;
+	uint64_t next;		/* resource to resume from */
+	struct dlm_plock_info prev;
+};
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static int get_varint(unsigned char **p, unsigned char *end, uint64_t *v)
+{
+	uint64_t val = 0;
+	int shift;
+
+	for (shift = 0; shift < 64 && *p < end; shift += 7) {
+		val |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			*v = val;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int frame_space(struct frame_state *fs)
+{
+	return fs->size - (int)((char *)fs->p - fs->buf);
+}
+
+static void frame_reset(struct frame_state *fs)
+{
+	fs->p = (unsigned char *)fs->buf + sizeof(struct dlm_header) +
+		sizeof(struct plocks_frame);
+	fs->entries = 0;
+	fs->locks = 0;
+	fs->waiters = 0;
+	fs->number = 0;
+}
+
+static void send_frame(struct frame_state *fs)
+{
+	struct dlm_header *hd = (struct dlm_header *)fs->buf;
+	struct plocks_frame *pf;
+	int len = (char *)fs->p - fs->buf;
+
+	memset(hd, 0, sizeof(struct dlm_header));
+	hd->type = DLM_MSG_PLOCKS_FRAME;
+	hd->msgdata = fs->seq;
+
+	pf = (struct plocks_frame *)(fs->buf + sizeof(struct dlm_header));
+	pf->version = cpu_to_le32(PLOCKS_FRAME_VERSION);
+	pf->entries = cpu_to_le32(fs->entries);
+	pf->locks = cpu_to_le32(fs->locks);
+	pf->waiters = cpu_to_le32(fs->waiters);
+
+	log_plock(fs->ls, "send_plocks_frame %d:%u entries %u locks %u waiters %u len %d",
+		  our_nodeid, fs->seq, fs->entries, fs->locks, fs->waiters, len);
+
+	dlm_send_message(fs->ls, fs->buf, len);
+	fs->send_count++;
+	frame_reset(fs);
+}
+
+static void frame_entry(struct frame_state *fs, struct resource *r, int owner,
+			uint32_t flags)
+{
+	if (frame_space(fs) < PF_ENTRY_MAX + PF_REC_MAX + 1)
+		send_frame(fs);
+
+	fs->p = put_varint(fs->p, r->number - fs->number);
+	fs->p = put_varint(fs->p, flags);
+	fs->p = put_varint(fs->p, zigzag(owner));
+	fs->number = r->number;
+	fs->entries++;
+	memset(&fs->prev, 0, sizeof(fs->prev));
+}
+
+static void frame_rec(struct frame_state *fs, struct resource *r, int owner,
+		      struct dlm_plock_info *in, int waiter)
+{
+	struct dlm_plock_info *prev = &fs->prev;
+	unsigned char *flags;
+
+	/* the end of the entry is written by the caller, and continued
+	   in a new entry in the next frame */
+
+	if (frame_space(fs) < PF_REC_MAX + 1) {
+		*fs->p++ = 0;
+		send_frame(fs);
+		frame_entry(fs, r, owner, RD_CONTINUE);
+	}
+
+	flags = fs->p++;
+	*flags = PF_REC;
+	if (waiter)
+		*flags |= PF_WAITER;
+	if (in->ex)
+		*flags |= PF_EX;
+
+	fs->p = put_varint(fs->p, zigzag((int64_t)(in->start - prev->start)));
+	fs->p = put_varint(fs->p, in->end - in->start);
+
+	if (in->owner == prev->owner)
+		*flags |= PF_SAME_OWNER;
+	else
+		fs->p = put_varint(fs->p, in->owner);
+
+	if (in->pid == prev->pid)
+		*flags |= PF_SAME_PID;
+	else
+		fs->p = put_varint(fs->p, in->pid);
+
+	if (in->nodeid == prev->nodeid)
+		*flags |= PF_SAME_NODEID;
+	else
+		fs->p = put_varint(fs->p, zigzag(in->nodeid));
+
+	prev->start = in->start;
+	prev->owner = in->owner;
+	prev->pid = in->pid;
+	prev->nodeid = in->nodeid;
+
+	if (waiter)
+		fs->waiters++;
+	else
+		fs->locks++;
+}
+
+static void frame_resource(struct frame_state *fs, struct resource *r, int owner)
+{
+	struct dlm_plock_info info;
+	struct posix_lock *po;
+	struct lock_waiter *w;
+
+	frame_entry(fs, r, owner, 0);
+
+	/* plocks not replicated for owned resources */
+	if (opt(plock_ownership_ind) && (owner == our_nodeid))
+		goto done;
+
+	memset(&info, 0, sizeof(info));
+
+	list_for_each_entry(po, &r->locks, list) {
+		if (po->flags & P_SYNCING)
+			continue;
+		info.start	= po->start;
+		info.end	= po->end;
+		info.owner	= po->owner;
+		info.pid	= po->pid;
+		info.nodeid	= po->nodeid;
+		info.ex		= po->ex;
+		frame_rec(fs, r, owner, &info, 0);
+	}
+
+	list_for_each_entry(w, &r->waiters, list) {
+		if (w->flags & P_SYNCING)
+			continue;
+		frame_rec(fs, r, owner, &w->info, 1);
+	}
+ done:
+	*fs->p++ = 0;
+}
+
+static int plocks_frame_size(void)
+{
+	int size = opt(plock_data_frame_size_ind);
+
+	if (size > PLOCKS_FRAME_MAX)
+		size = PLOCKS_FRAME_MAX;
+
+	if (size < (int)(sizeof(struct dlm_header) + sizeof(struct plocks_frame) +
+			 PF_ENTRY_MAX + PF_REC_MAX + 1))
+		return 0;
+
+	if (!all_daemons_plocks_frame())
+		return 0;
+
+	return size;
+}
+
+/* the owner to send for a resource, or -1 to skip it:
+
+   - If r owner is -1, ckpt nothing.
+   - If r owner is us, ckpt owner of us and no plocks.
+   - If r owner is other, ckpt that owner and any plocks we have on r
+     (they've just been synced but owner=0 msg not recved yet).
+   - If r owner is 0 and !got_unown, then we've just unowned r;
+     ckpt owner of us and any plocks that don't have SYNCING set
+     (plocks with SYNCING will be handled by our sync messages).
+   - If r owner is 0 and got_unown, then ckpt owner 0 and all plocks;
+     (there should be no SYNCING plocks) */
+
+static int send_owner(struct lockspace *ls, struct resource *r)
+{
+	if (!opt(plock_ownership_ind))
+		return 0;
+	else if (r->owner == -1)
+		return -1;
+	else if (r->owner == our_nodeid)
+		return our_nodeid;
+	else if (r->owner)
+		return r->owner;
+	else if (!r->owner && !got_unown(r))
+		return our_nodeid;
+	else if (!r->owner)
+		return 0;
+
+	log_elock(ls, "send_all_plocks_data error owner %d r %llx",
+		  r->owner, (unsigned long long)r->number);
+	return -1;
+}
+
+/*
+ * While the cpg send queue is full (see daemon_cpg.c), frames stop being
+ * generated, and the main loop picks up from the next resource number
+ * once it drains (send_plocks_frames).  Until the last frame is sent,
+ * plock messages we receive are saved, as they are on the joining node,
+ * so the frames hold the plock state of the point they were started at.
+ * plocks_done is sent after the last frame, and then the saved messages
+ * are processed.  A confchg for the lockspace finishes the frames first.
+ */
+
+/* returns 1 if the frames were paused by a full send queue */
+
+static int frames_resources(struct frame_state *fs, int pause)
+{
+	struct lockspace *ls = fs->ls;
+	struct resource *r;
+	int owner;
+
+	for (r = rb_first_plock_resource(ls, fs->next); r;
+	     r = next_plock_resource(r)) {
+		if (pause && send_queue_full) {
+			fs->next = r->number;
+			return 1;
+		}
+
+		owner = send_owner(ls, r);
+		if (owner >= 0)
+			frame_resource(fs, r, owner);
+	}
+
+	if (fs->entries)
+		send_frame(fs);
+	return 0;
+}
+
+static void frames_done(struct lockspace *ls)
+{
+	struct frame_state *fs = ls->plocks_frames;
+	uint32_t send_count = fs->send_count;
+
+	log_dlock(ls, "send_all_plocks_data %d:%u %u done",
+		  our_nodeid, fs->seq, send_count);
+
+	free(fs);
+	ls->plocks_frames = NULL;
+
+	plocks_data_done(ls, send_count);
+
+	process_saved_plocks(ls);
+	ls->save_plocks = 0;
+	state_changed();
+}
+
+/* returns 1 if frames are left to send from the main loop, < 0 to send
+   plock state the old way */
+
+static int send_all_plocks_frames(struct lockspace *ls, uint32_t seq, int size,
+				  uint32_t *send_count)
+{
+	struct frame_state *fs;
+
+	fs = malloc(sizeof(struct frame_state) + size);
+	if (!fs)
+		return -ENOMEM;
+	memset(fs, 0, sizeof(struct frame_state));
+	fs->ls = ls;
+	fs->seq = seq;
+	fs->size = size;
+	fs->buf = (char *)(fs + 1);
+	frame_reset(fs);
+
+	if (frames_resources(fs, 1)) {
+		log_dlock(ls, "send_all_plocks_data %d:%u paused at %llx",
+			  our_nodeid, seq, (unsigned long long)fs->next);
+		ls->plocks_frames = fs;
+		ls->save_plocks = 1;
+		poll_plocks_frames = 1;
+		state_changed();
+		return 1;
+	}
+
+	*send_count = fs->send_count;
+	free(fs);
+	return 0;
+}
+
+/* called from the main loop while poll_plocks_frames is set and the send
+   queue isn't full */
+
+void send_plocks_frames(void)
+{
+	struct lockspace *ls;
+
+	poll_plocks_frames = 0;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (!ls->plocks_frames)
+			continue;
+
+		if (frames_resources(ls->plocks_frames, 1)) {
+			poll_plocks_frames = 1;
+			continue;
+		}
+
+		frames_done(ls);
+	}
+}
+
+void finish_plocks_frames(struct lockspace *ls)
+{
+	if (!ls->plocks_frames)
+		return;
+
+	frames_resources(ls->plocks_frames, 0);
+	frames_done(ls);
+}
+
+/* returns 1 when plocks_done will be sent after frames still to come */
+
+int send_all_plocks_data(struct lockspace *ls, uint32_t seq, uint32_t *plocks_data)
 {
 	struct resource *r;
 	void *last;
-	int owner, count, len, full;
+	int owner, count, len, full, size, rv;
 	uint32_t send_count = 0;
 
 	if (!opt(enable_plock_ind) || ls->disable_plock)
-		return;
+		return 0;
 
 	log_dlock(ls, "send_all_plocks_data %d:%u", our_nodeid, seq);
 
-	/* - If r owner is -1, ckpt nothing.
-	   - If r owner is us, ckpt owner of us and no plocks.
-	   - If r owner is other, ckpt that owner and any plocks we have on r
-	     (they've just been synced but owner=0 msg not recved yet).
-	   - If r owner is 0 and !got_unown, then we've just unowned r;
-	     ckpt owner of us and any plocks that don't have SYNCING set
-	     (plocks with SYNCING will be handled by our sync messages).
-	   - If r owner is 0 and got_unown, then ckpt owner 0 and all plocks;
-	     (there should be no SYNCING plocks) */
+	size = plocks_frame_size();
+	if (size) {
+		rv = send_all_plocks_frames(ls, seq, size, &send_count);
+		if (rv > 0)
+			return 1;
+		if (!rv)
+			goto out;
+	}
 
-	list_for_each_entry(r, &ls->plock_resources, list) {
-		if (!opt(plock_ownership_ind))
-			owner = 0;
-		else if (r->owner == -1)
-			continue;
-		else if (r->owner == our_nodeid)
-			owner = our_nodeid;
-		else if (r->owner)
-			owner = r->owner;
-		else if (!r->owner && !got_unown(r))
-			owner = our_nodeid;
-		else if (!r->owner)
-			owner = 0;
-		else {
-			log_elock(ls, "send_all_plocks_data error owner %d r %llx",
-				  r->owner, (unsigned long long)r->number);
+	list_for_each_entry(r, &ls->plock_resources, list) {
+		owner = send_owner(ls, r);
+		if (owner < 0)
 			continue;
-		}
 
 		memset(&send_buf, 0, sizeof(send_buf));
 		count = 0;
@@ -1830,35 +3794,165 @@ void send_all_plocks_data(struct lockspace *ls, uint32_t seq, uint32_t *plocks_d
 
 		} while (full);
 	}
-
+ out:
 	*plocks_data = send_count;
 
 	log_dlock(ls, "send_all_plocks_data %d:%u %u done",
 		  our_nodeid, seq, send_count);
+	return 0;
 }
 
-static void free_r_lists(struct resource *r)
+static void free_r_lists(struct lockspace *ls, struct resource *r)
 {
 	struct posix_lock *po, *po2;
 	struct lock_waiter *w, *w2;
 
 	list_for_each_entry_safe(po, po2, &r->locks, list) {
 		list_del(&po->list);
-		free(po);
+		unlink_lock(ls, po);
+		pool_free(ls, PLOCK_POOL_LOCK, po);
 	}
+	r->locks_root = RB_ROOT;
 
 	list_for_each_entry_safe(w, w2, &r->waiters, list) {
 		list_del(&w->list);
-		free(w);
+		unlink_waiter(ls, w);
+		pool_free(ls, PLOCK_POOL_WAITER, w);
+	}
+	r->waiters_root = RB_ROOT;
+}
+
+/* whether plocks_data from hd should be saved, and count it if so */
+
+static int recv_plocks_start(struct lockspace *ls)
+{
+	if (!opt(enable_plock_ind) || ls->disable_plock)
+		return 0;
+
+	if (!ls->need_plocks)
+		return 0;
+
+	if (!ls->save_plocks)
+		return 0;
+
+	ls->recv_plocks_data_count++;
+
+	if (!ls->recv_plocks_data_time)
+		ls->recv_plocks_data_time = monotime_ms();
+	return 1;
+}
+
+static struct resource *recv_resource(struct lockspace *ls,
+				      struct dlm_header *hd, uint64_t num,
+				      int owner)
+{
+	struct resource *r;
+
+	if (!opt(plock_ownership_ind) && owner) {
+		log_elock(ls, "recv_plocks_data %d:%u n %llu bad owner %d",
+			  hd->nodeid, hd->msgdata, (unsigned long long)num,
+			  owner);
+		return NULL;
+	}
+
+	r = pool_alloc(ls, PLOCK_POOL_RESOURCE);
+	if (!r) {
+		log_elock(ls, "recv_plocks_data %d:%u n %llu no mem",
+			  hd->nodeid, hd->msgdata, (unsigned long long)num);
+		return NULL;
 	}
+	INIT_LIST_HEAD(&r->locks);
+	r->locks_root = RB_ROOT;
+	INIT_LIST_HEAD(&r->waiters);
+	r->waiters_root = RB_ROOT;
+	INIT_LIST_HEAD(&r->pending);
+	INIT_LIST_HEAD(&r->lru);
+	INIT_LIST_HEAD(&r->owned);
+	INIT_LIST_HEAD(&r->purge);
+
+	if (opt(plock_ownership_ind) && !owner)
+		r->flags |= R_GOT_UNOWN;
+
+	r->number = num;
+	set_owner(ls, r, owner);
+	return r;
+}
+
+static void recv_resource_done(struct lockspace *ls, struct resource *r)
+{
+	list_add_tail(&r->list, &ls->plock_resources);
+	rb_insert_plock_resource(ls, r);
+	touch_resource(ls, r);
+	ls->recv_plocks_resources++;
+}
+
+static void recv_resource_free(struct lockspace *ls, struct resource *r)
+{
+	free_r_lists(ls, r);
+	list_del(&r->owned);
+	pool_free(ls, PLOCK_POOL_RESOURCE, r);
+}
+
+static int recv_plock(struct lockspace *ls, struct resource *r,
+		      struct dlm_plock_info *in, int waiter)
+{
+	struct posix_lock *po;
+	struct lock_waiter *w;
+
+	if (!waiter) {
+		po = pool_alloc(ls, PLOCK_POOL_LOCK);
+		if (!po)
+			return -ENOMEM;
+		po->start	= in->start;
+		po->end		= in->end;
+		po->owner	= in->owner;
+		po->pid		= in->pid;
+		po->nodeid	= in->nodeid;
+		po->ex		= in->ex;
+		if (link_lock(ls, r, po) < 0) {
+			pool_free(ls, PLOCK_POOL_LOCK, po);
+			return -ENOMEM;
+		}
+		list_add_tail(&po->list, &r->locks);
+		rb_insert_lock(r, po);
+	} else {
+		w = pool_alloc(ls, PLOCK_POOL_WAITER);
+		if (!w)
+			return -ENOMEM;
+		w->info.start	= in->start;
+		w->info.end	= in->end;
+		w->info.owner	= in->owner;
+		w->info.pid	= in->pid;
+		w->info.nodeid	= in->nodeid;
+		w->info.ex	= in->ex;
+		if (queue_waiter(ls, r, w) < 0) {
+			pool_free(ls, PLOCK_POOL_WAITER, w);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* allocate all the records in a frame from one block up front rather
+   than letting the pools grow a slab at a time */
+
+static int recv_reserve(struct lockspace *ls, struct dlm_header *hd,
+			uint32_t locks, uint32_t waiters)
+{
+	if (pool_reserve(ls, PLOCK_POOL_LOCK, locks) < 0 ||
+	    pool_reserve(ls, PLOCK_POOL_WAITER, waiters) < 0) {
+		log_elock(ls, "recv_plocks_data %d:%u locks %u waiters %u no mem",
+			  hd->nodeid, hd->msgdata, locks, waiters);
+		return -ENOMEM;
+	}
+	return 0;
 }
 
 void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 {
+	struct dlm_plock_info info;
 	struct resource_data *rd;
 	struct plock_data *pp;
-	struct posix_lock *po;
-	struct lock_waiter *w;
 	struct resource *r;
 	uint64_t num;
 	uint32_t count;
@@ -1866,17 +3960,9 @@ void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 	int owner;
 	int i;
 
-	if (!opt(enable_plock_ind) || ls->disable_plock)
-		return;
-
-	if (!ls->need_plocks)
-		return;
-
-	if (!ls->save_plocks)
+	if (!recv_plocks_start(ls))
 		return;
 
-	ls->recv_plocks_data_count++;
-
 	if (len < sizeof(struct dlm_header) + sizeof(struct resource_data)) {
 		log_elock(ls, "recv_plocks_data %d:%u bad len %d",
 			  hd->nodeid, hd->msgdata, len);
@@ -1889,8 +3975,10 @@ void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 	count = le32_to_cpu(rd->lock_count);
 	flags = le32_to_cpu(rd->flags);
 
+	/* the first message for a resource has already inserted it */
+
 	if (flags & RD_CONTINUE) {
-		r = search_resource(ls, num);
+		r = rb_search_plock_resource(ls, num);
 		if (!r) {
 			log_elock(ls, "recv_plocks_data %d:%u n %llu not found",
 				  hd->nodeid, hd->msgdata, (unsigned long long)num);
@@ -1901,40 +3989,19 @@ void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 		goto unpack;
 	}
 
-	r = malloc(sizeof(struct resource));
-	if (!r) {
-		log_elock(ls, "recv_plocks_data %d:%u n %llu no mem",
-			  hd->nodeid, hd->msgdata, (unsigned long long)num);
+	r = recv_resource(ls, hd, num, owner);
+	if (!r)
 		return;
-	}
-	memset(r, 0, sizeof(struct resource));
-	INIT_LIST_HEAD(&r->locks);
-	INIT_LIST_HEAD(&r->waiters);
-	INIT_LIST_HEAD(&r->pending);
-
-	if (!opt(plock_ownership_ind)) {
-		if (owner) {
-			log_elock(ls, "recv_plocks_data %d:%u n %llu bad owner %d",
-				  hd->nodeid, hd->msgdata, (unsigned long long)num,
-				  owner);
-			goto fail_free;
-		}
-	} else {
-		if (!owner)
-			r->flags |= R_GOT_UNOWN;
 
-		/* no locks should be included for owned resources */
+	/* no locks should be included for owned resources */
 
-		if (owner && count) {
-			log_elock(ls, "recv_plocks_data %d:%u n %llu o %d bad count %u",
-				  (unsigned long long)num, owner, count);
-			goto fail_free;
-		}
+	if (opt(plock_ownership_ind) && owner && count) {
+		log_elock(ls, "recv_plocks_data %d:%u n %llu o %d bad count %u",
+			  hd->nodeid, hd->msgdata, (unsigned long long)num,
+			  owner, count);
+		goto fail_free;
 	}
 
-	r->number = num;
-	r->owner = owner;
-
  unpack:
 	if (len < sizeof(struct dlm_header) +
 		  sizeof(struct resource_data) +
@@ -1946,30 +4013,17 @@ void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 
 	pp = (struct plock_data *)((char *)rd + sizeof(struct resource_data));
 
+	memset(&info, 0, sizeof(info));
+
 	for (i = 0; i < count; i++) {
-		if (!pp->waiter) {
-			po = malloc(sizeof(struct posix_lock));
-			if (!po)
-				goto fail_free;
-			po->start	= le64_to_cpu(pp->start);
-			po->end		= le64_to_cpu(pp->end);
-			po->owner	= le64_to_cpu(pp->owner);
-			po->pid		= le32_to_cpu(pp->pid);
-			po->nodeid	= le32_to_cpu(pp->nodeid);
-			po->ex		= pp->ex;
-			list_add_tail(&po->list, &r->locks);
-		} else {
-			w = malloc(sizeof(struct lock_waiter));
-			if (!w)
-				goto fail_free;
-			w->info.start	= le64_to_cpu(pp->start);
-			w->info.end	= le64_to_cpu(pp->end);
-			w->info.owner	= le64_to_cpu(pp->owner);
-			w->info.pid	= le32_to_cpu(pp->pid);
-			w->info.nodeid	= le32_to_cpu(pp->nodeid);
-			w->info.ex	= pp->ex;
-			list_add_tail(&w->list, &r->waiters);
-		}
+		info.start	= le64_to_cpu(pp->start);
+		info.end	= le64_to_cpu(pp->end);
+		info.owner	= le64_to_cpu(pp->owner);
+		info.pid	= le32_to_cpu(pp->pid);
+		info.nodeid	= le32_to_cpu(pp->nodeid);
+		info.ex		= pp->ex;
+		if (recv_plock(ls, r, &info, pp->waiter) < 0)
+			goto fail_free;
 		pp++;
 	}
 
@@ -1977,18 +4031,168 @@ void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len)
 		  hd->nodeid, hd->msgdata, (unsigned long long)r->number,
 		  r->owner, count, len);
 
-	if (!(flags & RD_CONTINUE)) {
-		list_add_tail(&r->list, &ls->plock_resources);
-		rb_insert_plock_resource(ls, r);
-	}
+	if (!(flags & RD_CONTINUE))
+		recv_resource_done(ls, r);
 	return;
 
  fail_free:
-	if (!(flags & RD_CONTINUE)) {
-		free_r_lists(r);
-		free(r);
+	if (!(flags & RD_CONTINUE))
+		recv_resource_free(ls, r);
+	return;
+}
+
+/* see send_all_plocks_frames() for the format */
+
+void receive_plocks_frame(struct lockspace *ls, struct dlm_header *hd, int len)
+{
+	struct dlm_plock_info info;
+	struct plocks_frame *pf;
+	struct resource *r = NULL;
+	unsigned char *p, *end;
+	uint64_t num = 0, val, flags = 0;
+	uint32_t entries, locks, waiters, e;
+	uint32_t recv_locks = 0, recv_waiters = 0;
+	int owner, rflags;
+
+	if (!recv_plocks_start(ls))
+		return;
+
+	if (len < sizeof(struct dlm_header) + sizeof(struct plocks_frame)) {
+		log_elock(ls, "recv_plocks_frame %d:%u bad len %d",
+			  hd->nodeid, hd->msgdata, len);
+		return;
+	}
+
+	pf = (struct plocks_frame *)((char *)hd + sizeof(struct dlm_header));
+	p = (unsigned char *)pf + sizeof(struct plocks_frame);
+	end = (unsigned char *)hd + len;
+
+	entries = le32_to_cpu(pf->entries);
+	locks = le32_to_cpu(pf->locks);
+	waiters = le32_to_cpu(pf->waiters);
+
+	if (le32_to_cpu(pf->version) != PLOCKS_FRAME_VERSION) {
+		log_elock(ls, "recv_plocks_frame %d:%u bad version %u",
+			  hd->nodeid, hd->msgdata, le32_to_cpu(pf->version));
+		return;
+	}
+
+	/* every entry takes at least four bytes and every record three */
+
+	if ((uint64_t)entries * 4 + ((uint64_t)locks + waiters) * 3 > end - p) {
+		log_elock(ls, "recv_plocks_frame %d:%u entries %u locks %u waiters %u bad len %d",
+			  hd->nodeid, hd->msgdata, entries, locks, waiters, len);
+		return;
+	}
+
+	if (recv_reserve(ls, hd, locks, waiters) < 0)
+		return;
+
+	for (e = 0; e < entries; e++) {
+		if (get_varint(&p, end, &val) < 0)
+			goto bad;
+		num += val;
+		if (get_varint(&p, end, &flags) < 0 ||
+		    get_varint(&p, end, &val) < 0)
+			goto bad;
+		owner = unzigzag(val);
+
+		if (flags & ~(uint64_t)RD_CONTINUE)
+			goto bad;
+
+		if (flags & RD_CONTINUE) {
+			r = rb_search_plock_resource(ls, num);
+			if (!r) {
+				log_elock(ls, "recv_plocks_frame %d:%u n %llu not found",
+					  hd->nodeid, hd->msgdata,
+					  (unsigned long long)num);
+				return;
+			}
+		} else {
+			r = recv_resource(ls, hd, num, owner);
+			if (!r)
+				return;
+		}
+
+		memset(&info, 0, sizeof(info));
+
+		while (1) {
+			if (p >= end)
+				goto bad;
+			rflags = *p++;
+			if (!rflags)
+				break;
+
+			if (!(rflags & PF_REC) || (rflags & ~PF_REC_FLAGS))
+				goto bad;
+
+			/* no locks should be included for owned resources */
+
+			if (opt(plock_ownership_ind) && owner) {
+				log_elock(ls, "recv_plocks_frame %d:%u n %llu o %d has locks",
+					  hd->nodeid, hd->msgdata,
+					  (unsigned long long)num, owner);
+				goto fail_free;
+			}
+
+			if (get_varint(&p, end, &val) < 0)
+				goto bad;
+			info.start += unzigzag(val);
+			if (get_varint(&p, end, &val) < 0)
+				goto bad;
+			info.end = info.start + val;
+
+			if (!(rflags & PF_SAME_OWNER)) {
+				if (get_varint(&p, end, &val) < 0)
+					goto bad;
+				info.owner = val;
+			}
+			if (!(rflags & PF_SAME_PID)) {
+				if (get_varint(&p, end, &val) < 0)
+					goto bad;
+				info.pid = val;
+			}
+			if (!(rflags & PF_SAME_NODEID)) {
+				if (get_varint(&p, end, &val) < 0)
+					goto bad;
+				info.nodeid = unzigzag(val);
+			}
+			info.ex = !!(rflags & PF_EX);
+
+			if (rflags & PF_WAITER)
+				recv_waiters++;
+			else
+				recv_locks++;
+
+			if (recv_plock(ls, r, &info, rflags & PF_WAITER) < 0) {
+				log_elock(ls, "recv_plocks_frame %d:%u n %llu no mem",
+					  hd->nodeid, hd->msgdata,
+					  (unsigned long long)num);
+				goto fail_free;
+			}
+		}
+
+		if (!(flags & RD_CONTINUE))
+			recv_resource_done(ls, r);
+		r = NULL;
+	}
+
+	if (p != end || recv_locks != locks || recv_waiters != waiters) {
+		log_elock(ls, "recv_plocks_frame %d:%u locks %u %u waiters %u %u left %d",
+			  hd->nodeid, hd->msgdata, locks, recv_locks,
+			  waiters, recv_waiters, (int)(end - p));
 	}
+
+	log_plock(ls, "recv_plocks_frame %d:%u entries %u locks %u waiters %u len %d",
+		  hd->nodeid, hd->msgdata, entries, locks, waiters, len);
 	return;
+
+ bad:
+	log_elock(ls, "recv_plocks_frame %d:%u entry %u of %u bad data len %d",
+		  hd->nodeid, hd->msgdata, e, entries, len);
+ fail_free:
+	if (r && !(flags & RD_CONTINUE))
+		recv_resource_free(ls, r);
 }
 
 void clear_plocks_data(struct lockspace *ls)
@@ -2000,109 +4204,248 @@ void clear_plocks_data(struct lockspace *ls)
 		return;
 
 	list_for_each_entry_safe(r, r2, &ls->plock_resources, list) {
-		free_r_lists(r);
-		rb_del_plock_resource(ls, r);
-		list_del(&r->list);
-		free(r);
+		free_r_lists(ls, r);
+		free_resource(ls, r);
 		count++;
 	}
+	release_idle_pools(ls);
 
 	log_dlock(ls, "clear_plocks_data done %u recv_plocks_data_count %u",
 		  count, ls->recv_plocks_data_count);
 
 	ls->recv_plocks_data_count = 0;
+	ls->recv_plocks_data_time = 0;
+	ls->recv_plocks_resources = 0;
 }
 
-/* Called when a node has failed, or we're unmounting.  For a node failure, we
-   need to call this when the cpg confchg arrives so that we're guaranteed all
-   nodes do this in the same sequence wrt other messages. */
+static void purge_resource(struct lockspace *ls, struct resource *r,
+			   int nodeid)
+{
+	/* TODO: haven't thought carefully about how this transition
+	   to owner 0 might interact with other owner messages in
+	   progress. */
+
+	if (r->owner == nodeid) {
+		set_owner(ls, r, 0);
+		r->flags |= R_GOT_UNOWN;
+		r->flags |= R_PURGE_UNOWN;
+		send_pending_plocks(ls, r);
+	}
 
-void purge_plocks(struct lockspace *ls, int nodeid, int unmount)
+	if (!list_empty(&r->waiters))
+		do_all_waiters(ls, r);
+
+	if (!opt(plock_ownership_ind) &&
+	    list_empty(&r->locks) && list_empty(&r->waiters))
+		free_resource(ls, r);
+	else
+		touch_resource(ls, r);
+}
+
+/* look at every resource, for unmount, or if a node's resources couldn't
+   all be indexed */
+
+static int purge_all(struct lockspace *ls, int nodeid, int unmount)
 {
 	struct posix_lock *po, *po2;
 	struct lock_waiter *w, *w2;
 	struct resource *r, *r2;
 	int purged = 0;
 
-	if (!opt(enable_plock_ind) || ls->disable_plock)
-		return;
-
 	list_for_each_entry_safe(r, r2, &ls->plock_resources, list) {
 		list_for_each_entry_safe(po, po2, &r->locks, list) {
 			if (po->nodeid == nodeid || unmount) {
-				list_del(&po->list);
-				free(po);
+				del_lock(ls, r, po);
 				purged++;
 			}
 		}
 
 		list_for_each_entry_safe(w, w2, &r->waiters, list) {
 			if (w->info.nodeid == nodeid || unmount) {
-				list_del(&w->list);
-				free(w);
+				dequeue_waiter(ls, r, w);
+				pool_free(ls, PLOCK_POOL_WAITER, w);
 				purged++;
 			}
 		}
 
-		/* TODO: haven't thought carefully about how this transition
-		   to owner 0 might interact with other owner messages in
-		   progress. */
+		purge_resource(ls, r, nodeid);
+	}
+	return purged;
+}
+
+/* only the locks, waiters and resources of the failed node are visited,
+   through its plock_node */
+
+static int purge_node(struct lockspace *ls, int nodeid)
+{
+	struct plock_node *pn;
+	struct plock_owner *pown, *pown2;
+	struct posix_lock *po, *po2;
+	struct lock_waiter *w, *w2;
+	struct resource *r, *r2;
+	LIST_HEAD(purge);
+	int purged = 0;
+
+	pn = find_plock_node(ls, nodeid);
+	if (!pn)
+		return 0;
+
+	list_for_each_entry_safe(pown, pown2, &pn->owners, node_list) {
+		pown->count++;
 
-		if (r->owner == nodeid) {
-			r->owner = 0;
-			r->flags |= R_GOT_UNOWN;
-			r->flags |= R_PURGE_UNOWN;
-			send_pending_plocks(ls, r);
+		list_for_each_entry_safe(po, po2, &pown->locks, owner_list) {
+			r = po->r;
+			if (list_empty(&r->purge))
+				list_add_tail(&r->purge, &purge);
+			del_lock(ls, r, po);
+			purged++;
 		}
-		
-		if (!list_empty(&r->waiters))
-			do_waiters(ls, r);
-
-		if (!opt(plock_ownership_ind) &&
-		    list_empty(&r->locks) && list_empty(&r->waiters)) {
-			rb_del_plock_resource(ls, r);
-			list_del(&r->list);
-			free(r);
+
+		list_for_each_entry_safe(w, w2, &pown->waiters, owner_list) {
+			r = w->r;
+			if (list_empty(&r->purge))
+				list_add_tail(&r->purge, &purge);
+			dequeue_waiter(ls, r, w);
+			pool_free(ls, PLOCK_POOL_WAITER, w);
+			purged++;
 		}
+
+		put_plock_owner(ls, pown);
+	}
+
+	/* set_owner() in purge_resource() takes r off pn->resources */
+
+	list_for_each_entry(r, &pn->resources, owned) {
+		if (list_empty(&r->purge))
+			list_add_tail(&r->purge, &purge);
+	}
+
+	list_for_each_entry_safe(r, r2, &purge, purge) {
+		list_del_init(&r->purge);
+		purge_resource(ls, r, nodeid);
 	}
+
+	put_plock_node(ls, pn);
+	return purged;
+}
+
+/* Called when a node has failed, or we're unmounting.  For a node failure, we
+   need to call this when the cpg confchg arrives so that we're guaranteed all
+   nodes do this in the same sequence wrt other messages. */
+
+void purge_plocks(struct lockspace *ls, int nodeid, int unmount)
+{
+	uint64_t begin = monotime_ms();
+	int purged;
+
+	if (!opt(enable_plock_ind) || ls->disable_plock)
+		return;
+
+	if (unmount || ls->plock_nodes_incomplete)
+		purged = purge_all(ls, nodeid, unmount);
+	else
+		purged = purge_node(ls, nodeid);
+
+	if (ls->plock_nodes_incomplete && !unmount)
+		reindex_plock_nodes(ls);
+
+	release_idle_pools(ls);
 	
 	if (purged)
 		ls->last_plock_time = monotime();
 
-	log_dlock(ls, "purged %d plocks for %d", purged, nodeid);
+	log_dlock(ls, "purged %d plocks for %d in %llu ms", purged, nodeid,
+		  (unsigned long long)(monotime_ms() - begin));
 }
 
-int copy_plock_state(struct lockspace *ls, char *buf, int *len_out)
+static int match_plock_filter(struct dlmc_plock_filter *f, int waiting,
+			      int nodeid, uint32_t pid)
+{
+	if ((f->flags & DLMC_PLOCK_WAITERS) && !waiting)
+		return 0;
+	if (f->nodeid && f->nodeid != nodeid)
+		return 0;
+	if (f->pid && f->pid != pid)
+		return 0;
+	return 1;
+}
+
+/* add line i of r to buf, or if it doesn't fit, set the cursor to it */
+
+static int page_line(struct dlmc_plock_filter *f, struct resource *r,
+		     uint32_t i, char *line, int line_len,
+		     char *buf, int size, int *pos)
+{
+	if (*pos && *pos + line_len >= size) {
+		f->cursor = r->number;
+		f->cursor_line = i;
+		return 1;
+	}
+	memcpy(buf + *pos, line, line_len + 1);
+	*pos += line_len;
+	return 0;
+}
+
+/*
+ * Copy the plock lines matching the filter, starting from the filter
+ * cursor, until the next one doesn't fit in size bytes.  (A line is
+ * always copied to an empty buf, which is larger than any line.)
+ * Returns 1 with the cursor set to the next line if there are more,
+ * or 0 at the end.
+ *
+ * A resource has a line for each lock, waiter and pending lock, in that
+ * order, or one line if it has none of those.  The cursor is the number
+ * of the resource and the index of the line in it, counting the lines
+ * the filter skips, so it stays in place as long as the resource doesn't
+ * change.
+ */
+
+int copy_plock_state_page(struct lockspace *ls, struct dlmc_plock_filter *f,
+			  char *buf, int size, int *len_out)
 {
 	struct posix_lock *po;
 	struct lock_waiter *w;
 	struct resource *r;
-	struct timeval now;
-	int rv = 0;
-	int len = DLMC_DUMP_SIZE, pos = 0, ret;
+	char line[256];
+	uint64_t now;
+	uint32_t i, skip;
+	int pos = 0, len;
 
-	gettimeofday(&now, NULL);
+	now = monotime_ms();
 
-	list_for_each_entry(r, &ls->plock_resources, list) {
+	if (f->number && f->cursor != f->number) {
+		f->cursor = f->number;
+		f->cursor_line = 0;
+	}
+
+	for (r = rb_first_plock_resource(ls, f->cursor); r;
+	     r = next_plock_resource(r)) {
+
+		if (f->number && r->number != f->number)
+			break;
+
+		skip = (r->number == f->cursor) ? f->cursor_line : 0;
+		i = 0;
 
 		if (list_empty(&r->locks) &&
 		    list_empty(&r->waiters) &&
 		    list_empty(&r->pending)) {
-			ret = snprintf(buf + pos, len - pos,
+			if (skip || f->flags || f->nodeid || f->pid)
+				continue;
+			len = snprintf(line, sizeof(line),
 			      "%llu rown %d unused_ms %llu\n",
 			      (unsigned long long)r->number, r->owner,
-			      (unsigned long long)time_diff_ms(&r->last_access,
-				      			       &now));
-			if (ret >= len - pos) {
-				rv = -ENOSPC;
-				goto out;
-			}
-			pos += ret;
+			      (unsigned long long)(now - r->last_access));
+			if (page_line(f, r, 0, line, len, buf, size, &pos))
+				goto more;
 			continue;
 		}
 
 		list_for_each_entry(po, &r->locks, list) {
-			ret = snprintf(buf + pos, len - pos,
+			if (i++ < skip ||
+			    !match_plock_filter(f, 0, po->nodeid, po->pid))
+				continue;
+			len = snprintf(line, sizeof(line),
 			      "%llu %s %llu-%llu nodeid %d pid %u owner %llx rown %d\n",
 			      (unsigned long long)r->number,
 			      po->ex ? "WR" : "RD",
@@ -2110,16 +4453,15 @@ int copy_plock_state(struct lockspace *ls, char *buf, int *len_out)
 			      (unsigned long long)po->end,
 			      po->nodeid, po->pid,
 			      (unsigned long long)po->owner, r->owner);
-
-			if (ret >= len - pos) {
-				rv = -ENOSPC;
-				goto out;
-			}
-			pos += ret;
+			if (page_line(f, r, i - 1, line, len, buf, size, &pos))
+				goto more;
 		}
 
 		list_for_each_entry(w, &r->waiters, list) {
-			ret = snprintf(buf + pos, len - pos,
+			if (i++ < skip ||
+			    !match_plock_filter(f, 1, w->info.nodeid, w->info.pid))
+				continue;
+			len = snprintf(line, sizeof(line),
 			      "%llu %s %llu-%llu nodeid %d pid %u owner %llx rown %d WAITING\n",
 			      (unsigned long long)r->number,
 			      w->info.ex ? "WR" : "RD",
@@ -2127,16 +4469,15 @@ int copy_plock_state(struct lockspace *ls, char *buf, int *len_out)
 			      (unsigned long long)w->info.end,
 			      w->info.nodeid, w->info.pid,
 			      (unsigned long long)w->info.owner, r->owner);
-
-			if (ret >= len - pos) {
-				rv = -ENOSPC;
-				goto out;
-			}
-			pos += ret;
+			if (page_line(f, r, i - 1, line, len, buf, size, &pos))
+				goto more;
 		}
 
 		list_for_each_entry(w, &r->pending, list) {
-			ret = snprintf(buf + pos, len - pos,
+			if (i++ < skip ||
+			    !match_plock_filter(f, 1, w->info.nodeid, w->info.pid))
+				continue;
+			len = snprintf(line, sizeof(line),
 			      "%llu %s %llu-%llu nodeid %d pid %u owner %llx rown %d PENDING\n",
 			      (unsigned long long)r->number,
 			      w->info.ex ? "WR" : "RD",
@@ -2144,16 +4485,29 @@ int copy_plock_state(struct lockspace *ls, char *buf, int *len_out)
 			      (unsigned long long)w->info.end,
 			      w->info.nodeid, w->info.pid,
 			      (unsigned long long)w->info.owner, r->owner);
-
-			if (ret >= len - pos) {
-				rv = -ENOSPC;
-				goto out;
-			}
-			pos += ret;
+			if (page_line(f, r, i - 1, line, len, buf, size, &pos))
+				goto more;
 		}
 	}
- out:
+
+	f->cursor = 0;
+	f->cursor_line = 0;
 	*len_out = pos;
-	return rv;
+	return 0;
+
+ more:
+	*len_out = pos;
+	return 1;
+}
+
+int copy_plock_state(struct lockspace *ls, char *buf, int *len_out)
+{
+	struct dlmc_plock_filter f;
+
+	memset(&f, 0, sizeof(f));
+
+	if (copy_plock_state_page(ls, &f, buf, DLMC_DUMP_SIZE, len_out))
+		return -ENOSPC;
+	return 0;
 }
 
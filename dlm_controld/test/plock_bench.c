@@ -0,0 +1,525 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Timings of the plock paths, run in-process on the functions in plock.c:
+ *
+ * overlap   lock+unlock of a free range on a resource holding 10 to 100k
+ *           locks, against a walk of every lock as the list based
+ *           is_conflict(), lock_internal() and unlock_internal() did.
+ *
+ * waiters   unlocks of 100 to 10k locks on one resource, each with a
+ *           waiter blocked on it, granting the waiters with do_waiters()
+ *           and with the full rescan of do_all_waiters().
+ *
+ * ingest    the plock state of 1k to 100k resources sent to a joining
+ *           node, received with receive_plocks_data() one resource per
+ *           DLM_MSG_PLOCKS_DATA, and with receive_plocks_frame() many
+ *           resources per DLM_MSG_PLOCKS_FRAME.
+ *
+ * drop      drop_resources() finding the few idle resources among 1k to
+ *           100k owned ones on the plock_lru, against the walk of every
+ *           resource that it did before the lru.
+ */
+
+#include "../plock.c"
+#include "plock_test.h"
+
+#define NODE_OTHER	2
+#define NODE_BENCH	3
+
+static const int nodes_ingest[] = { 1, NODE_OTHER, 4 };
+
+static void set_info(struct dlm_plock_info *in, int nodeid, uint64_t owner,
+		     uint64_t start, uint64_t end, int ex)
+{
+	memset(in, 0, sizeof(*in));
+	in->nodeid = nodeid;
+	in->owner = owner;
+	in->pid = owner;
+	in->number = 1;
+	in->start = start;
+	in->end = end;
+	in->ex = ex;
+}
+
+static struct resource *get_resource(struct lockspace *ls, uint64_t number)
+{
+	struct resource *r;
+
+	if (find_resource(ls, number, 1, &r)) {
+		fprintf(stderr, "find_resource failed\n");
+		exit(1);
+	}
+	return r;
+}
+
+/* the conflict check of the list based is_conflict() */
+
+static int scan_conflict(struct resource *r, struct dlm_plock_info *in)
+{
+	struct posix_lock *po;
+
+	list_for_each_entry(po, &r->locks, list) {
+		if (po->nodeid == in->nodeid && po->owner == in->owner)
+			continue;
+		if (po->start > in->end || po->end < in->start)
+			continue;
+		if (in->ex || po->ex)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Locks of other owners on every even byte of the resource, and a lock
+ * and unlock of a random odd byte between them, so each op has to look
+ * for conflicts and finds none.
+ */
+
+static void bench_overlap(void)
+{
+	static const int counts[] = { 10, 100, 1000, 10000, 100000 };
+	struct dlm_plock_info in;
+	struct lockspace *ls;
+	struct resource *r;
+	uint64_t begin, op_ns, scan_ns, start;
+	int i, n, c, ops, scans, conflicts = 0;
+
+	printf("overlap: lock+unlock of a free range among n locks\n");
+	printf("%8s %12s %12s %12s\n", "n", "op ns", "walk ns", "3 walks ns");
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		n = counts[c];
+		ls = test_ls_new("bench");
+		r = get_resource(ls, 1);
+
+		for (i = 0; i < n; i++) {
+			set_info(&in, NODE_OTHER, i, 2 * i, 2 * i, 1);
+			if (lock_internal(ls, r, &in)) {
+				fprintf(stderr, "lock_internal failed\n");
+				exit(1);
+			}
+		}
+
+		ops = 200000;
+		begin = test_ns();
+		for (i = 0; i < ops; i++) {
+			start = 2 * (random() % n) + 1;
+			set_info(&in, NODE_BENCH, 1, start, start, 1);
+			do_lock(ls, &in, r);
+			in.optype = DLM_PLOCK_OP_UNLOCK;
+			do_unlock(ls, &in, r);
+		}
+		op_ns = (test_ns() - begin) / ops;
+
+		scans = 20000000 / n;
+		begin = test_ns();
+		for (i = 0; i < scans; i++) {
+			start = 2 * (random() % n) + 1;
+			set_info(&in, NODE_BENCH, 1, start, start, 1);
+			conflicts += scan_conflict(r, &in);
+		}
+		scan_ns = (test_ns() - begin) / scans;
+
+		if (conflicts || list_empty(&r->locks)) {
+			fprintf(stderr, "overlap: unexpected conflict\n");
+			exit(1);
+		}
+
+		printf("%8d %12llu %12llu %12llu\n", n,
+		       (unsigned long long)op_ns,
+		       (unsigned long long)scan_ns,
+		       (unsigned long long)scan_ns * 3);
+
+		test_ls_free(ls);
+	}
+}
+
+/* an unlock as do_unlock() did before do_waiters() */
+
+static void unlock_rescan(struct lockspace *ls, struct dlm_plock_info *in,
+			  struct resource *r)
+{
+	unlock_internal(ls, r, in);
+	do_all_waiters(ls, r);
+}
+
+static uint64_t waiters_run(int n, int rescan)
+{
+	struct dlm_plock_info in;
+	struct lockspace *ls;
+	struct resource *r;
+	uint64_t begin, ns;
+	int *order;
+	int i, j, t;
+
+	ls = test_ls_new("bench");
+	r = get_resource(ls, 1);
+
+	for (i = 0; i < n; i++) {
+		set_info(&in, NODE_OTHER, i, 2 * i, 2 * i, 1);
+		lock_internal(ls, r, &in);
+
+		set_info(&in, NODE_BENCH, i, 2 * i, 2 * i, 1);
+		in.wait = 1;
+		if (!is_conflict(r, &in, 0) || add_waiter(ls, r, &in)) {
+			fprintf(stderr, "waiters: add_waiter failed\n");
+			exit(1);
+		}
+	}
+
+	/* the locks are unlocked in a random order */
+
+	order = malloc(n * sizeof(int));
+	if (!order) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	begin = test_ns();
+	for (i = 0; i < n; i++) {
+		set_info(&in, NODE_OTHER, order[i], 2 * order[i],
+			 2 * order[i], 1);
+		in.optype = DLM_PLOCK_OP_UNLOCK;
+		if (rescan)
+			unlock_rescan(ls, &in, r);
+		else
+			do_unlock(ls, &in, r);
+	}
+	ns = (test_ns() - begin) / n;
+
+	if (!list_empty(&r->waiters)) {
+		fprintf(stderr, "waiters: waiters left after unlocks\n");
+		exit(1);
+	}
+
+	free(order);
+	test_ls_free(ls);
+	return ns;
+}
+
+static void bench_waiters(void)
+{
+	static const int counts[] = { 100, 1000, 10000 };
+	uint64_t new_ns, old_ns;
+	int c;
+
+	printf("waiters: unlock granting one of n blocked waiters\n");
+	printf("%8s %12s %12s\n", "n", "unlock ns", "rescan ns");
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		new_ns = waiters_run(counts[c], 0);
+		old_ns = waiters_run(counts[c], 1);
+
+		printf("%8d %12llu %12llu\n", counts[c],
+		       (unsigned long long)new_ns,
+		       (unsigned long long)old_ns);
+	}
+}
+
+/* messages sent by send_all_plocks_data() */
+
+struct sent {
+	char **bufs;
+	int *lens;
+	int count;
+	int alloc;
+	uint64_t bytes;
+};
+
+static struct sent sent;
+
+static void save_sent(struct lockspace *ls, char *buf, int len)
+{
+	if (sent.count == sent.alloc) {
+		sent.alloc = sent.alloc ? sent.alloc * 2 : 1024;
+		sent.bufs = realloc(sent.bufs, sent.alloc * sizeof(char *));
+		sent.lens = realloc(sent.lens, sent.alloc * sizeof(int));
+		if (!sent.bufs || !sent.lens) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	sent.bufs[sent.count] = malloc(len);
+	if (!sent.bufs[sent.count]) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(sent.bufs[sent.count], buf, len);
+	sent.lens[sent.count] = len;
+	sent.count++;
+	sent.bytes += len;
+}
+
+static void free_sent(void)
+{
+	int i;
+
+	for (i = 0; i < sent.count; i++)
+		free(sent.bufs[i]);
+	sent.count = 0;
+	sent.bytes = 0;
+}
+
+#define INGEST_LOCKS	4	/* per resource, and a waiter on every 4th */
+#define INGEST_RUNS	5
+
+/* returns the best time of INGEST_RUNS receives of the sent messages */
+
+static uint64_t ingest_receive(int n, int frame)
+{
+	struct lockspace *ls;
+	struct dlm_header *hd;
+	uint64_t begin, ns, best = 0;
+	int run, i;
+
+	for (run = 0; run < INGEST_RUNS; run++) {
+		ls = test_ls_new("recv");
+		ls->need_plocks = 1;
+		ls->save_plocks = 1;
+
+		begin = test_ns();
+		for (i = 0; i < sent.count; i++) {
+			hd = (struct dlm_header *)sent.bufs[i];
+			hd->nodeid = NODE_OTHER;
+			if (frame)
+				receive_plocks_frame(ls, hd, sent.lens[i]);
+			else
+				receive_plocks_data(ls, hd, sent.lens[i]);
+		}
+		ns = test_ns() - begin;
+
+		if (ls->recv_plocks_resources != n ||
+		    ls->plock_pools[PLOCK_POOL_LOCK].in_use != n * INGEST_LOCKS ||
+		    ls->plock_pools[PLOCK_POOL_WAITER].in_use != n / 4) {
+			fprintf(stderr, "ingest: received %u resources %u locks %u waiters\n",
+				ls->recv_plocks_resources,
+				ls->plock_pools[PLOCK_POOL_LOCK].in_use,
+				ls->plock_pools[PLOCK_POOL_WAITER].in_use);
+			exit(1);
+		}
+
+		if (!best || ns < best)
+			best = ns;
+		test_ls_free(ls);
+	}
+	return best;
+}
+
+static void bench_ingest(void)
+{
+	static const int counts[] = { 1000, 10000, 100000 };
+	struct dlm_plock_info in;
+	struct lockspace *ls;
+	struct resource *r;
+	uint64_t ns;
+	uint32_t plocks_data;
+	int i, j, c, n, frame;
+
+	printf("ingest: plock state of n resources with %d locks each\n",
+	       INGEST_LOCKS);
+	printf("%8s %6s %8s %10s %12s %14s\n",
+	       "n", "format", "msgs", "bytes", "ms", "resources/s");
+
+	dlm_options[plock_data_frame_size_ind].use_int = 65536;
+	test_send = save_sent;
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		n = counts[c];
+		ls = test_ls_new("send");
+
+		/* inode numbers as a filesystem might hand them out */
+		for (i = 0; i < n; i++) {
+			r = get_resource(ls, 4096 + 37 * (uint64_t)i);
+			for (j = 0; j < INGEST_LOCKS; j++) {
+				set_info(&in, nodes_ingest[j % 3], 100 + j,
+					 j * 4096, j * 4096 + 4095, j == 0);
+				lock_internal(ls, r, &in);
+			}
+			if (i % 4)
+				continue;
+			set_info(&in, NODE_BENCH, 200, 0, 4095, 1);
+			add_waiter(ls, r, &in);
+		}
+
+		for (frame = 0; frame < 2; frame++) {
+			test_plocks_frame = frame;
+			send_all_plocks_data(ls, 1, &plocks_data);
+
+			ns = ingest_receive(n, frame);
+
+			printf("%8d %6s %8d %10llu %12.2f %14.0f\n", n,
+			       frame ? "frame" : "data", sent.count,
+			       (unsigned long long)sent.bytes, ns / 1e6,
+			       n * 1e9 / ns);
+			free_sent();
+		}
+
+		test_ls_free(ls);
+	}
+
+	test_send = NULL;
+	test_plocks_frame = 0;
+}
+
+#define DROP_COUNT	10
+#define DROP_AGE	10000
+#define DROP_ROUNDS	50
+
+/* the drop_resources() before the lru: the newest resources first,
+   skipping any not idle for drop_resources_age */
+
+static void scan_drop(struct lockspace *ls)
+{
+	struct resource *r;
+	uint64_t now = monotime_ms();
+	int count = 0;
+
+	list_for_each_entry_reverse(r, &ls->plock_resources, list) {
+		if (count >= opt(drop_resources_count_ind))
+			break;
+		if (r->owner && r->owner != our_nodeid)
+			continue;
+		if (now - r->last_access < opt(drop_resources_age_ind))
+			continue;
+
+		if (list_empty(&r->locks) && list_empty(&r->waiters)) {
+			if (r->owner == our_nodeid) {
+				send_own(ls, r, 0);
+				set_owner(ls, r, 0);
+			} else if (r->owner == 0 && got_unown(r)) {
+				send_drop(ls, r);
+			}
+			count++;
+		}
+	}
+}
+
+/* ns per drop pass over n owned resources, DROP_COUNT of which have been
+   idle long enough, the oldest, as they are when resources are used and
+   then left alone in turn */
+
+static uint64_t drop_run(int n, int scan)
+{
+	struct resource **res;
+	struct lockspace *ls;
+	uint64_t begin, total = 0, now;
+	int i, round;
+
+	res = malloc(n * sizeof(*res));
+	if (!res) {
+		fprintf(stderr, "no memory\n");
+		exit(1);
+	}
+
+	ls = test_ls_new("drop");
+
+	for (i = 0; i < n; i++) {
+		res[i] = get_resource(ls, 4096 + (uint64_t)i);
+		set_owner(ls, res[i], our_nodeid);
+	}
+
+	for (round = 0; round < DROP_ROUNDS; round++) {
+		now = monotime_ms();
+		for (i = 0; i < DROP_COUNT; i++)
+			res[round * DROP_COUNT + i]->last_access =
+				now - DROP_AGE - 1;
+
+		begin = test_ns();
+		if (scan)
+			scan_drop(ls);
+		else
+			drop_resources(&ls->drop_timer);
+		total += test_ns() - begin;
+
+		for (i = 0; i < DROP_COUNT; i++) {
+			if (res[round * DROP_COUNT + i]->owner) {
+				fprintf(stderr, "resource not dropped\n");
+				exit(1);
+			}
+		}
+	}
+
+	test_ls_free(ls);
+	free(res);
+	return total / DROP_ROUNDS;
+}
+
+static void bench_drop(void)
+{
+	static const int counts[] = { 1000, 10000, 100000 };
+	uint64_t lru_ns, scan_ns;
+	int c;
+
+	printf("drop: %d of n owned resources idle for each pass\n",
+	       DROP_COUNT);
+	printf("%8s %12s %12s\n", "n", "lru ns", "scan ns");
+
+	dlm_options[plock_ownership_ind].use_int = 1;
+	dlm_options[drop_resources_count_ind].use_int = DROP_COUNT;
+	dlm_options[drop_resources_age_ind].use_int = DROP_AGE;
+	dlm_options[drop_resources_time_ind].use_int = 0;
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		lru_ns = drop_run(counts[c], 0);
+		scan_ns = drop_run(counts[c], 1);
+		printf("%8d %12llu %12llu\n", counts[c],
+		       (unsigned long long)lru_ns,
+		       (unsigned long long)scan_ns);
+	}
+
+	dlm_options[plock_ownership_ind].use_int = 0;
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} modes[] = {
+	{ "overlap", bench_overlap },
+	{ "waiters", bench_waiters },
+	{ "ingest", bench_ingest },
+	{ "drop", bench_drop },
+};
+
+#define MODES (int)(sizeof(modes) / sizeof(modes[0]))
+
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : "all";
+	int i, found = 0;
+
+	our_nodeid = 1;
+	dlm_options[enable_plock_ind].use_int = 1;
+	srandom(1);
+
+	for (i = 0; i < MODES; i++) {
+		if (strcmp(mode, "all") && strcmp(mode, modes[i].name))
+			continue;
+		modes[i].fn();
+		found = 1;
+	}
+
+	if (!found) {
+		fprintf(stderr, "usage: plock_bench [all");
+		for (i = 0; i < MODES; i++)
+			fprintf(stderr, "|%s", modes[i].name);
+		fprintf(stderr, "]\n");
+		return 1;
+	}
+	return test_errors ? 1 : 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Consistency checks of the plock paths, run in-process on the functions
+ * in plock.c.  Two lockspaces get the same random ops on one resource.
+ * One grants waiters with do_waiters(), looking only at the waiters that
+ * overlap the range an op released.  The other checks every waiter after
+ * every op with do_all_waiters(), as before do_waiters().  Closes go
+ * through the owner's locks and waiters with unlock_close() and
+ * clear_waiters() on one, and through every lock and waiter of the
+ * resource on the other.  A failed node is purged with purge_node() on
+ * one, and with purge_all() on the other.
+ *
+ * After each op the locks, waiters and results of the two must be the
+ * same, no waiter may be left that could be granted, and the plock_owner
+ * and plock_node indexes and the range trees of both must agree with the
+ * resource's lists.
+ *
+ * plock_check [seeds] [ops]
+ */
+
+#include "../plock.c"
+#include "plock_test.h"
+
+static const int nodes[] = { 1, 3, 4 };
+
+/* holds a lock that's never unlocked or purged, to keep the resource */
+#define NODE_ANCHOR 2
+
+#define NODES (int)(sizeof(nodes) / sizeof(nodes[0]))
+
+/* owners and span of the ranges, from a few owners fighting over a few
+   bytes to many owners spread over a larger file */
+
+static const struct {
+	int owners;
+	int span;
+} configs[] = {
+	{ 4, 10 },
+	{ 6, 100 },
+	{ 30, 1000 },
+};
+
+#define CONFIGS (int)(sizeof(configs) / sizeof(configs[0]))
+
+#define STATE_SIZE 65536
+
+struct side {
+	struct lockspace *ls;
+	struct resource *r;
+	int rescan;
+	char state[STATE_SIZE];
+	char results[STATE_SIZE];
+};
+
+static struct side fast, full;
+
+static void side_init(struct side *s, int rescan)
+{
+	s->ls = test_ls_new(rescan ? "full" : "fast");
+	s->rescan = rescan;
+	if (find_resource(s->ls, 1, 1, &s->r) ||
+	    add_lock(s->ls, s->r, NODE_ANCHOR, 0, 0, 1, 1ULL << 40, 1ULL << 40)) {
+		fprintf(stderr, "side_init failed\n");
+		exit(1);
+	}
+}
+
+static void side_free(struct side *s)
+{
+	test_ls_free(s->ls);
+}
+
+static void lock_op(struct side *s, struct dlm_plock_info *in)
+{
+	struct resource *r = s->r;
+	int releases = 0;
+	int rv;
+
+	if (is_conflict(r, in, 0)) {
+		if (!in->wait)
+			rv = -EAGAIN;
+		else {
+			rv = add_waiter(s->ls, r, in);
+			if (!rv)
+				rv = -EINPROGRESS;
+		}
+	} else {
+		releases = lock_releases(r, in);
+		rv = lock_internal(s->ls, r, in);
+	}
+
+	if (in->nodeid == our_nodeid && rv != -EINPROGRESS)
+		write_result(s->ls, in, rv);
+
+	if (s->rescan)
+		do_all_waiters(s->ls, r);
+	else if (releases)
+		do_waiters(s->ls, r, in->start, in->end);
+}
+
+static void unlock_op(struct side *s, struct dlm_plock_info *in)
+{
+	struct resource *r = s->r;
+	int rv;
+
+	rv = unlock_internal(s->ls, r, in);
+	if (in->nodeid == our_nodeid)
+		write_result(s->ls, in, rv);
+
+	if (s->rescan)
+		do_all_waiters(s->ls, r);
+	else
+		do_waiters(s->ls, r, in->start, in->end);
+}
+
+/* the locks and waiters of the owner on every part of the resource, as
+   do_unlock() did for a close before unlock_close() and clear_waiters() */
+
+static void close_op(struct side *s, struct dlm_plock_info *in)
+{
+	struct resource *r = s->r;
+	struct lock_waiter *w, *safe;
+
+	if (!s->rescan) {
+		unlock_close(s->ls, r, in);
+		clear_waiters(s->ls, r, in);
+		do_waiters(s->ls, r, in->start, in->end);
+		return;
+	}
+
+	unlock_internal(s->ls, r, in);
+
+	list_for_each_entry_safe(w, safe, &r->waiters, list) {
+		if (w->info.nodeid != in->nodeid || w->info.owner != in->owner)
+			continue;
+		dequeue_waiter(s->ls, r, w);
+		pool_free(s->ls, PLOCK_POOL_WAITER, w);
+	}
+
+	do_all_waiters(s->ls, r);
+}
+
+static int purge_op(struct side *s, int nodeid)
+{
+	if (s->rescan)
+		return purge_all(s->ls, nodeid, 0);
+	return purge_node(s->ls, nodeid);
+}
+
+/* the results written by the last op, in the order written */
+
+static void get_results(struct side *s)
+{
+	struct dlm_plock_info *in;
+	int i, len = 0;
+
+	s->results[0] = '\0';
+
+	for (i = 0; i < plock_results_count; i++) {
+		in = &plock_results[i];
+		len += snprintf(s->results + len, STATE_SIZE - len,
+				"%d/%llu %llu-%llu %d rv %d\n",
+				in->nodeid, (unsigned long long)in->owner,
+				(unsigned long long)in->start,
+				(unsigned long long)in->end, in->ex, in->rv);
+		if (len >= STATE_SIZE)
+			break;
+	}
+	plock_results_count = 0;
+}
+
+static void get_state(struct side *s)
+{
+	struct posix_lock *po;
+	struct lock_waiter *w;
+	struct rb_node *n;
+	int len = 0;
+
+	s->state[0] = '\0';
+
+	for (n = rb_first(&s->r->locks_root); n; n = rb_next(n)) {
+		po = rb_entry(n, struct posix_lock, rb_node);
+		len += snprintf(s->state + len, STATE_SIZE - len,
+				"lock %d/%llu %llu-%llu %d\n",
+				po->nodeid, (unsigned long long)po->owner,
+				(unsigned long long)po->start,
+				(unsigned long long)po->end, po->ex);
+		if (len >= STATE_SIZE)
+			return;
+	}
+
+	list_for_each_entry(w, &s->r->waiters, list) {
+		len += snprintf(s->state + len, STATE_SIZE - len,
+				"waiter %d/%llu %llu-%llu %d\n",
+				w->info.nodeid, (unsigned long long)w->info.owner,
+				(unsigned long long)w->info.start,
+				(unsigned long long)w->info.end, w->info.ex);
+		if (len >= STATE_SIZE)
+			return;
+	}
+}
+
+static uint64_t check_subtree(struct rb_node *n, uint64_t end,
+			      uint64_t (*last)(struct rb_node *))
+{
+	uint64_t max = end;
+
+	if (n->rb_left && last(n->rb_left) > max)
+		max = last(n->rb_left);
+	if (n->rb_right && last(n->rb_right) > max)
+		max = last(n->rb_right);
+	return max;
+}
+
+/* the plock_owner and plock_node lists, the owners tree and the range
+   trees must hold every lock and waiter on the resource, and nothing
+   else; returns an error string */
+
+static const char *check_index(struct side *s)
+{
+	struct lockspace *ls = s->ls;
+	struct resource *r = s->r;
+	struct plock_node *pn;
+	struct plock_owner *pown;
+	struct posix_lock *po;
+	struct lock_waiter *w;
+	struct rb_node *n;
+	int locks = 0, waiters = 0, tree_locks = 0, tree_waiters = 0;
+	int owner_locks = 0, owner_waiters = 0, owners = 0, tree_owners = 0;
+	int count;
+
+	list_for_each_entry(po, &r->locks, list) {
+		locks++;
+		if (po->r != r ||
+		    po->pown != find_plock_owner(ls, po->nodeid, po->owner))
+			return "lock not on its owner";
+	}
+
+	list_for_each_entry(w, &r->waiters, list) {
+		waiters++;
+		if (w->r != r ||
+		    w->pown != find_plock_owner(ls, w->info.nodeid,
+						w->info.owner))
+			return "waiter not on its owner";
+	}
+
+	for (n = rb_first(&r->locks_root); n; n = rb_next(n)) {
+		po = rb_entry(n, struct posix_lock, rb_node);
+		tree_locks++;
+		if (po->subtree_last != check_subtree(n, po->end,
+						      lock_subtree_last))
+			return "lock subtree_last";
+	}
+
+	for (n = rb_first(&r->waiters_root); n; n = rb_next(n)) {
+		w = rb_entry(n, struct lock_waiter, rb_node);
+		tree_waiters++;
+		if (w->subtree_last != check_subtree(n, w->info.end,
+						     waiter_subtree_last))
+			return "waiter subtree_last";
+	}
+
+	if (tree_locks != locks || tree_waiters != waiters)
+		return "range tree count";
+
+	list_for_each_entry(pn, &ls->plock_nodes, list) {
+		list_for_each_entry(pown, &pn->owners, node_list) {
+			owners++;
+			count = 0;
+
+			if (pown->node != pn ||
+			    find_plock_owner(ls, pn->nodeid, pown->owner) != pown)
+				return "owner not on its node";
+
+			list_for_each_entry(po, &pown->locks, owner_list) {
+				if (po->nodeid != pn->nodeid ||
+				    po->owner != pown->owner || po->pown != pown)
+					return "owner has another's lock";
+				count++;
+				owner_locks++;
+			}
+
+			list_for_each_entry(w, &pown->waiters, owner_list) {
+				if (w->info.nodeid != pn->nodeid ||
+				    w->info.owner != pown->owner ||
+				    w->pown != pown)
+					return "owner has another's waiter";
+				count++;
+				owner_waiters++;
+			}
+
+			if (!count || count != pown->count)
+				return "owner count";
+		}
+	}
+
+	for (n = rb_first(&ls->plock_owners_root); n; n = rb_next(n))
+		tree_owners++;
+
+	if (owner_locks != locks || owner_waiters != waiters ||
+	    tree_owners != owners)
+		return "owner lists count";
+
+	return NULL;
+}
+
+static int waiting(struct side *s, struct dlm_plock_info *in)
+{
+	struct lock_waiter *w;
+
+	list_for_each_entry(w, &s->r->waiters, list) {
+		if (w->info.nodeid == in->nodeid && w->info.owner == in->owner)
+			return 1;
+	}
+	return 0;
+}
+
+static struct lock_waiter *grantable(struct side *s)
+{
+	struct lock_waiter *w;
+
+	list_for_each_entry(w, &s->r->waiters, list) {
+		if (!is_conflict(s->r, &w->info, 0))
+			return w;
+	}
+	return NULL;
+}
+
+static const char *op_name(int op)
+{
+	if (!op)
+		return "purge";
+	if (op < 3)
+		return "close";
+	if (op < 9)
+		return "unlock";
+	return "lock";
+}
+
+static int run(int seed, int owners, int span, int ops)
+{
+	struct dlm_plock_info in, in2;
+	struct lock_waiter *w;
+	const char *err;
+	int i, op, purged, purged2;
+
+	srandom(seed);
+	side_init(&fast, 0);
+	side_init(&full, 1);
+
+	for (i = 0; i < ops; i++) {
+		op = random() % 40;
+
+		memset(&in, 0, sizeof(in));
+		in.number = 1;
+		in.nodeid = nodes[random() % NODES];
+		in.owner = random() % owners;
+		in.pid = in.owner;
+		in.start = random() % span;
+		in.end = in.start + random() % (span / 4 + 1);
+		in.ex = random() % 2;
+		in.wait = random() % 4 != 0;
+
+		if (!op) {
+			purged2 = purge_op(&full, in.nodeid);
+			get_results(&full);
+			purged = purge_op(&fast, in.nodeid);
+			get_results(&fast);
+
+			if (purged != purged2) {
+				printf("seed %d op %d purge %d: purge_node %d purge_all %d\n",
+				       seed, i, in.nodeid, purged, purged2);
+				return -1;
+			}
+			goto check;
+		}
+
+		/* a close can come while the process is waiting, it's
+		   for another process using the same file */
+		if (op < 3) {
+			in.start = 0;
+			if (random() % 2)
+				in.end = span;
+			in2 = in;
+			close_op(&full, &in2);
+			get_results(&full);
+			close_op(&fast, &in);
+			get_results(&fast);
+			goto check;
+		}
+
+		/* a process waiting for a lock can't do anything else */
+		if (waiting(&fast, &in))
+			continue;
+
+		in2 = in;
+
+		if (op < 9) {
+			unlock_op(&full, &in2);
+			get_results(&full);
+			unlock_op(&fast, &in);
+			get_results(&fast);
+		} else {
+			lock_op(&full, &in2);
+			get_results(&full);
+			lock_op(&fast, &in);
+			get_results(&fast);
+		}
+
+ check:
+		get_state(&fast);
+		get_state(&full);
+
+		if (strcmp(fast.state, full.state) ||
+		    strcmp(fast.results, full.results)) {
+			printf("seed %d op %d %s %d/%llu %llu-%llu %d differs\n",
+			       seed, i, op_name(op), in.nodeid,
+			       (unsigned long long)in.owner,
+			       (unsigned long long)in.start,
+			       (unsigned long long)in.end, in.ex);
+			printf("do_waiters:\n%s%s", fast.state, fast.results);
+			printf("do_all_waiters:\n%s%s", full.state, full.results);
+			return -1;
+		}
+
+		w = grantable(&fast);
+		if (w) {
+			printf("seed %d op %d %s: waiter %d/%llu %llu-%llu %d not granted\n",
+			       seed, i, op_name(op), w->info.nodeid,
+			       (unsigned long long)w->info.owner,
+			       (unsigned long long)w->info.start,
+			       (unsigned long long)w->info.end, w->info.ex);
+			printf("%s", fast.state);
+			return -1;
+		}
+
+		err = check_index(&fast);
+		if (!err)
+			err = check_index(&full);
+		if (err) {
+			printf("seed %d op %d %s: %s\n", seed, i, op_name(op), err);
+			return -1;
+		}
+	}
+
+	side_free(&fast);
+	side_free(&full);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int seeds = argc > 1 ? atoi(argv[1]) : 10;
+	int ops = argc > 2 ? atoi(argv[2]) : 20000;
+	int seed, c;
+
+	our_nodeid = 1;
+	plock_fd = -1;
+	test_quiet = 1;
+	dlm_options[enable_plock_ind].use_int = 1;
+
+	for (c = 0; c < CONFIGS; c++) {
+		for (seed = 1; seed <= seeds; seed++) {
+			if (run(seed, configs[c].owners, configs[c].span, ops) < 0)
+				return 1;
+		}
+		printf("owners %d span %d: %d seeds of %d ops ok\n",
+		       configs[c].owners, configs[c].span, seeds, ops);
+	}
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/* the parts of the daemon that plock.c uses, for the test programs */
+
+#define EXTERN
+#include "dlm_daemon.h"
+#include "plock_test.h"
+
+void (*test_send)(struct lockspace *ls, char *buf, int len);
+int test_plock_batch;
+int test_plocks_frame;
+int test_errors;
+int test_quiet;
+
+uint64_t test_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t monotime(void)
+{
+	return test_ns() / 1000000000;
+}
+
+uint64_t monotime_ms(void)
+{
+	return test_ns() / 1000000;
+}
+
+uint64_t monotime_us(void)
+{
+	return test_ns() / 1000;
+}
+
+void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
+{
+	va_list ap;
+
+	if ((level_in & 0xffff) != LOG_ERR)
+		return;
+
+	test_errors++;
+
+	if (test_quiet)
+		return;
+
+	fprintf(stderr, "%s ", name_in ? name_in : "-");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+void log_plock_trace(struct plock_trace *pt)
+{
+}
+
+/* no timers fire, they're only marked pending */
+
+void init_timer(struct dlm_timer *t, void (*fn)(struct dlm_timer *t),
+		void *data)
+{
+	memset(t, 0, sizeof(*t));
+	INIT_LIST_HEAD(&t->list);
+	t->fn = fn;
+	t->data = data;
+}
+
+int timer_pending(struct dlm_timer *t)
+{
+	return t->pending;
+}
+
+void mod_timer(struct dlm_timer *t, unsigned int ms)
+{
+	t->pending = 1;
+}
+
+void del_timer(struct dlm_timer *t)
+{
+	t->pending = 0;
+}
+
+const char *msg_name(int type)
+{
+	return "msg";
+}
+
+void dlm_send_message(struct lockspace *ls, char *buf, int len)
+{
+	if (test_send)
+		test_send(ls, buf, len);
+}
+
+int all_daemons_plock_batch(void)
+{
+	return test_plock_batch;
+}
+
+int all_daemons_plocks_frame(void)
+{
+	return test_plocks_frame;
+}
+
+void plocks_data_done(struct lockspace *ls, uint32_t plocks_data)
+{
+}
+
+void client_ignore(int ci, int fd)
+{
+}
+
+void client_back(int ci, int fd)
+{
+}
+
+struct lockspace *find_ls_id(uint32_t id)
+{
+	struct lockspace *ls;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (ls->global_id == id)
+			return ls;
+	}
+	return NULL;
+}
+
+void state_changed(void)
+{
+}
+
+/* as in create_ls() */
+
+struct lockspace *test_ls_new(const char *name)
+{
+	struct lockspace *ls;
+	int i;
+
+	if (!lockspaces.next)
+		INIT_LIST_HEAD(&lockspaces);
+
+	ls = calloc(1, sizeof(struct lockspace));
+	if (!ls) {
+		perror("calloc");
+		exit(1);
+	}
+	snprintf(ls->name, sizeof(ls->name), "%s", name);
+
+	INIT_LIST_HEAD(&ls->changes);
+	INIT_LIST_HEAD(&ls->node_history);
+	INIT_LIST_HEAD(&ls->saved_messages);
+	INIT_LIST_HEAD(&ls->plock_resources);
+	ls->plock_resources_root = RB_ROOT;
+	ls->plock_owners_root = RB_ROOT;
+	INIT_LIST_HEAD(&ls->plock_nodes);
+	INIT_LIST_HEAD(&ls->plock_lru);
+	INIT_LIST_HEAD(&ls->plock_ops);
+	for (i = 0; i < PLOCK_OPS_HASH; i++)
+		INIT_LIST_HEAD(&ls->plock_ops_hash[i]);
+	init_timer(&ls->drop_timer, drop_resources, ls);
+
+	list_add_tail(&ls->list, &lockspaces);
+	return ls;
+}
+
+void test_ls_free(struct lockspace *ls)
+{
+	clear_plocks_data(ls);
+	free_plock_pools(ls);
+	list_del(&ls->list);
+	free(ls);
+}
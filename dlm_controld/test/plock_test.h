@@ -0,0 +1,34 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __PLOCK_TEST_DOT_H__
+#define __PLOCK_TEST_DOT_H__
+
+/*
+ * The plock test programs include ../plock.c to call its static functions
+ * directly, without a cluster, and link plock_stubs.c in place of the rest
+ * of the daemon.
+ */
+
+/* messages plock.c sends go here, if set */
+extern void (*test_send)(struct lockspace *ls, char *buf, int len);
+
+/* returned by all_daemons_plock_batch() and all_daemons_plocks_frame() */
+extern int test_plock_batch;
+extern int test_plocks_frame;
+
+/* log_error and log_elock messages, which are also printed unless
+   test_quiet is set */
+extern int test_errors;
+extern int test_quiet;
+
+struct lockspace *test_ls_new(const char *name);
+void test_ls_free(struct lockspace *ls);
+uint64_t test_ns(void);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * Copyright 2004-2012 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include "dlm_daemon.h"
+#include <sys/timerfd.h>
+
+/*
+ * Hierarchical timer wheel for deferred daemon work.
+ *
+ * Time is counted in ticks of TIMER_TICK_MS on the monotonic clock.  The
+ * first level has a slot per tick for the next 256 ticks, the second level
+ * a slot per 256 ticks, and the third a slot per 16384 ticks.  When the
+ * first level wraps, the next slot of the level above is cascaded down and
+ * its timers are redistributed by their remaining time.  Adding, modifying
+ * and deleting a timer is O(1), and expiring timers only touches the slots
+ * that are due.
+ *
+ * A single timerfd, registered as a client in the main loop, is programmed
+ * for the next tick that has work: a non-empty first level slot, or the
+ * next cascade of a non-empty higher level slot.  With no timers pending
+ * the timerfd is disarmed, and the daemon doesn't wake up at all.
+ *
+ * Timer callbacks run from the main loop, the same as the other client
+ * workfns.
+ */
+
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TV2_SHIFT	TVR_BITS
+#define TV3_SHIFT	(TVR_BITS + TVN_BITS)
+#define MAX_TIMEOUT	((1ULL << (TVR_BITS + 2 * TVN_BITS)) - 1)
+
+static struct list_head tv1[TVR_SIZE];
+static struct list_head tv2[TVN_SIZE];
+static struct list_head tv3[TVN_SIZE];
+
+static uint64_t timer_ticks;	/* next tick to be processed */
+static uint32_t timer_count;	/* number of pending timers */
+static uint64_t timer_programmed; /* tick the timerfd is set for, 0 none */
+static int timer_fd = -1;
+
+static uint64_t now_ticks(void)
+{
+	return monotime_ms() / TIMER_TICK_MS;
+}
+
+static void internal_add_timer(struct dlm_timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t idx;
+	struct list_head *vec;
+
+	if (expires < timer_ticks)
+		expires = timer_ticks;
+
+	idx = expires - timer_ticks;
+
+	if (idx < TVR_SIZE) {
+		vec = &tv1[expires & TVR_MASK];
+	} else if (idx < (1ULL << TV3_SHIFT)) {
+		vec = &tv2[(expires >> TV2_SHIFT) & TVN_MASK];
+	} else {
+		/* beyond the wheel, it's moved along until it's in range */
+		if (idx > MAX_TIMEOUT)
+			expires = timer_ticks + MAX_TIMEOUT;
+		vec = &tv3[(expires >> TV3_SHIFT) & TVN_MASK];
+	}
+
+	list_add_tail(&t->list, vec);
+}
+
+static void cascade(struct list_head *vec)
+{
+	struct dlm_timer *t, *safe;
+	struct list_head work;
+
+	INIT_LIST_HEAD(&work);
+	list_splice_init(vec, &work);
+
+	list_for_each_entry_safe(t, safe, &work, list) {
+		list_del(&t->list);
+		internal_add_timer(t);
+	}
+}
+
+void init_timer(struct dlm_timer *t, void (*fn)(struct dlm_timer *t),
+		void *data)
+{
+	INIT_LIST_HEAD(&t->list);
+	t->expires = 0;
+	t->fn = fn;
+	t->data = data;
+	t->pending = 0;
+}
+
+int timer_pending(struct dlm_timer *t)
+{
+	return t->pending;
+}
+
+/* (re)arm the timer to expire ms from now */
+
+void mod_timer(struct dlm_timer *t, unsigned int ms)
+{
+	uint64_t now = monotime_ms();
+
+	if (t->pending)
+		list_del(&t->list);
+	else
+		timer_count++;
+
+	/* the wheel hasn't been run since it went idle */
+	if (timer_count == 1 && timer_ticks < now / TIMER_TICK_MS)
+		timer_ticks = now / TIMER_TICK_MS;
+
+	/* round up so a timer never expires early */
+	t->expires = (now + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	t->pending = 1;
+	internal_add_timer(t);
+}
+
+void del_timer(struct dlm_timer *t)
+{
+	if (!t->pending)
+		return;
+
+	list_del(&t->list);
+	INIT_LIST_HEAD(&t->list);
+	t->pending = 0;
+	timer_count--;
+}
+
+static void run_timers(void)
+{
+	struct list_head work;
+	struct dlm_timer *t;
+	uint64_t now = now_ticks();
+	int index;
+
+	INIT_LIST_HEAD(&work);
+
+	while (timer_count && timer_ticks <= now) {
+		index = timer_ticks & TVR_MASK;
+
+		if (!index) {
+			int i2 = (timer_ticks >> TV2_SHIFT) & TVN_MASK;
+
+			if (!i2)
+				cascade(&tv3[(timer_ticks >> TV3_SHIFT) & TVN_MASK]);
+			cascade(&tv2[i2]);
+		}
+
+		timer_ticks++;
+
+		list_splice_init(&tv1[index], &work);
+
+		/* a callback may add or delete any timer, including ones
+		   still on the work list, so take them one at a time */
+
+		while (!list_empty(&work)) {
+			t = list_first_entry(&work, struct dlm_timer, list);
+			list_del(&t->list);
+			INIT_LIST_HEAD(&t->list);
+			t->pending = 0;
+			timer_count--;
+			t->fn(t);
+		}
+	}
+
+	if (!timer_count)
+		timer_ticks = now + 1;
+}
+
+/* the next tick at which a slot of the given level is cascaded down */
+
+static uint64_t next_cascade(struct list_head *vec, int shift)
+{
+	uint64_t period = timer_ticks >> shift;
+	uint64_t tick, next = 0;
+	int d;
+
+	/* the slot of the current period has already been cascaded (unless
+	   we're at its first tick), so it's next cascaded a full turn later */
+
+	for (d = 0; d < TVN_SIZE; d++) {
+		if (list_empty(&vec[(period + d) & TVN_MASK]))
+			continue;
+		tick = (period + d) << shift;
+		if (tick < timer_ticks)
+			tick += (uint64_t)TVN_SIZE << shift;
+		if (!next || tick < next)
+			next = tick;
+		if (d)
+			break;
+	}
+	return next;
+}
+
+static uint64_t next_timer_tick(void)
+{
+	uint64_t next = 0, tick;
+	int i;
+
+	if (!timer_count)
+		return 0;
+
+	for (i = 0; i < TVR_SIZE; i++) {
+		if (!list_empty(&tv1[(timer_ticks + i) & TVR_MASK])) {
+			next = timer_ticks + i;
+			break;
+		}
+	}
+
+	/* timers in the higher levels may expire before the first one
+	   found above, but never before their slot is cascaded */
+
+	tick = next_cascade(tv2, TV2_SHIFT);
+	if (tick && (!next || tick < next))
+		next = tick;
+
+	tick = next_cascade(tv3, TV3_SHIFT);
+	if (tick && (!next || tick < next))
+		next = tick;
+
+	return next;
+}
+
+/* called before each main loop wait to program the timerfd */
+
+void update_timers(void)
+{
+	struct itimerspec its;
+	uint64_t next, ms;
+
+	if (timer_fd < 0)
+		return;
+
+	next = next_timer_tick();
+	if (next == timer_programmed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (next) {
+		ms = next * TIMER_TICK_MS;
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		log_error("timerfd_settime errno %d", errno);
+		return;
+	}
+	timer_programmed = next;
+}
+
+void process_timers(int ci)
+{
+	uint64_t expirations;
+	int rv;
+
+	rv = read(timer_fd, &expirations, sizeof(expirations));
+	if (rv < 0 && errno != EAGAIN)
+		log_error("timerfd read errno %d", errno);
+
+	timer_programmed = 0;
+	run_timers();
+}
+
+int setup_timers(void)
+{
+	int i;
+
+	for (i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&tv1[i]);
+	for (i = 0; i < TVN_SIZE; i++) {
+		INIT_LIST_HEAD(&tv2[i]);
+		INIT_LIST_HEAD(&tv3[i]);
+	}
+
+	timer_ticks = now_ticks();
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		log_error("timerfd_create errno %d", errno);
+		return -1;
+	}
+	return timer_fd;
+}
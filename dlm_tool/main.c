@@ -47,6 +47,7 @@
 #define OP_RUN_CANCEL			17
 #define OP_RUN_LIST			18
 #define OP_DUMP_RUN			19
+#define OP_PLOCKSTATS			20
 
 static char *prog_name;
 static char *lsname;
@@ -61,6 +62,7 @@ static int verbose;
 static int wide;
 static int wait_sec;
 static int summarize;
+static struct dlmc_plock_filter plock_filter;
 
 char run_command[DLMC_RUN_COMMAND_LEN];
 char run_uuid[DLMC_RUN_UUID_LEN];
@@ -197,7 +199,7 @@ static void print_usage(void)
 	printf("\n");
 	printf("Commands:\n");
 	printf("ls, status, dump, dump_config, fence_ack\n");
-	printf("log_plock, plocks\n");
+	printf("log_plock, plocks, plockstats\n");
 	printf("join, leave, lockdebug\n");
 	printf("run, run_start, run_check, run_cancel, run_list\n");
 	printf("\n");
@@ -217,6 +219,37 @@ static void print_usage(void)
 
 #define OPTION_STRING "MhVnm:e:f:vwsi:"
 
+/* plocks <name> [inode=<num>] [nodeid=<id>] [pid=<pid>] [waiters]
+   [max=<bytes>] [cursor=<num>:<line>] */
+
+static void decode_plock_filter(int argc, char **argv, int first)
+{
+	struct dlmc_plock_filter *f = &plock_filter;
+	unsigned long long cursor;
+	unsigned int line;
+	int i;
+
+	for (i = first; i < argc; i++) {
+		if (!strncmp(argv[i], "inode=", 6)) {
+			f->number = strtoull(argv[i] + 6, NULL, 0);
+		} else if (!strncmp(argv[i], "nodeid=", 7)) {
+			f->nodeid = atoi(argv[i] + 7);
+		} else if (!strncmp(argv[i], "pid=", 4)) {
+			f->pid = strtoul(argv[i] + 4, NULL, 0);
+		} else if (!strcmp(argv[i], "waiters")) {
+			f->flags |= DLMC_PLOCK_WAITERS;
+		} else if (!strncmp(argv[i], "max=", 4)) {
+			f->max_len = strtoul(argv[i] + 4, NULL, 0);
+		} else if (sscanf(argv[i], "cursor=%llu:%u", &cursor, &line) == 2) {
+			f->cursor = cursor;
+			f->cursor_line = line;
+		} else {
+			fprintf(stderr, "unknown plocks arg: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
 static void decode_arguments(int argc, char **argv)
 {
 	int cont = 1;
@@ -368,6 +401,10 @@ static void decode_arguments(int argc, char **argv)
 			operation = OP_PLOCKS;
 			opt_ind = optind + 1;
 			break;
+		} else if (!strcmp(argv[optind], "plockstats")) {
+			operation = OP_PLOCKSTATS;
+			opt_ind = optind + 1;
+			break;
 		} else if (!strncmp(argv[optind], "log_plock", 9) &&
 			   (strlen(argv[optind]) == 9)) {
 			operation = OP_LOG_PLOCK;
@@ -463,6 +500,11 @@ static void decode_arguments(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (operation == OP_PLOCKS) {
+		decode_plock_filter(argc, argv, opt_ind + 1);
+		return;
+	}
+
  copy_command:
 	for (i = opt_ind; i < argc; i++) {
 		if (strlen(run_command) + strlen(argv[i]) + 2 > DLMC_RUN_COMMAND_LEN) {
@@ -1300,6 +1342,20 @@ static void show_nodeids(int count, struct dlmc_node *nodes_in)
 	printf("\n");
 }
 
+/* ls makes a few queries per lockspace, so they share one connection
+   when dlm_controld supports it */
+
+static int query_fd = -1;
+
+static int lockspace_nodes(char *name, int type, int *count,
+			   struct dlmc_node *nodes_out)
+{
+	if (query_fd >= 0)
+		return dlmc_lockspace_nodes_fd(query_fd, name, type, MAX_NODES,
+					       count, nodes_out);
+	return dlmc_lockspace_nodes(name, type, MAX_NODES, count, nodes_out);
+}
+
 static void show_ls(struct dlmc_lockspace *ls)
 {
 	int rv, node_count;
@@ -1314,8 +1370,7 @@ static void show_ls(struct dlmc_lockspace *ls)
 
 	node_count = 0;
 	memset(&nodes, 0, sizeof(nodes));
-	rv = dlmc_lockspace_nodes(ls->name, DLMC_NODES_MEMBERS,
-				  MAX_NODES, &node_count, nodes);
+	rv = lockspace_nodes(ls->name, DLMC_NODES_MEMBERS, &node_count, nodes);
 	if (rv < 0) {
 		printf("members       error\n");
 		goto next;
@@ -1341,8 +1396,7 @@ static void show_ls(struct dlmc_lockspace *ls)
 
 	node_count = 0;
 	memset(&nodes, 0, sizeof(nodes));
-	rv = dlmc_lockspace_nodes(ls->name, DLMC_NODES_NEXT,
-				  MAX_NODES, &node_count, nodes);
+	rv = lockspace_nodes(ls->name, DLMC_NODES_NEXT, &node_count, nodes);
 	if (rv < 0) {
 		printf("new members   error\n");
 		return;
@@ -1390,9 +1444,16 @@ static void do_list(char *name)
 
 	memset(lss, 0, sizeof(lss));
 
-	if (name) {
+	query_fd = dlmc_open();
+
+	if (name && query_fd >= 0) {
+		ls_count = 1;
+		rv = dlmc_lockspace_info_fd(query_fd, name, lss);
+	} else if (name) {
 		ls_count = 1;
 		rv = dlmc_lockspace_info(name, lss);
+	} else if (query_fd >= 0) {
+		rv = dlmc_lockspaces_fd(query_fd, MAX_LS, &ls_count, lss);
 	} else {
 		rv = dlmc_lockspaces(MAX_LS, &ls_count, lss);
 	}
@@ -1414,8 +1475,8 @@ static void do_list(char *name)
 		node_count = 0;
 		memset(&nodes, 0, sizeof(nodes));
 
-		rv = dlmc_lockspace_nodes(ls->name, DLMC_NODES_ALL,
-					  MAX_NODES, &node_count, nodes);
+		rv = lockspace_nodes(ls->name, DLMC_NODES_ALL, &node_count,
+				     nodes);
 		if (rv < 0) {
 			printf("all nodes error %d %d\n", rv, errno);
 			goto next;
@@ -1428,6 +1489,9 @@ static void do_list(char *name)
  next:
 		printf("\n");
 	}
+
+	if (query_fd >= 0)
+		dlmc_close(query_fd);
 }
 
 static void do_deadlock_check(char *name)
@@ -1440,7 +1504,18 @@ static void do_fence_ack(char *name)
 	dlmc_fence_ack(name);
 }
 
-static void do_plocks(char *name)
+static int print_plocks(char *buf, int len, void *data)
+{
+	int *chunks = data;
+
+	(*chunks)++;
+	do_write(STDOUT_FILENO, buf, len);
+	return 0;
+}
+
+/* older daemons only have the single dump, limited to DLMC_DUMP_SIZE */
+
+static void do_plocks_dump(char *name)
 {
 	char buf[DLMC_DUMP_SIZE];
 
@@ -1453,6 +1528,107 @@ static void do_plocks(char *name)
 	do_write(STDOUT_FILENO, buf, strlen(buf));
 }
 
+static void do_plocks(char *name)
+{
+	struct dlmc_plock_filter empty;
+	int chunks = 0;
+	int rv;
+
+	memset(&empty, 0, sizeof(empty));
+
+	rv = dlmc_dump_plocks_stream(name, &plock_filter, print_plocks,
+				     &chunks);
+	if (rv == 1) {
+		fprintf(stderr, "more: cursor=%llu:%u\n",
+			(unsigned long long)plock_filter.cursor,
+			plock_filter.cursor_line);
+	} else if (rv < 0 && !chunks &&
+		   !memcmp(&plock_filter, &empty, sizeof(empty))) {
+		do_plocks_dump(name);
+	} else if (rv < 0) {
+		fprintf(stderr, "dlmc_dump_plocks_stream %s error %d\n",
+			name, rv);
+	}
+}
+
+/* the largest value counted in histogram bucket b, see libdlmcontrol.h */
+
+static uint64_t hist_bucket_max(int b)
+{
+	int e;
+
+	if (b < 4)
+		return b;
+	e = b / 4 + 1;
+	return (1ULL << e) + ((uint64_t)(b % 4 + 1) << (e - 2)) - 1;
+}
+
+static uint64_t hist_percentile(struct dlmc_plock_hist *h, int pct)
+{
+	uint64_t want, sum = 0;
+	int b;
+
+	want = (h->count * pct + 99) / 100;
+
+	for (b = 0; b < DLMC_PLOCK_HIST_BUCKETS; b++) {
+		sum += h->buckets[b];
+		if (sum >= want)
+			break;
+	}
+	if (b == DLMC_PLOCK_HIST_BUCKETS - 1)
+		return h->max;
+	return hist_bucket_max(b) < h->max ? hist_bucket_max(b) : h->max;
+}
+
+static void print_hist(const char *name, const char *path,
+		       struct dlmc_plock_hist *h, uint64_t seconds)
+{
+	if (!h->count)
+		return;
+
+	printf("%-7s %-8s %10llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+	       name, path,
+	       (unsigned long long)h->count,
+	       (unsigned long long)(seconds ? h->count / seconds : h->count),
+	       (unsigned long long)(h->total / h->count),
+	       (unsigned long long)hist_percentile(h, 50),
+	       (unsigned long long)hist_percentile(h, 90),
+	       (unsigned long long)hist_percentile(h, 99),
+	       (unsigned long long)h->max);
+}
+
+static void do_plockstats(char *name)
+{
+	struct dlmc_plock_stats st;
+	const char *op_names[DLMC_PLOCK_OPS] = { "lock", "unlock", "get", "wait" };
+	const char *path_names[DLMC_PLOCK_PATHS] = { "local", "owner", "cluster" };
+	int op, path, rv;
+
+	memset(&st, 0, sizeof(st));
+
+	rv = dlmc_plock_stats(name, &st);
+	if (rv < 0) {
+		fprintf(stderr, "dlmc_plock_stats %s error %d\n", name, rv);
+		return;
+	}
+
+	printf("%llu seconds, %llu ops not timed, times in usec\n",
+	       (unsigned long long)st.seconds,
+	       (unsigned long long)st.unmatched);
+	printf("%-7s %-8s %10s %8s %8s %8s %8s %8s %8s\n",
+	       "op", "path", "count", "per_sec", "avg", "p50", "p90", "p99",
+	       "max");
+
+	for (op = 0; op < DLMC_PLOCK_OPS; op++) {
+		for (path = 0; path < DLMC_PLOCK_PATHS; path++)
+			print_hist(op_names[op], path_names[path],
+				   &st.ops[op][path], st.seconds);
+	}
+
+	print_hist("waiter", "queued", &st.waiters, st.seconds);
+	print_hist("read", "delayed", &st.rate_delays, st.seconds);
+}
+
 static void do_dump(int op)
 {
 	char buf[DLMC_DUMP_SIZE];
@@ -1578,6 +1754,10 @@ int main(int argc, char **argv)
 		do_plocks(lsname);
 		break;
 
+	case OP_PLOCKSTATS:
+		do_plockstats(lsname);
+		break;
+
 	case OP_DEADLOCK_CHECK:
 		do_deadlock_check(lsname);
 		break;
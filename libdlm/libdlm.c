@@ -14,16 +14,20 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <linux/major.h>
+#include <linux/futex.h>
 #include <sys/sysmacros.h>
 #ifdef HAVE_SELINUX
 #include <selinux/selinux.h>
@@ -96,8 +100,45 @@ struct dlm_ls_info {
 #else
     int tid;
 #endif
+    struct dlm_cq *cq;
+    struct ast_pool *pool;
 };
 
+/*
+ * Completion queue
+ *
+ * With dlm_ls_cq_init(), the asts of a lockspace are saved as
+ * dlm_completion records instead of calling astaddr/bastaddr, and the
+ * application takes them with dlm_ls_cq_poll().  Asts read from the device
+ * by anything other than dlm_ls_cq_poll() (the recv thread, a sync lock
+ * call, dlm_ls_dispatch_many) are kept in the ring, which grows when full
+ * so none are lost, and the eventfd is signalled when the ring goes from
+ * empty to not empty.  It's cleared when dlm_ls_cq_poll() empties it.
+ * The library's own sync asts are still called directly.  dlm_dispatch()
+ * only has an fd, and finds the ring only for the default lockspace's.
+ */
+
+#define CQ_MIN_ENTRIES		64
+
+struct dlm_cq {
+#ifdef _REENTRANT
+    pthread_mutex_t mutex;
+#endif
+    struct dlm_completion *ring;
+    unsigned int size;		/* power of 2 */
+    unsigned int head;		/* next to take */
+    unsigned int tail;		/* next to fill */
+    int efd;
+};
+
+#ifdef _REENTRANT
+#define cq_lock(cq)	pthread_mutex_lock(&(cq)->mutex)
+#define cq_unlock(cq)	pthread_mutex_unlock(&(cq)->mutex)
+#else
+#define cq_lock(cq)	do { } while (0)
+#define cq_unlock(cq)	do { } while (0)
+#endif
+
 /*
  * The default lockspace.
  * I've resisted putting locking around this as the user should be
@@ -112,6 +153,10 @@ static int kernel_version_detected = 0;
 
 
 static int release_lockspace(uint32_t minor, uint32_t flags);
+static void free_cq(struct dlm_cq *cq);
+#ifdef _REENTRANT
+static void free_pool(struct ast_pool *pool);
+#endif
 
 
 static void ls_dev_name(const char *lsname, char *devname, int devlen)
@@ -124,21 +169,72 @@ static void dummy_ast_routine(void *arg)
 }
 
 #ifdef _REENTRANT
-/* Used for the synchronous and "simplified, synchronous" API routines */
+/*
+ * Used for the synchronous and "simplified, synchronous" API routines.
+ *
+ * A thread waits for one sync op at a time, so each has its own wait
+ * object that's reused for every op.  The AST routine sets state from
+ * LW_WAITING to LW_DONE, and only makes the futex wake call if the waiter
+ * had gone to sleep (LW_SLEEPING).  With dlm_set_sync_spin(), the waiter
+ * checks state that many times before sleeping, which saves both futex
+ * calls when ASTs come back quickly.
+ */
+
+#define LW_WAITING	0
+#define LW_DONE		1
+#define LW_SLEEPING	2
+
 struct lock_wait
 {
-    pthread_cond_t  cond;
-    pthread_mutex_t mutex;
+    uint32_t state;
     struct dlm_lksb lksb;
 };
 
+static __thread struct lock_wait thread_lock_wait;
+static unsigned int sync_spin;
+
+void dlm_set_sync_spin(unsigned int spins)
+{
+    sync_spin = spins;
+}
+
+static struct lock_wait *get_lock_wait(void)
+{
+    struct lock_wait *lwait = &thread_lock_wait;
+
+    __atomic_store_n(&lwait->state, LW_WAITING, __ATOMIC_RELAXED);
+    return lwait;
+}
+
+static void wait_lock_wait(struct lock_wait *lwait)
+{
+    uint32_t state;
+    unsigned int i;
+
+    for (i = 0; i < sync_spin; i++)
+    {
+	if (__atomic_load_n(&lwait->state, __ATOMIC_ACQUIRE) == LW_DONE)
+	    return;
+    }
+
+    state = LW_WAITING;
+    if (!__atomic_compare_exchange_n(&lwait->state, &state, LW_SLEEPING, 0,
+				     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	return; /* LW_DONE */
+
+    while (__atomic_load_n(&lwait->state, __ATOMIC_ACQUIRE) == LW_SLEEPING)
+	syscall(SYS_futex, &lwait->state, FUTEX_WAIT_PRIVATE, LW_SLEEPING,
+		NULL, NULL, 0);
+}
+
 static void sync_ast_routine(void *arg)
 {
     struct lock_wait *lwait = arg;
 
-    pthread_mutex_lock(&lwait->mutex);
-    pthread_cond_signal(&lwait->cond);
-    pthread_mutex_unlock(&lwait->mutex);
+    if (__atomic_exchange_n(&lwait->state, LW_DONE, __ATOMIC_RELEASE) ==
+	LW_SLEEPING)
+	syscall(SYS_futex, &lwait->state, FUTEX_WAKE_PRIVATE, 1,
+		NULL, NULL, 0);
 }
 
 /* lock_resource & unlock_resource
@@ -148,7 +244,7 @@ static void sync_ast_routine(void *arg)
 int lock_resource(const char *resource, int mode, int flags, int *lockid)
 {
     int status;
-    struct lock_wait lwait;
+    struct lock_wait *lwait;
 
     if (default_ls == NULL)
     {
@@ -164,35 +260,32 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 	return -1;
     }
 
+    lwait = get_lock_wait();
+
     /* Conversions need the lockid in the LKSB */
     if (flags & LKF_CONVERT)
-	lwait.lksb.sb_lkid = *lockid;
-
-    pthread_cond_init(&lwait.cond, NULL);
-    pthread_mutex_init(&lwait.mutex, NULL);
-    pthread_mutex_lock(&lwait.mutex);
+	lwait->lksb.sb_lkid = *lockid;
 
     status = dlm_lock(mode,
-		      &lwait.lksb,
+		      &lwait->lksb,
 		      flags,
 		      resource,
 		      strlen(resource),
 		      0,
 		      sync_ast_routine,
-		      &lwait,
+		      lwait,
 		      NULL,
 		      NULL);
     if (status)
 	return status;
 
     /* Wait for it to complete */
-    pthread_cond_wait(&lwait.cond, &lwait.mutex);
-    pthread_mutex_unlock(&lwait.mutex);
+    wait_lock_wait(lwait);
 
-    *lockid = lwait.lksb.sb_lkid;
+    *lockid = lwait->lksb.sb_lkid;
 
-    errno = lwait.lksb.sb_status;
-    if (lwait.lksb.sb_status)
+    errno = lwait->lksb.sb_status;
+    if (lwait->lksb.sb_status)
 	return -1;
     else
 	return 0;
@@ -202,7 +295,7 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 int unlock_resource(int lockid)
 {
     int status;
-    struct lock_wait lwait;
+    struct lock_wait *lwait;
 
     if (default_ls == NULL)
     {
@@ -210,21 +303,18 @@ int unlock_resource(int lockid)
 	return -1;
     }
 
-    pthread_cond_init(&lwait.cond, NULL);
-    pthread_mutex_init(&lwait.mutex, NULL);
-    pthread_mutex_lock(&lwait.mutex);
+    lwait = get_lock_wait();
 
-    status = dlm_unlock(lockid, 0, &lwait.lksb, &lwait);
+    status = dlm_unlock(lockid, 0, &lwait->lksb, lwait);
 
     if (status)
 	return status;
 
     /* Wait for it to complete */
-    pthread_cond_wait(&lwait.cond, &lwait.mutex);
-    pthread_mutex_unlock(&lwait.mutex);
+    wait_lock_wait(lwait);
 
-    errno = lwait.lksb.sb_status;
-    if (lwait.lksb.sb_status != DLM_EUNLOCK)
+    errno = lwait->lksb.sb_status;
+    if (lwait->lksb.sb_status != DLM_EUNLOCK)
 	return -1;
     else
 	return 0;
@@ -246,6 +336,8 @@ static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
     }
     if (!status)
     {
+	free_pool(lsinfo->pool);
+	free_cq(lsinfo->cq);
 	free(lsinfo);
 	close(fd);
     }
@@ -272,6 +364,7 @@ int dlm_pthread_cleanup(void)
 static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
 {
     close(lsinfo->fd);
+    free_cq(lsinfo->cq);
     free(lsinfo);
     return 0;
 }
@@ -529,17 +622,10 @@ static int do_dlm_dispatch_v5(int fd)
 	return 0;
 }
 
-static int do_dlm_dispatch_v6(int fd)
-{
-	char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
-	struct dlm_lock_result *result = (struct dlm_lock_result *)resultbuf;
-	int status;
-	void (*astaddr)(void *astarg);
-
-	status = read(fd, result, sizeof(resultbuf));
-	if (status <= 0)
-		return -1;
+/* updates the lksb an ast is for, then reads one and does that */
 
+static void apply_ast_v6(struct dlm_lock_result *result)
+{
 	/* Copy lksb to user's buffer - except the LVB ptr */
 	memcpy(result->user_lksb, &result->lksb,
 	       sizeof(struct dlm_lksb) - sizeof(char*));
@@ -550,21 +636,131 @@ static int do_dlm_dispatch_v6(int fd)
 		       (char *)result + result->lvb_offset, DLM_LVB_LEN);
 
 	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+}
 
-	if (result->user_astaddr) {
-		astaddr = result->user_astaddr;
-		astaddr(result->user_astparam);
+static struct dlm_lock_result *read_ast_v6(int fd, char *resultbuf, int len)
+{
+	struct dlm_lock_result *result = (struct dlm_lock_result *)resultbuf;
+	int status;
+
+	status = read(fd, result, len);
+	if (status <= 0)
+		return NULL;
+
+	apply_ast_v6(result);
+	return result;
+}
+
+#ifdef _REENTRANT
+#define internal_ast(addr) \
+	((addr) == dummy_ast_routine || (addr) == sync_ast_routine)
+#else
+#define internal_ast(addr) ((addr) == dummy_ast_routine)
+#endif
+
+static void fill_completion(struct dlm_completion *c,
+			    struct dlm_lock_result *result)
+{
+	c->astarg = result->user_astparam;
+	c->lksb = result->user_lksb;
+	c->status = result->user_lksb->sb_status;
+	c->lkid = result->user_lksb->sb_lkid;
+	c->type = result->bast_mode ? DLM_CQ_BAST : DLM_CQ_AST;
+	c->bast_mode = result->bast_mode;
+	c->sb_flags = result->user_lksb->sb_flags;
+	c->pad = 0;
+}
+
+static int cq_grow(struct dlm_cq *cq)
+{
+	struct dlm_completion *ring;
+	unsigned int i, count = cq->tail - cq->head;
+
+	ring = malloc(cq->size * 2 * sizeof(struct dlm_completion));
+	if (!ring)
+		return -1;
+
+	for (i = 0; i < count; i++)
+		ring[i] = cq->ring[(cq->head + i) & (cq->size - 1)];
+
+	free(cq->ring);
+	cq->ring = ring;
+	cq->size *= 2;
+	cq->head = 0;
+	cq->tail = count;
+	return 0;
+}
+
+static void cq_post(struct dlm_cq *cq, struct dlm_lock_result *result)
+{
+	int empty;
+
+	cq_lock(cq);
+
+	/* out of memory, the record is lost but the lksb is up to date */
+	if (cq->tail - cq->head == cq->size && cq_grow(cq) < 0) {
+		cq_unlock(cq);
+		return;
+	}
+
+	empty = (cq->tail == cq->head);
+	fill_completion(&cq->ring[cq->tail & (cq->size - 1)], result);
+	cq->tail++;
+
+	if (empty)
+		eventfd_write(cq->efd, 1);
+
+	cq_unlock(cq);
+}
+
+static int cq_take(struct dlm_cq *cq, struct dlm_completion *recs, int max)
+{
+	eventfd_t val;
+	int n = 0;
+
+	cq_lock(cq);
+
+	while (n < max && cq->head != cq->tail) {
+		recs[n++] = cq->ring[cq->head & (cq->size - 1)];
+		cq->head++;
 	}
 
+	if (n && cq->head == cq->tail)
+		eventfd_read(cq->efd, &val);
+
+	cq_unlock(cq);
+	return n;
+}
+
+static int do_dlm_dispatch_v6(int fd, struct dlm_cq *cq)
+{
+	char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
+	struct dlm_lock_result *result;
+	void (*astaddr)(void *astarg);
+
+	result = read_ast_v6(fd, resultbuf, sizeof(resultbuf));
+	if (!result)
+		return -1;
+
+	astaddr = result->user_astaddr;
+
+	if (cq && !internal_ast(astaddr)) {
+		cq_post(cq, result);
+		return 0;
+	}
+
+	if (astaddr)
+		astaddr(result->user_astparam);
+
 	return 0;
 }
 
-static int do_dlm_dispatch(int fd)
+static int do_dlm_dispatch(int fd, struct dlm_cq *cq)
 {
 	if (kernel_version.version[0] == 5)
 		return do_dlm_dispatch_v5(fd);
 	else
-		return do_dlm_dispatch_v6(fd);
+		return do_dlm_dispatch_v6(fd, cq);
 }
 
 
@@ -581,7 +777,7 @@ static int do_dlm_dispatch(int fd)
 static int sync_write_v5(struct dlm_ls_info *lsinfo,
 			 struct dlm_write_request_v5 *req, int len)
 {
-	struct lock_wait lwait;
+	struct lock_wait *lwait;
 	int status;
 
 	if (pthread_self() == lsinfo->tid) {
@@ -597,19 +793,16 @@ static int sync_write_v5(struct dlm_ls_info *lsinfo,
 			do_dlm_dispatch_v5(lsinfo->fd);
 		}
 	} else {
-		pthread_cond_init(&lwait.cond, NULL);
-		pthread_mutex_init(&lwait.mutex, NULL);
-		pthread_mutex_lock(&lwait.mutex);
+		lwait = get_lock_wait();
 
 		req->i.lock.castaddr  = sync_ast_routine;
-		req->i.lock.castparam = &lwait;
+		req->i.lock.castparam = lwait;
 
 		status = write(lsinfo->fd, req, len);
 		if (status < 0)
 			return -1;
 
-		pthread_cond_wait(&lwait.cond, &lwait.mutex);
-		pthread_mutex_unlock(&lwait.mutex);
+		wait_lock_wait(lwait);
 	}
 
 	return status; /* lock status is in the lksb */
@@ -618,7 +811,7 @@ static int sync_write_v5(struct dlm_ls_info *lsinfo,
 static int sync_write_v6(struct dlm_ls_info *lsinfo,
 			 struct dlm_write_request *req, int len)
 {
-	struct lock_wait lwait;
+	struct lock_wait *lwait;
 	int status;
 
 	if (pthread_self() == lsinfo->tid) {
@@ -631,22 +824,19 @@ static int sync_write_v6(struct dlm_ls_info *lsinfo,
 			return -1;
 
 		while (req->i.lock.lksb->sb_status == EINPROG) {
-			do_dlm_dispatch_v6(lsinfo->fd);
+			do_dlm_dispatch_v6(lsinfo->fd, lsinfo->cq);
 		}
 	} else {
-		pthread_cond_init(&lwait.cond, NULL);
-		pthread_mutex_init(&lwait.mutex, NULL);
-		pthread_mutex_lock(&lwait.mutex);
+		lwait = get_lock_wait();
 
 		req->i.lock.castaddr  = sync_ast_routine;
-		req->i.lock.castparam = &lwait;
+		req->i.lock.castparam = lwait;
 
 		status = write(lsinfo->fd, req, len);
 		if (status < 0)
 			return -1;
 
-		pthread_cond_wait(&lwait.cond, &lwait.mutex);
-		pthread_mutex_unlock(&lwait.mutex);
+		wait_lock_wait(lwait);
 	}
 
 	return status; /* lock status is in the lksb */
@@ -689,7 +879,7 @@ static int sync_write_v6(struct dlm_ls_info *lsinfo,
 		return -1;
 
 	while (req->i.lock.lksb->sb_status == EINPROG) {
-		do_dlm_dispatch_v6(lsinfo->fd);
+		do_dlm_dispatch_v6(lsinfo->fd, lsinfo->cq);
 	}
 
 	errno = req->i.lock.lksb->sb_status;
@@ -772,25 +962,21 @@ static int ls_lock_v5(dlm_lshandle_t ls,
 	return 0;
 }
 
-static int ls_lock_v6(dlm_lshandle_t ls,
-		uint32_t mode,
-		struct dlm_lksb *lksb,
-		uint32_t flags,
-		const void *name,
-		unsigned int namelen,
-		uint32_t parent,
-		void (*astaddr) (void *astarg),
-		void *astarg,
-		void (*bastaddr) (void *astarg),
-		uint64_t *xid,
-		uint64_t *timeout)
+/* fills in a lock request, returns its length or -1 */
+
+static int init_lock_v6(struct dlm_write_request *req,
+			uint32_t mode,
+			struct dlm_lksb *lksb,
+			uint32_t flags,
+			const void *name,
+			unsigned int namelen,
+			uint32_t parent,
+			void (*astaddr) (void *astarg),
+			void *astarg,
+			void (*bastaddr) (void *astarg),
+			uint64_t *xid,
+			uint64_t *timeout)
 {
-	char parambuf[sizeof(struct dlm_write_request) + DLM_RESNAME_MAXLEN];
-	struct dlm_write_request *req = (struct dlm_write_request *)parambuf;
-	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
-	int status;
-	int len;
-
 	memset(req, 0, sizeof(*req));
 	set_version_v6(req);
 
@@ -812,6 +998,7 @@ static int ls_lock_v6(dlm_lshandle_t ls,
 
 	if (flags & LKF_CONVERT) {
 		req->i.lock.namelen = 0;
+		namelen = 0;
 	} else {
 		if (namelen > DLM_RESNAME_MAXLEN) {
 			errno = EINVAL;
@@ -825,7 +1012,33 @@ static int ls_lock_v6(dlm_lshandle_t ls,
 		memcpy(req->i.lock.lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
 	}
 
-	len = sizeof(struct dlm_write_request) + namelen;
+	return sizeof(struct dlm_write_request) + namelen;
+}
+
+static int ls_lock_v6(dlm_lshandle_t ls,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen,
+		uint32_t parent,
+		void (*astaddr) (void *astarg),
+		void *astarg,
+		void (*bastaddr) (void *astarg),
+		uint64_t *xid,
+		uint64_t *timeout)
+{
+	char parambuf[sizeof(struct dlm_write_request) + DLM_RESNAME_MAXLEN];
+	struct dlm_write_request *req = (struct dlm_write_request *)parambuf;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	int status;
+	int len;
+
+	len = init_lock_v6(req, mode, lksb, flags, name, namelen, parent,
+			   astaddr, astarg, bastaddr, xid, timeout);
+	if (len < 0)
+		return -1;
+
 	lksb->sb_status = EINPROG;
 
 	if (flags & LKF_WAIT)
@@ -1006,20 +1219,26 @@ static int ls_unlock_v5(struct dlm_ls_info *lsinfo, uint32_t lkid,
 		return write(lsinfo->fd, &req, sizeof(req));
 }
 
+static void init_unlock_v6(struct dlm_write_request *req, uint32_t lkid,
+			   uint32_t flags, struct dlm_lksb *lksb, void *astarg)
+{
+	set_version_v6(req);
+	req->cmd = DLM_USER_UNLOCK;
+	req->i.lock.lkid = lkid;
+	req->i.lock.flags = (flags & ~LKF_WAIT);
+	req->i.lock.lksb  = lksb;
+	req->i.lock.namelen = 0;
+	req->i.lock.castparam = astarg;
+	/* DLM_USER_UNLOCK will default to existing completion AST */
+	req->i.lock.castaddr = 0;
+}
+
 static int ls_unlock_v6(struct dlm_ls_info *lsinfo, uint32_t lkid,
 			uint32_t flags, struct dlm_lksb *lksb, void *astarg)
 {
 	struct dlm_write_request req;
 
-	set_version_v6(&req);
-	req.cmd = DLM_USER_UNLOCK;
-	req.i.lock.lkid = lkid;
-	req.i.lock.flags = (flags & ~LKF_WAIT);
-	req.i.lock.lksb  = lksb;
-	req.i.lock.namelen = 0;
-	req.i.lock.castparam = astarg;
-	/* DLM_USER_UNLOCK will default to existing completion AST */
-	req.i.lock.castaddr = 0;
+	init_unlock_v6(&req, lkid, flags, lksb, astarg);
 	lksb->sb_status = EINPROG;
 
 	if (flags & LKF_WAIT)
@@ -1071,6 +1290,128 @@ int dlm_unlock(uint32_t lkid, uint32_t flags, struct dlm_lksb *lksb,
 	return dlm_ls_unlock(default_ls, lkid, flags, lksb, astarg);
 }
 
+/*
+ * Batches
+ * Submit many async requests or unlocks in one call
+ *
+ * The lockspace device takes one request per write, and returns the lock
+ * id rather than the length written, so a writev of several requests would
+ * stop after the first.  The entries are written one at a time from a
+ * single request buffer, and the result of each write is set in its
+ * status, so one failed entry doesn't stop the rest of the batch.
+ */
+
+/* returns 0 or the errno of the entry */
+
+static int lock_batch_one(struct dlm_ls_info *lsinfo,
+			  struct dlm_write_request *req,
+			  struct dlm_lock_request *r)
+{
+	int status;
+	int len;
+
+	/* waiting for each one would defeat the batch */
+	if (r->flags & LKF_WAIT)
+		return EINVAL;
+
+	if (r->flags & LKF_VALBLK && !r->lksb->sb_lvbptr)
+		return EINVAL;
+
+	len = init_lock_v6(req, r->mode, r->lksb, r->flags, r->name,
+			   r->namelen, r->parent, r->astaddr, r->astarg,
+			   r->bastaddr, r->xid ? &r->xid : NULL,
+			   r->timeout ? &r->timeout : NULL);
+	if (len < 0)
+		return errno;
+
+	r->lksb->sb_status = EINPROG;
+
+	status = write(lsinfo->fd, req, len);
+	if (status < 0)
+		return errno;
+
+	if (status > 0)
+		r->lksb->sb_lkid = status;
+	return 0;
+}
+
+int dlm_ls_lock_batch(dlm_lshandle_t ls, struct dlm_lock_request *reqs,
+		      int count)
+{
+	char parambuf[sizeof(struct dlm_write_request) + DLM_RESNAME_MAXLEN];
+	struct dlm_write_request *req = (struct dlm_write_request *)parambuf;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	int i, error = 0;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (kernel_version.version[0] < 6) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		reqs[i].status = lock_batch_one(lsinfo, req, &reqs[i]);
+		if (reqs[i].status && !error)
+			error = reqs[i].status;
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int dlm_ls_unlock_batch(dlm_lshandle_t ls, struct dlm_unlock_request *reqs,
+			int count)
+{
+	struct dlm_write_request req;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct dlm_unlock_request *r;
+	int i, error = 0;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (kernel_version.version[0] < 6) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+
+	for (i = 0; i < count; i++) {
+		r = &reqs[i];
+		r->status = 0;
+
+		if (!r->lkid || (r->flags & LKF_WAIT)) {
+			r->status = EINVAL;
+		} else {
+			init_unlock_v6(&req, r->lkid, r->flags, r->lksb,
+				       r->astarg);
+			r->lksb->sb_status = EINPROG;
+
+			if (write(lsinfo->fd, &req, sizeof(req)) < 0)
+				r->status = errno;
+		}
+
+		if (r->status && !error)
+			error = r->status;
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
 int dlm_ls_deadlock_cancel(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags)
 {
 	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
@@ -1153,24 +1494,199 @@ int dlm_get_fd(void)
     }
 }
 
-int dlm_dispatch(int fd)
+/* dlm_ls_cq_poll() reads asts straight into the caller's records, returns
+   1 when rec was filled, 0 when an ast was called or queued */
+
+static int dispatch_one(int fd, struct dlm_cq *cq, struct dlm_completion *rec)
 {
-    int status;
-    int fdflags;
+	char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
+	struct dlm_lock_result *result;
+	void (*astaddr)(void *astarg);
 
-    fdflags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL,  fdflags | O_NONBLOCK);
-    do
-    {
-	status = do_dlm_dispatch(fd);
-    } while (status == 0);
+	if (!rec)
+		return do_dlm_dispatch(fd, cq);
+
+	result = read_ast_v6(fd, resultbuf, sizeof(resultbuf));
+	if (!result)
+		return -1;
+
+	astaddr = result->user_astaddr;
+
+	if (internal_ast(astaddr)) {
+		astaddr(result->user_astparam);
+		return 0;
+	}
+
+	fill_completion(rec, result);
+	return 1;
+}
+
+/*
+ * Each read from the device returns one ast, so draining them takes a read
+ * each.  On a non-blocking fd the reads go on until one fails with EAGAIN.
+ * On a blocking fd, a poll() that doesn't wait says whether there's another
+ * one, so the fd flags, which other threads may depend on, are never
+ * changed.  A read can still block if something else reads the device
+ * between the poll and the read, so callers must serialise the calls on a
+ * lockspace, and can't make them while it has a recv thread.  A budget of
+ * 0 drains everything.
+ */
+
+static int ast_ready(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int rv;
+
+	do {
+		rv = poll(&pfd, 1, 0);
+	} while (rv < 0 && errno == EINTR);
+
+	return rv;
+}
+
+static int dispatch_many(int fd, struct dlm_cq *cq, int budget,
+			 struct dlm_completion *recs)
+{
+	int count = 0, status, nonblock;
 
-    /* EAGAIN is not an error */
-    if (status < 0 && errno == EAGAIN)
+	status = fcntl(fd, F_GETFL);
+	if (status < 0)
+		return -1;
+	nonblock = status & O_NONBLOCK;
 	status = 0;
 
-    fcntl(fd, F_SETFL, fdflags);
-    return status;
+	while (!budget || count < budget) {
+		if (!nonblock) {
+			status = ast_ready(fd);
+			if (status <= 0)
+				break;
+		}
+		status = dispatch_one(fd, cq, recs ? &recs[count] : NULL);
+		if (status < 0)
+			break;
+		if (!recs || status)
+			count++;
+	}
+
+	/* EAGAIN is not an error, and others will be seen again next time
+	   if asts were delivered before them */
+	if (status < 0 && errno != EAGAIN && !count)
+		return -1;
+	return count;
+}
+
+int dlm_dispatch(int fd)
+{
+	struct dlm_cq *cq = NULL;
+
+	if (default_ls && default_ls->fd == fd)
+		cq = default_ls->cq;
+
+	if (dispatch_many(fd, cq, 0, NULL) < 0)
+		return -1;
+	return 0;
+}
+
+int dlm_ls_dispatch_many(dlm_lshandle_t lockspace, int budget)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)lockspace;
+
+	if (lsinfo == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	/* the recv thread is the only reader of the device */
+	if (lsinfo->tid) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return dispatch_many(lsinfo->fd, lsinfo->cq, budget, NULL);
+}
+
+int dlm_ls_cq_init(dlm_lshandle_t lockspace, int entries)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)lockspace;
+	struct dlm_cq *cq;
+	unsigned int size = CQ_MIN_ENTRIES;
+
+	if (lsinfo == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (kernel_version.version[0] < 6) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (lsinfo->cq) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	while (size < entries && size < (1U << 30))
+		size *= 2;
+
+	cq = malloc(sizeof(struct dlm_cq));
+	if (!cq)
+		return -1;
+	memset(cq, 0, sizeof(struct dlm_cq));
+
+	cq->ring = malloc(size * sizeof(struct dlm_completion));
+	if (!cq->ring)
+		goto fail;
+	cq->size = size;
+
+	cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cq->efd < 0)
+		goto fail;
+
+#ifdef _REENTRANT
+	pthread_mutex_init(&cq->mutex, NULL);
+#endif
+	lsinfo->cq = cq;
+	return cq->efd;
+
+ fail:
+	free(cq->ring);
+	free(cq);
+	return -1;
+}
+
+int dlm_ls_cq_poll(dlm_lshandle_t lockspace, struct dlm_completion *recs,
+		   int max)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)lockspace;
+	int n, rv;
+
+	if (lsinfo == NULL || !lsinfo->cq) {
+		errno = lsinfo ? EINVAL : ENOTCONN;
+		return -1;
+	}
+
+	/* the ring has the older asts */
+	n = cq_take(lsinfo->cq, recs, max);
+
+	/* with a recv thread, it's the only reader of the device */
+	if (n == max || lsinfo->tid)
+		return n;
+
+	rv = dispatch_many(lsinfo->fd, lsinfo->cq, max - n, recs + n);
+	if (rv < 0)
+		return n ? n : -1;
+
+	return n + rv;
+}
+
+static void free_cq(struct dlm_cq *cq)
+{
+	if (!cq)
+		return;
+	close(cq->efd);
+	free(cq->ring);
+	free(cq);
 }
 
 /* Converts a lockspace handle into a file descriptor */
@@ -1187,7 +1703,7 @@ static void *dlm_recv_thread(void *lsinfo)
 	struct dlm_ls_info *lsi = lsinfo;
 
 	for (;;)
-		do_dlm_dispatch(lsi->fd);
+		do_dlm_dispatch(lsi->fd, lsi->cq);
 
 	return NULL;
 }
@@ -1229,6 +1745,275 @@ int dlm_ls_pthread_init(dlm_lshandle_t ls)
 
     return pthread_create(&lsinfo->tid, NULL, dlm_recv_thread, (void *)ls);
 }
+
+/*
+ * AST thread pool
+ *
+ * With dlm_ls_pthread_init_pool(), the recv thread only reads asts, and
+ * hands each to one of the pool's threads to call, chosen by the lock id
+ * or by the application's affinity function of the astarg.  Every ast of
+ * a lock goes to the same thread, in the order it was read, so per-lock
+ * ordering is kept, while a slow callback only holds up the locks that
+ * share its thread.  The lksb is updated by the thread that calls the ast,
+ * just before calling it.
+ *
+ * The library's own sync asts only wake a waiting thread, so the recv
+ * thread calls them itself, which also lets a callback make sync calls.
+ * Each thread's queue grows when full, like the completion queue.
+ */
+
+#define POOL_MIN_ENTRIES	64
+#define POOL_MAX_THREADS	256
+
+struct ast_entry {
+    char buf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
+};
+
+struct ast_worker {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct ast_entry *ring;
+    unsigned int size;		/* power of 2 */
+    unsigned int head;
+    unsigned int tail;
+    unsigned int max_queued;
+    uint64_t dispatched;
+    int started;
+};
+
+struct ast_pool {
+    int count;
+    uint32_t (*affinity)(void *astarg);
+    struct ast_worker workers[0];
+};
+
+static void *dlm_pool_thread(void *arg)
+{
+    struct ast_worker *w = arg;
+    struct ast_entry entry;
+    struct dlm_lock_result *result = (struct dlm_lock_result *)entry.buf;
+    void (*astaddr)(void *astarg);
+
+    for (;;)
+    {
+	pthread_mutex_lock(&w->mutex);
+	while (w->head == w->tail)
+	    pthread_cond_wait(&w->cond, &w->mutex);
+	entry = w->ring[w->head & (w->size - 1)];
+	w->head++;
+	pthread_mutex_unlock(&w->mutex);
+
+	apply_ast_v6(result);
+
+	astaddr = result->user_astaddr;
+	if (astaddr)
+	    astaddr(result->user_astparam);
+
+	__atomic_add_fetch(&w->dispatched, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static int pool_grow(struct ast_worker *w)
+{
+    struct ast_entry *ring;
+    unsigned int i, count = w->tail - w->head;
+
+    ring = malloc(w->size * 2 * sizeof(struct ast_entry));
+    if (!ring)
+	return -1;
+
+    for (i = 0; i < count; i++)
+	ring[i] = w->ring[(w->head + i) & (w->size - 1)];
+
+    free(w->ring);
+    w->ring = ring;
+    w->size *= 2;
+    w->head = 0;
+    w->tail = count;
+    return 0;
+}
+
+static void pool_queue(struct ast_worker *w, char *buf, int len)
+{
+    unsigned int queued;
+
+    pthread_mutex_lock(&w->mutex);
+
+    /* out of memory, the ast is lost but the kernel's state is right */
+    if (w->tail - w->head == w->size && pool_grow(w) < 0)
+    {
+	pthread_mutex_unlock(&w->mutex);
+	return;
+    }
+
+    memcpy(w->ring[w->tail & (w->size - 1)].buf, buf, len);
+    w->tail++;
+
+    queued = w->tail - w->head;
+    if (queued > w->max_queued)
+	w->max_queued = queued;
+
+    if (queued == 1)
+	pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void *dlm_pool_recv_thread(void *lsinfo)
+{
+    struct dlm_ls_info *lsi = lsinfo;
+    struct ast_pool *pool = lsi->pool;
+    char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
+    struct dlm_lock_result *result = (struct dlm_lock_result *)resultbuf;
+    void (*astaddr)(void *astarg);
+    uint32_t key;
+    int len;
+
+    for (;;)
+    {
+	len = read(lsi->fd, resultbuf, sizeof(resultbuf));
+	if (len <= 0)
+	    continue;
+
+	astaddr = result->user_astaddr;
+
+	if (internal_ast(astaddr) || lsi->cq)
+	{
+	    apply_ast_v6(result);
+	    if (!internal_ast(astaddr))
+		cq_post(lsi->cq, result);
+	    else
+		astaddr(result->user_astparam);
+	    continue;
+	}
+
+	if (pool->affinity)
+	    key = pool->affinity(result->user_astparam);
+	else
+	    key = result->lksb.sb_lkid;
+
+	pool_queue(&pool->workers[key % pool->count], resultbuf, len);
+    }
+
+    return NULL;
+}
+
+static void free_pool(struct ast_pool *pool)
+{
+    struct ast_worker *w;
+    int i;
+
+    if (!pool)
+	return;
+
+    for (i = 0; i < pool->count; i++)
+    {
+	w = &pool->workers[i];
+	if (w->started && !pthread_cancel(w->tid))
+	    pthread_join(w->tid, NULL);
+	free(w->ring);
+    }
+    free(pool);
+}
+
+int dlm_ls_pthread_init_pool(dlm_lshandle_t ls, int threads,
+			     uint32_t (*affinity)(void *astarg))
+{
+    struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+    struct ast_pool *pool;
+    struct ast_worker *w;
+    int i, rv;
+
+    if (lsinfo->tid)
+    {
+	errno = EEXIST;
+	return -1;
+    }
+
+    if (kernel_version.version[0] < 6)
+    {
+	errno = ENOSYS;
+	return -1;
+    }
+
+    if (threads < 1 || threads > POOL_MAX_THREADS)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    pool = malloc(sizeof(struct ast_pool) + threads * sizeof(struct ast_worker));
+    if (!pool)
+	return -1;
+    memset(pool, 0, sizeof(struct ast_pool) + threads * sizeof(struct ast_worker));
+    pool->count = threads;
+    pool->affinity = affinity;
+
+    for (i = 0; i < threads; i++)
+    {
+	w = &pool->workers[i];
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->size = POOL_MIN_ENTRIES;
+	w->ring = malloc(w->size * sizeof(struct ast_entry));
+	if (!w->ring)
+	    goto fail;
+
+	rv = pthread_create(&w->tid, NULL, dlm_pool_thread, w);
+	if (rv)
+	{
+	    errno = rv;
+	    goto fail;
+	}
+	w->started = 1;
+    }
+
+    lsinfo->pool = pool;
+
+    rv = pthread_create(&lsinfo->tid, NULL, dlm_pool_recv_thread, lsinfo);
+    if (rv)
+    {
+	lsinfo->pool = NULL;
+	lsinfo->tid = 0;
+	errno = rv;
+	goto fail;
+    }
+    return 0;
+
+ fail:
+    rv = errno;
+    free_pool(pool);
+    errno = rv;
+    return -1;
+}
+
+int dlm_ls_pool_stats(dlm_lshandle_t ls, struct dlm_ast_thread_stats *stats,
+		      int max)
+{
+    struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+    struct ast_pool *pool = lsinfo->pool;
+    struct ast_worker *w;
+    int i;
+
+    if (!pool)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    for (i = 0; i < pool->count && i < max; i++)
+    {
+	w = &pool->workers[i];
+	pthread_mutex_lock(&w->mutex);
+	stats[i].dispatched = __atomic_load_n(&w->dispatched, __ATOMIC_RELAXED);
+	stats[i].queued = w->tail - w->head;
+	stats[i].max_queued = w->max_queued;
+	pthread_mutex_unlock(&w->mutex);
+    }
+    return pool->count;
+}
 #endif
 
 /*
@@ -1334,6 +2119,8 @@ static dlm_lshandle_t create_lockspace(const char *name, mode_t mode,
 	if (mode)
 		fchmod(newls->fd, mode);
 	newls->tid = 0;
+	newls->cq = NULL;
+	newls->pool = NULL;
 	fcntl(newls->fd, F_SETFD, 1);
 	return (dlm_lshandle_t)newls;
 
@@ -1454,6 +2241,8 @@ dlm_lshandle_t dlm_open_lockspace(const char *name)
 		return NULL;
 
 	newls->tid = 0;
+	newls->cq = NULL;
+	newls->pool = NULL;
 	ls_dev_name(name, dev_name, sizeof(dev_name));
 
 	newls->fd = open(dev_name, O_RDWR);
@@ -109,7 +109,11 @@ extern int dlm_unlock_wait(uint32_t lkid,
  * These two are for users that want to do their own FD handling
  *
  * dlm_get_fd() - returns fd for the default lockspace for polling and dispatch
- * dlm_dispatch() - dispatches pending asts and basts
+ * dlm_dispatch() - dispatches pending asts and basts.  It only knows the
+ *                  completion queue of the default lockspace's fd; on the
+ *                  fd of any other lockspace in completion queue mode it
+ *                  calls astaddr and bastaddr, so use dlm_ls_cq_poll() or
+ *                  dlm_ls_dispatch_many() there.
  */
 
 extern int dlm_get_fd(void);
@@ -127,6 +131,11 @@ extern int dlm_dispatch(int fd);
  * dlm_release_lockspace()
  * dlm_close_lockspace()
  * dlm_ls_get_fd()
+ * dlm_ls_dispatch_many() - dispatches up to budget pending asts and basts
+ *                          in the order they arrived (0 for all), returns
+ *                          the number dispatched or -1.  Calls on a lockspace
+ *                          must be serialised by the caller, and fail with
+ *                          EINVAL if it has a recv thread.
  *
  * NOTE: that if you dlm_create_lockspace() then dlm_open_lockspace() you will
  * have two open files on the same device. Hardly a major problem but I thought
@@ -141,6 +150,43 @@ extern int dlm_release_lockspace(const char *name, dlm_lshandle_t ls,
 extern dlm_lshandle_t dlm_open_lockspace(const char *name);
 extern int dlm_close_lockspace(dlm_lshandle_t ls);
 extern int dlm_ls_get_fd(dlm_lshandle_t ls);
+extern int dlm_ls_dispatch_many(dlm_lshandle_t ls, int budget);
+
+/*
+ * Completion queue mode
+ *
+ * dlm_ls_cq_init() - asts and basts for the lockspace are returned as
+ *                    dlm_completion records instead of calling astaddr and
+ *                    bastaddr.  Returns an eventfd that is readable while
+ *                    records are queued, or -1.  entries is the initial
+ *                    size of the queue, which grows as needed.
+ * dlm_ls_cq_poll() - returns up to max records, oldest first, or -1.
+ *                    Without a recv thread, it also reads new asts from
+ *                    the lockspace fd, so poll both fds.  Unless it's the
+ *                    default lockspace, don't pass that fd to
+ *                    dlm_dispatch(); see above.
+ *
+ * astarg is returned in each record.  bastaddr must still be set for the
+ * kernel to send basts, but it isn't called.
+ */
+
+#define DLM_CQ_AST		1
+#define DLM_CQ_BAST		2
+
+struct dlm_completion {
+	void *astarg;
+	struct dlm_lksb *lksb;
+	int status;		/* sb_status for DLM_CQ_AST */
+	uint32_t lkid;
+	uint8_t type;		/* DLM_CQ_AST or DLM_CQ_BAST */
+	uint8_t bast_mode;	/* mode being blocked, for DLM_CQ_BAST */
+	uint8_t sb_flags;
+	uint8_t pad;
+};
+
+extern int dlm_ls_cq_init(dlm_lshandle_t ls, int entries);
+extern int dlm_ls_cq_poll(dlm_lshandle_t ls, struct dlm_completion *recs,
+		int max);
 extern dlm_lshandle_t dlm_new_lockspace(const char *name, mode_t mode,
 		uint32_t flags);
 
@@ -212,6 +258,51 @@ extern int dlm_ls_purge(dlm_lshandle_t lockspace,
 		int nodeid,
 		int pid);
 
+/*
+ * Batches of async requests in own lockspace
+ *
+ * dlm_ls_lock_batch() - dlm_ls_lockx() for each entry
+ * dlm_ls_unlock_batch() - dlm_ls_unlock() for each entry
+ *
+ * Every entry is submitted, and its status set to 0 or the errno it
+ * failed with.  Returns 0 if all were submitted, or -1 with errno set
+ * from the first that failed.  Completions are delivered to each lksb and
+ * AST as usual.  LKF_WAIT isn't allowed.  xid and timeout are not used
+ * when 0.  The device takes one request per write, so a batch costs the
+ * same as a call for each entry; it isn't a faster way to submit them.
+ */
+
+struct dlm_lock_request {
+	uint32_t mode;
+	uint32_t flags;
+	struct dlm_lksb *lksb;
+	const void *name;
+	unsigned int namelen;
+	uint32_t parent;			/* unused */
+	void (*astaddr) (void *astarg);
+	void *astarg;
+	void (*bastaddr) (void *astarg);
+	uint64_t xid;
+	uint64_t timeout;
+	int status;
+};
+
+struct dlm_unlock_request {
+	uint32_t lkid;
+	uint32_t flags;
+	struct dlm_lksb *lksb;
+	void *astarg;
+	int status;
+};
+
+extern int dlm_ls_lock_batch(dlm_lshandle_t lockspace,
+		struct dlm_lock_request *reqs,
+		int count);
+
+extern int dlm_ls_unlock_batch(dlm_lshandle_t lockspace,
+		struct dlm_unlock_request *reqs,
+		int count);
+
 
 /*
  * For threaded applications
@@ -233,6 +324,38 @@ extern int dlm_ls_pthread_init(dlm_lshandle_t lockspace);
 extern int dlm_pthread_cleanup(void);
 #endif
 
+/*
+ * dlm_ls_pthread_init_pool() - like dlm_ls_pthread_init(), but the ASTs are
+ *                              called by a pool of threads.  All the ASTs of
+ *                              a lock are called by the same thread, in
+ *                              order, chosen by the lock id, or by
+ *                              affinity(astarg) if affinity isn't NULL.
+ * dlm_ls_pool_stats() - fills in stats for up to max pool threads, returns
+ *                       the number of threads in the pool
+ */
+
+#ifdef _REENTRANT
+struct dlm_ast_thread_stats {
+	uint64_t dispatched;	/* ASTs called */
+	uint32_t queued;	/* ASTs waiting to be called */
+	uint32_t max_queued;
+};
+
+extern int dlm_ls_pthread_init_pool(dlm_lshandle_t lockspace, int threads,
+		uint32_t (*affinity)(void *astarg));
+extern int dlm_ls_pool_stats(dlm_lshandle_t lockspace,
+		struct dlm_ast_thread_stats *stats, int max);
+#endif
+
+/*
+ * dlm_set_sync_spin() - the number of times a thread waiting in a sync
+ *                       call checks for its AST before sleeping (default 0)
+ */
+
+#ifdef _REENTRANT
+extern void dlm_set_sync_spin(unsigned int spins);
+#endif
+
 
 /*
  * Lock modes
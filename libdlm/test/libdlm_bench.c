@@ -0,0 +1,527 @@
+/*
+ * Copyright 2004-2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+/*
+ * Timings of libdlm calls, run in-process.  libdlm.c is included so a
+ * lockspace can be made on a fake device: one end of a SOCK_SEQPACKET
+ * socketpair, which keeps each write and read a separate message as the
+ * device does, with a thread at the other end playing the kernel.  The
+ * costs are those of the library and the syscalls, not of the dlm.
+ *
+ * batch     submitting locks and unlocks one call each, and with
+ *           dlm_ls_lock_batch() and dlm_ls_unlock_batch().
+ * dispatch  dlm_ls_dispatch_many() draining bursts of queued asts, on a
+ *           non-blocking and a blocking fd.
+ * wait      dlm_ls_lock_wait() from 1, 8 and 64 threads, answered by the
+ *           recv thread, sleeping or with dlm_set_sync_spin().
+ * pool      asts with a handler that blocks for a while, called by the
+ *           recv thread and by pools of 4 and 16 threads, checking that
+ *           each lock's asts are called in order.
+ */
+
+#include <sys/socket.h>
+#include <time.h>
+
+#include "../libdlm.c"
+
+/* the kernel end of a fake lockspace device */
+
+struct fake_dev {
+	int fd;
+	int reply;		/* write an ast for each request */
+	uint32_t lkid;
+	pthread_t tid;
+};
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* the ast of a request, as the kernel would write it when the request
+   completes; an unlock (castaddr 0) gets the ast it was locked with,
+   which isn't known here, so the fake only answers locks */
+
+static void fake_ast(struct fake_dev *dev, struct dlm_write_request *req)
+{
+	struct dlm_lock_result res;
+
+	memset(&res, 0, sizeof(res));
+	res.version[0] = DLM_DEVICE_VERSION_MAJOR;
+	res.length = sizeof(res);
+	res.user_astaddr = req->i.lock.castaddr;
+	res.user_astparam = req->i.lock.castparam;
+	res.user_lksb = req->i.lock.lksb;
+	res.lksb.sb_lkid = ++dev->lkid;
+
+	if (write(dev->fd, &res, sizeof(res)) != sizeof(res))
+		fail("fake ast write");
+}
+
+static void *fake_kernel(void *arg)
+{
+	char buf[sizeof(struct dlm_write_request) + DLM_RESNAME_MAXLEN];
+	struct dlm_write_request *req = (struct dlm_write_request *)buf;
+	struct fake_dev *dev = arg;
+	int rv;
+
+	for (;;) {
+		rv = read(dev->fd, buf, sizeof(buf));
+		if (rv <= 0)
+			break;
+		if (dev->reply && req->cmd == DLM_USER_LOCK)
+			fake_ast(dev, req);
+	}
+	return NULL;
+}
+
+static struct dlm_ls_info *fake_ls(struct fake_dev *dev, int reply)
+{
+	struct dlm_ls_info *lsinfo;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		fail("socketpair");
+
+	lsinfo = calloc(1, sizeof(struct dlm_ls_info));
+	if (!lsinfo)
+		fail("calloc");
+	lsinfo->fd = sv[0];
+
+	memset(dev, 0, sizeof(*dev));
+	dev->fd = sv[1];
+	dev->reply = reply;
+
+	if (pthread_create(&dev->tid, NULL, fake_kernel, dev))
+		fail("pthread_create");
+	return lsinfo;
+}
+
+/* closing the library's end makes the fake kernel's read return 0 */
+
+static void fake_ls_close(struct dlm_ls_info *lsinfo, struct fake_dev *dev)
+{
+	ls_pthread_cleanup(lsinfo);
+	pthread_join(dev->tid, NULL);
+	close(dev->fd);
+}
+
+#define BATCH_LOCKS	65536
+#define BATCH_MAX	256
+
+static struct dlm_lksb batch_lksb[BATCH_MAX];
+static struct dlm_lock_request lock_reqs[BATCH_MAX];
+static struct dlm_unlock_request unlock_reqs[BATCH_MAX];
+static char batch_names[BATCH_MAX][16];
+
+static void batch_ast(void *arg)
+{
+}
+
+/* ns per lock and per unlock of BATCH_LOCKS, submitted size at a time,
+   size 0 for one call each */
+
+static void batch_run(int size, uint64_t *lock_ns, uint64_t *unlock_ns)
+{
+	struct dlm_ls_info *ls;
+	struct fake_dev dev;
+	uint64_t begin, lock_total = 0, unlock_total = 0;
+	int n = size ? size : BATCH_MAX;
+	int done, i;
+
+	ls = fake_ls(&dev, 0);
+
+	for (i = 0; i < n; i++) {
+		snprintf(batch_names[i], sizeof(batch_names[i]), "res%d", i);
+		lock_reqs[i].mode = LKM_EXMODE;
+		lock_reqs[i].lksb = &batch_lksb[i];
+		lock_reqs[i].name = batch_names[i];
+		lock_reqs[i].namelen = strlen(batch_names[i]);
+		lock_reqs[i].astaddr = batch_ast;
+		unlock_reqs[i].lksb = &batch_lksb[i];
+		unlock_reqs[i].lkid = i + 1;
+	}
+
+	for (done = 0; done < BATCH_LOCKS; done += n) {
+		begin = bench_ns();
+		if (size) {
+			if (dlm_ls_lock_batch(ls, lock_reqs, n))
+				fail("dlm_ls_lock_batch");
+		} else {
+			for (i = 0; i < n; i++) {
+				if (dlm_ls_lock(ls, LKM_EXMODE, &batch_lksb[i],
+						0, batch_names[i],
+						lock_reqs[i].namelen, 0,
+						batch_ast, NULL, NULL, NULL))
+					fail("dlm_ls_lock");
+			}
+		}
+		lock_total += bench_ns() - begin;
+
+		begin = bench_ns();
+		if (size) {
+			if (dlm_ls_unlock_batch(ls, unlock_reqs, n))
+				fail("dlm_ls_unlock_batch");
+		} else {
+			for (i = 0; i < n; i++) {
+				if (dlm_ls_unlock(ls, i + 1, 0, &batch_lksb[i],
+						  NULL))
+					fail("dlm_ls_unlock");
+			}
+		}
+		unlock_total += bench_ns() - begin;
+	}
+
+	*lock_ns = lock_total / BATCH_LOCKS;
+	*unlock_ns = unlock_total / BATCH_LOCKS;
+
+	fake_ls_close(ls, &dev);
+}
+
+static void bench_batch(void)
+{
+	static const int sizes[] = { 0, 16, 256 };
+	uint64_t lock_ns, unlock_ns;
+	int s;
+
+	printf("batch: submitting %d locks and unlocks\n", BATCH_LOCKS);
+	printf("%10s %12s %12s\n", "batch", "lock ns", "unlock ns");
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		batch_run(sizes[s], &lock_ns, &unlock_ns);
+		if (sizes[s])
+			printf("%10d", sizes[s]);
+		else
+			printf("%10s", "none");
+		printf(" %12llu %12llu\n", (unsigned long long)lock_ns,
+		       (unsigned long long)unlock_ns);
+	}
+}
+
+#define DISPATCH_ASTS	65536
+
+static unsigned int dispatch_count;
+
+static void dispatch_ast(void *arg)
+{
+	dispatch_count++;
+}
+
+/* ns per ast of DISPATCH_ASTS, queued burst at a time by the fake kernel
+   and each burst drained by one dlm_ls_dispatch_many() */
+
+static uint64_t dispatch_run(int burst, int nonblock)
+{
+	struct dlm_lock_result res;
+	struct dlm_ls_info *ls;
+	struct fake_dev dev;
+	uint64_t begin, total = 0;
+	int done, i, size = 4 * 1024 * 1024;
+
+	ls = fake_ls(&dev, 0);
+
+	/* room for the biggest burst before the library reads any of it */
+	setsockopt(dev.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (nonblock)
+		fcntl(ls->fd, F_SETFL, fcntl(ls->fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&res, 0, sizeof(res));
+	res.version[0] = DLM_DEVICE_VERSION_MAJOR;
+	res.length = sizeof(res);
+	res.user_astaddr = dispatch_ast;
+	res.user_lksb = &batch_lksb[0];
+
+	dispatch_count = 0;
+
+	for (done = 0; done < DISPATCH_ASTS; done += burst) {
+		for (i = 0; i < burst; i++) {
+			if (send(dev.fd, &res, sizeof(res), MSG_DONTWAIT) !=
+			    sizeof(res))
+				fail("fake ast send");
+		}
+
+		begin = bench_ns();
+		if (dlm_ls_dispatch_many(ls, 0) != burst)
+			fail("dlm_ls_dispatch_many");
+		total += bench_ns() - begin;
+	}
+
+	if (dispatch_count != done)
+		fail("dispatch count");
+
+	fake_ls_close(ls, &dev);
+	return total / DISPATCH_ASTS;
+}
+
+static void bench_dispatch(void)
+{
+	static const int bursts[] = { 1, 16, 256 };
+	uint64_t nonblock_ns, block_ns;
+	int b;
+
+	printf("dispatch: draining %d asts in bursts\n", DISPATCH_ASTS);
+	printf("%10s %14s %14s %14s %14s\n", "burst", "nonblock ns",
+	       "blocking ns", "nonblock/call", "blocking/call");
+
+	for (b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++) {
+		nonblock_ns = dispatch_run(bursts[b], 1);
+		block_ns = dispatch_run(bursts[b], 0);
+		printf("%10d %14llu %14llu %14llu %14llu\n", bursts[b],
+		       (unsigned long long)nonblock_ns,
+		       (unsigned long long)block_ns,
+		       (unsigned long long)nonblock_ns * bursts[b],
+		       (unsigned long long)block_ns * bursts[b]);
+	}
+}
+
+#define WAIT_OPS	65536
+#define WAIT_SPIN	1000
+#define WAIT_THREADS	64
+
+struct wait_thread {
+	pthread_t tid;
+	struct dlm_ls_info *ls;
+	int ops;
+	uint64_t ns;
+};
+
+static void *wait_thread_fn(void *arg)
+{
+	struct wait_thread *wt = arg;
+	struct dlm_lksb lksb;
+	uint64_t begin;
+	char name[16];
+	int i;
+
+	snprintf(name, sizeof(name), "wait%lu", (unsigned long)pthread_self());
+
+	for (i = 0; i < wt->ops; i++) {
+		memset(&lksb, 0, sizeof(lksb));
+		begin = bench_ns();
+		if (dlm_ls_lock_wait(wt->ls, LKM_EXMODE, &lksb, 0, name,
+				     strlen(name), 0, NULL, NULL, NULL))
+			fail("dlm_ls_lock_wait");
+		wt->ns += bench_ns() - begin;
+	}
+	return NULL;
+}
+
+/* mean ns per dlm_ls_lock_wait() of WAIT_OPS split over threads, and
+   the ops per second of all of them */
+
+static void wait_run(int threads, unsigned int spin, uint64_t *op_ns,
+		     uint64_t *rate)
+{
+	struct wait_thread wt[WAIT_THREADS];
+	struct dlm_ls_info *ls;
+	struct fake_dev dev;
+	uint64_t begin, elapsed, total = 0;
+	int i;
+
+	ls = fake_ls(&dev, 1);
+	if (dlm_ls_pthread_init(ls))
+		fail("dlm_ls_pthread_init");
+	dlm_set_sync_spin(spin);
+
+	begin = bench_ns();
+	for (i = 0; i < threads; i++) {
+		memset(&wt[i], 0, sizeof(wt[i]));
+		wt[i].ls = ls;
+		wt[i].ops = WAIT_OPS / threads;
+		if (pthread_create(&wt[i].tid, NULL, wait_thread_fn, &wt[i]))
+			fail("pthread_create");
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(wt[i].tid, NULL);
+		total += wt[i].ns;
+	}
+	elapsed = bench_ns() - begin;
+
+	*op_ns = total / WAIT_OPS;
+	*rate = (uint64_t)WAIT_OPS * 1000000000 / elapsed;
+
+	dlm_set_sync_spin(0);
+	fake_ls_close(ls, &dev);
+}
+
+static void bench_wait(void)
+{
+	static const int threads[] = { 1, 8, WAIT_THREADS };
+	uint64_t sleep_ns, sleep_rate, spin_ns, spin_rate;
+	int t;
+
+	printf("wait: %d dlm_ls_lock_wait() calls, spin 0 and %d\n",
+	       WAIT_OPS, WAIT_SPIN);
+	printf("%10s %12s %12s %12s %12s\n", "threads", "sleep ns",
+	       "sleep ops/s", "spin ns", "spin ops/s");
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		wait_run(threads[t], 0, &sleep_ns, &sleep_rate);
+		wait_run(threads[t], WAIT_SPIN, &spin_ns, &spin_rate);
+		printf("%10d %12llu %12llu %12llu %12llu\n", threads[t],
+		       (unsigned long long)sleep_ns,
+		       (unsigned long long)sleep_rate,
+		       (unsigned long long)spin_ns,
+		       (unsigned long long)spin_rate);
+	}
+}
+
+#define POOL_ASTS	4096
+#define POOL_LOCKS	64
+#define POOL_BLOCK_NS	20000
+
+static struct dlm_lksb pool_lksb[POOL_LOCKS];
+static int pool_last[POOL_LOCKS];
+static unsigned int pool_done, pool_order_errors;
+
+/* the seq of each of a lock's asts is in sb_status, which is set just
+   before the ast is called */
+
+static void pool_ast(void *arg)
+{
+	struct timespec ts = { 0, POOL_BLOCK_NS };
+	long lock = (long)arg;
+
+	if (pool_lksb[lock].sb_status != pool_last[lock] + 1)
+		__atomic_add_fetch(&pool_order_errors, 1, __ATOMIC_RELAXED);
+	pool_last[lock] = pool_lksb[lock].sb_status;
+
+	nanosleep(&ts, NULL);
+	__atomic_add_fetch(&pool_done, 1, __ATOMIC_RELEASE);
+}
+
+/* ns from writing the first of POOL_ASTS to the last being called, with
+   the recv thread calling them (threads 0) or a pool */
+
+static uint64_t pool_run(int threads, unsigned int *max_queued)
+{
+	struct dlm_ast_thread_stats stats[16];
+	struct timespec ts = { 0, 100000 };
+	struct dlm_lock_result res;
+	struct dlm_ls_info *ls;
+	struct fake_dev dev;
+	uint64_t begin, elapsed;
+	int i, n, lock;
+
+	ls = fake_ls(&dev, 0);
+	if (threads ? dlm_ls_pthread_init_pool(ls, threads, NULL) :
+		      dlm_ls_pthread_init(ls))
+		fail("pthread init");
+
+	memset(pool_lksb, 0, sizeof(pool_lksb));
+	memset(pool_last, 0, sizeof(pool_last));
+	pool_done = 0;
+	pool_order_errors = 0;
+
+	memset(&res, 0, sizeof(res));
+	res.version[0] = DLM_DEVICE_VERSION_MAJOR;
+	res.length = sizeof(res);
+	res.user_astaddr = pool_ast;
+
+	begin = bench_ns();
+	for (i = 0; i < POOL_ASTS; i++) {
+		lock = i % POOL_LOCKS;
+		res.user_astparam = (void *)(long)lock;
+		res.user_lksb = &pool_lksb[lock];
+		res.lksb.sb_lkid = lock + 1;
+		res.lksb.sb_status = -(i / POOL_LOCKS + 1);
+		if (write(dev.fd, &res, sizeof(res)) != sizeof(res))
+			fail("fake ast write");
+	}
+	while (__atomic_load_n(&pool_done, __ATOMIC_ACQUIRE) < POOL_ASTS)
+		nanosleep(&ts, NULL);
+	elapsed = bench_ns() - begin;
+
+	if (pool_order_errors)
+		fail("pool ast order");
+
+	*max_queued = 0;
+	if (threads) {
+		n = dlm_ls_pool_stats(ls, stats, 16);
+		for (i = 0; i < n; i++) {
+			if (stats[i].max_queued > *max_queued)
+				*max_queued = stats[i].max_queued;
+		}
+	}
+
+	fake_ls_close(ls, &dev);
+	return elapsed;
+}
+
+static void bench_pool(void)
+{
+	static const int threads[] = { 0, 4, 16 };
+	unsigned int max_queued;
+	uint64_t ns;
+	int t;
+
+	printf("pool: %d asts on %d locks, each blocking %d ns\n",
+	       POOL_ASTS, POOL_LOCKS, POOL_BLOCK_NS);
+	printf("%10s %12s %12s %12s\n", "threads", "total ms", "asts/s",
+	       "max queued");
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		ns = pool_run(threads[t], &max_queued);
+		if (threads[t])
+			printf("%10d", threads[t]);
+		else
+			printf("%10s", "recv");
+		printf(" %12llu %12llu %12u\n",
+		       (unsigned long long)(ns / 1000000),
+		       (unsigned long long)POOL_ASTS * 1000000000 / ns,
+		       max_queued);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} modes[] = {
+	{ "batch", bench_batch },
+	{ "dispatch", bench_dispatch },
+	{ "wait", bench_wait },
+	{ "pool", bench_pool },
+};
+
+#define MODES (int)(sizeof(modes) / sizeof(modes[0]))
+
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : "all";
+	int i, found = 0;
+
+	kernel_version.version[0] = DLM_DEVICE_VERSION_MAJOR;
+	kernel_version.version[1] = DLM_DEVICE_VERSION_MINOR;
+	kernel_version.version[2] = DLM_DEVICE_VERSION_PATCH;
+
+	for (i = 0; i < MODES; i++) {
+		if (strcmp(mode, "all") && strcmp(mode, modes[i].name))
+			continue;
+		modes[i].fn();
+		found = 1;
+	}
+
+	if (!found) {
+		fprintf(stderr, "usage: libdlm_bench [all");
+		for (i = 0; i < MODES; i++)
+			fprintf(stderr, "|%s", modes[i].name);
+		fprintf(stderr, "]\n");
+		return 1;
+	}
+	return 0;
+}